@@ -241,16 +241,27 @@ void flush_queue(char *path)
 char *fmt_event(json_object * event)
 {
     int rv;
-    json_object *name, *path, *mask;
+    json_object *name, *path, *mask, *old_name, *old_path;
     char *fmt;
 
     mask = json_object_object_get(event, "mask");
     name = json_object_object_get(event, "name");
     path = json_object_object_get(event, "path");
-
-    rv = mk_string(&fmt, "%s/%s  %d", json_object_get_string(path),
-                   json_object_get_string(name),
-                   json_object_get_int(mask));
+    old_name = json_object_object_get(event, "old_name");
+    old_path = json_object_object_get(event, "old_path");
+
+    /* Paired moves carry where the file came from as well. */
+    if ((old_path != NULL) && (old_name != NULL))
+        rv = mk_string(&fmt, "%s/%s -> %s/%s  %d",
+                       json_object_get_string(old_path),
+                       json_object_get_string(old_name),
+                       json_object_get_string(path),
+                       json_object_get_string(name),
+                       json_object_get_int(mask));
+    else
+        rv = mk_string(&fmt, "%s/%s  %d", json_object_get_string(path),
+                       json_object_get_string(name),
+                       json_object_get_int(mask));
 
     if (rv == -1) {
         printf
@@ -264,10 +275,12 @@ char *fmt_event(json_object * event)
 
 void get_status(void)
 {
-    int rv;
+    int i, rv;
     char *cmd1, *cmd2;
     char *request = "{\"call\":\"status\"}";
     json_object *pid, *status, *watches, *uptime;
+    json_object *events_per_batch, *batches_per_sec;
+    json_object *instances, *instance;
 
     send_request(request, 0);
 
@@ -275,11 +288,38 @@ void get_status(void)
     watches = json_object_object_get(status, "watches");
     uptime = json_object_object_get(status, "uptime");
     pid = json_object_object_get(status, "pid");
+    events_per_batch = json_object_object_get(status, "events_per_batch");
+    batches_per_sec = json_object_object_get(status, "batches_per_sec");
 
     printf("pid: %d\nwatches: %d\nuptime: %s\n",
            json_object_get_int(pid),
            json_object_get_int(watches), json_object_get_string(uptime));
 
+    if (events_per_batch && batches_per_sec)
+        printf("events/batch: %.2f\nbatches/sec: %.2f\n",
+               json_object_get_double(events_per_batch),
+               json_object_get_double(batches_per_sec));
+
+    instances = json_object_object_get(status, "instances");
+    if (instances) {
+        printf("instances:\n");
+        for (i = 0; i < json_object_array_length(instances); i++) {
+            instance = json_object_array_get_idx(instances, i);
+            printf
+                ("  %s: roots=%d watches=%d events=%d overflows=%d\n",
+                 json_object_get_string(json_object_object_get
+                                        (instance, "name")),
+                 json_object_get_int(json_object_object_get
+                                     (instance, "roots")),
+                 json_object_get_int(json_object_object_get
+                                     (instance, "watches")),
+                 json_object_get_int(json_object_object_get
+                                     (instance, "events")),
+                 json_object_get_int(json_object_object_get
+                                     (instance, "overflows")));
+        }
+    }
+
     mk_string(&cmd1, "cat /proc/%d/status | grep VmRSS",
               json_object_get_int(pid));
     mk_string(&cmd2, "cat /proc/%d/status | grep VmData",
@@ -61,10 +61,21 @@ int init_config(int silent, char *config_file)
     /* Create config struct and assign default values. */
     CONFIG = g_slice_new(struct inotispy_config);
     CONFIG->zmq_uri = ZMQ_URI;
+    CONFIG->zmq_pub_uri = ZMQ_PUB_URI;
+    CONFIG->zmq_workers = ZMQ_WORKERS;
     CONFIG->log_level = LOG_LEVEL_NOTICE;
     CONFIG->log_syslog = FALSE;
     CONFIG->max_inotify_events = INOTIFY_MAX_EVENTS;
     CONFIG->memclean_freq = INOTIFY_MEMCLEAN_FREQ;
+    CONFIG->ingest_ring_size = INOTIFY_INGEST_RING_SIZE;
+    CONFIG->inotify_instance_per_root = FALSE;
+    CONFIG->move_pair_window = INOTIFY_MOVE_PAIR_WINDOW;
+    CONFIG->overflow_rescan = FALSE;
+    CONFIG->overflow_rescan_rate = INOTIFY_RESCAN_RATE;
+    CONFIG->fanotify_backend = FALSE;
+    CONFIG->crawl_threads = CRAWL_THREADS;
+    CONFIG->crawl_io_uring = TRUE;
+    CONFIG->pool_threads = POOL_THREADS;
     CONFIG->silent = FALSE;
     CONFIG->logging_enabled = TRUE;
 
@@ -132,6 +143,40 @@ int init_config(int silent, char *config_file)
         g_free(str_rv);
     }
 
+    /* zmq_pub_uri */
+    str_rv =
+        g_key_file_get_string(keyfile, CONF_GROUP, "zmq_pub_uri", &error);
+    if (error != NULL) {
+        g_error_free(error);
+        error = NULL;
+    } else {
+        int_rv = mk_string(&CONFIG->zmq_pub_uri, "%s", str_rv);
+        if (int_rv == -1) {
+            fprintf(stderr,
+                    "** Failed to allocate memory for user supplied 0MQ publish URI %s: %s %s **",
+                    str_rv, "using default 0MQ publish URI", ZMQ_PUB_URI);
+            CONFIG->zmq_pub_uri = ZMQ_PUB_URI;
+        }
+
+        g_free(str_rv);
+    }
+
+    /* zmq_workers */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP, "zmq_workers", &error);
+    if (error == NULL) {
+        if ((int_rv > 0) && (int_rv <= ZMQ_MAX_WORKERS)) {
+            CONFIG->zmq_workers = int_rv;
+        } else {
+            fprintf(stderr,
+                    "zmq_workers value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->zmq_workers);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
     /* Logging config */
     _set_log_file(keyfile);
     _set_log_level(keyfile);
@@ -168,6 +213,141 @@ int init_config(int silent, char *config_file)
         error = NULL;
     }
 
+    /* ingest_ring_size */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP,
+                               "ingest_ring_size", &error);
+    if (error == NULL) {
+        if (int_rv > 0) {
+            CONFIG->ingest_ring_size = int_rv;
+        } else {
+            fprintf(stderr,
+                    "ingest_ring_size value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->ingest_ring_size);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* inotify_instance_per_root */
+    bool_rv =
+        g_key_file_get_boolean(keyfile, CONF_GROUP,
+                               "inotify_instance_per_root", &error);
+    if (error == NULL) {
+        CONFIG->inotify_instance_per_root = bool_rv;
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* move_pair_window */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP,
+                               "move_pair_window", &error);
+    if (error == NULL) {
+        if (int_rv > 0) {
+            CONFIG->move_pair_window = int_rv;
+        } else {
+            fprintf(stderr,
+                    "move_pair_window value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->move_pair_window);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* overflow_rescan */
+    bool_rv =
+        g_key_file_get_boolean(keyfile, CONF_GROUP, "overflow_rescan",
+                               &error);
+    if (error == NULL) {
+        CONFIG->overflow_rescan = bool_rv;
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* overflow_rescan_rate */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP,
+                               "overflow_rescan_rate", &error);
+    if (error == NULL) {
+        if (int_rv > 0) {
+            CONFIG->overflow_rescan_rate = int_rv;
+        } else {
+            fprintf(stderr,
+                    "overflow_rescan_rate value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->overflow_rescan_rate);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* crawl_threads */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP, "crawl_threads", &error);
+    if (error == NULL) {
+        if (int_rv >= 0) {
+            CONFIG->crawl_threads = int_rv;
+        } else {
+            fprintf(stderr,
+                    "crawl_threads value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->crawl_threads);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* pool_threads */
+    int_rv =
+        g_key_file_get_integer(keyfile, CONF_GROUP, "pool_threads", &error);
+    if (error == NULL) {
+        if ((int_rv > 0) && (int_rv <= POOL_MAX_THREADS)) {
+            CONFIG->pool_threads = int_rv;
+        } else {
+            fprintf(stderr,
+                    "pool_threads value '%d' is invalid. Using default value '%d'.\n",
+                    int_rv, CONFIG->pool_threads);
+        }
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* crawl_io_uring */
+    bool_rv =
+        g_key_file_get_boolean(keyfile, CONF_GROUP, "crawl_io_uring",
+                               &error);
+    if (error == NULL) {
+        CONFIG->crawl_io_uring = bool_rv;
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
+    /* event_backend */
+    str_rv =
+        g_key_file_get_string(keyfile, CONF_GROUP, "event_backend", &error);
+    if (error == NULL) {
+        if (strcmp(str_rv, "fanotify") == 0) {
+            CONFIG->fanotify_backend = TRUE;
+        } else if (strcmp(str_rv, "inotify") == 0) {
+            CONFIG->fanotify_backend = FALSE;
+        } else {
+            fprintf(stderr,
+                    "event_backend value '%s' is invalid. Using default value 'inotify'.\n",
+                    str_rv);
+        }
+        g_free(str_rv);
+    } else {
+        g_error_free(error);
+        error = NULL;
+    }
+
     /* Silent mode.
      *
      * The command line argument '-s' takes precidence over what's in the
@@ -354,6 +534,9 @@ void print_config(char *file)
     fprintf(fp, "Using configuration values from %s:\n",
             (CONFIG->path ? CONFIG->path : "DEFAULTS LIST"));
     fprintf(fp, " - zmq_uri            : %s\n", CONFIG->zmq_uri);
+    fprintf(fp, " - zmq_pub_uri        : %s\n",
+            (*CONFIG->zmq_pub_uri ? CONFIG->zmq_pub_uri : "disabled"));
+    fprintf(fp, " - zmq_workers        : %d\n", CONFIG->zmq_workers);
     fprintf(fp, " - log_file           : %s\n",
             (CONFIG->logging_enabled ? CONFIG->log_file :
              "Regular logging disabled"));
@@ -369,6 +552,26 @@ void print_config(char *file)
     } else {
         fprintf(fp, " - memclean_freq      : never\n");
     }
+    fprintf(fp, " - ingest_ring_size   : %d bytes\n",
+            CONFIG->ingest_ring_size);
+    fprintf(fp, " - instance_per_root  : %s\n",
+            (CONFIG->inotify_instance_per_root ? "true" : "false"));
+    fprintf(fp, " - move_pair_window   : %d ms\n",
+            CONFIG->move_pair_window);
+    fprintf(fp, " - overflow_rescan    : %s\n",
+            (CONFIG->overflow_rescan ? "true" : "false"));
+    fprintf(fp, " - rescan_rate        : %d dirs/sec\n",
+            CONFIG->overflow_rescan_rate);
+    fprintf(fp, " - event_backend      : %s\n",
+            (CONFIG->fanotify_backend ? "fanotify" : "inotify"));
+    if (CONFIG->crawl_threads > 0) {
+        fprintf(fp, " - crawl_threads      : %d\n", CONFIG->crawl_threads);
+    } else {
+        fprintf(fp, " - crawl_threads      : one per CPU\n");
+    }
+    fprintf(fp, " - crawl_io_uring     : %s\n",
+            (CONFIG->crawl_io_uring ? "true" : "false"));
+    fprintf(fp, " - pool_threads       : %d\n", CONFIG->pool_threads);
     fprintf(fp, " - silent mode        : %s\n",
             (CONFIG->silent ? "true" : "false"));
 
@@ -32,6 +32,8 @@
 #include "zeromq.h"
 #include "log.h"
 #include "inotify.h"
+#include "crawl.h"
+#include "pool.h"
 
 #include <time.h>
 #include <glib.h>
@@ -49,6 +51,8 @@ struct inotispy_config {
 
     /* zmq.h */
     char *zmq_uri;
+    char *zmq_pub_uri;          /* Empty if not publishing */
+    int zmq_workers;
 
     /* log.h */
     int log_level;
@@ -59,6 +63,19 @@ struct inotispy_config {
     /* inotify.h */
     int max_inotify_events;
     int memclean_freq;
+    int ingest_ring_size;
+    gboolean inotify_instance_per_root;
+    int move_pair_window;
+    gboolean overflow_rescan;
+    gboolean fanotify_backend;  /* event_backend = fanotify */
+    int overflow_rescan_rate;
+
+    /* crawl.h */
+    int crawl_threads;
+    gboolean crawl_io_uring;
+
+    /* pool.h */
+    int pool_threads;
 
     /* Toggle printing information to stderr */
     gboolean silent;
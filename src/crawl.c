@@ -0,0 +1,832 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "log.h"
+#include "reply.h"
+#include "crawl.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>        /* SYS_getdents64 */
+
+/* A directory that has been read but still has subdirectories
+ * waiting to be opened relative to it.
+ */
+typedef struct crawl_parent {
+    int fd;
+    int refs;
+} Parent;
+
+/* What getdents64() fills the buffer with. glibc only has this as
+ * 'struct dirent64', which isn't guaranteed to be laid out the same.
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct crawl_job {
+    const Crawl_Ops *ops;
+    void *data;
+    int pending;                /* Directories not finished with yet */
+    unsigned int dirs;          /* Directories read */
+    struct timespec start;
+    char path[];
+} Job;
+
+typedef struct crawl_item {
+    Crawl_Dir dir;
+    Job *job;
+    Parent *parent;             /* NULL for the root of a crawl */
+    int pinned;                 /* Never freed (SEE: open_uring()) */
+    char path[];
+} Item;
+
+/* Each thread's stack. The thread itself pushes and pops at 'end',
+ * other threads steal from 'start'.
+ */
+typedef struct crawl_worker {
+    pthread_mutex_t lock;
+    Item **items;
+    int start;
+    int end;
+    int size;
+    char *buf;                  /* CRAWL_BUF_SIZE, for crawl_readdir() */
+    Uring *ring;                /* NULL without io_uring */
+    struct statx *stx;          /* CRAWL_URING_DEPTH, for resolve_uring() */
+} Worker;
+
+/* What item_read() needs for each entry crawl_readdir() finds. */
+typedef struct crawl_read_data {
+    Worker *self;
+    Item *item;
+    Parent *parent;
+} Read_Data;
+
+static Worker *crawl_workers = NULL;
+static int crawl_num_workers = 0;
+static unsigned int crawl_next_worker = 0;
+static int crawl_use_uring = 0;
+
+/* Idle threads sleep on 'crawl_idle_cond' until 'crawl_queued', the
+ * number of directories on all of the stacks, is non-zero.
+ */
+static pthread_mutex_t crawl_idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crawl_idle_cond = PTHREAD_COND_INITIALIZER;
+static int crawl_queued = 0;
+static int crawl_idle = 0;
+static int crawl_jobs = 0;
+
+static void *_crawl_worker(void *thread_data);
+static int readdir_buf(int fd, char *buf, size_t size, int resolve,
+                       Worker * self, Crawl_Readdir_Func func, void *data);
+
+static int is_dot(const char *name)
+{
+    return (name[0] == '.')
+        && ((name[1] == '\0') || ((name[1] == '.') && (name[2] == '\0')));
+}
+
+static void parent_release(Parent * parent)
+{
+    if (parent == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(parent->fd);
+        free(parent);
+    }
+}
+
+static int worker_push(Worker * worker, Item * item)
+{
+    pthread_mutex_lock(&worker->lock);
+
+    if (worker->end == worker->size) {
+        if (worker->start > 0) {
+            memmove(worker->items, worker->items + worker->start,
+                    (worker->end - worker->start) * sizeof(Item *));
+            worker->end -= worker->start;
+            worker->start = 0;
+        } else {
+            int size = worker->size ? 2 * worker->size : 256;
+            Item **items = realloc(worker->items, size * sizeof(Item *));
+
+            if (items == NULL) {
+                pthread_mutex_unlock(&worker->lock);
+                return -1;
+            }
+
+            worker->items = items;
+            worker->size = size;
+        }
+    }
+
+    worker->items[worker->end++] = item;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    __atomic_add_fetch(&crawl_queued, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&crawl_idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&crawl_idle_mutex);
+        pthread_cond_signal(&crawl_idle_cond);
+        pthread_mutex_unlock(&crawl_idle_mutex);
+    }
+
+    return 0;
+}
+
+/* Take up to 'max' of the newest directories off our own stack. */
+static int worker_pop(Worker * worker, Item ** items, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&worker->lock);
+
+    while ((n < max) && (worker->end > worker->start))
+        items[n++] = worker->items[--worker->end];
+
+    if (worker->end == worker->start)
+        worker->start = worker->end = 0;
+
+    pthread_mutex_unlock(&worker->lock);
+
+    if (n > 0)
+        __atomic_sub_fetch(&crawl_queued, n, __ATOMIC_SEQ_CST);
+
+    return n;
+}
+
+/* Take the oldest directory off some other thread's stack. */
+static int worker_steal(Worker * self, Item ** items)
+{
+    int i, n = 0;
+    Worker *victim;
+
+    for (i = 1; (i < crawl_num_workers) && (n == 0); i++) {
+        victim = &crawl_workers[((self - crawl_workers) + i)
+                                % crawl_num_workers];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->end > victim->start)
+            items[n++] = victim->items[victim->start++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (n > 0)
+        __atomic_sub_fetch(&crawl_queued, n, __ATOMIC_SEQ_CST);
+
+    return n;
+}
+
+static void worker_wait(void)
+{
+    pthread_mutex_lock(&crawl_idle_mutex);
+
+    __atomic_add_fetch(&crawl_idle, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&crawl_queued, __ATOMIC_SEQ_CST) == 0)
+        pthread_cond_wait(&crawl_idle_cond, &crawl_idle_mutex);
+    __atomic_sub_fetch(&crawl_idle, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&crawl_idle_mutex);
+}
+
+/* Give the thread a ring if we can. Failing that it just goes on
+ * without one.
+ */
+static void worker_uring(Worker * self)
+{
+    self->stx = malloc(CRAWL_URING_DEPTH * sizeof(struct statx));
+    if (self->stx == NULL)
+        return;
+
+    self->ring = uring_new(CRAWL_URING_DEPTH);
+    if (self->ring == NULL) {
+        free(self->stx);
+        self->stx = NULL;
+    }
+}
+
+/* Something went wrong with the ring, so go back to doing things
+ * the slow way. If the kernel still has requests of ours we can't
+ * safely hand back the memory they point at, so it's left alone:
+ * the ring and the statx() buffers here, and the items whose paths
+ * are being opened by the caller (SEE: open_uring()). The names
+ * being stat()ed are in Worker::buf, which is never freed.
+ */
+static void worker_uring_fail(Worker * self, unsigned int inflight)
+{
+    log_warn("io_uring failed, crawling without it: %s",
+             strerror(errno));
+
+    if (inflight == 0) {
+        uring_free(self->ring);
+        free(self->stx);
+    }
+
+    self->ring = NULL;
+    self->stx = NULL;
+}
+
+static void job_done(Job * job)
+{
+    double secs, rate;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    secs = (now.tv_sec - job->start.tv_sec)
+        + (now.tv_nsec - job->start.tv_nsec) / 1e9;
+    rate = (secs > 0) ? job->dirs / secs : 0;
+
+    if (job->dirs >= CRAWL_LOG_DIRS)
+        log_notice("Crawled %u dirs under '%s' in %.2fs (%.0f dirs/sec)",
+                   job->dirs, job->path, secs, rate);
+    else
+        log_debug("Crawled %u dirs under '%s' in %.2fs (%.0f dirs/sec)",
+                  job->dirs, job->path, secs, rate);
+
+    job->ops->done(job->data);
+    free(job);
+
+    __atomic_sub_fetch(&crawl_jobs, 1, __ATOMIC_RELAXED);
+}
+
+static Item *item_new(Job * job, Parent * parent, const char *path,
+                      const char *name)
+{
+    size_t path_len, name_len;
+    Item *item;
+
+    path_len = strlen(path);
+    name_len = (name != NULL) ? strlen(name) : 0;
+
+    item = malloc(sizeof(Item) + path_len + name_len + 2);
+    if (item == NULL)
+        return NULL;
+
+    memcpy(item->path, path, path_len + 1);
+
+    if (name != NULL) {
+        if (strcmp(path, "/") != 0)
+            item->path[path_len++] = '/';
+        memcpy(item->path + path_len, name, name_len + 1);
+        item->dir.name = item->path + path_len;
+    } else {
+        item->dir.name = strrchr(item->path, '/');
+        item->dir.name = item->dir.name ? item->dir.name + 1 : item->path;
+    }
+
+    item->dir.path = item->path;
+    item->dir.fd = -1;
+    item->dir.skip = 0;
+    item->dir.wd = -1;
+    item->dir.gen = 0;
+    item->dir.user = NULL;
+    item->dir.entries = 0;
+    item->job = job;
+    item->parent = parent;
+    item->pinned = 0;
+
+    return item;
+}
+
+static void item_finish(Item * item)
+{
+    Job *job = item->job;
+
+    parent_release(item->parent);
+    if (!item->pinned)
+        free(item);
+
+    if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        job_done(job);
+}
+
+static int item_entry(int fd, const char *name, unsigned char type,
+                      void *data)
+{
+    int is_dir = (type == DT_DIR);
+    Read_Data *read = data;
+    Item *item = read->item;
+    Job *job = item->job;
+    Item *child;
+
+    (void) fd;                  /* Subdirectories open relative to the Parent */
+
+    ++item->dir.entries;
+
+    if (!job->ops->entry(&item->dir, name, is_dir, job->data) || !is_dir)
+        return 0;
+
+    child = item_new(job, read->parent, item->path, name);
+    if (child == NULL) {
+        log_error("Failed to allocate memory for crawl of '%s/%s': %s",
+                  item->path, name, "crawl.c:item_entry()");
+        return 0;
+    }
+
+    __atomic_add_fetch(&read->parent->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+
+    if (worker_push(read->self, child) != 0) {
+        log_error("Failed to queue '%s' for crawling: %s", child->path,
+                  "crawl.c:item_entry()");
+        item_finish(child);
+    }
+
+    return 0;
+}
+
+/* Read one directory, queueing any subdirectories the caller wants
+ * crawled on 'self'. The directory's fd is handed over to the new
+ * Parent, and closed once all of them have been opened.
+ */
+static void item_read(Worker * self, Item * item)
+{
+    Read_Data read;
+
+    if (self->buf == NULL) {
+        self->buf = malloc(CRAWL_BUF_SIZE);
+        if (self->buf == NULL) {
+            log_error("Failed to allocate memory for crawl of '%s': %s",
+                      item->path, "crawl.c:item_read()");
+            close(item->dir.fd);
+            return;
+        }
+    }
+
+    read.self = self;
+    read.item = item;
+    read.parent = malloc(sizeof(Parent));
+    if (read.parent == NULL) {
+        log_error("Failed to allocate memory for crawl of '%s': %s",
+                  item->path, "crawl.c:item_read()");
+        close(item->dir.fd);
+        return;
+    }
+
+    read.parent->fd = item->dir.fd;
+    read.parent->refs = 1;
+
+    if (readdir_buf(item->dir.fd, self->buf, CRAWL_BUF_SIZE, 1, self,
+                    item_entry, &read) != 0)
+        log_debug("Failed to read dir '%s' while crawling: %s",
+                  item->path, strerror(errno));
+
+    __atomic_add_fetch(&item->job->dirs, 1, __ATOMIC_RELAXED);
+
+    parent_release(read.parent);
+}
+
+/* Call Crawl_Ops::watch(), or Crawl_Ops::read() if 'read' is set,
+ * once for each run of 'items' that belong to the same crawl.
+ */
+static void crawl_callback(Item ** items, Crawl_Dir ** dirs, int num,
+                           int read)
+{
+    int i, j;
+    Job *job;
+
+    for (i = 0; i < num; i = j) {
+        job = items[i]->job;
+        for (j = i + 1; (j < num) && (items[j]->job == job); j++);
+
+        if (read)
+            job->ops->read(dirs + i, j - i, job->data);
+        else
+            job->ops->watch(dirs + i, j - i, job->data);
+    }
+}
+
+/* Open everything in a batch, relative to it's parent where we can,
+ * setting Crawl_Dir::fd to the file descriptor or -errno.
+ */
+static void open_sync(Item ** items, int num)
+{
+    int i, flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    Item *item;
+
+    for (i = 0; i < num; i++) {
+        item = items[i];
+
+        if (item->parent != NULL)
+            item->dir.fd = openat(item->parent->fd, item->dir.name,
+                                  flags | O_NOFOLLOW);
+        else
+            item->dir.fd = open(item->path, flags);
+
+        if (item->dir.fd < 0)
+            item->dir.fd = -errno;
+    }
+}
+
+/* The same, but with all of the opens submitted together. The ring
+ * is always empty between calls, and a batch is never more than
+ * CRAWL_URING_DEPTH, so there's room for all of them.
+ */
+static void open_uring(Worker * self, Item ** items, int num)
+{
+    int i, res, flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    char done[CRAWL_BATCH];
+    unsigned int inflight = num;
+    uint64_t data;
+    Item *item;
+
+    for (i = 0; i < num; i++) {
+        item = items[i];
+        done[i] = 0;
+
+        if (item->parent != NULL)
+            uring_openat(self->ring, item->parent->fd, item->dir.name,
+                         flags | O_NOFOLLOW, i);
+        else
+            uring_openat(self->ring, AT_FDCWD, item->path, flags, i);
+    }
+
+    while (inflight > 0) {
+        if (uring_submit(self->ring, inflight) != 0) {
+            worker_uring_fail(self, inflight);
+            break;
+        }
+
+        while (uring_reap(self->ring, &data, &res)) {
+            items[data]->dir.fd = res;
+            done[data] = 1;
+            --inflight;
+        }
+    }
+
+    /* Anything the ring didn't get to. Those are still in flight as
+     * far as we know, and the kernel may yet read their paths, so
+     * once the crawl is done with them they're left rather than
+     * freed, like the ring itself.
+     */
+    for (i = 0; i < num; i++) {
+        if (!done[i]) {
+            items[i]->pinned = 1;
+            open_sync(items + i, 1);
+        }
+    }
+}
+
+static void crawl_batch(Worker * self, Item ** items, int num)
+{
+    int i, n = 0;
+    Crawl_Dir *dirs[CRAWL_BATCH];
+    Item *item;
+
+    /* Drop anything from crawls that have been called off. */
+    for (i = 0; i < num; i++) {
+        item = items[i];
+
+        if ((item->job->ops->cancelled != NULL)
+            && item->job->ops->cancelled(item->job->data)) {
+            parent_release(item->parent);
+            item->parent = NULL;
+            item_finish(item);
+            continue;
+        }
+
+        items[n++] = item;
+    }
+
+    num = n;
+    n = 0;
+
+    if (self->ring != NULL)
+        open_uring(self, items, num);
+    else
+        open_sync(items, num);
+
+    /* Anything that's vanished in the meantime is dropped. */
+    for (i = 0; i < num; i++) {
+        item = items[i];
+
+        parent_release(item->parent);
+        item->parent = NULL;
+
+        if (item->dir.fd < 0) {
+            log_debug("Failed to open dir '%s' while crawling: %s",
+                      item->path, strerror(-item->dir.fd));
+            item_finish(item);
+            continue;
+        }
+
+        items[n] = item;
+        dirs[n++] = &item->dir;
+    }
+
+    crawl_callback(items, dirs, n, 0);
+
+    for (i = 0; i < n; i++) {
+        if (dirs[i]->skip)
+            close(dirs[i]->fd);
+        else
+            item_read(self, items[i]);
+    }
+
+    crawl_callback(items, dirs, n, 1);
+
+    for (i = 0; i < n; i++)
+        item_finish(items[i]);
+}
+
+static void *_crawl_worker(void *thread_data)
+{
+    int n;
+    Item *items[CRAWL_BATCH];
+    Worker *self = thread_data;
+
+    if (crawl_use_uring)
+        worker_uring(self);
+
+    for (;;) {
+        n = worker_pop(self, items, CRAWL_BATCH);
+        if (n == 0)
+            n = worker_steal(self, items);
+
+        if (n == 0) {
+            worker_wait();
+            continue;
+        }
+
+        crawl_batch(self, items, n);
+    }
+
+    return NULL;
+}
+
+/* Fill in the type of everything in the buffer the file system
+ * didn't give one for.
+ */
+static void resolve_sync(int fd, char *buf, long n)
+{
+    long pos;
+    struct stat stat_buf;
+    struct linux_dirent64 *ent;
+
+    for (pos = 0; pos < n; pos += ent->d_reclen) {
+        ent = (struct linux_dirent64 *) (buf + pos);
+
+        if ((ent->d_type == DT_UNKNOWN) && !is_dot(ent->d_name)
+            && (fstatat(fd, ent->d_name, &stat_buf,
+                        AT_SYMLINK_NOFOLLOW) == 0))
+            ent->d_type = IFTODT(stat_buf.st_mode);
+    }
+}
+
+/* The same, with up to CRAWL_URING_DEPTH statx() calls in flight at
+ * a time, topping the ring back up as they finish. Each one gets a
+ * slot in Worker::stx for its result, and its slot number back with
+ * it to find the entry again. Returns -1 if the ring failed, leaving
+ * whatever it didn't get to as DT_UNKNOWN.
+ */
+static int resolve_uring(Worker * self, int fd, char *buf, long n)
+{
+    int res, slot;
+    int free_slots[CRAWL_URING_DEPTH];
+    long slot_pos[CRAWL_URING_DEPTH];
+    long pos = 0;
+    unsigned int nfree, inflight = 0;
+    uint64_t data;
+    struct linux_dirent64 *ent;
+
+    for (nfree = 0; nfree < CRAWL_URING_DEPTH; nfree++)
+        free_slots[nfree] = nfree;
+
+    for (;;) {
+        for (; (pos < n) && (nfree > 0); pos += ent->d_reclen) {
+            ent = (struct linux_dirent64 *) (buf + pos);
+
+            if ((ent->d_type != DT_UNKNOWN) || is_dot(ent->d_name))
+                continue;
+
+            slot = free_slots[--nfree];
+            uring_statx(self->ring, fd, ent->d_name, AT_SYMLINK_NOFOLLOW,
+                        STATX_TYPE, &self->stx[slot], slot);
+            slot_pos[slot] = pos;
+            ++inflight;
+        }
+
+        if (inflight == 0)
+            return 0;
+
+        if (uring_submit(self->ring, 1) != 0) {
+            worker_uring_fail(self, inflight);
+            return -1;
+        }
+
+        while (uring_reap(self->ring, &data, &res)) {
+            slot = (int) data;
+            if (res == 0) {
+                ent = (struct linux_dirent64 *) (buf + slot_pos[slot]);
+                ent->d_type = IFTODT(self->stx[slot].stx_mode);
+            }
+
+            free_slots[nfree++] = slot;
+            --inflight;
+        }
+    }
+}
+
+static int readdir_buf(int fd, char *buf, size_t size, int resolve,
+                       Worker * self, Crawl_Readdir_Func func, void *data)
+{
+    long n, pos;
+    struct linux_dirent64 *ent;
+
+    for (;;) {
+        n = syscall(SYS_getdents64, fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        if (n == 0)
+            return 0;
+
+        /* Not every file system fills in d_type (XFS and ZFS for
+         * instance) so sometimes we have to ask. Doing it for the
+         * whole buffer before handing any of it out keeps the stat()s
+         * back to back, against the directory's inodes that the read
+         * has only just brought in.
+         */
+        if (resolve) {
+            if ((self == NULL) || (self->ring == NULL)
+                || (resolve_uring(self, fd, buf, n) != 0))
+                resolve_sync(fd, buf, n);
+        }
+
+        for (pos = 0; pos < n; pos += ent->d_reclen) {
+            ent = (struct linux_dirent64 *) (buf + pos);
+
+            if (is_dot(ent->d_name))
+                continue;
+
+            if (func(fd, ent->d_name, ent->d_type, data) != 0)
+                return 0;
+        }
+    }
+}
+
+int crawl_readdir(int fd, char *buf, size_t size, int resolve,
+                  Crawl_Readdir_Func func, void *data)
+{
+    return readdir_buf(fd, buf, size, resolve, NULL, func, data);
+}
+
+int crawl_init(int num_threads, int use_uring)
+{
+    Uring *ring;
+
+    int i, rv;
+    pthread_t t;
+    pthread_attr_t attr;
+
+    if (num_threads <= 0)
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads <= 0)
+        num_threads = 1;
+    if (num_threads > CRAWL_MAX_THREADS)
+        num_threads = CRAWL_MAX_THREADS;
+
+    crawl_workers = calloc(num_threads, sizeof(Worker));
+    if (crawl_workers == NULL) {
+        log_error("Failed to allocate memory for crawler threads: %s",
+                  "crawl.c:crawl_init()");
+        return -1;
+    }
+
+    /* See if we can have io_uring before the threads try for their
+     * own rings, so it's only logged once.
+     */
+    if (use_uring) {
+        ring = uring_new(CRAWL_URING_DEPTH);
+        if (ring != NULL) {
+            crawl_use_uring = 1;
+            uring_free(ring);
+        } else {
+            log_notice("io_uring is not available, crawling without it");
+        }
+    }
+
+    /* Initialize thread attribute to automatically detach */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < num_threads; i++) {
+        pthread_mutex_init(&crawl_workers[i].lock, NULL);
+
+        rv = pthread_create(&t, &attr, _crawl_worker, &crawl_workers[i]);
+        if (rv) {
+            log_error("Failed to create crawler thread: %d", rv);
+            break;
+        }
+
+        ++crawl_num_workers;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (crawl_num_workers == 0)
+        return -1;
+
+    log_debug("Started %d crawler threads%s", crawl_num_workers,
+              crawl_use_uring ? " with io_uring" : "");
+
+    return 0;
+}
+
+int crawl_tree(const char *path, const Crawl_Ops * ops, void *data)
+{
+    unsigned int w;
+    Job *job;
+    Item *item;
+
+    if (crawl_num_workers == 0)
+        return ERROR_FAILED_TO_CREATE_NEW_THREAD;
+
+    job = malloc(sizeof(Job) + strlen(path) + 1);
+    if (job == NULL) {
+        log_error("Failed to allocate memory for crawl of '%s': %s", path,
+                  "crawl.c:crawl_tree()");
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    job->ops = ops;
+    job->data = data;
+    job->pending = 1;
+    job->dirs = 0;
+    strcpy(job->path, path);
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+
+    item = item_new(job, NULL, path, NULL);
+    if (item == NULL) {
+        log_error("Failed to allocate memory for crawl of '%s': %s", path,
+                  "crawl.c:crawl_tree()");
+        free(job);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    __atomic_add_fetch(&crawl_jobs, 1, __ATOMIC_RELAXED);
+
+    w = __atomic_fetch_add(&crawl_next_worker, 1, __ATOMIC_RELAXED);
+
+    if (worker_push(&crawl_workers[w % crawl_num_workers], item) != 0) {
+        log_error("Failed to queue '%s' for crawling: %s", path,
+                  "crawl.c:crawl_tree()");
+        __atomic_sub_fetch(&crawl_jobs, 1, __ATOMIC_RELAXED);
+        free(item);
+        free(job);
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    return 0;
+}
+
+void crawl_get_stats(Crawl_Stats * stats)
+{
+    stats->threads = crawl_num_workers;
+    stats->idle = __atomic_load_n(&crawl_idle, __ATOMIC_RELAXED);
+    stats->queued = __atomic_load_n(&crawl_queued, __ATOMIC_RELAXED);
+    stats->crawls = __atomic_load_n(&crawl_jobs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_CRAWL_H_
+#define _INOTISPY_CRAWL_H_
+
+#include <stdint.h>
+#include <stddef.h>             /* size_t */
+
+/* Default number of crawler threads. 0 (zero) means one for each
+ * online CPU, up to CRAWL_MAX_THREADS.
+ */
+#define CRAWL_THREADS      0
+#define CRAWL_MAX_THREADS  64
+
+/* The most directories a crawler thread works on at once. */
+#define CRAWL_BATCH        64
+
+/* How much of a directory is read at a time (SEE: crawl_readdir()). */
+#define CRAWL_BUF_SIZE     (256 * 1024)
+
+/* How many openat() and statx() calls each crawler thread keeps in
+ * flight when it has io_uring (SEE: uring.h).
+ */
+#define CRAWL_URING_DEPTH  256
+
+/* Crawls of at least this many directories are logged at notice
+ * level, with how long they took. Smaller ones only at debug.
+ */
+#define CRAWL_LOG_DIRS     1000
+
+/* Walks directory trees on a fixed pool of threads.
+ *
+ * Each thread keeps its own stack of directories still to be read,
+ * newest on top, so a crawl goes depth first and only the directories
+ * along the current path hold file descriptors. A thread that runs
+ * out of work steals the oldest directory (the top of a subtree)
+ * from another.
+ *
+ * A thread takes up to CRAWL_BATCH directories off its stack at a
+ * time, opens each with openat() relative to its parent, and hands
+ * the whole batch to Crawl_Ops::watch(). Only once that's returned
+ * are the directories read (SEE: crawl_readdir()), so anything created
+ * in them after that is left to the caller to find out about some
+ * other way.
+ *
+ * Where the kernel has io_uring each thread gets a ring of its own,
+ * and instead of one system call at a time submits the opens for a
+ * whole batch, and the statx() calls for everything in a directory
+ * buffer that needs one, together (SEE: uring.h). Without it, or if
+ * the ring fails, the thread goes back to the plain system calls.
+ */
+typedef struct crawl_dir {
+    const char *path;
+    const char *name;           /* Last component of 'path' */
+    int fd;                     /* Open on the directory */
+    int skip;                   /* Set to not read the directory */
+    int wd;                     /* For the callbacks */
+    uint32_t gen;               /* For the callbacks */
+    void *user;                 /* For the callbacks */
+    uint32_t entries;           /* Set once it's been read */
+} Crawl_Dir;
+
+typedef struct crawl_ops {
+    /* Called with each batch of 'num' opened directories before they
+     * are read. Setting Crawl_Dir::skip leaves that one unread.
+     */
+    void (*watch) (Crawl_Dir ** dirs, int num, void *data);
+
+    /* Called for everything found in a directory. Returns 1 if 'name'
+     * is a directory that should be crawled too, otherwise 0 (zero).
+     */
+    int (*entry) (Crawl_Dir * dir, const char *name, int is_dir,
+                  void *data);
+
+    /* Called with each batch once it has been read. Every directory
+     * in the batch is passed to it, read or skipped, so this is where
+     * anything hung off Crawl_Dir::user gets let go of.
+     */
+    void (*read) (Crawl_Dir ** dirs, int num, void *data);
+
+    /* Called once, after everything under the crawl's root. */
+    void (*done) (void *data);
+
+    /* Returns non-zero once the crawl has been called off, after
+     * which anything of it's still queued is dropped without being
+     * opened. May be NULL.
+     */
+    int (*cancelled) (void *data);
+} Crawl_Ops;
+
+/* Point in time copy of the crawler's counters, SEE:
+ * crawl_get_stats().
+ */
+typedef struct crawl_stats {
+    int threads;
+    int idle;                   /* Threads with nothing to do */
+    int queued;                 /* Directories waiting to be crawled */
+    int crawls;                 /* Crawls that aren't done yet */
+} Crawl_Stats;
+
+/* Called by crawl_readdir() for each entry in the directory open on
+ * 'fd'. 'type' is one of the DT_* values from <dirent.h>. Returning
+ * anything but 0 (zero) stops the read.
+ */
+typedef int (*Crawl_Readdir_Func) (int fd, const char *name,
+                                   unsigned char type, void *data);
+
+/* Read the directory open on 'fd' with getdents64(), 'size' bytes at
+ * a time into 'buf', calling 'func' for everything in it except '.'
+ * and '..'. Nothing is allocated and no paths are built.
+ *
+ * If 'resolve' is set entries the file system didn't give a type
+ * for are looked up with fstatat() relative to 'fd', otherwise
+ * they're passed on as DT_UNKNOWN.
+ *
+ * Returns 0 (zero) on success, or -1 with errno set on error.
+ */
+int crawl_readdir(int fd, char *buf, size_t size, int resolve,
+                  Crawl_Readdir_Func func, void *data);
+
+/* Start the crawler threads, using io_uring if 'use_uring' is set
+ * and the kernel has it. Returns 0 (zero) on success.
+ */
+int crawl_init(int num_threads, int use_uring);
+
+/* Crawl the tree at 'path' in the background. 'ops' must stay
+ * valid until Crawl_Ops::done() has been called, and 'data' is
+ * passed to each of the callbacks.
+ *
+ * Returns 0 (zero) on success, or an ERROR_* code.
+ */
+int crawl_tree(const char *path, const Crawl_Ops * ops, void *data);
+
+void crawl_get_stats(Crawl_Stats * stats);
+
+#endif /*_INOTISPY_CRAWL_H_*/
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "log.h"
+#include "fanotify.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>              /* open_by_handle_at() */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>             /* PATH_MAX */
+#include <sys/inotify.h>        /* IN_Q_OVERFLOW */
+
+#ifdef HAVE_FANOTIFY
+
+#include <sys/vfs.h>            /* statfs() */
+#include <sys/fanotify.h>
+
+#define FANOTIFY_PATH_CACHE_MAX  65536
+
+/* Events a filesystem mark can ask for. Anything else in a root's
+ * mask (IN_UNMOUNT, IN_DONT_FOLLOW, ...) has no fanotify equivalent.
+ */
+#define FANOTIFY_EVENTS  ( \
+        FAN_ACCESS       | \
+        FAN_MODIFY       | \
+        FAN_ATTRIB       | \
+        FAN_CLOSE_WRITE  | \
+        FAN_CLOSE_NOWRITE| \
+        FAN_OPEN         | \
+        FAN_MOVED_FROM   | \
+        FAN_MOVED_TO     | \
+        FAN_CREATE       | \
+        FAN_DELETE       | \
+        FAN_DELETE_SELF  | \
+        FAN_MOVE_SELF      \
+    )
+
+/* One marked filesystem. 'mount_fd' is an open directory on it,
+ * which open_by_handle_at() needs to know where to look.
+ */
+typedef struct fanotify_mark {
+    uint64_t fsid;
+    int mount_fd;
+    int refs;
+    uint64_t mask;
+} Mark;
+
+/* Marked filesystems by fsid, the fsid of every root (which can't
+ * be asked for again once the root is gone) and directory handle ->
+ * path.
+ */
+static GHashTable *fanotify_marks = NULL;
+static GHashTable *fanotify_roots = NULL;
+static GHashTable *fanotify_paths = NULL;
+
+/* Key for fanotify_paths: the fsid and file handle, back to back. */
+typedef struct fanotify_handle_key {
+    uint32_t len;
+    unsigned char data[];
+} Handle_Key;
+
+static guint handle_hash(gconstpointer key)
+{
+    uint32_t i;
+    guint hash = 5381;
+    const Handle_Key *k = key;
+
+    for (i = 0; i < k->len; i++)
+        hash = hash * 33 + k->data[i];
+
+    return hash;
+}
+
+static gboolean handle_equal(gconstpointer a, gconstpointer b)
+{
+    const Handle_Key *ka = a, *kb = b;
+
+    return (ka->len == kb->len) && (memcmp(ka->data, kb->data, ka->len) == 0);
+}
+
+static int fanotify_fsid(const char *path, uint64_t * fsid)
+{
+    struct statfs buf;
+
+    if (statfs(path, &buf) != 0)
+        return -1;
+
+    memcpy(fsid, &buf.f_fsid, sizeof *fsid);
+
+    return 0;
+}
+
+int fanotify_open(void)
+{
+    int fd;
+
+    if (fanotify_marks == NULL) {
+        fanotify_marks =
+            g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
+        fanotify_roots =
+            g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+        fanotify_paths =
+            g_hash_table_new_full(handle_hash, handle_equal, free, free);
+    }
+
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                       FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) {
+        log_warn("Failed to create fanotify group: %s", strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+int fanotify_add_root(int fd, const char *path, uint32_t mask)
+{
+    uint64_t fsid, fan_mask, *root_fsid;
+    char *root_path;
+    Mark *mark;
+
+    if (fanotify_fsid(path, &fsid) != 0) {
+        log_error("Failed to statfs() '%s': %s", path, strerror(errno));
+        return -1;
+    }
+
+    root_path = strdup(path);
+    root_fsid = malloc(sizeof *root_fsid);
+    if ((root_path == NULL) || (root_fsid == NULL)) {
+        log_error("Failed to allocate memory for fanotify root: %s",
+                  "fanotify.c:fanotify_add_root()");
+        free(root_path);
+        free(root_fsid);
+        return -1;
+    }
+
+    *root_fsid = fsid;
+
+    /* Moves of directories are always asked for, even if the root
+     * doesn't want them, since they're what tells us that cached
+     * paths have gone stale.
+     */
+    fan_mask = (mask & FANOTIFY_EVENTS) | FAN_MOVED_FROM | FAN_MOVED_TO
+        | FAN_ONDIR;
+
+    mark = g_hash_table_lookup(fanotify_marks, &fsid);
+
+    if ((mark == NULL) || ((mark->mask | fan_mask) != mark->mask)) {
+        if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, fan_mask,
+                          AT_FDCWD, path) != 0) {
+            log_error("Failed to add fanotify mark for '%s': %s", path,
+                      strerror(errno));
+            free(root_path);
+            free(root_fsid);
+            return -1;
+        }
+    }
+
+    if (mark == NULL) {
+        mark = malloc(sizeof(Mark));
+        if (mark == NULL) {
+            log_error("Failed to allocate memory for fanotify mark: %s",
+                      "fanotify.c:fanotify_add_root()");
+            fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                          fan_mask, AT_FDCWD, path);
+            free(root_path);
+            free(root_fsid);
+            return -1;
+        }
+
+        mark->mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mark->mount_fd < 0) {
+            log_error("Failed to open '%s': %s", path, strerror(errno));
+            fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                          fan_mask, AT_FDCWD, path);
+            free(mark);
+            free(root_path);
+            free(root_fsid);
+            return -1;
+        }
+
+        mark->fsid = fsid;
+        mark->refs = 0;
+        mark->mask = 0;
+
+        g_hash_table_insert(fanotify_marks, &mark->fsid, mark);
+
+        log_debug("Added fanotify mark for the filesystem of '%s'", path);
+    }
+
+    mark->mask |= fan_mask;
+    ++mark->refs;
+
+    g_hash_table_replace(fanotify_roots, root_path, root_fsid);
+
+    return 0;
+}
+
+void fanotify_remove_root(int fd, const char *path)
+{
+    uint64_t fsid, *root_fsid;
+    Mark *mark;
+
+    if (fanotify_roots == NULL)
+        return;
+
+    root_fsid = g_hash_table_lookup(fanotify_roots, path);
+    if (root_fsid == NULL)
+        return;
+
+    fsid = *root_fsid;
+    g_hash_table_remove(fanotify_roots, path);
+
+    mark = g_hash_table_lookup(fanotify_marks, &fsid);
+    if ((mark == NULL) || (--mark->refs > 0))
+        return;
+
+    /* The root itself may be gone, but the directory we kept open
+     * is still on the same filesystem.
+     */
+    if (fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                      mark->mask, mark->mount_fd, NULL) != 0)
+        log_warn("Failed to remove fanotify mark for '%s': %s", path,
+                 strerror(errno));
+
+    close(mark->mount_fd);
+    g_hash_table_remove(fanotify_marks, &fsid);
+    g_hash_table_remove_all(fanotify_paths);
+}
+
+/* Turn a directory file handle back into a path. Returns NULL if
+ * the directory is gone, otherwise the path, which belongs to the
+ * cache and is only good until the next call to
+ * fanotify_read_events().
+ */
+static const char *fanotify_resolve(uint64_t fsid,
+                                    struct file_handle *handle)
+{
+    int fd;
+    ssize_t len;
+    size_t size;
+    char proc[64], buf[PATH_MAX];
+    char *path;
+    Handle_Key *key;
+    Mark *mark;
+
+    size = sizeof fsid + sizeof(struct file_handle) + handle->handle_bytes;
+
+    key = malloc(sizeof(Handle_Key) + size);
+    if (key == NULL)
+        return NULL;
+
+    key->len = size;
+    memcpy(key->data, &fsid, sizeof fsid);
+    memcpy(key->data + sizeof fsid, handle, size - sizeof fsid);
+
+    path = g_hash_table_lookup(fanotify_paths, key);
+    if (path != NULL) {
+        free(key);
+        return path;
+    }
+
+    mark = g_hash_table_lookup(fanotify_marks, &fsid);
+    if (mark == NULL) {
+        free(key);
+        return NULL;
+    }
+
+    fd = open_by_handle_at(mark->mount_fd, handle, O_PATH);
+    if (fd < 0) {
+        free(key);
+        return NULL;
+    }
+
+    snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+    len = readlink(proc, buf, sizeof buf - 1);
+    close(fd);
+
+    /* A directory that's been removed still has a handle, but it's
+     * path comes back with " (deleted)" tacked on.
+     */
+    if ((len <= 0) || (len >= (ssize_t) sizeof buf - 1)
+        || (buf[0] != '/')) {
+        free(key);
+        return NULL;
+    }
+
+    buf[len] = '\0';
+
+    if ((len > 10) && (strcmp(buf + len - 10, " (deleted)") == 0)) {
+        free(key);
+        return NULL;
+    }
+
+    path = strdup(buf);
+    if (path == NULL) {
+        free(key);
+        return NULL;
+    }
+
+    if (g_hash_table_size(fanotify_paths) >= FANOTIFY_PATH_CACHE_MAX)
+        g_hash_table_remove_all(fanotify_paths);
+
+    g_hash_table_insert(fanotify_paths, key, path);
+
+    return path;
+}
+
+int fanotify_read_events(char *buffer, int len, Fanotify_Func func,
+                         void *data)
+{
+    int count = 0;
+    uint32_t mask, off;
+    uint64_t fsid;
+    const char *path, *name;
+    struct fanotify_event_metadata *meta;
+    struct fanotify_event_info_header *info;
+    struct fanotify_event_info_fid *fid;
+    struct file_handle *handle;
+
+    for (meta = (struct fanotify_event_metadata *) buffer;
+         FAN_EVENT_OK(meta, len); meta = FAN_EVENT_NEXT(meta, len)) {
+
+        ++count;
+
+        if (meta->vers != FANOTIFY_METADATA_VERSION) {
+            log_error("Unknown fanotify metadata version %d: %s",
+                      meta->vers, "fanotify.c:fanotify_read_events()");
+            break;
+        }
+
+        /* There shouldn't be an fd when reporting file handles. */
+        if (meta->fd >= 0)
+            close(meta->fd);
+
+        mask = (uint32_t) meta->mask;
+
+        if (mask & FAN_Q_OVERFLOW) {
+            func(IN_Q_OVERFLOW, NULL, NULL, data);
+            continue;
+        }
+
+        /* Find the directory's file handle, and name, among the
+         * info records after the event.
+         */
+        fid = NULL;
+        for (off = meta->metadata_len;
+             off + sizeof(*info) <= meta->event_len; off += info->len) {
+            info = (struct fanotify_event_info_header *) ((char *) meta +
+                                                          off);
+            if (info->len == 0)
+                break;
+            if ((info->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+                || (info->info_type == FAN_EVENT_INFO_TYPE_DFID)) {
+                fid = (struct fanotify_event_info_fid *) info;
+                break;
+            }
+        }
+
+        if (fid == NULL) {
+            log_trace("Skipping fanotify event without a directory handle");
+            continue;
+        }
+
+        handle = (struct file_handle *) fid->handle;
+        if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+            name = (char *) handle->f_handle + handle->handle_bytes;
+        else
+            name = "";
+
+        memcpy(&fsid, &fid->fsid, sizeof fsid);
+
+        path = fanotify_resolve(fsid, handle);
+        if (path == NULL) {
+            log_trace("Failed to find the directory of fanotify event '%s'",
+                      name);
+            continue;
+        }
+
+        func(mask, path, name, data);
+
+        /* Every path under a directory that moved is now wrong. */
+        if ((mask & FAN_ONDIR) && (mask & (FAN_MOVED_FROM | FAN_MOVED_TO)))
+            g_hash_table_remove_all(fanotify_paths);
+    }
+
+    return count;
+}
+
+#else /* HAVE_FANOTIFY */
+
+int fanotify_open(void)
+{
+    log_warn("Inotispy was built without fanotify support");
+    errno = ENOSYS;
+    return -1;
+}
+
+int fanotify_add_root(int fd, const char *path, uint32_t mask)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void fanotify_remove_root(int fd, const char *path)
+{
+}
+
+int fanotify_read_events(char *buffer, int len, Fanotify_Func func,
+                         void *data)
+{
+    return 0;
+}
+
+#endif /* HAVE_FANOTIFY */
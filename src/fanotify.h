@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_FANOTIFY_H_
+#define _INOTISPY_FANOTIFY_H_
+
+#include <stdint.h>
+
+/* fanotify event source.
+ *
+ * Instead of an inotify watch on every directory, a fanotify mark
+ * on the whole filesystem a root lives on reports every change on
+ * that filesystem, so watching a root is a single system call no
+ * matter how big the tree is, and there's nothing to crawl and no
+ * max_user_watches to run into. In exchange we're sent events for
+ * the entire filesystem, and have to throw away the ones that aren't
+ * under a watched root.
+ *
+ * Events identify the directory they happened in by file handle
+ * (FAN_REPORT_DFID_NAME), which is turned back into a path with
+ * open_by_handle_at(). Resolved paths are cached, since most events
+ * land in the same few directories.
+ *
+ * This needs Linux 5.9 or later and CAP_SYS_ADMIN. HAVE_FANOTIFY is
+ * set by configure when the headers support it; without it every
+ * function here fails, and roots fall back to inotify.
+ *
+ * None of this is thread safe. The caller must hold inotify_mutex.
+ */
+
+/* Called by fanotify_read_events() for each event. 'path' is the
+ * directory the event happened in and 'name' the entry in it, the
+ * same as an inotify event once it's path has been rebuilt. The
+ * FAN_* event bits are the same as the IN_* ones, so 'mask' can be
+ * treated as an inotify mask. An overflow is passed on as
+ * IN_Q_OVERFLOW with a NULL path and name.
+ */
+typedef void (*Fanotify_Func) (uint32_t mask, const char *path,
+                               const char *name, void *data);
+
+/* Create a fanotify group. Returns it's file descriptor, which is
+ * read just like an inotify one, or -1 on error.
+ */
+int fanotify_open(void);
+
+/* Start (or stop) getting events for the filesystem 'path' is on.
+ * Filesystems are reference counted, so the mark is only taken off
+ * once the last root on it is removed.
+ *
+ * On success 0 (zero) is returned.
+ * On failure -1 is returned.
+ */
+int fanotify_add_root(int fd, const char *path, uint32_t mask);
+void fanotify_remove_root(int fd, const char *path);
+
+/* Decode a buffer read from the fanotify file descriptor, calling
+ * 'func' for each event. Returns the number of events.
+ */
+int fanotify_read_events(char *buffer, int len, Fanotify_Func func,
+                         void *data);
+
+#endif /*_INOTISPY_FANOTIFY_H_*/
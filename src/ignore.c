@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "log.h"
+#include "ignore.h"
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>             /* PATH_MAX */
+#include <fnmatch.h>
+
+/* Flags on a trie node saying a pattern ends there. The suffix trie
+ * holds both exact names and '*suffix' patterns, the prefix trie
+ * only uses the SUFFIX_* flags for its 'prefix*' patterns.
+ */
+#define SUFFIX_ANY  0x01
+#define SUFFIX_DIR  0x02
+#define EXACT_ANY   0x04
+#define EXACT_DIR   0x08
+
+/* Built in patterns every root gets. The rsync temp files are the
+ * reason this ever existed.
+ */
+static char *ignore_builtin[] = {
+    "*.~tmp~",
+    NULL
+};
+
+/* Tries are stored as a flat array of nodes with first child / next
+ * sibling links (indexes, 0 (zero) meaning "none" since the root is
+ * node 0 and is never anyones child or sibling).
+ */
+typedef struct ignore_node {
+    int child;
+    int sibling;
+    unsigned char c;
+    unsigned char flags;
+} Node;
+
+typedef struct ignore_trie {
+    Node *nodes;
+    int num_nodes;
+    int size;
+} Trie;
+
+typedef struct ignore_glob {
+    char *pattern;
+    size_t len;
+    int dir;
+} Glob;
+
+struct ignore {
+    char *root;
+    size_t root_len;
+
+    Trie suffixes;              /* Names and '*suffix', reversed */
+    Trie prefixes;              /* 'prefix*' */
+
+    Glob *globs;                /* Anything else, for fnmatch() */
+    int num_globs;
+
+    Glob *paths;                /* Relative to the root, no slashes */
+    int num_paths;              /* at either end */
+
+    char **patterns;
+    int num_patterns;
+};
+
+static int trie_init(Trie * trie)
+{
+    trie->nodes = calloc(16, sizeof(Node));
+    if (trie->nodes == NULL)
+        return -1;
+
+    trie->num_nodes = 1;
+    trie->size = 16;
+    return 0;
+}
+
+static int trie_child(const Trie * trie, int n, unsigned char c)
+{
+    for (n = trie->nodes[n].child; n != 0; n = trie->nodes[n].sibling)
+        if (trie->nodes[n].c == c)
+            return n;
+
+    return 0;
+}
+
+/* Add the 'len' characters at 's' to 'trie', last character first
+ * if 'reverse' is set, and mark the node it ends on with 'flags'.
+ */
+static int trie_add(Trie * trie, const char *s, size_t len, int reverse,
+                    unsigned char flags)
+{
+    size_t i;
+    int n = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = reverse ? s[len - i - 1] : s[i];
+        int next = trie_child(trie, n, c);
+
+        if (next == 0) {
+            if (trie->num_nodes == trie->size) {
+                Node *nodes = realloc(trie->nodes,
+                                      2 * trie->size * sizeof(Node));
+                if (nodes == NULL)
+                    return -1;
+
+                trie->nodes = nodes;
+                trie->size *= 2;
+            }
+
+            next = trie->num_nodes++;
+            trie->nodes[next].c = c;
+            trie->nodes[next].flags = 0;
+            trie->nodes[next].child = 0;
+            trie->nodes[next].sibling = trie->nodes[n].child;
+            trie->nodes[n].child = next;
+        }
+
+        n = next;
+    }
+
+    trie->nodes[n].flags |= flags;
+    return 0;
+}
+
+static int glob_add(Glob ** globs, int *num_globs, char *pattern, int dir)
+{
+    Glob *new_globs = realloc(*globs, (*num_globs + 1) * sizeof(Glob));
+    if (new_globs == NULL)
+        return -1;
+
+    new_globs[*num_globs].pattern = pattern;
+    new_globs[*num_globs].len = strlen(pattern);
+    new_globs[*num_globs].dir = dir;
+
+    *globs = new_globs;
+    ++*num_globs;
+    return 0;
+}
+
+/* Sort 'pattern' into the right table. 'pattern' is modified and
+ * is either kept or freed.
+ */
+static int ignore_add(Ignore * ignore, char *pattern)
+{
+    size_t len = strlen(pattern);
+    int rv, dir = 0;
+    char *p = pattern;
+
+    while (len > 0 && p[len - 1] == '/') {
+        p[--len] = '\0';
+        dir = 1;
+    }
+
+    if (strchr(p, '/') != NULL) {
+        while (*p == '/')
+            ++p;
+
+        if (*p == '\0') {
+            free(pattern);
+            return 0;
+        }
+
+        memmove(pattern, p, strlen(p) + 1);
+        return glob_add(&ignore->paths, &ignore->num_paths, pattern, dir);
+    }
+
+    if (len == 0) {
+        rv = 0;
+    }
+    else if (strpbrk(p, "*?[\\") == NULL) {
+        rv = trie_add(&ignore->suffixes, p, len, 1,
+                      dir ? EXACT_DIR : EXACT_ANY);
+    }
+    else if (p[0] == '*' && strpbrk(p + 1, "*?[\\") == NULL) {
+        rv = trie_add(&ignore->suffixes, p + 1, len - 1, 1,
+                      dir ? SUFFIX_DIR : SUFFIX_ANY);
+    }
+    else if (p[len - 1] == '*' && strpbrk(p, "*?[\\") == p + len - 1) {
+        rv = trie_add(&ignore->prefixes, p, len - 1, 0,
+                      dir ? SUFFIX_DIR : SUFFIX_ANY);
+    }
+    else {
+        return glob_add(&ignore->globs, &ignore->num_globs, pattern, dir);
+    }
+
+    free(pattern);
+    return rv;
+}
+
+Ignore *ignore_compile(const char *root, char **patterns)
+{
+    int i, num_patterns = 0;
+    Ignore *ignore;
+
+    ignore = calloc(1, sizeof(Ignore));
+    if (ignore == NULL)
+        goto fail;
+
+    if (patterns != NULL)
+        while (patterns[num_patterns] != NULL)
+            ++num_patterns;
+
+    ignore->root = strdup(root);
+    ignore->patterns = calloc(num_patterns + 1, sizeof(char *));
+    if (ignore->root == NULL || ignore->patterns == NULL)
+        goto fail;
+
+    ignore->root_len = strlen(root);
+    while (ignore->root_len > 1 && root[ignore->root_len - 1] == '/')
+        ignore->root[--ignore->root_len] = '\0';
+
+    if (trie_init(&ignore->suffixes) != 0
+        || trie_init(&ignore->prefixes) != 0)
+        goto fail;
+
+    for (i = 0; ignore_builtin[i] != NULL; i++) {
+        char *pattern = strdup(ignore_builtin[i]);
+        if (pattern == NULL || ignore_add(ignore, pattern) != 0)
+            goto fail;
+    }
+
+    for (i = 0; i < num_patterns; i++) {
+        char *pattern = strdup(patterns[i]);
+        if (pattern == NULL)
+            goto fail;
+
+        ignore->patterns[ignore->num_patterns++] = pattern;
+
+        pattern = strdup(patterns[i]);
+        if (pattern == NULL || ignore_add(ignore, pattern) != 0)
+            goto fail;
+    }
+
+    return ignore;
+
+  fail:
+    log_error("Failed to allocate memory for ignore patterns: %s",
+              strerror(errno));
+    ignore_free(ignore);
+    return NULL;
+}
+
+void ignore_free(Ignore * ignore)
+{
+    int i;
+
+    if (ignore == NULL)
+        return;
+
+    for (i = 0; i < ignore->num_globs; i++)
+        free(ignore->globs[i].pattern);
+
+    for (i = 0; i < ignore->num_paths; i++)
+        free(ignore->paths[i].pattern);
+
+    for (i = 0; i < ignore->num_patterns; i++)
+        free(ignore->patterns[i]);
+
+    free(ignore->globs);
+    free(ignore->paths);
+    free(ignore->patterns);
+    free(ignore->suffixes.nodes);
+    free(ignore->prefixes.nodes);
+    free(ignore->root);
+    free(ignore);
+}
+
+char **ignore_patterns(const Ignore * ignore)
+{
+    return ignore->patterns;
+}
+
+/* Check the 'len' characters at 'name', which needn't be NUL
+ * terminated, against the tries. The globs need a C string so
+ * they're left to the caller.
+ */
+static int ignore_tries(const Ignore * ignore, const char *name,
+                        size_t len, int is_dir)
+{
+    const Trie *trie;
+    unsigned char want, exact;
+    size_t i;
+    int n;
+
+    want = is_dir ? (SUFFIX_ANY | SUFFIX_DIR) : SUFFIX_ANY;
+    exact = is_dir ? (EXACT_ANY | EXACT_DIR) : EXACT_ANY;
+
+    /* Walk the name backwards down the suffix trie. Any suffix flag
+     * along the way is a match, an exact flag only counts once the
+     * whole name has been used up.
+     */
+    trie = &ignore->suffixes;
+    if (trie->nodes[0].flags & want)
+        return 1;
+
+    for (i = len, n = 0; i > 0; i--) {
+        n = trie_child(trie, n, name[i - 1]);
+        if (n == 0)
+            break;
+
+        if (trie->nodes[n].flags & want)
+            return 1;
+    }
+
+    if (n != 0 && i == 0 && (trie->nodes[n].flags & exact))
+        return 1;
+
+    trie = &ignore->prefixes;
+    if (trie->nodes[0].flags & want)
+        return 1;
+
+    for (i = 0, n = 0; i < len; i++) {
+        n = trie_child(trie, n, name[i]);
+        if (n == 0)
+            break;
+
+        if (trie->nodes[n].flags & want)
+            return 1;
+    }
+
+    return 0;
+}
+
+int ignore_name(const Ignore * ignore, const char *name, int is_dir)
+{
+    int i;
+
+    if (ignore_tries(ignore, name, strlen(name), is_dir))
+        return 1;
+
+    for (i = 0; i < ignore->num_globs; i++) {
+        if (ignore->globs[i].dir && !is_dir)
+            continue;
+
+        if (fnmatch(ignore->globs[i].pattern, name, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Returns a pointer to 'path' relative to the root, or NULL if it
+ * isn't under the root. The root itself is "".
+ */
+static const char *ignore_relative(const Ignore * ignore, const char *path)
+{
+    if (strncmp(path, ignore->root, ignore->root_len) != 0)
+        return NULL;
+
+    path += ignore->root_len;
+    if (*path == '/')
+        return path + 1;
+
+    if (*path == '\0' || ignore->root_len == 1)
+        return path;
+
+    return NULL;
+}
+
+int ignore_path(const Ignore * ignore, const char *dir, const char *name,
+                int is_dir)
+{
+    const char *rel;
+    size_t rel_len, name_len;
+    int i;
+
+    if (ignore->num_paths == 0)
+        return 0;
+
+    rel = ignore_relative(ignore, dir);
+    if (rel == NULL)
+        return 0;
+
+    rel_len = strlen(rel);
+    name_len = strlen(name);
+
+    for (i = 0; i < ignore->num_paths; i++) {
+        const Glob *p = &ignore->paths[i];
+        const char *tail;
+
+        /* Is the pattern the directory, or a directory above it? */
+        if (rel_len >= p->len && strncmp(rel, p->pattern, p->len) == 0
+            && (rel[p->len] == '\0' || rel[p->len] == '/'))
+            return 1;
+
+        /* Otherwise it has to be the directory followed by the name. */
+        if (rel_len > 0) {
+            if (p->len <= rel_len || strncmp(rel, p->pattern, rel_len) != 0
+                || p->pattern[rel_len] != '/')
+                continue;
+            tail = p->pattern + rel_len + 1;
+        }
+        else {
+            tail = p->pattern;
+        }
+
+        if (strlen(tail) == name_len && strcmp(tail, name) == 0
+            && (is_dir || !p->dir))
+            return 1;
+    }
+
+    return 0;
+}
+
+int ignore_tree(const Ignore * ignore, const char *dir, const char *name,
+                int is_dir)
+{
+    char buf[NAME_MAX + 1];
+    const char *rel, *end;
+
+    if (ignore_name(ignore, name, is_dir)
+        || ignore_path(ignore, dir, name, is_dir))
+        return 1;
+
+    rel = ignore_relative(ignore, dir);
+    if (rel == NULL)
+        return 0;
+
+    while (*rel != '\0') {
+        size_t len;
+
+        end = strchr(rel, '/');
+        len = end ? (size_t) (end - rel) : strlen(rel);
+
+        if (ignore_tries(ignore, rel, len, 1))
+            return 1;
+
+        /* The globs need the name on its own. */
+        if (ignore->num_globs > 0 && len < sizeof buf) {
+            memcpy(buf, rel, len);
+            buf[len] = '\0';
+            if (ignore_name(ignore, buf, 1))
+                return 1;
+        }
+
+        if (end == NULL)
+            break;
+
+        rel = end + 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_IGNORE_H_
+#define _INOTISPY_IGNORE_H_
+
+/* Per root ignore rules (SEE: the 'ignore' argument to 'watch').
+ *
+ * Each pattern is one of:
+ *
+ *   name     - An exact file or directory name, i.e. '.git'.
+ *   *suffix  - Names ending in 'suffix', i.e. '*.swp'.
+ *   prefix*  - Names starting with 'prefix', i.e. '.#*'.
+ *   a/b      - A path relative to the root, and everything under it.
+ *              A leading '/' is allowed and means the same thing.
+ *
+ * Any other glob is matched against the name with fnmatch(). A
+ * trailing '/' limits a pattern to directories, i.e. 'cache/'.
+ * Ignored directories are never watched, so nothing under them is
+ * seen either.
+ *
+ * The names and suffixes are compiled into tries that are walked
+ * one character at a time, so checking a name costs about the same
+ * however many patterns there are. Matching never allocates memory
+ * or takes a lock.
+ *
+ * Every root ignores rsync's '*.~tmp~' files on top of whatever it
+ * was given.
+ */
+typedef struct ignore Ignore;
+
+/* Compile the NULL terminated list 'patterns' (which may itself be
+ * NULL) for the root at 'root'. Returns NULL if memory runs out.
+ */
+Ignore *ignore_compile(const char *root, char **patterns);
+void ignore_free(Ignore * ignore);
+
+/* The patterns 'ignore' was compiled from, less the built in ones,
+ * as a NULL terminated list that belongs to 'ignore'.
+ */
+char **ignore_patterns(const Ignore * ignore);
+
+/* Returns 1 if the file or directory called 'name' is ignored by
+ * one of the name patterns, otherwise 0 (zero).
+ */
+int ignore_name(const Ignore * ignore, const char *name, int is_dir);
+
+/* Returns 1 if 'name' in the directory 'dir' (an absolute path) is,
+ * or is under, one of the path patterns, otherwise 0 (zero).
+ */
+int ignore_path(const Ignore * ignore, const char *dir, const char *name,
+                int is_dir);
+
+/* Like ignore_name() and ignore_path() together, but also checks the
+ * name of every directory between the root and 'dir'. This is for
+ * events that weren't filtered out by never watching an ignored
+ * directory in the first place (SEE: fanotify.h).
+ */
+int ignore_tree(const Ignore * ignore, const char *dir, const char *name,
+                int is_dir);
+
+#endif /*_INOTISPY_IGNORE_H_*/
@@ -26,8 +26,15 @@
   * SUCH DAMAGE.
   */
 
+#include "log.h"
+#include "ring.h"
 #include "reply.h"
+#include "config.h"
 #include "inotify.h"
+#include "watch.h"
+#include "fanotify.h"
+#include "crawl.h"
+#include "pool.h"
 #include "utils.h"
 
 #include <glib.h>
@@ -35,14 +42,20 @@
 #include <errno.h>
 #include <ctype.h>              /* isalnum() */
 #include <dirent.h>
+#include <fcntl.h>              /* AT_SYMLINK_NOFOLLOW */
 #include <unistd.h>             /* read(), usleep() */
+#include <time.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>             /* PATH_MAX */
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>          /* FIONREAD */
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <glib/ghash.h>
 
 static pthread_mutex_t inotify_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -50,76 +63,395 @@ static int IN_MEMCLEAN = 0;
 static int IN_ROOT_REWATCH = 0;
 static int NUM_ROOT_REWATCH = 0;
 
-/* When you create a new thread using pthreads you give it
- * a reference to a subroutine and it envokes that subroutine.
- * Unlike other subroutines where you can choose how many
- * arguments you'd like to pass in, a newly threaded subroutine
- * can only take a single argument.
+/* Ingest thread state. The ingest thread is the producer for
+ * ingest_ring and the main loop (inotify_handle_event()) is the
+ * consumer. The producer bumps ingest_event_fd, an eventfd that
+ * the main loop polls on, whenever it adds data to the ring.
+ */
+static Ring ingest_ring;
+static int ingest_event_fd = -1;
+static unsigned long ingest_stalls = 0;
+
+/* Set when an event has been queued for a published root since the
+ * main loop last went looking (SEE: inotify_get_publish_roots()).
+ */
+static int publish_pending = 0;
+
+/* An event read for a wd that isn't in the watch table (yet) while
+ * a crawl is adding watches to the instance (SEE: crawl_watch()).
+ * 'data' is the raw inotify event, name and all.
+ */
+typedef struct held_event {
+    uint32_t gen;
+    uint32_t len;
+    char data[];
+} Held_Event;
+
+static int held_events = 0;     /* Across all instances */
+
+/* The ingest thread waits on every inotify instance's file
+ * descriptor through ingest_epoll_fd. ingest_instances maps
+ * instance ids to instances for the ingest thread and is guarded
+ * by ingest_mutex, which is also held while an instance's file
+ * descriptor is being read or closed. That way the ingest thread
+ * can never read from a descriptor that has been closed (and
+ * possibly reused) out from under it.
+ *
+ * NOTE: Never wait on inotify_mutex while holding ingest_mutex.
+ */
+static int ingest_epoll_fd = -1;
+static GHashTable *ingest_instances;
+static pthread_mutex_t ingest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How long inotify_mutex and ingest_mutex are held for, which is
+ * how long everything else waiting on them is kept waiting (SEE:
+ * inotify_get_lock_stats()). Always take and give up the two with
+ * inotify_lock() and ingest_lock() and friends, which keep these
+ * counters. Each is guarded by the lock it's counting.
+ */
+static LockStats inotify_lock_stats = {.name = "inotify_mutex" };
+static LockStats ingest_lock_stats = {.name = "ingest_mutex" };
+static struct timespec inotify_locked_at;
+static struct timespec ingest_locked_at;
+
+static void lock_held(LockStats * stats, const struct timespec *since)
+{
+    int i;
+    unsigned long ns, us;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ns = (unsigned long) (now.tv_sec - since->tv_sec) * 1000000000UL
+        + now.tv_nsec - since->tv_nsec;
+
+    ++stats->holds;
+    stats->total_ns += ns;
+    if (ns > stats->max_ns)
+        stats->max_ns = ns;
+
+    for (i = 0, us = ns / 1000; (us > 0) && (i < INOTIFY_LOCK_BUCKETS - 1);
+         us >>= 1)
+        ++i;
+
+    ++stats->hold_us[i];
+}
+
+static void inotify_lock(void)
+{
+    pthread_mutex_lock(&inotify_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &inotify_locked_at);
+}
+
+static void inotify_unlock(void)
+{
+    lock_held(&inotify_lock_stats, &inotify_locked_at);
+    pthread_mutex_unlock(&inotify_mutex);
+}
+
+static void ingest_lock(void)
+{
+    pthread_mutex_lock(&ingest_mutex);
+    clock_gettime(CLOCK_MONOTONIC, &ingest_locked_at);
+}
+
+static void ingest_unlock(void)
+{
+    lock_held(&ingest_lock_stats, &ingest_locked_at);
+    pthread_mutex_unlock(&ingest_mutex);
+}
+
+/* Every inotify instance, keyed by id and by name. Both are
+ * guarded by inotify_mutex.
  *
- * The way to get more than one piece of data to your new thread
- * is to create a struct with all the data, and then pass in a
- * single pointer to that struct.
+ * The fanotify group (SEE: fanotify.h), while there are roots using
+ * it, is read and counted like any other instance, so it's in
+ * inotify_instances too. It's kept out of inotify_instance_names
+ * so that a client can't put inotify watches on it by asking for
+ * an instance with the same name.
+ */
+static GHashTable *inotify_instances;
+static GHashTable *inotify_instance_names;
+static Instance *default_instance;
+static Instance *fanotify_instance = NULL;
+static int instance_next_id = 1;
+
+/* Each record the ingest thread puts in the ring starts with
+ * this header, followed by the raw inotify events read from
+ * the instance's file descriptor. 'gen' is the instance's
+ * generation just after the read (SEE: WdTable in inotify.h).
+ */
+typedef struct ingest_header {
+    int32_t instance_id;
+    uint32_t gen;
+} Ingest_Header;
+
+/* Directories that have been moved away from (IN_MOVED_FROM) but
+ * not yet seen arriving anywhere (IN_MOVED_TO), keyed by the cookie
+ * the kernel gives both halves of a rename. The subtree is detached
+ * from the watch table with all of its wds intact so that, once the
+ * other half shows up, it can just be put back under its new name
+ * instead of being unwatched and crawled all over again.
+ *
+ * The two halves are read from the kernel together, so a move that
+ * is still unmatched after the next call to inotify_handle_event()
+ * went somewhere we're not watching and is unwatched for good.
+ *
+ * Guarded by inotify_mutex.
+ */
+typedef struct inotify_move {
+    Watch *watch;
+    unsigned long round;
+} Move;
+
+static GHashTable *inotify_moves;
+static unsigned long move_round = 0;
+
+/* For roots that pair moves (SEE: INOTIFY_ROOT_PAIR_MOVES), the
+ * IN_MOVED_FROM events still waiting for their IN_MOVED_TO, keyed
+ * by cookie. If nothing turns up within move_pair_window
+ * milliseconds (SEE: inotispy.conf) the file was moved somewhere
+ * we're not watching, and it's queued as a plain IN_DELETE.
  *
- * The following typedef is that struct.
+ * Guarded by inotify_mutex.
  */
-typedef struct thread_data {
+typedef struct inotify_move_event {
+    Root *root;
+    Event event;                /* path and name share one allocation */
+    long long expires;          /* CLOCK_MONOTONIC, in microseconds */
+} Move_Event;
+
+static GHashTable *inotify_move_events;
+
+/* Drain statistics. See inotify_log_drain_stats(). */
+static unsigned long drain_events = 0;
+static unsigned long drain_batches = 0;
+static time_t drain_window_start = 0;
+static double drain_events_per_batch = 0;
+static double drain_batches_per_sec = 0;
+
+/* When you queue a task for the background threads (SEE: pool.h)
+ * you give it a reference to a subroutine and it envokes that
+ * subroutine. Unlike other subroutines where you can choose how
+ * many arguments you'd like to pass in, a task can only take a
+ * single argument.
+ *
+ * The way to get more than one piece of data to your task is to
+ * create a struct with all the data, and then pass in a single
+ * pointer to that struct.
+ *
+ * The following typedef is that struct, for _unwatch_tree().
+ */
+typedef struct unwatch_data {
+    Watch *watch;
+    Instance *instance;
+} U_Data;
+
+/* A crawl started by do_watch_tree(), handed back to each of the
+ * crawl_*() callbacks.
+ */
+typedef struct crawl_data {
     char *path;
     Root *root;
-    int cleanup;
-} T_Data;
+    int mode;
+} C_Data;
+
+/* An entry found in a newly created directory, waiting on the rest
+ * of its directory (SEE: crawl_found()).
+ */
+typedef struct crawl_found {
+    uint32_t mask;
+    char name[];
+} C_Found;
+
+/* What do_watch_tree() is crawling for. */
+#define CRAWL_ROOT      0       /* A root that's just been watched */
+#define CRAWL_CLEANUP   1       /* Watches the memory cleanup lost */
+#define CRAWL_NEW       2       /* A directory created under a root */
+
+/* A directory to be looked at by _inotify_rescan(), along with
+ * what the watch table last knew about it (SEE: Watch::mtime).
+ */
+typedef struct rescan_dir {
+    uint32_t mtime;
+    uint32_t entries;
+    char path[];
+} R_Dir;
+
+/* Where an overflow rescan is up to between batches. */
+typedef struct rescan_state {
+    char *cursor;               /* Path of the next batch's first watch */
+    time_t since;               /* 0 until this pass has started */
+    int total;
+    char root_path[];
+} R_State;
+
+/* The directory rescan_dir() is reading, for rescan_entry(). */
+typedef struct rescan_read {
+    const char *root_path;
+    const R_Dir *dir;
+    time_t since;
+    int changed;
+    uint32_t entries;
+    uint32_t created;
+} R_Read;
 
 /* Prototypes for private functions. */
 static Root *inotify_path_to_root(const char *path);
 static Root *make_root(const char *path, int mask, int max_events,
-                       int rewatch);
-static Watch *make_watch(int wd, const char *path);
+                       int rewatch, int flags, char **ignore);
+static guint record_hash(gconstpointer key);
+static gboolean record_equal(gconstpointer a, gconstpointer b);
+static Event_Record *record_lookup(Root * root, const char *path,
+                                   const char *name);
+static void record_index_rebuild(Root * root);
+static void _unwatch(Watch * watch, void *data);
+static void unwatch_tree(Watch * watch);
+static void _unwatch_tree(void *thread_data);
+static int move_start(Watch * watch, uint32_t cookie);
+static int move_finish(Watch * parent, Root * root, const IN_Event * event,
+                       const char *abs_path);
+static void move_expire(const Root * root);
+static int move_event_queue(Root * root, Event * event);
+static void move_event_expire(const Root * root, long long now);
+static void move_event_flush(Move_Event * move);
+static long long now_usec(void);
 static char *inotify_is_parent(const char *path);
-static int inotify_enqueue(const Root * root, const IN_Event * event,
-                           const char *path);
-static void free_node_mem(Event * node, gpointer user_data);
-
-static int do_watch_tree(const char *path, Root * root, int cleanup);
-static void *_do_watch_tree(void *thread_data);
-static void _do_watch_tree_rec(char *path, Root * root, int cleanup);
-static void *_destroy_root(void *thread_data);
-static void *_inotify_memclean(void *thread_data);
-
-/* Initialize inotify file descriptor and set up meta data hashes.
+static int inotify_enqueue(Root * root, const Event * event);
+static void publish_wakeup(void);
+static int held_add(Instance * instance, uint32_t gen,
+                    const IN_Event * event);
+static void held_replay(Instance * instance);
+static int inotify_handle_batch(Instance * instance, uint32_t gen,
+                                char *buffer, int num_in_events);
+static void *_inotify_ingest(void *thread_data);
+static Instance *instance_get(const char *name);
+static Instance *instance_new(const char *name, int fd);
+static Instance *fanotify_instance_get(void);
+static void fanotify_event(uint32_t mask, const char *path,
+                           const char *name, void *data);
+static int instance_release(Instance * instance);
+static void instance_destroy(Instance * instance);
+static void instance_add_root(Instance * instance, Root * root);
+static void instance_remove_root(Instance * instance, Root * root);
+
+static int do_watch_tree(const char *path, Root * root, int mode);
+static void crawl_watch(Crawl_Dir ** dirs, int num, void *data);
+static int crawl_entry(Crawl_Dir * dir, const char *name, int is_dir,
+                       void *data);
+static void crawl_read(Crawl_Dir ** dirs, int num, void *data);
+static void crawl_done(void *data);
+static int crawl_cancelled(void *data);
+static void crawl_complete(Root * root);
+static void crawl_found(Crawl_Dir * dir, Root * root, const char *name,
+                        int is_dir);
+static void crawl_events(Root * root, const char *path, GPtrArray * found);
+static void _destroy_root(void *thread_data);
+static void root_free(Root * root);
+static void _inotify_memclean(void *thread_data);
+static void overflow_start(Instance * instance);
+static void _inotify_rescan(void *thread_data);
+static void rescan_free(void *data);
+static void rescan_dir(const char *root_path, const R_Dir * dir,
+                       time_t since, char *read_buf);
+static int rescan_entry(int fd, const char *name, unsigned char type,
+                        void *data);
+static void rescan_event(const char *root_path, uint32_t mask,
+                         const char *path, const char *name);
+static int rescan_stat(int fd, const char *name, mode_t * mode,
+                       time_t * mtime, time_t * ctime, time_t * btime);
+
+/* Callbacks for the crawler threads (SEE: do_watch_tree()). */
+static const Crawl_Ops crawl_ops = {
+    crawl_watch,
+    crawl_entry,
+    crawl_read,
+    crawl_done,
+    crawl_cancelled
+};
+
+/* Initialize inotify file descriptor, set up meta data hashes
+ * and start the ingest thread.
  *
- * On success the inotify file descriptor is returned.
+ * On success the ingest eventfd, which is the file descriptor the
+ * main loop should poll on, is returned.
  * On failure 0 (zero) is returned.
  */
 int inotify_setup(void)
 {
     int rv;
+    pthread_t t;
+    pthread_attr_t attr;
 
     inotify_num_watched_roots = 0;
+    drain_window_start = time(NULL);
+
+    if (ring_init(&ingest_ring, CONFIG->ingest_ring_size) != 0) {
+        log_error("Failed to allocate %d bytes for the ingest ring: %s",
+                  CONFIG->ingest_ring_size, "inotify.c:inotify_setup()");
+        return 0;
+    }
 
-    inotify_fd = inotify_init();
+    ingest_event_fd = eventfd(0, EFD_NONBLOCK);
 
-    if (inotify_fd < 0) {
-        log_error("Inotify failed to init: %s", strerror(errno));
+    if (ingest_event_fd < 0) {
+        log_error("Failed to create ingest eventfd: %s", strerror(errno));
+        return 0;
+    }
+
+    ingest_epoll_fd = epoll_create(16);
+
+    if (ingest_epoll_fd < 0) {
+        log_error("Failed to create ingest epoll fd: %s", strerror(errno));
+        return 0;
+    }
+
+    if (crawl_init(CONFIG->crawl_threads, CONFIG->crawl_io_uring) != 0) {
+        log_error("Failed to start the crawler threads");
+        return 0;
+    }
+
+    if (pool_init(CONFIG->pool_threads) != 0) {
+        log_error("Failed to start the background threads");
         return 0;
     }
 
-    inotify_wd_to_watch =
+    ingest_instances =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    inotify_instances =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    inotify_instance_names =
+        g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+    inotify_moves =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+    inotify_move_events =
         g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
 
-    if (inotify_wd_to_watch == NULL) {
-        log_error("Failed to init GHashTable inotify_wd_to_watch");
+    if (ingest_instances == NULL || inotify_instances == NULL
+        || inotify_instance_names == NULL || inotify_moves == NULL
+        || inotify_move_events == NULL) {
+        log_error("Failed to init GHashTables for inotify instances");
         return 0;
     }
 
-    inotify_path_to_watch =
-        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    /* The default instance is shared by every root that isn't
+     * given one of its own, and is never destroyed.
+     */
+    default_instance = instance_get(INOTIFY_DEFAULT_INSTANCE);
 
-    if (inotify_path_to_watch == NULL) {
-        log_error("Failed to init GHashTable inotify_path_to_watch");
+    if (default_instance == NULL) {
+        log_error("Inotify failed to init: %s", strerror(errno));
+        return 0;
+    }
+
+    if (watch_table_init() != 0) {
+        log_error("Failed to init the watch table");
         return 0;
     }
 
+    /* Roots are freed by hand (SEE: root_free()). */
     inotify_roots =
-        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
     if (inotify_roots == NULL) {
         log_error("Failed to init GHashTable inotify_roots");
@@ -145,18 +477,21 @@ int inotify_setup(void)
             log_warn("Failed to open presistant root dump file '%s': %s",
                      INOTIFY_ROOT_DUMP_FILE, strerror(errno));
         } else {
-            int mask, max_events;
-            char *path;
-            char line[1024];
+            int mask, max_events, flags;
+            char *path, *field, *instance, *save;
+            char line[4096];
             char delim[] = ",";
+            GPtrArray *ignore = g_ptr_array_new();
 
             while (fgets(line, sizeof line, dump) != NULL) {
                 if (line[strlen(line) - 1] == '\n')
                     line[strlen(line) - 1] = '\0';
 
-                path = strtok(line, delim);
-                mask = atoi(strtok(NULL, delim));
-                max_events = atoi(strtok(NULL, delim));
+                path = strtok_r(line, delim, &save);
+                field = strtok_r(NULL, delim, &save);
+                mask = field ? atoi(field) : 0;
+                field = strtok_r(NULL, delim, &save);
+                max_events = field ? atoi(field) : 0;
 
                 if (!(path && mask && max_events)) {
                     log_error("Invalid entry in dump file '%s': %s",
@@ -165,13 +500,49 @@ int inotify_setup(void)
                     continue;
                 }
 
+                /* Anything after max_events is an optional key=value
+                 * field. Unknown keys are ignored so older versions of
+                 * the daemon can still read newer dump files.
+                 */
+                instance = NULL;
+                flags = 0;
+                g_ptr_array_set_size(ignore, 0);
+                while ((field = strtok_r(NULL, delim, &save)) != NULL) {
+                    if (strncmp(field, "instance=", 9) == 0)
+                        instance = field + 9;
+                    else if (strncmp(field, "ignore=", 7) == 0)
+                        g_ptr_array_add(ignore, field + 7);
+                    else if (strcmp(field, "coalesce=1") == 0)
+                        flags |= INOTIFY_ROOT_COALESCE;
+                    else if (strcmp(field, "pair_moves=1") == 0)
+                        flags |= INOTIFY_ROOT_PAIR_MOVES;
+                }
+
+                g_ptr_array_add(ignore, NULL);
+
                 log_notice("Rewatching tree at root '%s'", path);
-                inotify_watch_tree(path, mask, max_events, 1);
+                inotify_watch_tree(path, mask, max_events, 1, flags,
+                                   instance, (char **) ignore->pdata);
             }
+
+            g_ptr_array_free(ignore, TRUE);
+            fclose(dump);
         }
     }
 
-    return inotify_fd;
+    /* Initialize thread attribute to automatically detach */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    rv = pthread_create(&t, &attr, _inotify_ingest, NULL);
+    if (rv) {
+        log_error("Failed to create the inotify ingest thread: %d", rv);
+        return 0;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    return ingest_event_fd;
 }
 
 int is_a_dir(char *dir)
@@ -186,703 +557,1649 @@ int is_a_dir(char *dir)
 
 int inotify_num_watched_dirs(void)
 {
-    return (int) g_hash_table_size(inotify_path_to_watch);
+    int count;
+
+    inotify_lock();
+    count = watch_count();
+    inotify_unlock();
+
+    return count;
 }
 
+/* Process the events the ingest thread has handed us.
+ *
+ * The kernel side of things is handled entirely by the ingest
+ * thread (SEE: _inotify_ingest() below), which does nothing but
+ * drain the non-blocking inotify file descriptors into ingest_ring.
+ * This function is the other half: it's called from the main loop
+ * when the ingest eventfd becomes readable and does the expensive
+ * work (path resolution, new directory watches, queueing) for every
+ * batch sitting in the ring.
+ *
+ * Each batch is worked on in place in the ring while holding
+ * inotify_mutex once, rather than locking and unlocking for every
+ * single event. Batches belonging to an instance that has since
+ * been destroyed are thrown away.
+ */
 void inotify_handle_event(void)
 {
-    int i = 0, rv, num_in_events;
-    char buffer[INOTIFY_EVENT_BUF_LEN];
-    char *path, *abs_path;
-    Root *root;
-    IN_Event *event;
+    int num_events;
+    uint32_t len;
+    uint64_t count;
+    char *buffer;
+    Ingest_Header *header;
+    Instance *instance;
+
+    /* Reset the eventfd before draining the ring. Anything the
+     * ingest thread adds after this point will wake us up again.
+     */
+    if ((read(ingest_event_fd, &count, sizeof count) == -1)
+        && (errno != EAGAIN)) {
+        log_error("Failed to read ingest eventfd: %s", strerror(errno));
+    }
 
-    event = NULL;
+    while ((buffer = ring_peek(&ingest_ring, &len)) != NULL) {
+
+        header = (Ingest_Header *) buffer;
+
+        inotify_lock();
+
+        instance = g_hash_table_lookup(inotify_instances,
+                                       GINT_TO_POINTER(header->
+                                                       instance_id));
+        if (instance != NULL) {
+            if (instance->fanotify)
+                num_events =
+                    fanotify_read_events(buffer + sizeof(Ingest_Header),
+                                         (int) (len -
+                                                sizeof(Ingest_Header)),
+                                         fanotify_event, instance);
+            else {
+                /* Anything held back from before goes first, to keep
+                 * the events for each wd in order.
+                 */
+                if (instance->held != NULL)
+                    held_replay(instance);
+
+                num_events =
+                    inotify_handle_batch(instance, header->gen,
+                                         buffer + sizeof(Ingest_Header),
+                                         (int) (len -
+                                                sizeof(Ingest_Header)));
+            }
 
-    sync();
+            ++instance->batches;
+            instance->events += num_events;
+            instance->drained = time(NULL);
+            ++drain_batches;
+            drain_events += num_events;
+        }
 
-    /* Grab the next buffer of inotoify events. If the
-     * length of this buffer is negative then we've
-     * encountered a read error.
-     */
-    num_in_events = read(inotify_fd, buffer, INOTIFY_EVENT_BUF_LEN);
+        inotify_unlock();
 
-    if (num_in_events < 0) {
-        log_error("Inotify read error: %s", strerror(errno));
-        return;
+        ring_release(&ingest_ring, len);
     }
 
-    /* Loop through, read, and act on the returned
-     * list of inotify events.
-     */
-    while (i < num_in_events) {
+    /* Give up on moves that didn't find their other half. */
+    inotify_lock();
 
-        event = (struct inotify_event *) &buffer[i];
+    /* Held events whose watches have been added since. */
+    if (held_events > 0) {
+        GHashTableIter iter;
+        gpointer value;
 
-        /* Skip bogus events. */
-        if ((event == NULL) || (event->len == 0)) {
-            i += INOTIFY_EVENT_SIZE;
-            continue;
+        g_hash_table_iter_init(&iter, inotify_instances);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            if (((Instance *) value)->held != NULL)
+                held_replay(value);
         }
+    }
 
-        /* IN_Q_OVERFLOW is the event that occurrs when inotify's
-         * event buffer is full.
-         */
-        if (event->mask & IN_Q_OVERFLOW) {
-            log_error
-                ("Inotify event buffer is full: Raise the value in %s %s",
-                 "/proc/sys/fs/inotify/max_queued_events if",
-                 "this is a chronic error");
-            i += INOTIFY_EVENT_SIZE + event->len;
-            continue;
-        }
+    move_expire(NULL);
+    ++move_round;
+    inotify_unlock();
+}
 
-        /* IN_CLOSE_NOWRITE events occur on a directory when inotify
-         * sets up a watch on it. They also occur when someone does
-         * a tab complete within a watched tree. We don't care about
-         * these events and never want to queue them, so we skip.
-         */
-        if ((event->mask & IN_ISDIR) && (event->mask & IN_CLOSE_NOWRITE)) {
-            log_trace("Skipping inotify IN_CLOSE_NOWRITE event on wd %d",
-                      event->wd);
-            i += INOTIFY_EVENT_SIZE + event->len;
-            continue;
-        }
+/* Read whatever is waiting on a single inotify instance into the
+ * ring. Called only by the ingest thread.
+ *
+ * ingest_mutex is held while looking at, and reading from, the
+ * instance's file descriptor, but never while waiting for room in
+ * the ring. Otherwise a main loop that is itself waiting on
+ * ingest_mutex (to close an instance) would never get around to
+ * draining the ring and we'd deadlock.
+ *
+ * Returns the number of bytes read, 0 if there was nothing to read,
+ * or -1 on error.
+ */
+static ssize_t _inotify_ingest_one(int id)
+{
+    int fd, avail = 0;
+    ssize_t len;
+    uint32_t want, gen;
+    char *buffer;
+    Ingest_Header *header;
+    Instance *instance;
+
+    ingest_lock();
+
+    instance = g_hash_table_lookup(ingest_instances, GINT_TO_POINTER(id));
+    if (instance == NULL) {
+        ingest_unlock();
+        return 0;
+    }
 
-        /* IN_IGNORED events occur when we remove an inotify watch by
-         * making a call to inotify_rm_watch(). We don't care about
-         * these events and never want to queue them.
-         */
-        if (event->mask & IN_IGNORED) {
-            log_trace("Skipping inotify IN_IGNORED event on wd %d",
-                      event->wd);
-            i += INOTIFY_EVENT_SIZE + event->len;
-            continue;
-        }
+    fd = instance->fd;
 
-        /* Skip .~tmp~ events (generated by rsync) */
-        char *tmp_str = ".~tmp~";
-        char *idx = NULL;
+    /* FIONREAD on a fanotify group only counts the fixed part of each
+     * event, not the file handles and names after it, so it's no use
+     * for sizing the read. Just give it a full buffer; the read won't
+     * block if there's nothing there.
+     */
+    if (instance->fanotify) {
+        avail = INOTIFY_EVENT_BUF_LEN;
+    } else if (ioctl(fd, FIONREAD, &avail) == -1) {
+        log_error("Failed to call ioctl(FIONREAD) on inotify fd: %s",
+                  strerror(errno));
+        ingest_unlock();
+        return -1;
+    }
 
-        if (idx = strstr(event->name, tmp_str)) {
-            idx += strlen(tmp_str);
-            if (*idx == '\0') {
-                log_trace("Skipping '.~tmp~' event on wd %d", event->wd);
-                i += INOTIFY_EVENT_SIZE + event->len;
-                continue;
-            }
-        }
+    ingest_unlock();
 
+    if (avail <= 0)
+        return 0;
 
-        log_trace("Got inotify event on %s '%s' for wd %d",
-                  ((event->mask & IN_ISDIR) ? "directory" : "file"),
-                  event->name, event->wd);
+    want = (uint32_t) avail + sizeof(Ingest_Header);
+    if (want > ring_max_record(&ingest_ring))
+        want = ring_max_record(&ingest_ring);
 
-        pthread_mutex_lock(&inotify_mutex);
+    while ((buffer = ring_reserve(&ingest_ring, want)) == NULL) {
+        ++ingest_stalls;
+        usleep(INOTIFY_INGEST_STALL_USEC);
+    }
 
-        /* Since inotify only reports the name of the file
-         * or directory under notification we need to lookup
-         * it's parent path in our watch descriptor hash map.
-         */
-        Watch *watch = g_hash_table_lookup(inotify_wd_to_watch,
-                                           GINT_TO_POINTER(event->wd)
-            );
+    ingest_lock();
 
-        /* Move onto the next event if we can't find its watcher.
-         *
-         * This really ony happens when there is a rapid creation and
-         * immediate deletion of directorie trees. The only time I've
-         * seen it happen are during stress/load tests where large trees,
-         * (i.e. the linux kernel tarball, or Erlang OTP tarball) are un-
-         * tar-ed and rm -rf-ed in rapid succession. This is not behavior
-         * I really wanted to see, but because of the reactive nature of
-         * inotify, and the fact that file system events are not instan-
-         * taious this situation might occur. There is eventual consistency
-         * so for now I'm labling this less of a bug and more of an
-         * unfortunate feature.
-         */
-        if (watch == NULL) {
-            log_trace
-                ("Failed to look up watcher for wd '%d' in inotify_handle_event (%s)",
-                 event->wd, event->name);
-            i += INOTIFY_EVENT_SIZE + event->len;
-            pthread_mutex_unlock(&inotify_mutex);
-            continue;
-        }
+    /* The instance may have been closed while we were waiting. */
+    if (g_hash_table_lookup(ingest_instances, GINT_TO_POINTER(id))
+        != instance) {
+        ingest_unlock();
+        return 0;
+    }
 
-        /* Look up the root meta data. */
-        int path_len = strlen(watch->path);
-        path = malloc(path_len + 1);
-        if (path == NULL) {
-            log_error
-                ("Failed to allocate memory while copying watch path '%s': %s",
-                 watch->path, "inotify.c:inotify_handle_event()");
-            i += INOTIFY_EVENT_SIZE + event->len;
-            pthread_mutex_unlock(&inotify_mutex);
-            continue;
-        }
+    len = read(fd, buffer + sizeof(Ingest_Header),
+               want - sizeof(Ingest_Header));
 
-        memcpy(path, watch->path, path_len);
-        path[path_len] = '\0';
+    /* Taken after the read, so that any watch added with a later
+     * generation than this can't have events in this batch.
+     */
+    gen = __atomic_load_n(&instance->gen, __ATOMIC_ACQUIRE);
 
-        root = inotify_path_to_root(path);
+    ingest_unlock();
 
-        if (root == NULL) {
-            log_debug("Failed to look up meta data for root '%s'", path);
-            i += INOTIFY_EVENT_SIZE + event->len;
-            free(path);
-            pthread_mutex_unlock(&inotify_mutex);
-            continue;
-        }
+    if (len < 0) {
+        if ((errno == EAGAIN) || (errno == EINTR))
+            return 0;
 
-        if (root->pause) {
-            log_trace("Root is currently paused. Skipping event");
-            i += INOTIFY_EVENT_SIZE + event->len;
-            free(path);
-            pthread_mutex_unlock(&inotify_mutex);
-            continue;
-        }
+        log_error("Inotify read error: %s", strerror(errno));
+        return -1;
+    }
 
-        if (root->destroy != 0) {
-            log_trace("Root is being destroyed. Skipping event");
-            i += INOTIFY_EVENT_SIZE + event->len;
-            free(path);
-            pthread_mutex_unlock(&inotify_mutex);
-            continue;
-        }
+    if (len == 0)
+        return 0;
 
-        pthread_mutex_unlock(&inotify_mutex);
+    header = (Ingest_Header *) buffer;
+    header->instance_id = id;
+    header->gen = gen;
 
-        /* Construct the absolute path for this event. */
-        if (strcmp(path, "/") == 0)
-            rv = mk_string(&abs_path, "/%s", path, event->name);
-        else
-            rv = mk_string(&abs_path, "%s/%s", path, event->name);
+    ring_commit(&ingest_ring, (uint32_t) (len + sizeof(Ingest_Header)));
 
-        if (rv == -1) {
-            log_error
-                ("Failed to allocate memory while creating absolute event path: %s",
-                 "inotify.c:inotify_handle_event()");
-            i += INOTIFY_EVENT_SIZE + event->len;
-            free(path);
+    return len;
+}
+
+/* The ingest thread.
+ *
+ * This is the only thread that ever reads from the inotify file
+ * descriptors. It waits on all of them at once through
+ * ingest_epoll_fd and, each time around, does one read from every
+ * instance that has events waiting. That keeps a single very busy
+ * tree from starving all of the others. Each read is sized with
+ * FIONREAD and goes straight into space reserved in ingest_ring,
+ * so the raw event records are never copied. After each round the
+ * main loop is poked through ingest_event_fd.
+ *
+ * If the main loop falls so far behind that the ring fills up we
+ * just wait for it to catch up; the kernel queues absorb events in
+ * the meantime, exactly as they did before this thread existed.
+ */
+static void *_inotify_ingest(void *thread_data)
+{
+    int i, n, got;
+    uint64_t one = 1;
+    struct epoll_event ready[INOTIFY_INGEST_MAX_READY];
+
+    (void) thread_data;
+
+    while (1) {
+
+        n = epoll_wait(ingest_epoll_fd, ready, INOTIFY_INGEST_MAX_READY,
+                       -1);
+        if (n == -1) {
+            if (errno != EINTR)
+                log_error("Ingest thread failed to call epoll_wait(): %s",
+                          strerror(errno));
             continue;
         }
 
-        log_trace("Got event for '%s'", abs_path);
+        /* The epoll set is level triggered, so any instance that
+         * still has events left after its read this round will be
+         * handed back to us straight away by the next epoll_wait().
+         */
+        got = 0;
+        for (i = 0; i < n; i++) {
+            if (_inotify_ingest_one((int) ready[i].data.u32) > 0)
+                got = 1;
+        }
 
-        if (event->mask & IN_ISDIR) {
+        if (got && (write(ingest_event_fd, &one, sizeof one) == -1))
+            log_error("Failed to write ingest eventfd: %s",
+                      strerror(errno));
+    }
 
-            /* Here we have new directory creation, which means that
-             * beyond just queuing the event(s) we also need to perform
-             * a recursive watch on the new tree and make sure those
-             * watches are tied to the appropriate root path.
-             */
-            if ((event->mask & IN_CREATE)
-                || (event->mask & IN_MOVED_TO)) {
+    return NULL;
+}
 
-                /* Skip .~tmp~ directories (generated by rsync) */
-                char *tmp_str = ".~tmp~";
-                char *idx = NULL;
+/* Find the instance called 'name', creating it (with its own
+ * inotify file descriptor) if it doesn't exist yet, and take a
+ * reference on it. A NULL name means the default instance.
+ *
+ * The caller must hold inotify_mutex, except for the very first
+ * call from inotify_setup().
+ *
+ * If a new inotify instance can't be created (most likely because
+ * we've hit /proc/sys/fs/inotify/max_user_instances) the default
+ * instance is returned instead so the tree still gets watched.
+ */
+static Instance *instance_get(const char *name)
+{
+    int fd;
+    Instance *instance;
 
-                if (idx = strstr(path, tmp_str)) {
-                    idx += strlen(tmp_str);
-                    if (*idx == '\0') {
-                        log_trace
-                            ("Skipping do_watch_tree() on '.~tmp~' directory: %s",
-                             path);
-                        i += INOTIFY_EVENT_SIZE + event->len;
-                        free(path);
-                        free(abs_path);
-                        continue;
-                    }
-                }
+    if (name == NULL || *name == '\0')
+        name = INOTIFY_DEFAULT_INSTANCE;
 
-                log_trace("New directory '%s' found", abs_path);
-                usleep(1000);
+    instance = g_hash_table_lookup(inotify_instance_names, name);
+    if (instance != NULL) {
+        ++instance->refs;
+        return instance;
+    }
 
-                rv = do_watch_tree(abs_path, root, 0);
-                if (rv != 0) {
-                    log_error("Failed to watch root at dir '%s': %s",
-                              abs_path, error_to_string(rv));
-                    i += INOTIFY_EVENT_SIZE + event->len;
-                    free(path);
-                    free(abs_path);
-                    continue;
-                }
-            }
+    fd = inotify_init1(IN_NONBLOCK);
+    if (fd < 0) {
+        if (default_instance == NULL)
+            return NULL;
 
-            /* Here we have directory deletion. So we need to tell
-             * inotify to stop watching this directory for us, as
-             * well as remove the mapping we have stored in our
-             * watch descriptor meta maps.
-             */
-            else if ((event->mask & IN_DELETE)
-                     || (event->mask & IN_MOVED_FROM)) {
-                log_trace
-                    ("Existing directory '%s' has been moved or removed",
-                     abs_path);
+        log_warn
+            ("Failed to create inotify instance '%s', using '%s' instead: %s",
+             name, INOTIFY_DEFAULT_INSTANCE, strerror(errno));
+        ++default_instance->refs;
+        return default_instance;
+    }
 
-                /* TODO: How can we determine if the actual root itself
-                 *       is being deleted since the root itself is not
-                 *       watched by anything?
-                 */
+    instance = instance_new(name, fd);
+    if (instance != NULL)
+        g_hash_table_insert(inotify_instance_names, instance->name,
+                            instance);
 
-                pthread_mutex_lock(&inotify_mutex);
+    return instance;
+}
 
-                Watch *delete = g_hash_table_lookup(inotify_path_to_watch,
-                                                    abs_path);
+/* Take a reference on the fanotify group, creating it if this is
+ * the first root to use it. Returns NULL if fanotify isn't
+ * available.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static Instance *fanotify_instance_get(void)
+{
+    int fd;
 
-                if (delete == NULL) {
-                    log_trace
-                        ("Failed to look up watcher for path '%s' while attempting to delete it",
-                         abs_path);
-                    i += INOTIFY_EVENT_SIZE + event->len;
-                    free(path);
-                    free(abs_path);
-                    pthread_mutex_unlock(&inotify_mutex);
-                    continue;
-                }
+    if (fanotify_instance != NULL) {
+        ++fanotify_instance->refs;
+        return fanotify_instance;
+    }
 
-                inotify_rm_watch(inotify_fd, delete->wd);
+    fd = fanotify_open();
+    if (fd < 0)
+        return NULL;
 
-                /* Clean up meta data mappings and tell inotify
-                 * to stop watching the deleted dir.
-                 */
-                void *t1, *t2;
-                int wd = delete->wd;
+    fanotify_instance = instance_new("fanotify", fd);
+    if (fanotify_instance != NULL)
+        fanotify_instance->fanotify = 1;
 
-                if (g_hash_table_lookup_extended
-                    (inotify_wd_to_watch, GINT_TO_POINTER(wd), &t1, &t2)) {
-                    g_hash_table_remove(inotify_wd_to_watch,
-                                        GINT_TO_POINTER(wd));
-                }
+    return fanotify_instance;
+}
 
-                if (g_hash_table_lookup_extended
-                    (inotify_path_to_watch, abs_path, &t1, &t2)
-                    && abs_path[0] == '/') {
-                    g_hash_table_remove(inotify_path_to_watch, abs_path);
-                }
+/* Set up an Instance for the already open file descriptor 'fd' and
+ * hand it to the ingest thread. On failure 'fd' is closed and NULL
+ * is returned.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static Instance *instance_new(const char *name, int fd)
+{
+    Instance *instance;
+    struct epoll_event ev;
+
+    instance = calloc(1, sizeof(Instance));
+    if (instance == NULL) {
+        log_error("Failed to allocate memory for inotify instance '%s'",
+                  name);
+        close(fd);
+        return NULL;
+    }
 
-                free(delete->path);
-                free(delete);
+    instance->id = instance_next_id++;
+    instance->fd = fd;
+    instance->name = strdup(name);
+    instance->refs = 1;
+    instance->drained = time(NULL);
 
-                if (event->mask & IN_MOVED_FROM) {
-                    int rv;
-                    GList *key = NULL, *keys = NULL;
-                    char *tmp, *sub_path, *ptr;
-                    Watch *sub_watch;
+    g_hash_table_insert(inotify_instances, GINT_TO_POINTER(instance->id),
+                        instance);
 
-                    log_trace
-                        ("Existing directory '%s' has been moved. Unwatching it's sub dirs",
-                         abs_path);
+    ingest_lock();
+    g_hash_table_insert(ingest_instances, GINT_TO_POINTER(instance->id),
+                        instance);
+    ingest_unlock();
 
-                    /* Destroy all the watches associated with this subroot. */
-                    keys = g_hash_table_get_keys(inotify_path_to_watch);
-                    rv = mk_string(&tmp, "%s/", abs_path);
-                    if (rv == -1) {
-                        log_error
-                            ("Failed to allocate memory for temporary path variable: %s",
-                             "inotify.c:inotify_handle_event()");
-                        g_list_free(keys);
-                        free(path);
-                        free(abs_path);
-                        pthread_mutex_unlock(&inotify_mutex);
-                        return;
-                    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t) instance->id;
 
-                    for (key = keys; key; key = key->next) {
-                        sub_path = (char *) key->data;
-
-                        if ((ptr = strstr(sub_path, tmp))
-                            && ptr == sub_path) {
-                            sub_watch =
-                                g_hash_table_lookup(inotify_path_to_watch,
-                                                    sub_path);
-
-                            if (sub_watch == NULL) {
-                                log_warn
-                                    ("While unwatching sub dirs unable to look up watch for path %s",
-                                     sub_path);
-                            } else {
-                                log_debug("Unwatching sub path '%s'",
-                                          sub_path);
-
-                                rv = inotify_rm_watch(inotify_fd,
-                                                      sub_watch->wd);
-                                if (rv != 0) {
-                                    log_warn
-                                        ("Failed to call inotify_rm_watch() on wd:%d: %s",
-                                         sub_watch->wd, strerror(errno));
-                                }
-
-                                g_hash_table_remove(inotify_wd_to_watch,
-                                                    GINT_TO_POINTER
-                                                    (sub_watch->wd));
-                                g_hash_table_remove(inotify_path_to_watch,
-                                                    sub_path);
-
-                                free(sub_watch->path);
-                                free(sub_watch);
-                            }
-                        }
-                    }
+    if (epoll_ctl(ingest_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        log_error("Failed to add inotify instance '%s' to epoll set: %s",
+                  name, strerror(errno));
 
-                    free(tmp);
-                    g_list_free(keys);
-                }
+    log_debug("Created inotify instance '%s' (id %d, fd %d)", name,
+              instance->id, fd);
 
-                pthread_mutex_unlock(&inotify_mutex);
-            }
-        }
+    return instance;
+}
 
-        /* Queue event */
-        if (event->mask & root->mask) {
-            rv = inotify_enqueue(root, event, path);
-            if (rv != 0)
-                log_warn("Failed to queue event for wd:%d path:%s: %s",
-                         event->wd, path, error_to_string(rv));
-        }
+/* Drop a reference on an instance. When the last one goes away
+ * the instance is removed from the registry so no more of its
+ * events will be processed, and 1 is returned to tell the caller
+ * to finish the job with instance_destroy() once it has let go of
+ * inotify_mutex. Otherwise 0 is returned.
+ *
+ * The default instance is never removed.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static int instance_release(Instance * instance)
+{
+    unsigned int i;
+
+    if (instance == NULL)
+        return 0;
+
+    if (--instance->refs > 0 || instance == default_instance)
+        return 0;
 
-        free(path);
-        free(abs_path);
+    g_hash_table_remove(inotify_instances, GINT_TO_POINTER(instance->id));
 
-        i += INOTIFY_EVENT_SIZE + event->len;
+    if (instance == fanotify_instance)
+        fanotify_instance = NULL;
+    else
+        g_hash_table_remove(inotify_instance_names, instance->name);
+
+    /* No more of its events will be handled, held ones included. */
+    if (instance->held != NULL) {
+        held_events -= instance->held->len;
+        for (i = 0; i < instance->held->len; i++)
+            free(g_ptr_array_index(instance->held, i));
+        g_ptr_array_free(instance->held, TRUE);
+        instance->held = NULL;
     }
+
+    return 1;
 }
 
-/* Add a new inotify event to its Root's queue.
+/* Keep count of the roots on an instance, and while there's only
+ * one, a pointer to its ignore rules for inotify_handle_batch().
+ * The pointer is dropped before the root can be freed.
  *
- * On success 0 (zero) is returned.
- * On failure the appropriate error code is returned.
+ * The caller must hold inotify_mutex.
  */
-static int inotify_enqueue(const Root * root, const IN_Event * event,
-                           const char *path)
+static void instance_add_root(Instance * instance, Root * root)
 {
-    int rv, queue_len;
-    Event *node;
+    instance->ignore = (++instance->roots == 1) ? root->ignore : NULL;
+}
 
-    pthread_mutex_lock(&inotify_mutex);
+static void instance_remove_root(Instance * instance, Root * root)
+{
+    GHashTableIter iter;
+    gpointer value;
+    Root *other;
 
-    if (root == NULL) {
-        log_warn
-            ("Failed to enqueue because root at path %s does not exist",
-             path);
-        pthread_mutex_unlock(&inotify_mutex);
-        return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
+    instance->ignore = NULL;
+    if (--instance->roots != 1)
+        return;
+
+    g_hash_table_iter_init(&iter, inotify_roots);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        other = value;
+        if ((other != root) && (other->instance == instance)) {
+            instance->ignore = other->ignore;
+            return;
+        }
     }
+}
 
-    /* Check to make sure we don't overflow the queue */
-    queue_len = (int) g_queue_get_length(root->queue);
+/* Close and free an instance removed by instance_release().
+ * Closing the inotify file descriptor drops every watch on it
+ * in a single step.
+ *
+ * The caller must NOT hold inotify_mutex.
+ */
+static void instance_destroy(Instance * instance)
+{
+    ingest_lock();
 
-    log_trace("Root '%s' has %d/%d events queued",
-              root->path, queue_len, root->max_events);
+    g_hash_table_remove(ingest_instances, GINT_TO_POINTER(instance->id));
+    epoll_ctl(ingest_epoll_fd, EPOLL_CTL_DEL, instance->fd, NULL);
+    close(instance->fd);
 
-    if (queue_len >= root->max_events) {
-        log_warn
-            ("Queue full for root '%s' (max_events=%d). Dropping event!",
-             root->path, root->max_events);
-        pthread_mutex_unlock(&inotify_mutex);
-        return ERROR_INOTIFY_ROOT_QUEUE_FULL;
-    }
+    ingest_unlock();
 
-    log_trace("Queuing event root:%s path:%s name:%s",
-              root->path, path, event->name);
+    log_debug("Closed inotify instance '%s' (id %d)", instance->name,
+              instance->id);
 
-    /* Create our new queue node and copy over all
-     * the data fields from the event.
-     */
-    node = (Event *) malloc(sizeof(Event));
-    if (node == NULL) {
-        log_error("Failed to allocate memory for new queue node: %s",
-                  "inotify.c:inotify_enqueue()");
-        return ERROR_MEMORY_ALLOCATION;
-    }
+    wd_table_free(&instance->wds);
+    free(instance->name);
+    free(instance);
+}
 
-    node->wd = event->wd;
-    node->mask = event->mask;
-    node->cookie = event->cookie;
-    node->len = event->len;
+/* Hold on to an event for a wd that isn't in the watch table, while
+ * a crawl is adding watches to the instance. Returns 0 if it's been
+ * held and 1 if there's no room for it (or no memory), in which case
+ * it's dropped like any other event for an unknown wd.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static int held_add(Instance * instance, uint32_t gen,
+                    const IN_Event * event)
+{
+    uint32_t len;
+    Held_Event *held;
 
-    rv = mk_string(&node->name, "%s", event->name);
-    if (rv == -1) {
-        log_error("Failed to allocate memory for new queue node NAME: %s",
-                  "inotify.c:inotify_enqueue()");
-        return ERROR_MEMORY_ALLOCATION;
+    if (instance->held == NULL) {
+        instance->held = g_ptr_array_new();
+        if (instance->held == NULL)
+            return 1;
     }
 
-    rv = mk_string(&node->path, "%s", path);
-    if (rv == -1) {
-        log_error("Failed to allocate memory for new queue node PATH: %s",
-                  "inotify.c:inotify_enqueue()");
-        return ERROR_MEMORY_ALLOCATION;
+    if (instance->held->len >= INOTIFY_HELD_MAX) {
+        log_debug("Too many events held for instance '%s'. Dropping one",
+                  instance->name);
+        return 1;
     }
 
-    /* Add new node to the queue. */
-    if (root != NULL)
-        g_queue_push_tail(root->queue, node);
+    len = INOTIFY_EVENT_SIZE + event->len;
+    held = malloc(sizeof(Held_Event) + len);
+    if (held == NULL)
+        return 1;
+
+    held->gen = gen;
+    held->len = len;
+    memcpy(held->data, event, len);
+
+    g_ptr_array_add(instance->held, held);
+    ++held_events;
 
-    pthread_mutex_unlock(&inotify_mutex);
     return 0;
 }
 
-/* Return a list of all the currently watched root paths. */
-char **inotify_get_roots(void)
+/* Handle the held events whose watches are now in the table. The
+ * rest are kept while watches are still being added, and dropped
+ * once none are, since then they really are for a wd we don't know.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void held_replay(Instance * instance)
 {
-    int i = 0, rv;
-    GList *key = NULL, *keys = NULL;
-    char **roots;
+    unsigned int i;
+    GPtrArray *held;
+    Held_Event *h;
+    const IN_Event *event;
+
+    held = instance->held;
+    instance->held = NULL;
+    held_events -= held->len;
+
+    for (i = 0; i < held->len; i++) {
+        h = g_ptr_array_index(held, i);
+        event = (const IN_Event *) h->data;
+
+        if (wd_table_get(&instance->wds, event->wd, h->gen) != NULL) {
+            inotify_handle_batch(instance, h->gen, h->data, (int) h->len);
+        } else if (instance->adding > 0) {
+            if (instance->held == NULL)
+                instance->held = g_ptr_array_new();
+            g_ptr_array_add(instance->held, h);
+            ++held_events;
+            continue;
+        } else {
+            log_trace("Dropping held event for unknown wd '%d' (%s)",
+                      event->wd, event->name);
+        }
 
-    pthread_mutex_lock(&inotify_mutex);
+        free(h);
+    }
 
-    keys = g_hash_table_get_keys(inotify_roots);
-    roots = malloc((g_list_length(keys) + 1) * (sizeof *roots));
+    g_ptr_array_free(held, TRUE);
+}
 
-    if (roots == NULL) {
-        log_error("Failed to allocate memory for roots list: %s",
-                  "inotify.c:inotify_get_roots()");
-        g_list_free(keys);
-        pthread_mutex_unlock(&inotify_mutex);
-        return NULL;
-    }
+/* Collect per instance statistics for the 'status' call. The
+ * returned array has one entry per instance, its length is
+ * stored in 'count'. Free it with inotify_free_instance_stats().
+ */
+InstanceStats *inotify_get_instance_stats(int *count)
+{
+    int i = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    Instance *instance;
+    Root *root;
+    InstanceStats *stats;
 
-    for (key = keys; key; key = key->next) {
-        rv = mk_string(&roots[i++], "%s", (char *) key->data);
+    inotify_lock();
 
-        if (rv == -1) {
-            log_error
-                ("Failed to allocate memory while adding root to list: %s",
-                 "inotify.c:inotify_get_roots()");
-            g_list_free(keys);
-            pthread_mutex_unlock(&inotify_mutex);
-            return NULL;
-        }
+    *count = (int) g_hash_table_size(inotify_instances);
+    stats = calloc(*count ? *count : 1, sizeof(InstanceStats));
+    if (stats == NULL) {
+        *count = 0;
+        inotify_unlock();
+        return NULL;
     }
 
-    rv = mk_string(&roots[i], "EOL");
-    if (rv == -1) {
-        log_error
-            ("Failed to allocate memory while adding EOL to list: %s",
-             "inotify.c:inotify_get_roots()");
-        g_list_free(keys);
-        pthread_mutex_unlock(&inotify_mutex);
-        return NULL;
+    g_hash_table_iter_init(&iter, inotify_instances);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        instance = value;
+        stats[i].name = strdup(instance->name);
+        stats[i].watches = instance->wds.count;
+        stats[i].events = instance->events;
+        stats[i].overflows = instance->overflows;
+        i++;
     }
 
-    g_list_free(keys);
+    g_hash_table_iter_init(&iter, inotify_roots);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        root = value;
+        for (i = 0; i < *count; i++) {
+            if (strcmp(stats[i].name, root->instance->name) == 0) {
+                stats[i].roots++;
+                break;
+            }
+        }
+    }
 
-    pthread_mutex_unlock(&inotify_mutex);
+    inotify_unlock();
 
-    return roots;
+    return stats;
 }
 
-/* Take the data structure created by the inotify_get_roots()
- * (ABOVE) and free all it's dynamically allocated memory.
- */
-void inotify_free_roots(char **roots)
+void inotify_free_instance_stats(InstanceStats * stats, int count)
 {
     int i;
 
-    for (i = 0; strcmp(roots[i], "EOL") != 0; i++)
-        free(roots[i]);
+    if (stats == NULL)
+        return;
 
-    free(roots[i]);
-    free(roots);
-}
+    for (i = 0; i < count; i++)
+        free(stats[i].name);
 
-void inotify_cleanup(void)
-{
-    inotify_dump_roots();
+    free(stats);
 }
 
-void inotify_dump_roots(void)
+CrawlStats *inotify_get_crawl_stats(const char *path, int *count)
 {
-    int i, rv;
-    FILE *fp;
-    GList *roots_ptr = NULL, *roots = NULL;
+    int i = 0;
+    double secs;
+    unsigned long left;
+    GHashTableIter iter;
+    gpointer key, value;
     Root *root;
-    char *dump_file;
+    CrawlStats *stats;
 
-    pthread_mutex_lock(&inotify_mutex);
+    inotify_lock();
 
-    fp = fopen(INOTIFY_ROOT_DUMP_FILE, "w");
-    if (fp == NULL) {
-        log_error("Failed to open root dump file %s for writing: %s",
-                  dump_file, strerror(errno));
-        free(dump_file);
-        pthread_mutex_unlock(&inotify_mutex);
-        return;
+    *count = (int) g_hash_table_size(inotify_roots);
+    stats = calloc(*count ? *count : 1, sizeof(CrawlStats));
+    if (stats == NULL) {
+        *count = 0;
+        inotify_unlock();
+        return NULL;
     }
 
-    roots = g_hash_table_get_values(inotify_roots);
+    g_hash_table_iter_init(&iter, inotify_roots);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        root = value;
 
-    for (roots_ptr = roots; roots != NULL; roots = roots->next) {
-        root = roots->data;
-        if (root->rewatch)
-            fprintf(fp, "%s,%d,%d\n", root->path, root->mask,
-                    root->max_events);
+        if ((root->destroy != 0)
+            || ((path != NULL) && (strcmp(path, root->path) != 0)))
+            continue;
+
+        if (root->crawl_state == INOTIFY_CRAWL_COMPLETE)
+            secs = root->crawl_secs;
+        else if (root->crawl_state == INOTIFY_CRAWL_CRAWLING)
+            secs = (now_usec() - root->crawl_start) / 1e6;
+        else
+            secs = 0;
+
+        stats[i].path = strdup(root->path);
+        stats[i].state = root->crawl_state;
+        stats[i].dirs = root->crawl_dirs;
+        stats[i].found =
+            __atomic_load_n(&root->crawl_found, __ATOMIC_RELAXED);
+        stats[i].secs = secs;
+        stats[i].dirs_per_sec = (secs > 0) ? stats[i].dirs / secs : 0;
+        stats[i].eta = -1;
+
+        if (root->crawl_state == INOTIFY_CRAWL_COMPLETE) {
+            stats[i].eta = 0;
+        } else if (stats[i].dirs_per_sec > 0) {
+            left = (stats[i].found > stats[i].dirs)
+                ? stats[i].found - stats[i].dirs : 0;
+            stats[i].eta = left / stats[i].dirs_per_sec;
+        }
+
+        i++;
     }
 
-    g_list_free(roots_ptr);
-    fclose(fp);
-    free(dump_file);
-    pthread_mutex_unlock(&inotify_mutex);
-}
+    inotify_unlock();
 
-/* Take the data structure that holds events and free all
- * it's dynamically allocated memory.
- */
-void inotify_free_events(Event ** events)
-{
-    int i;
+    *count = i;
 
-    if (events != NULL) {
-        for (i = 0; events[i]; i++) {
-            free_node_mem(events[i], NULL);
-        }
+    if ((path != NULL) && (i == 0)) {
+        free(stats);
+        return NULL;
     }
 
-    free(events);
+    return stats;
 }
 
-static Event **inotify_dequeue(Root * root, int count)
+void inotify_free_crawl_stats(CrawlStats * stats, int count)
 {
-    int i, queue_len;
-    Event *e, **events;
+    int i;
 
-    if (count == 0)
-        log_debug("Dequeuing *all* events from root '%s'", root->path);
-    else
-        log_debug("Dequeuing %d events from root '%s'", count, root->path);
+    if (stats == NULL)
+        return;
 
-    pthread_mutex_lock(&inotify_mutex);
+    for (i = 0; i < count; i++)
+        free(stats[i].path);
 
-    queue_len = (int) g_queue_get_length(root->queue);
+    free(stats);
+}
 
-    if (queue_len == 0) {
-        pthread_mutex_unlock(&inotify_mutex);
-        return NULL;
-    }
+/* Log, and then reset, the drain statistics gathered by
+ * inotify_handle_event() since the last time this was called.
+ * The values for the last window are kept around so they
+ * can be reported through the 'status' call.
+ */
+void inotify_log_drain_stats(void)
+{
+    time_t now, elapsed;
 
-    if (count == 0 || count > queue_len)
-        count = queue_len;
+    now = time(NULL);
+    elapsed = now - drain_window_start;
 
-    log_trace("Root '%s' has %d/%d events queued. Dequeueing %d events.",
-              root->path, queue_len, root->max_events, count);
+    if (elapsed <= 0)
+        return;
 
-    events = malloc((count + 1) * sizeof *events);
-    if (events == NULL) {
-        log_error("Failed to allocate memory for events list: %s",
-                  "inotify.c:inotify_dequeue()");
-        pthread_mutex_unlock(&inotify_mutex);
-        return (Event **) - 1;
-    }
+    inotify_lock();
 
-    for (i = 0; i < count; i++) {
-        e = g_queue_pop_head(root->queue);
+    drain_events_per_batch =
+        (drain_batches > 0) ? ((double) drain_events / drain_batches) : 0;
+    drain_batches_per_sec = (double) drain_batches / elapsed;
 
-        log_trace("Dequeued event root:%s path:%s name:%s",
-                  root->path, e->path, e->name);
+    log_debug
+        ("Inotify drain: %lu events in %lu batches over %d seconds (%.2f events/batch, %.2f batches/sec, %lu ingest stalls)",
+         drain_events, drain_batches, (int) elapsed,
+         drain_events_per_batch, drain_batches_per_sec, ingest_stalls);
 
-        events[i] = e;
-    }
-    events[i] = NULL;
+    drain_events = 0;
+    drain_batches = 0;
+    drain_window_start = now;
 
-    pthread_mutex_unlock(&inotify_mutex);
-    return events;
+    inotify_unlock();
 }
 
-/* Given a root path return 'count' events from the
- * front of the queue, if there are any.
- */
-Event **inotify_get_events(const char *path, int count)
+void inotify_get_drain_stats(double *events_per_batch,
+                             double *batches_per_sec)
 {
-    Root *root;
+    inotify_lock();
+    *events_per_batch = drain_events_per_batch;
+    *batches_per_sec = drain_batches_per_sec;
+    inotify_unlock();
+}
 
-    root = inotify_is_root(path);
-    if (root == NULL) {
-        log_warn
-            ("Cannot get event for path '%s' since it is not a watched root'",
-             path);
-        return (Event **) NULL;
+int inotify_get_lock_stats(LockStats * stats, int max)
+{
+    int n = 0;
+
+    if (n < max) {
+        inotify_lock();
+        stats[n++] = inotify_lock_stats;
+        inotify_unlock();
     }
 
-    return inotify_dequeue(root, count);
-}
+    if (n < max) {
+        ingest_lock();
+        stats[n++] = ingest_lock_stats;
+        ingest_unlock();
+    }
 
-/* Given a root path grab a single event off the queue */
-Event **inotify_get_event(const char *path)
-{
-    return inotify_get_events(path, 1);
+    return n;
 }
 
-/* Given a path return data indicating whether or not the path
- * is a watched root.
+/* Act on a buffer of inotify events read from 'instance'.
  *
- * Since roots are stored in a hash table this is really not
- * necessary, it just provides a little syntatic sugar.
+ * The caller must hold inotify_mutex.
+ *
+ * Returns the number of events found in the buffer.
  */
-Root *inotify_is_root(const char *path)
+static int inotify_handle_batch(Instance * instance, uint32_t gen,
+                                char *buffer, int num_in_events)
 {
-    return g_hash_table_lookup(inotify_roots, path);
-}
+    int i = 0, rv, count = 0;
+    char path[PATH_MAX], abs_path[PATH_MAX];
+    Root *root;
+    IN_Event *event;
 
-/* Given a path determine if it has a watched root, and if so
- * what that root path is. For example, if the root path
- *
- *   /zing/zang
+    event = NULL;
+
+    /* Loop through, read, and act on the returned
+     * list of inotify events.
+     */
+    while (i < num_in_events) {
+
+        event = (struct inotify_event *) &buffer[i];
+        ++count;
+
+        /* IN_Q_OVERFLOW is the event that occurrs when inotify's
+         * event buffer is full. It carries no name, so this has to
+         * be checked before the bogus event test below.
+         */
+        if (event->mask & IN_Q_OVERFLOW) {
+            ++instance->overflows;
+            log_error
+                ("Inotify event buffer for instance '%s' is full: Raise the value in %s %s",
+                 instance->name, "/proc/sys/fs/inotify/max_queued_events if",
+                 "this is a chronic error");
+            if (CONFIG->overflow_rescan)
+                overflow_start(instance);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        /* Skip bogus events. */
+        if ((event == NULL) || (event->len == 0)) {
+            i += INOTIFY_EVENT_SIZE;
+            continue;
+        }
+
+        /* IN_CLOSE_NOWRITE events occur on a directory when inotify
+         * sets up a watch on it. They also occur when someone does
+         * a tab complete within a watched tree. We don't care about
+         * these events and never want to queue them, so we skip.
+         */
+        if ((event->mask & IN_ISDIR) && (event->mask & IN_CLOSE_NOWRITE)) {
+            log_trace("Skipping inotify IN_CLOSE_NOWRITE event on wd %d",
+                      event->wd);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        /* IN_IGNORED events occur when we remove an inotify watch by
+         * making a call to inotify_rm_watch(). We don't care about
+         * these events and never want to queue them.
+         */
+        if (event->mask & IN_IGNORED) {
+            log_trace("Skipping inotify IN_IGNORED event on wd %d",
+                      event->wd);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        log_trace("Got inotify event on %s '%s' for wd %d",
+                  ((event->mask & IN_ISDIR) ? "directory" : "file"),
+                  event->name, event->wd);
+
+        /* Since inotify only reports the name of the file
+         * or directory under notification we need to lookup
+         * it's parent path in our watch descriptor hash map.
+         */
+        Watch *watch = wd_table_get(&instance->wds, event->wd, gen);
+
+        /* Move onto the next event if we can't find its watcher.
+         *
+         * This really ony happens when there is a rapid creation and
+         * immediate deletion of directorie trees. The only time I've
+         * seen it happen are during stress/load tests where large trees,
+         * (i.e. the linux kernel tarball, or Erlang OTP tarball) are un-
+         * tar-ed and rm -rf-ed in rapid succession. This is not behavior
+         * I really wanted to see, but because of the reactive nature of
+         * inotify, and the fact that file system events are not instan-
+         * taious this situation might occur. There is eventual consistency
+         * so for now I'm labling this less of a bug and more of an
+         * unfortunate feature.
+         */
+        if (watch == NULL) {
+            /* A crawl may have just added the watch for this wd and
+             * not yet put it in the table, in which case the event
+             * is held until it has.
+             */
+            if ((instance->adding > 0)
+                && (held_add(instance, gen, event) == 0)) {
+                i += INOTIFY_EVENT_SIZE + event->len;
+                continue;
+            }
+
+            log_trace
+                ("Failed to look up watcher for wd '%d' in inotify_handle_event (%s)",
+                 event->wd, event->name);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        /* With just the one root on the instance, that root's name
+         * patterns can be checked before the path is even built, so
+         * an ignored event costs no more than the wd lookup.
+         */
+        if ((instance->ignore != NULL)
+            && ignore_name(instance->ignore, event->name,
+                           event->mask & IN_ISDIR)) {
+            log_trace("Skipping ignored event on '%s' for wd %d",
+                      event->name, event->wd);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        /* Rebuild the watched directory's path, and from that the
+         * absolute path for this event. This fails for watches in a
+         * detached tree (SEE: watch_detach()), whose root may already
+         * be gone, so it has to come before we look at the root.
+         */
+        if (watch_path(watch, path, sizeof path) == -1) {
+            log_debug("Path for wd %d is too long, or in the middle of a move: %s",
+                      event->wd, "inotify.c:inotify_handle_event()");
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        /* The watch knows which root it belongs to. */
+        root = watch->root;
+
+        /* Otherwise the root is only known from here on. Path patterns
+         * always need the path. Either way it's still before anything
+         * is allocated or queued for the event (SEE: ignore.h).
+         */
+        if (((instance->ignore == NULL)
+             && ignore_name(root->ignore, event->name,
+                            event->mask & IN_ISDIR))
+            || ignore_path(root->ignore, path, event->name,
+                           event->mask & IN_ISDIR)) {
+            log_trace("Skipping ignored event on '%s' in '%s'",
+                      event->name, path);
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        if (root->pause) {
+            log_trace("Root is currently paused. Skipping event");
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        if (root->destroy != 0) {
+            log_trace("Root is being destroyed. Skipping event");
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+
+        if (strcmp(path, "/") == 0)
+            rv = snprintf(abs_path, sizeof abs_path, "/%s", event->name);
+        else
+            rv = snprintf(abs_path, sizeof abs_path, "%s/%s", path,
+                          event->name);
+
+        if ((rv < 0) || (rv >= (int) sizeof abs_path)) {
+            log_error("Absolute event path for '%s' in '%s' is too long: %s",
+                      event->name, path, "inotify.c:inotify_handle_event()");
+            i += INOTIFY_EVENT_SIZE + event->len;
+            continue;
+        }
+
+        log_trace("Got event for '%s'", abs_path);
+
+        if (event->mask & IN_ISDIR) {
+
+            /* Here we have new directory creation, which means that
+             * beyond just queuing the event(s) we also need to perform
+             * a recursive watch on the new tree and make sure those
+             * watches are tied to the appropriate root path.
+             */
+            if ((event->mask & IN_CREATE)
+                || (event->mask & IN_MOVED_TO)) {
+
+                /* A directory we were already watching that has just
+                 * been renamed. Its watches are still good, they only
+                 * need to be put back under the new name.
+                 */
+                if ((event->mask & IN_MOVED_TO)
+                    && (move_finish(watch, root, event, abs_path) == 0)) {
+                    log_trace("Directory '%s' was moved, kept its watches",
+                              abs_path);
+                } else {
+                    log_trace("New directory '%s' found", abs_path);
+
+                    rv = do_watch_tree(abs_path, root, CRAWL_NEW);
+                    if (rv != 0) {
+                        log_error("Failed to watch root at dir '%s': %s",
+                                  abs_path, error_to_string(rv));
+                        i += INOTIFY_EVENT_SIZE + event->len;
+                        continue;
+                    }
+                }
+            }
+
+            /* Here we have directory deletion. So we need to tell
+             * inotify to stop watching this directory for us, as
+             * well as remove the mapping we have stored in our
+             * watch descriptor meta maps.
+             */
+            else if ((event->mask & IN_DELETE)
+                     || (event->mask & IN_MOVED_FROM)) {
+                log_trace
+                    ("Existing directory '%s' has been moved or removed",
+                     abs_path);
+
+                /* TODO: How can we determine if the actual root itself
+                 *       is being deleted since the root itself is not
+                 *       watched by anything?
+                 */
+
+                Watch *delete = watch_lookup(abs_path);
+
+                if (delete == NULL) {
+                    log_trace
+                        ("Failed to look up watcher for path '%s' while attempting to delete it",
+                         abs_path);
+                    i += INOTIFY_EVENT_SIZE + event->len;
+                    continue;
+                }
+
+                /* Clean up meta data mappings and tell inotify
+                 * to stop watching the deleted dir. If it was moved
+                 * the whole tree is set aside until we find out where
+                 * it went (SEE: inotify_moves).
+                 */
+                if (event->mask & IN_MOVED_FROM) {
+                    if (move_start(delete, event->cookie) != 0) {
+                        log_trace
+                            ("Existing directory '%s' has been moved. Unwatching it's sub dirs",
+                             abs_path);
+                        unwatch_tree(delete);
+                    }
+                } else {
+                    _unwatch(delete, root->instance);
+                    watch_remove(delete);
+                }
+            }
+        }
+
+        /* Queue event */
+        Event e = {
+            event->wd, event->mask, event->cookie, event->len,
+            path, event->name, NULL, NULL
+        };
+
+        if ((event->mask & (IN_MOVED_FROM | IN_MOVED_TO))
+            && move_event_queue(root, &e)) {
+            /* Held on to, or queued, as (half of) a paired move. */
+        } else if (event->mask & root->mask) {
+            rv = inotify_enqueue(root, &e);
+            if (rv != 0)
+                log_warn("Failed to queue event for wd:%d path:%s: %s",
+                         event->wd, path, error_to_string(rv));
+        }
+
+        i += INOTIFY_EVENT_SIZE + event->len;
+    }
+
+    return count;
+}
+
+/* Handle one event from the fanotify group, called back from
+ * fanotify_read_events().
  *
- * is being watched then calling this function with the following
- * paths would return the value '/zing/zang':
+ * fanotify marks whole filesystems, so most of what we're sent
+ * isn't under any root at all, or is under a root that's being
+ * watched with inotify instead, and is simply dropped. There are no
+ * watches to keep up to date, so what's left is just queued.
  *
- *   /zing/zang/zong
- *   /zing/zang/zoop/boop
+ * The caller must hold inotify_mutex.
  */
-Root *inotify_path_to_root(const char *path)
+static void fanotify_event(uint32_t mask, const char *path,
+                           const char *name, void *data)
 {
     int rv;
-    GList *key = NULL, *keys = NULL;
-    char *tmp;
     Root *root;
+    Instance *instance = data;
 
-    root = g_hash_table_lookup(inotify_roots, "/");
-    if (root != NULL)
-        return root;
+    if (mask & IN_Q_OVERFLOW) {
+        ++instance->overflows;
+        log_error
+            ("fanotify event queue is full, events have been lost: %s",
+             "inotify.c:fanotify_event()");
+        if (CONFIG->overflow_rescan)
+            overflow_start(instance);
+        return;
+    }
+
+    root = inotify_path_to_root(path);
+
+    if ((root == NULL) || (root->instance != instance))
+        return;
+
+    if (root->pause || (root->destroy != 0))
+        return;
+
+    if ((mask & IN_ISDIR) && (mask & IN_CLOSE_NOWRITE))
+        return;
+
+    if (ignore_tree(root->ignore, path, name, mask & IN_ISDIR)) {
+        log_trace("Skipping ignored event on '%s' in '%s'", name, path);
+        return;
+    }
+
+    if (!(mask & root->mask))
+        return;
+
+    Event e = {
+        -1, mask, 0, strlen(name) + 1, (char *) path, (char *) name,
+        NULL, NULL
+    };
+
+    rv = inotify_enqueue(root, &e);
+    if (rv != 0)
+        log_warn("Failed to queue event for path:%s: %s", path,
+                 error_to_string(rv));
+}
+
+/* Add a new inotify event to its Root's queue.
+ *
+ * The caller must hold inotify_mutex.
+ *
+ * On success 0 (zero) is returned.
+ * On failure the appropriate error code is returned.
+ */
+static int inotify_enqueue(Root * root, const Event * event)
+{
+    uint32_t size, path_len, name_len, old_path_len, old_name_len;
+    uint32_t ring_size;
+    char *data;
+    Event_Record *record, *queued;
+
+    if (root == NULL) {
+        log_warn
+            ("Failed to enqueue because root at path %s does not exist",
+             event->path);
+        return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
+    }
+
+    log_trace("Queuing event root:%s path:%s name:%s",
+              root->path, event->path, event->name);
+
+    path_len = strlen(event->path);
+    name_len = strlen(event->name);
+    old_path_len = event->old_path ? strlen(event->old_path) : 0;
+    old_name_len = event->old_name ? strlen(event->old_name) : 0;
+    size = sizeof(Event_Record) + path_len + name_len + old_path_len +
+        old_name_len + 4;
+
+    /* Check to make sure we don't overflow the queue, before anything
+     * is reserved in it, let alone grown.
+     */
+    log_trace("Root '%s' has %d/%d events queued",
+              root->path, root->queue_len, root->max_events);
+
+    /* An overflow marker is let in even if the queue is full, since
+     * it's the one thing telling the client what else it's missing.
+     * Likewise for the marker saying the crawl is done. An event that
+     * would only be folded into one already queued doesn't take any
+     * room, so it isn't dropped either.
+     */
+    if ((root->queue_len >= root->max_events)
+        && !(event->mask & (IN_Q_OVERFLOW | IN_CRAWL_COMPLETE))) {
+        if ((root->queue_index != NULL) && (event->cookie == 0)) {
+            queued = record_lookup(root, event->path, event->name);
+            if (queued != NULL) {
+                queued->mask |= event->mask;
+                return 0;
+            }
+        }
+
+        log_warn
+            ("Queue full for root '%s' (max_events=%d). Dropping event!",
+             root->path, root->max_events);
+        return ERROR_INOTIFY_ROOT_QUEUE_FULL;
+    }
+
+    /* Write the record straight into the root's queue, growing the
+     * queue first if it's full. The queue never shrinks again, but
+     * it can't grow past what max_events worth of records needs.
+     */
+    record = ring_reserve(&root->queue, size);
+    while (record == NULL) {
+        ring_size = root->queue.size * 2;
+        if ((ring_size == 0) || (ring_size > 0x80000000)
+            || (ring_resize(&root->queue, ring_size) != 0)) {
+            log_error("Failed to grow the event queue for root '%s': %s",
+                      root->path, "inotify.c:inotify_enqueue()");
+            return ERROR_MEMORY_ALLOCATION;
+        }
+        if (root->queue_index != NULL)
+            record_index_rebuild(root);
+        record = ring_reserve(&root->queue, size);
+    }
+
+    record->wd = event->wd;
+    record->mask = event->mask;
+    record->cookie = event->cookie;
+    record->len = event->len;
+    record->path_len = path_len;
+    record->name_len = name_len;
+    record->old_path_len = old_path_len;
+    record->old_name_len = old_name_len;
+
+    data = record->data;
+    memcpy(data, event->path, path_len + 1);
+    data += path_len + 1;
+    memcpy(data, event->name, name_len + 1);
+    data += name_len + 1;
+    if (old_path_len)
+        memcpy(data, event->old_path, old_path_len);
+    data[old_path_len] = '\0';
+    data += old_path_len + 1;
+    if (old_name_len)
+        memcpy(data, event->old_name, old_name_len);
+    data[old_name_len] = '\0';
+
+    /* When coalescing, an event for a path that's already queued is
+     * folded into the queued one and the new record, which hasn't
+     * been committed, is simply left behind to be written over.
+     * Moves (anything with a cookie) are never folded since they
+     * only make sense as a pair.
+     */
+    if ((root->queue_index != NULL) && (record->cookie == 0)) {
+        queued = g_hash_table_lookup(root->queue_index, record);
+        if (queued != NULL) {
+            log_trace("Coalescing event for '%s/%s'", event->path,
+                      event->name);
+            queued->mask |= record->mask;
+            return 0;
+        }
+    }
+
+    ring_commit(&root->queue, size);
+    ++root->queue_len;
+
+    if ((root->queue_index != NULL) && (record->cookie == 0))
+        g_hash_table_insert(root->queue_index, record, record);
+
+    if (root->publish)
+        publish_wakeup();
+
+    return 0;
+}
+
+/* Let the main loop know a published root has something for it.
+ * Events can be queued from the crawler and pool threads as well
+ * as from the main loop, so the main loop is poked through the
+ * ingest eventfd rather than left to notice on its own. Only the
+ * first event since the last look does that.
+ */
+static void publish_wakeup(void)
+{
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&publish_pending, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    if (write(ingest_event_fd, &one, sizeof one) == -1)
+        log_error("Failed to write ingest eventfd: %s", strerror(errno));
+}
+
+/* Hash and compare queued records on their path and name, for
+ * Root::queue_index.
+ */
+static guint record_hash(gconstpointer key)
+{
+    const Event_Record *record = key;
+    const unsigned char *p, *end;
+    guint h = 5381;
+
+    end = (const unsigned char *) record->data + record->path_len +
+        record->name_len + 1;
+    for (p = (const unsigned char *) record->data; p < end; p++)
+        h = (h << 5) + h + *p;
+
+    return h;
+}
+
+static gboolean record_equal(gconstpointer a, gconstpointer b)
+{
+    const Event_Record *x = a, *y = b;
+
+    return (x->path_len == y->path_len) && (x->name_len == y->name_len)
+        && (memcmp(x->data, y->data, x->path_len + x->name_len + 1) == 0);
+}
+
+/* Find the queued record for 'name' in 'path', if there is one.
+ * Root::queue_index must be set.
+ */
+static Event_Record *record_lookup(Root * root, const char *path,
+                                   const char *name)
+{
+    size_t path_len, name_len;
+    Event_Record *key, *queued;
+
+    path_len = strlen(path);
+    name_len = strlen(name);
+
+    key = malloc(sizeof(Event_Record) + path_len + name_len + 2);
+    if (key == NULL)
+        return NULL;
+
+    key->path_len = path_len;
+    key->name_len = name_len;
+    memcpy(key->data, path, path_len + 1);
+    memcpy(key->data + path_len + 1, name, name_len + 1);
+
+    queued = g_hash_table_lookup(root->queue_index, key);
+    free(key);
+
+    return queued;
+}
+
+/* The index points straight at records in the queue, so it has to
+ * be rebuilt whenever they move (SEE: ring_resize()).
+ */
+static void record_index_rebuild(Root * root)
+{
+    uint32_t len;
+    uint64_t pos = 0;
+    Event_Record *record;
+
+    g_hash_table_remove_all(root->queue_index);
+
+    while ((record = ring_peek_next(&root->queue, &pos, &len)) != NULL) {
+        if (record->cookie == 0)
+            g_hash_table_insert(root->queue_index, record, record);
+    }
+}
+
+/* Return a list of all the currently watched root paths. */
+char **inotify_get_roots(void)
+{
+    int i = 0, rv;
+    GList *key = NULL, *keys = NULL;
+    char **roots;
+
+    inotify_lock();
 
     keys = g_hash_table_get_keys(inotify_roots);
+    roots = malloc((g_list_length(keys) + 1) * (sizeof *roots));
+
+    if (roots == NULL) {
+        log_error("Failed to allocate memory for roots list: %s",
+                  "inotify.c:inotify_get_roots()");
+        g_list_free(keys);
+        inotify_unlock();
+        return NULL;
+    }
 
     for (key = keys; key; key = key->next) {
+        rv = mk_string(&roots[i++], "%s", (char *) key->data);
 
-        rv = mk_string(&tmp, "%s/", (char *) key->data);
         if (rv == -1) {
             log_error
-                ("Failed to allocate memory while copying data to a temporary variable: %s",
-                 "inotify.c:inotify_path_to_root()");
+                ("Failed to allocate memory while adding root to list: %s",
+                 "inotify.c:inotify_get_roots()");
             g_list_free(keys);
+            inotify_unlock();
             return NULL;
         }
+    }
 
-        if ((strcmp(path, key->data) == 0) || strstr(path, tmp)) {
-            free(tmp);
+    rv = mk_string(&roots[i], "EOL");
+    if (rv == -1) {
+        log_error
+            ("Failed to allocate memory while adding EOL to list: %s",
+             "inotify.c:inotify_get_roots()");
+        g_list_free(keys);
+        inotify_unlock();
+        return NULL;
+    }
+
+    g_list_free(keys);
+
+    inotify_unlock();
+
+    return roots;
+}
+
+/* Take the data structure created by the inotify_get_roots()
+ * (ABOVE) and free all it's dynamically allocated memory.
+ */
+void inotify_free_roots(char **roots)
+{
+    int i;
+
+    for (i = 0; strcmp(roots[i], "EOL") != 0; i++)
+        free(roots[i]);
+
+    free(roots[i]);
+    free(roots);
+}
+
+void inotify_cleanup(void)
+{
+    inotify_dump_roots();
+}
+
+void inotify_dump_roots(void)
+{
+    FILE *fp;
+    GList *roots_ptr = NULL, *roots = NULL;
+    Root *root;
+    char **pattern;
+
+    inotify_lock();
+
+    fp = fopen(INOTIFY_ROOT_DUMP_FILE, "w");
+    if (fp == NULL) {
+        log_error("Failed to open root dump file %s for writing: %s",
+                  INOTIFY_ROOT_DUMP_FILE, strerror(errno));
+        inotify_unlock();
+        return;
+    }
+
+    roots = g_hash_table_get_values(inotify_roots);
+
+    /* Each line is "path,mask,max_events" followed by optional
+     * key=value fields. Roots on the default instance don't
+     * record one.
+     */
+    for (roots_ptr = roots; roots != NULL; roots = roots->next) {
+        root = roots->data;
+        if (!root->rewatch)
+            continue;
+
+        fprintf(fp, "%s,%d,%d", root->path, root->mask, root->max_events);
+        if ((root->instance != default_instance)
+            && !root->instance->fanotify)
+            fprintf(fp, ",instance=%s", root->instance->name);
+        if (root->queue_index != NULL)
+            fprintf(fp, ",coalesce=1");
+        if (root->pair_moves)
+            fprintf(fp, ",pair_moves=1");
+        for (pattern = ignore_patterns(root->ignore); *pattern; pattern++)
+            fprintf(fp, ",ignore=%s", *pattern);
+        fprintf(fp, "\n");
+    }
+
+    g_list_free(roots_ptr);
+    fclose(fp);
+    inotify_unlock();
+}
+
+/* Take the data structure that holds events and free all
+ * it's dynamically allocated memory.
+ */
+void inotify_free_events(Event ** events)
+{
+    free(events);
+}
+
+int inotify_queue_size(const char *path)
+{
+    int size;
+    Root *root;
+
+    inotify_lock();
+
+    root = inotify_is_root(path);
+    if (root == NULL)
+        size = -1;
+    else if (root->destroy)
+        size = 0;
+    else
+        size = root->queue_len;
+
+    inotify_unlock();
+
+    return size;
+}
+
+/* Take up to 'count' (or all, for 0) events off the front of the
+ * root's queue. The returned list, the Events in it and all of
+ * their strings are one single allocation: first the NULL ended
+ * array of pointers, then the Events, then the strings.
+ *
+ * Called with inotify_mutex held.
+ */
+static Event **inotify_dequeue(Root * root, int count)
+{
+    int i;
+    size_t size, strings;
+    uint32_t len, n;
+    uint64_t pos = 0;
+    char *str;
+    Event *e, **events;
+    Event_Record *record;
+
+    if (count == 0)
+        log_debug("Dequeuing *all* events from root '%s'", root->path);
+    else
+        log_debug("Dequeuing %d events from root '%s'", count, root->path);
+
+    if (root->queue_len == 0)
+        return NULL;
+
+    if (count == 0 || count > root->queue_len)
+        count = root->queue_len;
+
+    log_trace("Root '%s' has %d/%d events queued. Dequeueing %d events.",
+              root->path, root->queue_len, root->max_events, count);
+
+    /* First pass: find out how much room the strings need. */
+    strings = 0;
+    for (i = 0; i < count; i++) {
+        record = ring_peek_next(&root->queue, &pos, &len);
+        strings += record->path_len + record->name_len +
+            record->old_path_len + record->old_name_len + 4;
+    }
+
+    size = (count + 1) * sizeof *events + count * sizeof(Event) + strings;
+
+    events = malloc(size);
+    if (events == NULL) {
+        log_error("Failed to allocate memory for events list: %s",
+                  "inotify.c:inotify_dequeue()");
+        return (Event **) - 1;
+    }
+
+    e = (Event *) (events + count + 1);
+    str = (char *) (e + count);
+
+    /* Second pass: copy them out and release them. */
+    for (i = 0; i < count; i++, e++) {
+        record = ring_peek(&root->queue, &len);
+
+        e->wd = record->wd;
+        e->mask = record->mask;
+        e->cookie = record->cookie;
+        e->len = record->len;
+
+        n = record->path_len + record->name_len + record->old_path_len +
+            record->old_name_len + 4;
+        memcpy(str, record->data, n);
+        e->path = str;
+        e->name = e->path + record->path_len + 1;
+        e->old_path = NULL;
+        e->old_name = NULL;
+        if (record->old_path_len != 0) {
+            e->old_path = e->name + record->name_len + 1;
+            e->old_name = e->old_path + record->old_path_len + 1;
+        }
+        str += n;
+
+        log_trace("Dequeued event root:%s path:%s name:%s",
+                  root->path, e->path, e->name);
+
+        events[i] = e;
+
+        if ((root->queue_index != NULL) && (record->cookie == 0))
+            g_hash_table_remove(root->queue_index, record);
+
+        ring_release(&root->queue, len);
+    }
+    events[i] = NULL;
+
+    root->queue_len -= count;
 
-            root = g_hash_table_lookup(inotify_roots, key->data);
+    return events;
+}
+
+/* Given a root path return 'count' events from the
+ * front of the queue, if there are any.
+ */
+Event **inotify_get_events(const char *path, int count)
+{
+    Root *root;
+    Event **events;
+
+    /* Requests are handled on several threads at once, so the root
+     * is looked up under the lock too; otherwise it could be freed
+     * by an unwatch between the lookup and the dequeue.
+     */
+    inotify_lock();
+
+    root = inotify_is_root(path);
+    if (root == NULL) {
+        log_warn
+            ("Cannot get event for path '%s' since it is not a watched root'",
+             path);
+        inotify_unlock();
+        return (Event **) NULL;
+    }
+
+    events = inotify_dequeue(root, count);
+
+    inotify_unlock();
+
+    return events;
+}
+
+/* Given a root path grab a single event off the queue */
+Event **inotify_get_event(const char *path)
+{
+    return inotify_get_events(path, 1);
+}
+
+/* Given a path return data indicating whether or not the path
+ * is a watched root.
+ *
+ * Since roots are stored in a hash table this is really not
+ * necessary, it just provides a little syntatic sugar.
+ */
+Root *inotify_is_root(const char *path)
+{
+    return g_hash_table_lookup(inotify_roots, path);
+}
+
+int inotify_is_watched(const char *path)
+{
+    int watched;
+    Root *root;
+
+    inotify_lock();
+    root = inotify_is_root(path);
+    watched = (root != NULL) && !root->destroy;
+    inotify_unlock();
+
+    return watched;
+}
+
+/* Given a path determine if it has a watched root, and if so
+ * what that root path is. For example, if the root path
+ *
+ *   /zing/zang
+ *
+ * is being watched then calling this function with the following
+ * paths would return the value '/zing/zang':
+ *
+ *   /zing/zang/zong
+ *   /zing/zang/zoop/boop
+ */
+Root *inotify_path_to_root(const char *path)
+{
+    int len;
+    char *tmp, *slash;
+    Root *root;
 
-            if (root == NULL) {
-                log_warn("Failed to look up root for '%s'", key->data);
-                g_list_free(keys);
-                return NULL;
-            }
+    root = g_hash_table_lookup(inotify_roots, "/");
+    if (root != NULL)
+        return root;
 
-            log_trace("Found root '%s' for path '%s'", key->data, path);
+    /* Roots can't be nested, so at most one prefix of 'path' is
+     * a root. Chop 'path' back one component at a time and look
+     * each prefix up directly, rather than comparing against every
+     * root we have.
+     */
+    len = strlen(path);
+    tmp = malloc(len + 1);
+    if (tmp == NULL) {
+        log_error
+            ("Failed to allocate memory while copying data to a temporary variable: %s",
+             "inotify.c:inotify_path_to_root()");
+        return NULL;
+    }
 
-            g_list_free(keys);
+    memcpy(tmp, path, len + 1);
 
+    while (1) {
+        root = g_hash_table_lookup(inotify_roots, tmp);
+        if (root != NULL) {
+            log_trace("Found root '%s' for path '%s'", tmp, path);
+            free(tmp);
             return root;
         }
 
-        free(tmp);
+        slash = strrchr(tmp, '/');
+        if ((slash == NULL) || (slash == tmp))
+            break;
+
+        *slash = '\0';
     }
 
-    g_list_free(keys);
+    free(tmp);
     return NULL;
 }
 
@@ -943,149 +2260,128 @@ char *inotify_is_parent(const char *path)
 }
 
 /* When a client app makes an 'unwatch' call this is the function
- * that eventually gets called to do the dirty work.
+ * that eventually gets called to do the dirty work. The caller has
+ * already claimed the root by setting its 'destroy' flag, so this
+ * only ever runs once for any root.
  */
 static int destroy_root(Root * root)
 {
     int rv;
-    pthread_t t;
-    pthread_attr_t attr;
 
     if (root == NULL) {
         log_warn("Attempting to destroy an unwatched root");
         return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
     }
 
-    root->destroy = 1;
-    usleep(1000);
-
-    /* Initialize thread attribute to automatically detach */
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* Setting 'destroy' is enough to call off it's crawls (SEE:
+     * crawl_cancelled()), but anything else the root still has
+     * waiting for a background thread can go now. The only thing
+     * queued on a root's behalf is it's overflow rescan.
+     */
+    pool_cancel(root, rescan_free);
 
-    rv = pthread_create(&t, &attr, _destroy_root, (void *) root);
-    if (rv) {
-        log_error("Failed to create new thread for destroying root '%s'",
-                  root->path);
-        return ERROR_FAILED_TO_CREATE_NEW_THREAD;
+    /* Ahead of anything else, so a client that unwatches and watches
+     * the root again isn't left waiting on a pool full of rescans.
+     */
+    rv = pool_run_first(_destroy_root, root, NULL);
+    if (rv != 0) {
+        log_error("Failed to queue destroy of root '%s': %s", root->path,
+                  error_to_string(rv));
+        return rv;
     }
 
-    pthread_attr_destroy(&attr);
-
     return 0;
 }
 
-static void *_destroy_root(void *thread_data)
+static void _destroy_root(void *thread_data)
 {
     Root *root;
-    int rv;
     Watch *watch;
-    char *tmp, *path, *ptr;
-    GList *key = NULL, *keys = NULL;
 
     root = thread_data;
 
-    pthread_mutex_lock(&inotify_mutex);
-
-    rv = mk_string(&tmp, "%s/", root->path);
-    if (rv == -1) {
-        log_error
-            ("Failed to allocate memory for temporary path variable: %s",
-             "inotify.c:destroy_root()");
-        return NULL;
-    }
+    inotify_lock();
 
     /* Destroy all the queue data associated with this root. */
-    g_queue_foreach(root->queue, (GFunc) free_node_mem, NULL);
-    g_queue_free(root->queue);
-
-    /* Destroy all the watches associated with this root. */
-    keys = g_hash_table_get_keys(inotify_path_to_watch);
-
-    pthread_mutex_unlock(&inotify_mutex);
-
-    for (key = keys; key; key = key->next) {
-
-        path = (char *) key->data;
-
-        if ((ptr = strstr(path, tmp)) && ptr == path) {
-
-            pthread_mutex_lock(&inotify_mutex);
-            watch = g_hash_table_lookup(inotify_path_to_watch, path);
-            pthread_mutex_unlock(&inotify_mutex);
-
-            if (watch == NULL) {
-                log_warn
-                    ("During recusrive delete unable to look up watch for path %s",
-                     path);
-                continue;
-            }
-
-            log_debug("Unwatching path '%s'", path);
-
-            rv = inotify_rm_watch(inotify_fd, watch->wd);
-            if (rv != 0) {
-                log_warn("Failed to call inotify_rm_watch() on wd:%d: %s",
-                         watch->wd, strerror(errno));
-            }
-
-            pthread_mutex_lock(&inotify_mutex);
-            g_hash_table_remove(inotify_wd_to_watch,
-                                GINT_TO_POINTER(watch->wd));
-            g_hash_table_remove(inotify_path_to_watch, path);
-            pthread_mutex_unlock(&inotify_mutex);
-
-            free(watch->path);
-            free(watch);
-        }
+    if (root->queue_index != NULL)
+        g_hash_table_destroy(root->queue_index);
+    root->queue_index = NULL;
+    ring_free(&root->queue);
+    root->queue_len = 0;
+
+    /* Destroy all the watches associated with this root, including
+     * the root watch itself. Big trees are finished off in the
+     * background (SEE: unwatch_tree()).
+     */
+    watch = watch_lookup(root->path);
+    if (watch != NULL) {
+        log_debug("Unwatching tree at '%s'", root->path);
+        unwatch_tree(watch);
     }
-    free(tmp);
 
-    pthread_mutex_lock(&inotify_mutex);
+    /* Anything moved out of this root that hasn't landed yet. */
+    move_expire(root);
+    move_event_expire(root, 0);
 
-    /* Destroy the root watch itself. */
-    watch = g_hash_table_lookup(inotify_path_to_watch, root->path);
-    if (watch != NULL) {
-        g_hash_table_remove(inotify_wd_to_watch,
-                            GINT_TO_POINTER(watch->wd));
-        g_hash_table_remove(inotify_path_to_watch, root->path);
+    if (root->instance->fanotify)
+        fanotify_remove_root(root->instance->fd, root->path);
 
-        free(watch->path);
-        free(watch);
-    }
+    /* Let go of the root's inotify instance. If this was the last
+     * root using it the instance is closed once we've given up
+     * inotify_mutex.
+     */
+    Instance *instance = root->instance;
+    instance_remove_root(instance, root);
+    int close_instance = instance_release(instance);
 
-    char *root_path = root->path;
-    g_hash_table_remove(inotify_roots, root_path);
-    free(root_path);
-    root = NULL;
+    g_hash_table_remove(inotify_roots, root->path);
     --inotify_num_watched_roots;
 
-    g_list_free(keys);
+    /* Crawls that are still going hold on to the root, in which case
+     * the last of them frees it (SEE: crawl_done()).
+     */
+    if (root->crawls == 0)
+        root_free(root);
+    root = NULL;
 
-    pthread_mutex_unlock(&inotify_mutex);
+    inotify_unlock();
+
+    if (close_instance)
+        instance_destroy(instance);
 
     inotify_dump_roots();
-    pthread_exit(NULL);
+}
+
+/* Free what's left of a root once _destroy_root() and any crawls
+ * of it are all done with it.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void root_free(Root * root)
+{
+    ignore_free(root->ignore);
+    free(root->path);
+    free(root);
 }
 
 int inotify_pause_tree(char *path)
 {
     Root *root;
 
-    pthread_mutex_lock(&inotify_mutex);
+    inotify_lock();
 
     root = inotify_is_root(path);
     if (root == NULL) {
         log_warn
             ("Cannot pause path '%s' since it is not a watched root'",
              path);
-        pthread_mutex_unlock(&inotify_mutex);
+        inotify_unlock();
         return ERROR_INOTIFY_ROOT_NOT_WATCHED;
     }
 
     root->pause = 1;
 
-    pthread_mutex_unlock(&inotify_mutex);
+    inotify_unlock();
 
     return 0;
 }
@@ -1094,24 +2390,90 @@ int inotify_unpause_tree(char *path)
 {
     Root *root;
 
-    pthread_mutex_lock(&inotify_mutex);
+    inotify_lock();
 
     root = inotify_is_root(path);
     if (root == NULL) {
         log_warn
             ("Cannot unpause path '%s' since it is not a watched root'",
              path);
-        pthread_mutex_unlock(&inotify_mutex);
+        inotify_unlock();
         return ERROR_INOTIFY_ROOT_NOT_WATCHED;
     }
 
     root->pause = 0;
 
-    pthread_mutex_unlock(&inotify_mutex);
+    inotify_unlock();
+
+    return 0;
+}
+
+int inotify_publish_tree(char *path, int publish)
+{
+    Root *root;
+
+    inotify_lock();
+
+    root = inotify_is_root(path);
+    if (root == NULL) {
+        log_warn
+            ("Cannot publish path '%s' since it is not a watched root'",
+             path);
+        inotify_unlock();
+        return ERROR_INOTIFY_ROOT_NOT_WATCHED;
+    }
+
+    root->publish = publish;
+
+    /* Anything that was queued before the root was published goes
+     * out with the next lot.
+     */
+    if (publish && (root->queue_len > 0))
+        publish_wakeup();
+
+    inotify_unlock();
 
     return 0;
 }
 
+/* Return the paths of the published roots that have events queued.
+ * This gets called every time around the main loop, so when nothing
+ * has been queued for a published root since the last call we
+ * don't bother taking the lock, let alone walking the roots.
+ */
+char **inotify_get_publish_roots(void)
+{
+    GHashTableIter iter;
+    GPtrArray *paths;
+    gpointer value;
+    Root *root;
+
+    if (!__atomic_exchange_n(&publish_pending, 0, __ATOMIC_ACQ_REL))
+        return NULL;
+
+    paths = g_ptr_array_new();
+
+    inotify_lock();
+
+    g_hash_table_iter_init(&iter, inotify_roots);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        root = value;
+        if (root->publish && !root->destroy && (root->queue_len > 0))
+            g_ptr_array_add(paths, g_strdup(root->path));
+    }
+
+    inotify_unlock();
+
+    if (paths->len == 0) {
+        g_ptr_array_free(paths, TRUE);
+        return NULL;
+    }
+
+    g_ptr_array_add(paths, NULL);
+
+    return (char **) g_ptr_array_free(paths, FALSE);
+}
+
 int inotify_unwatch_tree(char *path)
 {
     int last;
@@ -1122,20 +2484,34 @@ int inotify_unwatch_tree(char *path)
     if (path[last] == '/')
         path[last] = '\0';
 
-    /* First check to see if the path is a valid,
-     * watched root.
+    /* First check to see if the path is a valid, watched root, and
+     * mark it as being destroyed in the same go. Requests are
+     * handled on several threads at once, so otherwise two unwatches
+     * of the same root could both get past the check and tear it
+     * down (and free it) twice.
      */
+    inotify_lock();
+
     root = inotify_is_root(path);
     if (root == NULL) {
         log_warn
             ("Cannot unwatch path '%s' since it is not a watched root'",
              path);
+        inotify_unlock();
         return ERROR_INOTIFY_ROOT_NOT_WATCHED;
     } else if (root->destroy) {
         log_warn("Currently destroying tree at root '%s'", path);
+        inotify_unlock();
         return ERROR_INOTIFY_ROOT_BEING_DESTROYED;
     }
 
+    __atomic_store_n(&root->destroy, 1, __ATOMIC_RELEASE);
+
+    inotify_unlock();
+
+    /* The root can't go anywhere until the teardown queued here
+     * has run.
+     */
     return destroy_root(root);
 }
 
@@ -1143,9 +2519,11 @@ int inotify_unwatch_tree(char *path)
  * for each directory in the tree, as well as adding entries in the
  * meta data mappings.
  */
-int inotify_watch_tree(char *path, int mask, int max_events, int rewatch)
+int inotify_watch_tree(char *path, int mask, int max_events, int rewatch,
+                       int flags, const char *instance, char **ignore)
 {
-    int rv, last;
+    int rv, last, fanotify;
+    Instance *close_instance = NULL;
 
     log_trace("Entering inotify_watch_tree() on path '%s' with mask %lu",
               path, mask);
@@ -1155,32 +2533,51 @@ int inotify_watch_tree(char *path, int mask, int max_events, int rewatch)
     if ((path[last] == '/') && (strcmp(path, "/") != 0))
         path[last] = '\0';
 
-    /* A quick check of the current state of watched roots. */
+    /* Check to make sure root is a valid, and open-able, directory. */
+    {
+        DIR *d = opendir(path);
+        if (d == NULL) {
+            log_error("Failed to open root at dir '%s': %s",
+                      path, strerror(errno));
+            return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
+        }
+        closedir(d);
+    }
+
+    /* A quick check of the current state of watched roots.
+     *
+     * Requests are handled on several threads at once, so from here
+     * until the new root is in inotify_roots is all one hold of
+     * inotify_mutex. Otherwise two watches of the same path could
+     * both pass these checks, and the second root would replace the
+     * first in the hash, leaving the first (and its crawl) behind.
+     */
+    inotify_lock();
     {
         /* First we make sure we're not already watching a tree
          * at this root. This includes a sub tree, i.e. if the
          * root '/foo' is already being watched the user requests
          * a watch at '/foo/bar/baz'.
          */
-        pthread_mutex_lock(&inotify_mutex);
         Root *r = inotify_path_to_root(path);
 
         if (r != NULL) {
-            pthread_mutex_unlock(&inotify_mutex);
-
             if (strcmp(path, r->path) == 0) {
                 if (r->destroy) {
                     log_warn("Currently destroying tree at root '%s'",
                              path);
+                    inotify_unlock();
                     return ERROR_INOTIFY_ROOT_BEING_DESTROYED;
                 } else {
                     log_warn("Already watching tree at root '%s'", path);
+                    inotify_unlock();
                     return ERROR_INOTIFY_ROOT_ALREADY_WATCHED;
                 }
             } else {
                 log_warn
                     ("path '%s' is the child of already watched root '%s'",
                      path, r->path);
+                inotify_unlock();
                 return ERROR_INOTIFY_CHILD_OF_ROOT;
             }
         }
@@ -1195,29 +2592,16 @@ int inotify_watch_tree(char *path, int mask, int max_events, int rewatch)
             log_error
                 ("Memory allocation error while calling inotify_is_parent");
             free(sub_path);
-            pthread_mutex_unlock(&inotify_mutex);
+            inotify_unlock();
             return ERROR_MEMORY_ALLOCATION;
         } else if (sub_path) {
             log_warn
                 ("Path '%s' is the parent of already watched root '%s'",
                  path, sub_path);
             free(sub_path);
-            pthread_mutex_unlock(&inotify_mutex);
+            inotify_unlock();
             return ERROR_INOTIFY_PARENT_OF_ROOT;
         }
-
-        pthread_mutex_unlock(&inotify_mutex);
-    }
-
-    /* Check to make sure root is a valid, and open-able, directory. */
-    {
-        DIR *d = opendir(path);
-        if (d == NULL) {
-            log_error("Failed to open root at dir '%s': %s",
-                      path, strerror(errno));
-            return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
-        }
-        closedir(d);
     }
 
     /* Next we allocate space and store the meta data
@@ -1225,28 +2609,89 @@ int inotify_watch_tree(char *path, int mask, int max_events, int rewatch)
      */
     Root *new_root;
 
-    pthread_mutex_lock(&inotify_mutex);
-
-    new_root = make_root(path, mask, max_events, rewatch);
+    new_root = make_root(path, mask, max_events, rewatch, flags, ignore);
     if (new_root == NULL) {
         log_error
             ("Failed to create new root for path %s: memory allocation error",
              path);
-        pthread_mutex_unlock(&inotify_mutex);
+        inotify_unlock();
+        return ERROR_MEMORY_ALLOCATION;
+    }
+
+    /* With the fanotify backend the root goes on the fanotify group,
+     * as long as the kernel and filesystem are up to it. Otherwise
+     * it falls back to inotify.
+     */
+    new_root->instance = NULL;
+    if (CONFIG->fanotify_backend) {
+        new_root->instance = fanotify_instance_get();
+
+        if ((new_root->instance != NULL)
+            && (fanotify_add_root(new_root->instance->fd, path, mask) != 0)) {
+            if (instance_release(new_root->instance))
+                close_instance = new_root->instance;
+            new_root->instance = NULL;
+        }
+
+        if (new_root->instance == NULL)
+            log_warn("Failed to watch root '%s' with fanotify: %s", path,
+                     "falling back to inotify");
+    }
+
+    /* Pick the inotify instance for this root. An instance named
+     * in the request wins, otherwise with 'inotify_instance_per_root'
+     * set each root gets an instance of its own (named after the
+     * root), and failing both it goes on the shared default one.
+     */
+    if ((instance == NULL || *instance == '\0')
+        && CONFIG->inotify_instance_per_root)
+        instance = path;
+
+    if (new_root->instance == NULL)
+        new_root->instance = instance_get(instance);
+
+    if (new_root->instance == NULL) {
+        log_error("Failed to get inotify instance for root '%s'", path);
+        free(new_root->path);
+        ring_free(&new_root->queue);
+        if (new_root->queue_index != NULL)
+            g_hash_table_destroy(new_root->queue_index);
+        ignore_free(new_root->ignore);
+        free(new_root);
+        inotify_unlock();
+        if (close_instance != NULL)
+            instance_destroy(close_instance);
         return ERROR_MEMORY_ALLOCATION;
     }
 
     g_hash_table_replace(inotify_roots, g_strdup(path), new_root);
     ++inotify_num_watched_roots;
+    instance_add_root(new_root->instance, new_root);
 
-    pthread_mutex_unlock(&inotify_mutex);
+    /* Finally we need to recursively setup inotify watches for
+     * our new root. A fanotify root is already getting everything
+     * it needs.
+     */
+    fanotify = new_root->instance->fanotify;
+
+    rv = 0;
+    if (!fanotify)
+        rv = do_watch_tree(new_root->path, new_root, CRAWL_ROOT);
+    else
+        crawl_complete(new_root);
+
+    inotify_unlock();
+
+    if (close_instance != NULL)
+        instance_destroy(close_instance);
 
     inotify_dump_roots();
 
-    /* Finally we need to recursively setup inotify
-     * watches for our new root.
-     */
-    rv = do_watch_tree(new_root->path, new_root, 0);
+    if (fanotify) {
+        log_notice("Watching root '%s' with fanotify", path);
+        return 0;
+    }
+
     if (rv != 0) {
         log_error("Failed to watch root at dir '%s': %s", path,
                   error_to_string(rv));
@@ -1255,13 +2700,22 @@ int inotify_watch_tree(char *path, int mask, int max_events, int rewatch)
     return rv;
 }
 
-/* Recursive, threaded portion of inotify_watch_tree(). */
-static int do_watch_tree(const char *path, Root * root, int cleanup)
+/* Recursive, background portion of inotify_watch_tree(), carried out
+ * by the crawler threads (SEE: crawl.h).
+ *
+ * A directory created under a root (CRAWL_NEW) may already have had
+ * things put in it by the time it's watched, which inotify will never
+ * tell us about. So once it's watched every entry in it gets a
+ * synthetic IN_CREATE event. Anything created in between the watch
+ * being added and the directory being read can be queued twice, but
+ * nothing is missed.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static int do_watch_tree(const char *path, Root * root, int mode)
 {
     int rv;
-    pthread_t t;
-    pthread_attr_t attr;
-    T_Data *data;
+    C_Data *data;
 
     if ((root == NULL) || (root->destroy != 0)) {
         log_trace("Bailing out watch tree on path %s. %s", path,
@@ -1269,7 +2723,14 @@ static int do_watch_tree(const char *path, Root * root, int cleanup)
         return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
     }
 
-    data = (T_Data *) malloc(sizeof(T_Data));
+    if (strlen(path) < strlen(root->path)) {
+        log_error
+            ("Bailing out of recursive watch because a bad path was given: %s",
+             "inotify.c:do_watch_tree()");
+        return ERROR_INOTIFY_ROOT_DOES_NOT_EXIST;
+    }
+
+    data = (C_Data *) malloc(sizeof(C_Data));
 
     if (data == NULL) {
         log_error("Failed to allocate memory for thread data: %s",
@@ -1281,249 +2742,467 @@ static int do_watch_tree(const char *path, Root * root, int cleanup)
     if (rv == -1) {
         log_error("Failed to allocate memory for thread data PATH: %s",
                   "inotify.c:do_watch_tree()");
+        free(data);
         return ERROR_MEMORY_ALLOCATION;
     }
 
-    data->root = root;
-    data->cleanup = cleanup;
+    data->root = root;
+    data->mode = mode;
+
+    rv = crawl_tree(path, &crawl_ops, data);
+    if (rv != 0) {
+        log_error("Failed to start crawl for watch on '%s': %s",
+                  path, error_to_string(rv));
+        free(data->path);
+        free(data);
+        return rv;
+    }
+
+    /* The root is freed by whichever of _destroy_root() and the last
+     * of it's crawls is done with it last.
+     */
+    ++root->crawls;
+
+    if (mode == CRAWL_ROOT) {
+        root->crawl_state = INOTIFY_CRAWL_QUEUED;
+        root->crawl_found = 1;
+        root->crawl_dirs = 0;
+        root->crawl_start = now_usec();
+        root->crawl_secs = 0;
+    }
+
+    if (mode == CRAWL_CLEANUP) {
+        IN_ROOT_REWATCH = 1;
+        NUM_ROOT_REWATCH = 0;
+    }
+
+    return 0;
+}
+
+/* Add watches for a batch of directories the crawler has opened.
+ * Anything we don't end up watching is marked to be skipped, so the
+ * crawl goes no further down that way.
+ *
+ * inotify_mutex is only held to decide what needs watching and,
+ * once the system calls are out of the way, to put the results in
+ * the watch table. Never across the calls themselves.
+ */
+static void crawl_watch(Crawl_Dir ** dirs, int num, void *data)
+{
+    int i, wd[CRAWL_BATCH], err[CRAWL_BATCH], close_instance;
+    uint64_t one = 1;
+    uint32_t mask, gen[CRAWL_BATCH], mtime[CRAWL_BATCH];
+    struct stat stat_buf;
+    Watch *watch;
+    Instance *instance;
+    C_Data *crawl = data;
+    Root *root = crawl->root;
+
+    /* Remember what the directories looked like when we started
+     * watching them, for the overflow rescan (SEE: _inotify_rescan()).
+     * The entry counts are filled in once they've been read.
+     */
+    for (i = 0; i < num; i++)
+        mtime[i] = (fstat(dirs[i]->fd, &stat_buf) == 0)
+            ? (uint32_t) stat_buf.st_mtime : 0;
+
+    inotify_lock();
+
+    /* Hang on to the instance while we're not holding the lock, so
+     * that it's file descriptor can't be closed out from under us.
+     */
+    instance = root->instance;
+    ++instance->refs;
+    mask = root->mask | IN_DONT_FOLLOW;
+
+    /* Until the new watches are in the table below, events for their
+     * wds are held rather than dropped (SEE: held_add()).
+     */
+    ++instance->adding;
+
+    if ((crawl->mode == CRAWL_ROOT)
+        && (root->crawl_state == INOTIFY_CRAWL_QUEUED)) {
+        root->crawl_state = INOTIFY_CRAWL_CRAWLING;
+        root->crawl_start = now_usec();
+    }
+
+    for (i = 0; i < num; i++) {
+        const char *path = dirs[i]->path;
+
+        if (root->destroy != 0) {
+            log_trace("Skipping watch tree on path %s. %s", path,
+                      "because root has been unwatched or is being destroyed");
+            dirs[i]->skip = 1;
+            continue;
+        }
+
+        /* If we're in cleanup mode just check to see if the path
+         * we've currently crawled to is being watched. If not it has
+         * been missed or deleted at some point and we need to rewatch
+         * it. If it's already in the watch list skip it.
+         */
+        if (crawl->mode == CRAWL_CLEANUP) {
+            if (watch_lookup(path) != NULL) {
+                dirs[i]->skip = 1;
+                continue;
+            }
+
+            ++NUM_ROOT_REWATCH;
+            log_debug
+                ("In memclean routine found orphan path '%s' that needs to be rewatched",
+                 path);
+        }
+    }
+
+    inotify_unlock();
+
+    /* Add the watches without holding inotify_mutex, so a crawl on a
+     * slow disk doesn't hold up events and clients for every other
+     * root while the kernel looks up each path.
+     *
+     * Bump the generation first, so that events for the wd read from
+     * the kernel before now are recognised as belonging to whatever
+     * had the wd before us.
+     */
+    for (i = 0; i < num; i++) {
+        if (dirs[i]->skip)
+            continue;
+
+        gen[i] = __atomic_add_fetch(&instance->gen, 1, __ATOMIC_RELEASE);
+        wd[i] = inotify_add_watch(instance->fd, dirs[i]->path, mask);
+        err[i] = errno;
+    }
+
+    /* Then put the whole batch in the watch table in one go. */
+    inotify_lock();
+
+    for (i = 0; i < num; i++) {
+        const char *path = dirs[i]->path;
+
+        if (dirs[i]->skip)
+            continue;
+
+        if (wd[i] < 0) {
+            log_error("Failed to set up inotify watch for path '%s': %s",
+                      path, strerror(err[i]));
+            dirs[i]->skip = 1;
+            continue;
+        }
+
+        /* The root went away while we weren't looking. Take the
+         * watch back off again, unless it turned out to be one
+         * somebody else already had.
+         */
+        if (root->destroy != 0) {
+            if (wd_table_get(&instance->wds, wd[i],
+                             __atomic_load_n(&instance->gen,
+                                             __ATOMIC_ACQUIRE)) == NULL)
+                inotify_rm_watch(instance->fd, wd[i]);
+            dirs[i]->skip = 1;
+            continue;
+        }
+
+        log_trace("Watching wd:%d path:%s", wd[i], path);
+
+        /* If something else was watched at this path before (i.e. the
+         * directory was replaced) forget it's old watch descriptor.
+         *
+         * The wd may also still belong to a tree that's on it's way out
+         * (SEE: unwatch_tree()), in which case it's simply taken over.
+         */
+        watch = watch_lookup(path);
+
+        if ((watch != NULL)
+            && (wd_table_get(&instance->wds, wd[i], gen[i]) == watch)) {
+            log_debug
+                ("Found a tree that's already being watched: wd:%d path:%s",
+                 wd[i], path);
+            dirs[i]->skip = 1;
+            continue;
+        }
+
+        if (watch != NULL)
+            wd_table_remove(&watch->root->instance->wds, watch->wd);
+
+        watch = watch_add(path, wd[i], root);
+        if ((watch == NULL)
+            || (wd_table_set(&instance->wds, wd[i], watch, gen[i]))) {
+            log_error("Failed to create new watch for wd:%d path:%s: %s",
+                      wd[i], path, "memory allocation error");
+            if (watch != NULL)
+                watch_remove(watch);
+            inotify_rm_watch(instance->fd, wd[i]);
+            dirs[i]->skip = 1;
+            continue;
+        }
+
+        watch->mtime = mtime[i];
+        dirs[i]->wd = wd[i];
+
+        if (crawl->mode == CRAWL_ROOT)
+            ++root->crawl_dirs;
+    }
+
+    /* Have the main loop go through anything that was held for
+     * these watches in the meantime.
+     */
+    --instance->adding;
+    if ((instance->held != NULL)
+        && (write(ingest_event_fd, &one, sizeof one) == -1))
+        log_error("Failed to write ingest eventfd: %s", strerror(errno));
+
+    close_instance = instance_release(instance);
 
-    /* Initialize thread attribute to automatically detach */
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    inotify_unlock();
 
-    rv = pthread_create(&t, &attr, _do_watch_tree, (void *) data);
-    if (rv) {
-        log_error("Failed to create new thread for watch on '%s': %d",
-                  path, rv);
-        free(data->path);
-        free(data);
-        return ERROR_FAILED_TO_CREATE_NEW_THREAD;
+    if (close_instance)
+        instance_destroy(instance);
+}
+
+/* Something the crawler found in one of the directories we watched.
+ * Returns 1 if it's a directory the crawl should go into.
+ */
+static int crawl_entry(Crawl_Dir * dir, const char *name, int is_dir,
+                       void *data)
+{
+    C_Data *crawl = data;
+    Root *root = crawl->root;
+
+    if (crawl->mode == CRAWL_NEW)
+        crawl_found(dir, root, name, is_dir);
+
+    if (!is_dir || (root->destroy != 0))
+        return 0;
+
+    /* Ignored directories are never watched, so nothing under
+     * them ever makes it as far as inotify_handle_batch().
+     */
+    if (ignore_name(root->ignore, name, 1)
+        || ignore_path(root->ignore, dir->path, name, 1)) {
+        log_trace("Skipping watch on ignored directory '%s' in '%s'",
+                  name, dir->path);
+        return 0;
     }
 
-    pthread_attr_destroy(&attr);
+    if (crawl->mode == CRAWL_ROOT)
+        __atomic_add_fetch(&root->crawl_found, 1, __ATOMIC_RELAXED);
 
-    return 0;
+    return 1;
 }
 
-static void *_do_watch_tree(void *thread_data)
+/* A batch of directories has been read, so now we know how many
+ * entries each of them has, and can queue the synthetic events for
+ * what was found in them (SEE: crawl_found()). The whole batch is
+ * done under one hold of inotify_mutex.
+ */
+static void crawl_read(Crawl_Dir ** dirs, int num, void *data)
 {
-    int cleanup;
-    T_Data *data;
-    data = thread_data;
-    cleanup = data->cleanup;
+    int i;
+    C_Data *crawl = data;
+    Watch *watch;
 
-    if ((data->root == NULL) || (data->root->destroy != 0)) {
-        log_error
-            ("Bailing out of recursive watch because the root is not watched: %s",
-             "inotify.c:_do_watch_tree()");
-        free(data->path);
-        free(data);
-        return (void *) 1;
-    }
+    inotify_lock();
 
-    if (strlen(data->path) < strlen(data->root->path)) {
-        log_error
-            ("Bailing out of recursive watch because a bad path was given: %s",
-             "inotify.c:_do_watch_tree()");
-        free(data->path);
-        free(data);
-        return (void *) 1;
-    }
+    for (i = 0; i < num; i++) {
+        if (dirs[i]->user != NULL) {
+            crawl_events(crawl->root, dirs[i]->path, dirs[i]->user);
+            dirs[i]->user = NULL;
+        }
 
-    if (data->cleanup) {
-        IN_ROOT_REWATCH = 1;
-        NUM_ROOT_REWATCH = 0;
+        if (dirs[i]->skip)
+            continue;
+
+        watch = watch_lookup(dirs[i]->path);
+        if ((watch != NULL) && (watch->wd == dirs[i]->wd))
+            watch->entries = dirs[i]->entries;
     }
 
-    _do_watch_tree_rec(data->path, data->root, data->cleanup);
+    inotify_unlock();
+}
+
+static void crawl_done(void *data)
+{
+    C_Data *crawl = data;
+    Root *root = crawl->root;
 
-    if (data->cleanup) {
+    if (crawl->mode == CRAWL_CLEANUP) {
         log_notice
             ("Completed full rewatch of root '%s' finding %d orphaned directories",
-             data->path, NUM_ROOT_REWATCH);
+             crawl->path, NUM_ROOT_REWATCH);
         IN_ROOT_REWATCH = 0;
         NUM_ROOT_REWATCH = 0;
     }
 
-    free(data->path);
-    free(data);
+    inotify_lock();
 
-    pthread_exit(NULL);
+    if (crawl->mode == CRAWL_ROOT)
+        crawl_complete(root);
 
-    return (void *) 0;
+    if ((--root->crawls == 0) && (root->destroy != 0)
+        && (g_hash_table_lookup(inotify_roots, root->path) != root))
+        root_free(root);
+
+    inotify_unlock();
+
+    free(crawl->path);
+    free(crawl);
 }
 
-static void _do_watch_tree_rec(char *path, Root * root, int cleanup)
+/* A root's crawls are called off as soon as it's unwatched, so
+ * a big tree that's still being crawled stops straight away.
+ */
+static int crawl_cancelled(void *data)
 {
-    int wd, rv;
-    DIR *d;
-    struct dirent *dir;
-    Watch *watch;
-    char *tmp;
-    struct stat stat_buf;
+    C_Data *crawl = data;
 
-    /* Skip .~tmp~ directories (generated by rsync) */
-    char *tmp_str = ".~tmp~";
-    char *idx = NULL;
+    return __atomic_load_n(&crawl->root->destroy, __ATOMIC_RELAXED) != 0;
+}
 
-    if (idx = strstr(path, tmp_str)) {
-        idx += strlen(tmp_str);
-        if (*idx == '\0') {
-            log_trace("Skipping watch on '.~tmp~' directory: %s", path);
-            return;
-        }
-    }
+/* Everything under 'root' is being watched now, so let the client
+ * know it's not missing anything any more (SEE: IN_CRAWL_COMPLETE).
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void crawl_complete(Root * root)
+{
+    int rv;
 
-    pthread_mutex_lock(&inotify_mutex);
+    root->crawl_state = INOTIFY_CRAWL_COMPLETE;
+    if (root->crawl_start != 0)
+        root->crawl_secs = (now_usec() - root->crawl_start) / 1e6;
 
-    if ((root == NULL) || (root->destroy != 0)) {
-        log_trace("Skipping watch tree on path %s. %s", path,
-                  "because root has been unwatched or is being destroyed");
-        pthread_mutex_unlock(&inotify_mutex);
+    if ((root->destroy != 0) || root->pause)
         return;
-    }
 
-    /* If we're in cleanup mode just check to see if the path we've currently
-     * recursed to is being watched. If not it has been missed or deleted at
-     * some point and we need to rewatch it. If it's already in the watch list
-     * skip it and move on down the tree.
-     */
-    if (cleanup) {
-        watch = g_hash_table_lookup(inotify_path_to_watch, path);
-
-        if (watch != NULL) {
-            pthread_mutex_unlock(&inotify_mutex);
-            return;
-        }
-
-        ++NUM_ROOT_REWATCH;
-        log_debug
-            ("In memclean routine found orphan path '%s' that needs to be rewatched",
-             path);
-    }
+    log_debug("Crawl of root '%s' complete, watching %lu dirs",
+              root->path, root->crawl_dirs);
 
-    /* Check to make sure path is a valid, and open-able, directory. */
-    {
-        DIR *d = opendir(path);
-        if (d == NULL) {
-            log_debug
-                ("While doing recursive watch failed to open root at dir '%s' in _do_watch_tree_rec(): %s",
-                 path, strerror(errno));
-            pthread_mutex_unlock(&inotify_mutex);
-            return;
-        }
-        closedir(d);
-    }
+    Event e = { -1, IN_CRAWL_COMPLETE, 0, 0, root->path, "", NULL, NULL };
 
-    /* XXX: Need switch here to do ALL_EVENTS or just the root->mask. */
-    /*
-       wd = inotify_add_watch(inotify_fd, path,
-       IN_ALL_EVENTS | IN_DONT_FOLLOW);
-     */
-    wd = inotify_add_watch(inotify_fd, path, root->mask | IN_DONT_FOLLOW);
+    rv = inotify_enqueue(root, &e);
+    if (rv != 0)
+        log_warn("Failed to queue crawl complete event for root '%s': %s",
+                 root->path, error_to_string(rv));
+}
 
-    if (wd < 0) {
-        log_error("Failed to set up inotify watch for path '%s': %s",
-                  path, strerror(errno));
-        pthread_mutex_unlock(&inotify_mutex);
+/* An entry the crawler found in a newly created directory (SEE:
+ * do_watch_tree()). Rather than being queued on its own it's kept
+ * on the directory until the batch has been read, and then queued
+ * along with everything else in it (SEE: crawl_events()). Anything
+ * the root wouldn't get an event for is left out here, without
+ * inotify_mutex, since neither the mask nor the ignore list of a
+ * root ever change.
+ */
+static void crawl_found(Crawl_Dir * dir, Root * root, const char *name,
+                        int is_dir)
+{
+    size_t len;
+    uint32_t mask = IN_CREATE | (is_dir ? IN_ISDIR : 0);
+    C_Found *found;
+
+    if (!(mask & root->mask)
+        || (__atomic_load_n(&root->destroy, __ATOMIC_RELAXED) != 0)
+        || ignore_name(root->ignore, name, is_dir)
+        || ignore_path(root->ignore, dir->path, name, is_dir))
         return;
-    }
-
-    log_trace("Watching wd:%d path:%s", wd, path);
 
-    watch = make_watch(wd, path);
-    if (watch == NULL) {
-        log_error("Failed to create new watch for wd:%d path:%s: %s",
-                  "memory allocation error", wd, path);
-        pthread_mutex_unlock(&inotify_mutex);
-        return;
+    if (dir->user == NULL) {
+        dir->user = g_ptr_array_new();
+        if (dir->user == NULL)
+            return;
     }
 
-    if (g_hash_table_lookup(inotify_wd_to_watch, GINT_TO_POINTER(wd))) {
-        log_debug
-            ("Found a tree that's already being watched: wd:%d path:%s",
-             wd, path);
-        free(watch->path);
-        free(watch);
-        pthread_mutex_unlock(&inotify_mutex);
+    len = strlen(name);
+    found = malloc(sizeof(C_Found) + len + 1);
+    if (found == NULL) {
+        log_error("Failed to allocate memory for event for '%s' in '%s': %s",
+                  name, dir->path, "inotify.c:crawl_found()");
         return;
     }
 
-    g_hash_table_replace(inotify_wd_to_watch, GINT_TO_POINTER(wd), watch);
-    g_hash_table_replace(inotify_path_to_watch, g_strdup(path), watch);
-
-    pthread_mutex_unlock(&inotify_mutex);
-
-    d = opendir(path);
-    if (d == NULL) {
-        log_error("Failed to open dir '%s' in _do_watch_tree_rec(): %s",
-                  path, strerror(errno));
-        closedir(d);
-        return;
-    }
+    found->mask = mask;
+    memcpy(found->name, name, len + 1);
+    g_ptr_array_add(dir->user, found);
+}
 
-    while ((dir = readdir(d))) {
+/* Queue the synthetic events for everything crawl_found() kept for
+ * the directory 'path', and free them.
+ *
+ * When the root coalesces, an entry that already has an event queued
+ * is skipped: the client will be looking at it anyway, and a big
+ * tree being moved in would otherwise see most of it queued twice.
+ * Once the queue is full the rest are dropped without trying.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void crawl_events(Root * root, const char *path, GPtrArray * found)
+{
+    unsigned int i, skipped = 0;
+    int rv = 0;
+    size_t path_len, name_len;
+    C_Found *f;
+    Event_Record *key = NULL;
 
-        if (strcmp(dir->d_name, ".") == 0
-            || strcmp(dir->d_name, "..") == 0)
-            continue;
+    if ((root->destroy != 0) || root->pause)
+        goto done;
 
-        if (strcmp(path, "/") == 0)
-            rv = mk_string(&tmp, "/%s", dir->d_name);
-        else
-            rv = mk_string(&tmp, "%s/%s", path, dir->d_name);
+    path_len = strlen(path);
 
-        if (rv == -1) {
-            log_error
-                ("Failed to allocate memroy for temporary path variable: %s",
-                 "inotify.c:_do_watch_tree_rec");
-            free(tmp);
-            closedir(d);
-            return;
+    /* A record to look entries up in Root::queue_index with. Only
+     * the path and name matter (SEE: record_equal()).
+     */
+    if (root->queue_index != NULL) {
+        key = malloc(sizeof(Event_Record) + path_len + NAME_MAX + 2);
+        if (key != NULL) {
+            key->path_len = path_len;
+            memcpy(key->data, path, path_len + 1);
         }
+    }
 
-        /* If d_type is DT_UNKNOWN then we are on a file system that
-         * does not support dirent::d_type flags. This includes XFS
-         * and ZFS, and probably others.
-         *
-         * Since we cannot use the d_type flag on XFS and ZFS to
-         * determine if a file is a directory we have to make a call
-         * to stat() for each file we encounter. This is not very
-         * efficient for large trees, but it's what we're left with.
-         */
-        if (dir->d_type == DT_UNKNOWN) {
-            lstat(tmp, &stat_buf);
+    for (i = 0; i < found->len; i++) {
+        f = g_ptr_array_index(found, i);
+        name_len = strlen(f->name);
 
-            if (S_ISLNK(stat_buf.st_mode) || !S_ISDIR(stat_buf.st_mode)) {
-                free(tmp);
+        if ((key != NULL) && (name_len <= NAME_MAX)) {
+            key->name_len = name_len;
+            memcpy(key->data + path_len + 1, f->name, name_len + 1);
+            if (g_hash_table_lookup(root->queue_index, key) != NULL) {
+                ++skipped;
                 continue;
             }
-        } else if ((dir->d_type == DT_LNK) || (dir->d_type != DT_DIR)) {
-            free(tmp);
-            continue;
         }
 
-        /* Make sure that while looping our root hasn't been destroyed. */
-        if ((root == NULL) || (root->destroy != 0)) {
-            log_trace("Skipping watch tree on path %s. %s", path,
-                      "because root has been unwatched or is being destroyed");
-            free(tmp);
-            closedir(d);
-            return;
-        }
+        Event e = {
+            -1, f->mask, 0, name_len + 1, (char *) path, f->name,
+            NULL, NULL
+        };
+
+        rv = inotify_enqueue(root, &e);
+        if (rv == ERROR_INOTIFY_ROOT_QUEUE_FULL)
+            break;
+        if (rv != 0)
+            log_warn("Failed to queue event for '%s' in '%s': %s",
+                     f->name, path, error_to_string(rv));
+    }
 
-        /* Recurse! */
-        _do_watch_tree_rec(tmp, root, cleanup);
+    if (skipped > 0)
+        log_trace("Skipped %u entries of '%s' that were already queued",
+                  skipped, path);
 
-        free(tmp);
-    }
+    if (rv == ERROR_INOTIFY_ROOT_QUEUE_FULL)
+        log_debug("Dropped %u synthetic events for '%s'", found->len - i,
+                  path);
 
-    closedir(d);
+  done:
+    for (i = 0; i < found->len; i++)
+        free(g_ptr_array_index(found, i));
+    g_ptr_array_free(found, TRUE);
+    free(key);
 }
 
 /* Create a new root meta data structure. */
 static Root *make_root(const char *path, int mask, int max_events,
-                       int rewatch)
+                       int rewatch, int flags, char **ignore)
 {
     int rv;
     Root *root;
@@ -1542,59 +3221,472 @@ static Root *make_root(const char *path, int mask, int max_events,
         return NULL;
     }
 
+    if (ring_init(&root->queue, INOTIFY_QUEUE_MIN_SIZE) != 0) {
+        log_error("Failed to allocate memory for new root QUEUE: %s",
+                  "inotify.c:make_root()");
+        free(root->path);
+        free(root);
+        return NULL;
+    }
+
+    root->queue_index = NULL;
+    if (flags & INOTIFY_ROOT_COALESCE) {
+        root->queue_index =
+            g_hash_table_new(record_hash, record_equal);
+        if (root->queue_index == NULL) {
+            log_error("Failed to allocate memory for new root INDEX: %s",
+                      "inotify.c:make_root()");
+            ring_free(&root->queue);
+            free(root->path);
+            free(root);
+            return NULL;
+        }
+    }
+
+    root->ignore = ignore_compile(path, ignore);
+    if (root->ignore == NULL) {
+        log_error("Failed to allocate memory for new root IGNORE: %s",
+                  "inotify.c:make_root()");
+        if (root->queue_index != NULL)
+            g_hash_table_destroy(root->queue_index);
+        ring_free(&root->queue);
+        free(root->path);
+        free(root);
+        return NULL;
+    }
+
+    root->pair_moves = (flags & INOTIFY_ROOT_PAIR_MOVES) ? 1 : 0;
     root->mask = mask;
-    root->queue = g_queue_new();
+    root->queue_len = 0;
     root->max_events = max_events;
     root->destroy = 0;
     root->pause = 0;
+    root->publish = 0;
     root->rewatch = rewatch;
     root->persist = 0;          /* TODO: Future feature */
-
-    g_queue_init(root->queue);
+    root->rescan_since = 0;
+    root->rescanning = 0;
+    root->rescan_again = 0;
+    root->crawls = 0;
+    root->crawl_state = INOTIFY_CRAWL_QUEUED;
+    root->crawl_found = 0;
+    root->crawl_dirs = 0;
+    root->crawl_start = 0;
+    root->crawl_secs = 0;
+    root->instance = NULL;      /* Set by inotify_watch_tree() */
 
     return root;
 }
 
-/* Create a new watch structure. There will be one of these
- * for every single directory we set up an inotify watch
- * for.
+/* Tell inotify to stop watching a directory and forget it's
+ * watch descriptor. 'data' is the Instance the watch belongs to.
+ * The watch itself is left for the caller to take out of the watch
+ * table.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void _unwatch(Watch * watch, void *data)
+{
+    Instance *instance = data;
+    uint32_t gen = __atomic_load_n(&instance->gen, __ATOMIC_ACQUIRE);
+
+    /* A detached tree can hang around for a while after the root
+     * it came from is gone. If the directory has been watched again
+     * in the meantime the wd, which the kernel hands back unchanged,
+     * belongs to the new watch now and must be left alone.
+     */
+    if (wd_table_get(&instance->wds, watch->wd, gen) != watch)
+        return;
+
+    if (inotify_rm_watch(instance->fd, watch->wd) != 0) {
+        log_trace("Failed to call inotify_rm_watch() on wd:%d: %s",
+                  watch->wd, strerror(errno));
+    }
+
+    wd_table_remove(&instance->wds, watch->wd);
+}
+
+/* Queue the IN_MOVED_FROM or IN_MOVED_TO 'event' on 'root' as part
+ * of a paired move (SEE: inotify_move_events).
+ *
+ * An IN_MOVED_FROM is held on to until its other half shows up.
+ * When the matching IN_MOVED_TO arrives a single event, with both
+ * the old and new location and the mask IN_MOVED_FROM|IN_MOVED_TO,
+ * is queued on the root the file came from, and on the root it
+ * went to if that's a different one. An IN_MOVED_TO with nothing
+ * to pair up with came from outside of our roots and is queued as
+ * a plain IN_CREATE.
+ *
+ * The caller must hold inotify_mutex.
+ *
+ * Returns 1 if the event has been taken care of, or 0 (zero) if it
+ * should be queued as is.
  */
-static Watch *make_watch(int wd, const char *path)
+static int move_event_queue(Root * root, Event * event)
 {
-    int rv, len;
-    size_t size;
-    Watch *watch;
+    int rv;
+    size_t path_len, name_len;
+    Event move;
+    Move_Event *from, *old;
+    gpointer cookie = GUINT_TO_POINTER(event->cookie);
+
+    if (event->mask & IN_MOVED_FROM) {
+        if (!root->pair_moves || (event->cookie == 0)
+            || !(event->mask & root->mask))
+            return 0;
+
+        path_len = strlen(event->path);
+        name_len = strlen(event->name);
+
+        from = malloc(sizeof(Move_Event) + path_len + name_len + 2);
+        if (from == NULL)
+            return 0;
+
+        from->root = root;
+        from->event = *event;
+        from->event.path = (char *) (from + 1);
+        from->event.name = from->event.path + path_len + 1;
+        memcpy(from->event.path, event->path, path_len + 1);
+        memcpy(from->event.name, event->name, name_len + 1);
+        from->expires = now_usec() + CONFIG->move_pair_window * 1000LL;
+
+        /* Cookies aren't reused any time soon, but just in case. */
+        old = g_hash_table_lookup(inotify_move_events, cookie);
+        if (old != NULL) {
+            g_hash_table_remove(inotify_move_events, cookie);
+            move_event_flush(old);
+        }
 
-    size = strlen(path);
-    watch = malloc(sizeof(Watch));
-    if (watch == NULL) {
-        log_error("Failed to allocate memory for new watch: %s",
-                  "inotify.c:make_watch()");
-        return NULL;
+        g_hash_table_insert(inotify_move_events, cookie, from);
+        return 1;
     }
 
-    watch->wd = wd;
+    from = NULL;
+    if (event->cookie != 0) {
+        from = g_hash_table_lookup(inotify_move_events, cookie);
+        if (from != NULL)
+            g_hash_table_remove(inotify_move_events, cookie);
+    }
 
-    len = strlen(path);
-    watch->path = malloc(len + 1);
-    if (watch->path == NULL) {
-        log_error("Failed to allocate memory for new watch PATH '%s': %s",
-                  path, "inotify.c:make_watch()");
-        return NULL;
+    if (from == NULL) {
+        if (!root->pair_moves)
+            return 0;
+
+        if (event->mask & root->mask) {
+            event->mask = IN_CREATE | (event->mask & IN_ISDIR);
+            event->cookie = 0;
+
+            rv = inotify_enqueue(root, event);
+            if (rv != 0)
+                log_warn("Failed to queue event for path:%s: %s",
+                         event->path, error_to_string(rv));
+        }
+        return 1;
+    }
+
+    move = *event;
+    move.mask = IN_MOVED_FROM | IN_MOVED_TO | (event->mask & IN_ISDIR);
+    move.old_path = from->event.path;
+    move.old_name = from->event.name;
+
+    if (!from->root->pause) {
+        rv = inotify_enqueue(from->root, &move);
+        if (rv != 0)
+            log_warn("Failed to queue move event for path:%s: %s",
+                     move.old_path, error_to_string(rv));
+    }
+
+    if ((from->root != root) && (event->mask & root->mask)) {
+        rv = inotify_enqueue(root, root->pair_moves ? &move : event);
+        if (rv != 0)
+            log_warn("Failed to queue move event for path:%s: %s",
+                     event->path, error_to_string(rv));
+    }
+
+    free(from);
+    return 1;
+}
+
+/* Queue a held IN_MOVED_FROM that never found its other half as a
+ * plain IN_DELETE, and free it.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void move_event_flush(Move_Event * move)
+{
+    int rv;
+
+    if (!move->root->pause && !move->root->destroy) {
+        move->event.mask = IN_DELETE | (move->event.mask & IN_ISDIR);
+        move->event.cookie = 0;
+
+        rv = inotify_enqueue(move->root, &move->event);
+        if (rv != 0)
+            log_warn("Failed to queue event for path:%s: %s",
+                     move->event.path, error_to_string(rv));
+    }
+
+    free(move);
+}
+
+/* Flush every held IN_MOVED_FROM that expired before 'now'. With a
+ * 'root' every one held for that root is thrown away instead.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void move_event_expire(const Root * root, long long now)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    Move_Event *move;
+
+    g_hash_table_iter_init(&iter, inotify_move_events);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        move = value;
+
+        if ((root == NULL) ? (move->expires > now) : (move->root != root))
+            continue;
+
+        g_hash_table_iter_remove(&iter);
+
+        if (root == NULL)
+            move_event_flush(move);
+        else
+            free(move);
+    }
+}
+
+static long long now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long inotify_timeout(void)
+{
+    long long next = -1, now;
+    GHashTableIter iter;
+    gpointer key, value;
+    Move_Event *move;
+
+    inotify_lock();
+
+    g_hash_table_iter_init(&iter, inotify_move_events);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        move = value;
+        if ((next == -1) || (move->expires < next))
+            next = move->expires;
+    }
+
+    inotify_unlock();
+
+    if (next == -1)
+        return -1;
+
+    now = now_usec();
+    return (next > now) ? (long) (next - now) : 0;
+}
+
+void inotify_tick(void)
+{
+    inotify_lock();
+
+    if (g_hash_table_size(inotify_move_events) > 0)
+        move_event_expire(NULL, now_usec());
+
+    inotify_unlock();
+}
+
+/* Unwatch and free the tree at 'watch', which is taken out of the
+ * watch table first. Small trees are dealt with right away, anything
+ * bigger than INOTIFY_UNWATCH_BATCH watches is finished off in the
+ * background (SEE: pool.h) a batch at a time. That way inotify_mutex is
+ * never held for long, however big the tree is.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void unwatch_tree(Watch * watch)
+{
+    int rv;
+    Instance *instance;
+    U_Data *data;
+
+    instance = watch->root->instance;
+
+    watch_detach(watch);
+
+    if (watch_remove_tree_max(watch, _unwatch, instance,
+                              INOTIFY_UNWATCH_BATCH) == 0)
+        return;
+
+    data = malloc(sizeof(U_Data));
+    if (data == NULL) {
+        watch_remove_tree(watch, _unwatch, instance);
+        return;
+    }
+
+    data->watch = watch;
+    data->instance = instance;
+
+    /* The task hangs on to the instance until it's done with it. */
+    ++instance->refs;
+
+    rv = pool_run_first(_unwatch_tree, data, NULL);
+    if (rv != 0) {
+        log_warn("Failed to queue unwatch of tree: %s: %s",
+                 error_to_string(rv), "inotify.c:unwatch_tree()");
+        --instance->refs;
+        watch_remove_tree(watch, _unwatch, instance);
+        free(data);
+    }
+}
+
+static void _unwatch_tree(void *thread_data)
+{
+    int more, close_instance;
+    U_Data *data = thread_data;
+
+    do {
+        inotify_lock();
+        more = watch_remove_tree_max(data->watch, _unwatch, data->instance,
+                                     INOTIFY_UNWATCH_BATCH);
+        inotify_unlock();
+    } while (more);
+
+    inotify_lock();
+    close_instance = instance_release(data->instance);
+    inotify_unlock();
+
+    if (close_instance)
+        instance_destroy(data->instance);
+
+    free(data);
+}
+
+/* Set the directory tree at 'watch' aside after it has been moved
+ * away (IN_MOVED_FROM) until the matching IN_MOVED_TO comes in.
+ *
+ * The caller must hold inotify_mutex.
+ *
+ * Returns 0 (zero) on success, or 1 if the tree can't be kept and
+ * should be unwatched instead.
+ */
+static int move_start(Watch * watch, uint32_t cookie)
+{
+    Move *move;
+
+    if (cookie == 0)
+        return 1;
+
+    /* Cookies aren't reused any time soon, but just in case. */
+    move = g_hash_table_lookup(inotify_moves, GUINT_TO_POINTER(cookie));
+    if (move != NULL) {
+        unwatch_tree(move->watch);
+        g_hash_table_remove(inotify_moves, GUINT_TO_POINTER(cookie));
+    }
+
+    move = malloc(sizeof(Move));
+    if (move == NULL)
+        return 1;
+
+    move->watch = watch;
+    move->round = move_round;
+
+    watch_detach(watch);
+    g_hash_table_replace(inotify_moves, GUINT_TO_POINTER(cookie), move);
+
+    return 0;
+}
+
+/* Put a tree set aside by move_start() back into the watch table at
+ * 'abs_path', as the child 'event->name' of 'parent' in 'root'. The
+ * kernel's wds follow the directories around, so nothing needs to be
+ * re-watched unless the move crosses into another inotify instance
+ * or into a root watching for different events.
+ *
+ * The caller must hold inotify_mutex.
+ *
+ * Returns 0 (zero) if the tree was moved, or 1 if there was nothing
+ * to move (or it couldn't be moved) and 'abs_path' has to be
+ * crawled and watched from scratch.
+ */
+static int move_finish(Watch * parent, Root * root, const IN_Event * event,
+                       const char *abs_path)
+{
+    Move *move;
+    Watch *watch, *existing;
+    Root *from;
+
+    if (event->cookie == 0)
+        return 1;
+
+    move = g_hash_table_lookup(inotify_moves,
+                               GUINT_TO_POINTER(event->cookie));
+    if (move == NULL)
+        return 1;
+
+    watch = move->watch;
+    from = watch->root;
+
+    g_hash_table_steal(inotify_moves, GUINT_TO_POINTER(event->cookie));
+    free(move);
+
+    if ((from->instance != root->instance) || (from->mask != root->mask)) {
+        log_trace("Moving '%s' between roots that can't share watches",
+                  abs_path);
+        unwatch_tree(watch);
+        return 1;
+    }
+
+    /* Whatever the rename replaced is gone. */
+    existing = watch_lookup(abs_path);
+    if (existing != NULL)
+        unwatch_tree(existing);
+
+    existing = watch;
+    watch = watch_attach(watch, parent, event->name);
+    if (watch == NULL) {
+        log_debug("Failed to move watches to '%s': %s", abs_path,
+                  "inotify.c:move_finish()");
+        unwatch_tree(existing);
+        return 1;
     }
 
-    memcpy(watch->path, path, len);
-    watch->path[len] = '\0';
+    if (watch != existing)
+        wd_table_replace(&root->instance->wds, watch->wd, watch);
 
-    return watch;
+    if (from != root)
+        watch_set_root(watch, root);
+
+    return 0;
 }
 
-/* Free up the dynamically allocated memory of a queue node. */
-static void free_node_mem(Event * node, gpointer user_data)
+/* Unwatch the trees of moves that were never finished. With a NULL
+ * 'root' that's every move started before the current round, with
+ * a 'root' it's every move away from that root.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void move_expire(const Root * root)
 {
-    free(node->path);
-    free(node->name);
-    free(node);
+    GHashTableIter iter;
+    gpointer key, value;
+    Move *move;
+
+    g_hash_table_iter_init(&iter, inotify_moves);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        move = value;
+
+        if ((root == NULL) ? (move->round == move_round)
+            : (move->watch->root != root))
+            continue;
+
+        log_trace("Unwatching tree moved out of the watched roots");
+        unwatch_tree(move->watch);
+        g_hash_table_iter_remove(&iter);
+    }
 }
 
 /* This function will periodically get called to go through
@@ -1609,25 +3701,26 @@ static void free_node_mem(Event * node, gpointer user_data)
 void inotify_memclean(void)
 {
     int rv;
-    pthread_t t;
-    pthread_attr_t attr;
 
     if (IN_MEMCLEAN) {
         log_debug("Already performing a memclean. Skipping operation");
         return;
     }
 
-    /* Initialize thread attribute to automatically detach */
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* Set here rather than in _inotify_memclean(), so another one
+     * isn't queued while this one is waiting for a thread.
+     */
+    IN_MEMCLEAN = 1;
 
-    rv = pthread_create(&t, &attr, _inotify_memclean, NULL);
-    if (rv) {
-        log_error("Failed to create new thread for memclean operation");
-        return;
+    /* Give a couple seconds for potential file system operations to
+     * catch up, without holding on to a thread while we wait.
+     */
+    rv = pool_run_later(_inotify_memclean, NULL, NULL, 2000);
+    if (rv != 0) {
+        log_error("Failed to queue memclean operation: %s",
+                  error_to_string(rv));
+        IN_MEMCLEAN = 0;
     }
-
-    pthread_attr_destroy(&attr);
 }
 
 void inotify_rewatch_roots(void)
@@ -1647,15 +3740,17 @@ void inotify_rewatch_roots(void)
     /* Now let's rewatch all our roots for directories
      * that somehow got lost in the madness.
      */
-    pthread_mutex_lock(&inotify_mutex);
+    inotify_lock();
     roots = g_hash_table_get_values(inotify_roots);
-    pthread_mutex_unlock(&inotify_mutex);
 
     for (roots_ptr = roots; roots != NULL; roots = roots->next) {
         root = roots->data;
 
+        if (root->instance->fanotify)
+            continue;
+
         log_debug("Rewatching root '%s'", root->path);
-        rv = do_watch_tree(root->path, root, 1);
+        rv = do_watch_tree(root->path, root, CRAWL_CLEANUP);
 
         if (rv != 0) {
             log_error("Failed to watch root at dir '%s': %s", root->path,
@@ -1663,98 +3758,109 @@ void inotify_rewatch_roots(void)
         }
     }
 
+    inotify_unlock();
     g_list_free(roots_ptr);
 }
 
-static void *_inotify_memclean(void *thread_data)
+static void _inotify_memclean(void *thread_data)
 {
-    int i, rv;
+    guint i;
     double count = 0, total = 0;
-    GList *key = NULL, *keys = NULL;
-    char *tmp, *sub_path, *ptr;
+    char buf[PATH_MAX], *path, *cursor = NULL;
+    GPtrArray *batch;
     Watch *watch;
 
     thread_data = NULL;
-    IN_MEMCLEAN = 1;
 
-    /* Sleep for a couple seconds to let potential
-     * file system operations to catch up.
+    log_notice("Performing the inotify metadata memory cleanup.");
+
+    batch = g_ptr_array_sized_new(INOTIFY_MEMCLEAN_BATCH);
+
+    /* Walk the watch table a batch at a time. For each batch we
+     * grab the paths while holding inotify_mutex and then let go of
+     * it while we hit the disk, so event processing isn't held up
+     * for the whole walk. 'cursor' is the path of the first watch
+     * of the next batch.
      */
-    sleep(2);
+    while (1) {
 
-    log_notice("Performing the inotify metadata memory cleanup.");
+        inotify_lock();
 
-    pthread_mutex_lock(&inotify_mutex);
-    keys = g_hash_table_get_keys(inotify_path_to_watch);
-    pthread_mutex_unlock(&inotify_mutex);
+        if (cursor == NULL) {
+            watch = watch_first();
+        } else {
+            watch = watch_lookup(cursor);
+            g_free(cursor);
+            cursor = NULL;
+
+            /* The watch we were going to start at went away in the
+             * meantime. Whatever we didn't get to will be looked at
+             * next time around.
+             */
+            if (watch == NULL) {
+                inotify_unlock();
+                log_debug("Memory cleanup lost it's place in the watch table");
+                break;
+            }
+        }
 
-    for (key = keys; key; key = key->next, ++total) {
+        for (; watch && batch->len < INOTIFY_MEMCLEAN_BATCH;
+             watch = watch_next(watch, NULL)) {
+            if ((watch->wd != -1)
+                && (watch_path(watch, buf, sizeof buf) != -1))
+                g_ptr_array_add(batch, g_strdup(buf));
+        }
 
-        char *path = key->data;
-        path[strlen(path)] = 0;
-        /* If the path does not start with at '/' then we've found a garbage
-         * path key. This is most likey because the inotify_path_to_watch hash
-         * was modified while the memcleanup routine was running. This is a
-         * little sloppy, but I'm just going to continue letting the cleanup
-         * run. This is bound to happen and the next time around will clean
-         * things up.
-         */
-        if (path[0] != '/')
-            continue;
+        while (watch && watch->wd == -1)
+            watch = watch_next(watch, NULL);
 
-        /* If the directory does not exist on disk or has become a garbage
-         * path that does not start with at slash (/), and is still in this
-         * list then we have a rogue watch that needs it's meta data blown
-         * away.
-         */
-        if (!is_a_dir(path)) {
+        if (watch && (watch_path(watch, buf, sizeof buf) != -1))
+            cursor = g_strdup(buf);
+
+        inotify_unlock();
 
-            watch = NULL;
-            void *t1, *t2;
-            pthread_mutex_lock(&inotify_mutex);
+        for (i = 0; i < batch->len; i++, ++total) {
+            path = g_ptr_array_index(batch, i);
 
-            if (g_hash_table_lookup_extended
-                (inotify_path_to_watch, path, &t1, &t2)) {
-                watch = g_hash_table_lookup(inotify_path_to_watch, path);
+            /* If the directory does not exist on disk, and is still
+             * in the watch table, then we have a rogue watch that
+             * needs it's meta data blown away.
+             */
+            if (is_a_dir(path)) {
+                g_free(path);
+                continue;
             }
 
+            inotify_lock();
+
+            watch = watch_lookup(path);
             if (watch == NULL) {
                 log_trace
                     ("In memclean routine, watcher for path '%s' is already freed",
                      path);
-                pthread_mutex_unlock(&inotify_mutex);
-                continue;
-            }
-
-            log_debug("Found rogue directory '%s'.", path);
-
-            ++count;
-
-            /* Clean up meta data mappings and tell inotify
-             * to stop watching the deleted dir.
-             */
-            inotify_rm_watch(inotify_fd, watch->wd);
+            } else {
+                log_debug("Found rogue directory '%s'.", path);
+                ++count;
 
-            if (g_hash_table_lookup_extended
-                (inotify_wd_to_watch, GINT_TO_POINTER(watch->wd), NULL,
-                 NULL)) {
-                g_hash_table_remove(inotify_wd_to_watch,
-                                    GINT_TO_POINTER(watch->wd));
+                /* Clean up meta data mappings and tell inotify
+                 * to stop watching the deleted dir.
+                 */
+                _unwatch(watch, watch->root->instance);
+                watch_remove(watch);
             }
 
-            if (g_hash_table_lookup_extended
-                (inotify_path_to_watch, path, NULL, NULL)) {
-                g_hash_table_remove(inotify_path_to_watch, path);
-            }
+            inotify_unlock();
+            g_free(path);
+        }
 
-            free(watch->path);
-            free(watch);
-            watch = NULL;
+        g_ptr_array_set_size(batch, 0);
 
-            pthread_mutex_unlock(&inotify_mutex);
-        }
+        if (cursor == NULL)
+            break;
     }
 
+    g_ptr_array_free(batch, TRUE);
+
     /* Log our results. */
     if (count > 0) {
         log_notice
@@ -1765,11 +3871,535 @@ static void *_inotify_memclean(void *thread_data)
                    (int) total);
     }
 
-    pthread_mutex_lock(&inotify_mutex);
+    inotify_lock();
 
-    g_list_free(keys);
     IN_MEMCLEAN = 0;
 
-    pthread_mutex_unlock(&inotify_mutex);
-    pthread_exit(NULL);
+    inotify_unlock();
+}
+
+/* Called when an instance's kernel queue has overflowed, which
+ * means events for any root on it may have been thrown away.
+ *
+ * Every root on the instance gets an IN_Q_OVERFLOW event in it's
+ * queue, so clients know they may have missed something, and is
+ * marked as possibly inconsistent until a rescan of it's tree (SEE:
+ * _inotify_rescan()) has caught up with whatever went missing.
+ *
+ * The caller must hold inotify_mutex.
+ */
+static void overflow_start(Instance * instance)
+{
+    int rv;
+    time_t since;
+    R_State *state;
+    GHashTableIter iter;
+    gpointer key, value;
+    Root *root;
+
+    /* Anything lost happened after the last batch we got from this
+     * instance. Back off another second since mtimes are only looked
+     * at to the second.
+     */
+    since = instance->drained - 1;
+
+    g_hash_table_iter_init(&iter, inotify_roots);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        root = (Root *) value;
+
+        if ((root->instance != instance) || (root->destroy != 0))
+            continue;
+
+        if (!root->pause) {
+            Event e = { -1, IN_Q_OVERFLOW, 0, 0, root->path, "", NULL,
+                NULL
+            };
+
+            rv = inotify_enqueue(root, &e);
+            if (rv != 0)
+                log_warn("Failed to queue overflow event for root '%s': %s",
+                         root->path, error_to_string(rv));
+        }
+
+        /* There's no watch table to rescan against for a root on
+         * fanotify, so the client is left to sort itself out.
+         */
+        if (instance->fanotify)
+            continue;
+
+        if ((root->rescan_since == 0) || (since < root->rescan_since))
+            root->rescan_since = since;
+
+        /* A rescan that's already running may have gone past
+         * things that have changed since, so have it go again.
+         */
+        if (root->rescanning) {
+            root->rescan_again = 1;
+            continue;
+        }
+
+        state = malloc(sizeof(R_State) + strlen(root->path) + 1);
+        if (state == NULL) {
+            log_error("Failed to allocate memory for rescan of '%s': %s",
+                      root->path, "inotify.c:overflow_start()");
+            continue;
+        }
+
+        state->cursor = NULL;
+        state->since = 0;
+        state->total = 0;
+        strcpy(state->root_path, root->path);
+
+        rv = pool_run(_inotify_rescan, state, root);
+        if (rv != 0) {
+            log_error("Failed to queue rescan of root '%s': %s",
+                      root->path, error_to_string(rv));
+            free(state);
+            continue;
+        }
+
+        log_notice("Rescanning root '%s' after an inotify queue overflow",
+                   root->path);
+
+        root->rescanning = 1;
+    }
+}
+
+/* Walk the watched tree of a root that may have lost events to an
+ * overflow, comparing each directory on disk with what the watch
+ * table last knew about it, and queue synthetic events for whatever
+ * changed (SEE: rescan_dir()).
+ *
+ * Each run looks at one batch, only holding inotify_mutex while
+ * collecting it, and then queues the next run with pool_run_later().
+ * Runs are spaced out to keep to overflow_rescan_rate directories a
+ * second, since an overflow usually means the box is busy enough
+ * already, and no thread sits idle in between. A big root could
+ * otherwise keep a thread to itself for hours.
+ *
+ * 'thread_data' is the rescan's R_State, which we own. The root is
+ * looked up again by path every time we need it, as it may be
+ * unwatched underneath us. Anything still queued when it is gets
+ * dropped by destroy_root().
+ */
+static void _inotify_rescan(void *thread_data)
+{
+    guint i, n;
+    int rv;
+    char buf[PATH_MAX], *read_buf;
+    GPtrArray *batch;
+    R_State *state;
+    R_Dir *dir;
+    Root *root;
+    Watch *top, *watch;
+
+    state = (R_State *) thread_data;
+    batch = g_ptr_array_sized_new(INOTIFY_RESCAN_BATCH);
+
+    read_buf = malloc(CRAWL_BUF_SIZE);
+    if (read_buf == NULL) {
+        log_error("Failed to allocate memory to rescan root '%s': %s",
+                  state->root_path, "inotify.c:_inotify_rescan()");
+        inotify_lock();
+        root = g_hash_table_lookup(inotify_roots, state->root_path);
+        if (root != NULL) {
+            root->rescanning = 0;
+            root->rescan_since = 0;
+        }
+        inotify_unlock();
+        g_ptr_array_free(batch, TRUE);
+        rescan_free(state);
+        return;
+    }
+
+    inotify_lock();
+
+    root = g_hash_table_lookup(inotify_roots, state->root_path);
+    top = watch_lookup(state->root_path);
+
+    if ((root == NULL) || (root->destroy != 0)) {
+        inotify_unlock();
+        g_ptr_array_free(batch, TRUE);
+        free(read_buf);
+        goto finished;
+    }
+
+    /* The last pass has finished, and we've waited out it's last
+     * batch. Go again if there was another overflow in the meantime,
+     * otherwise the root is back to being consistent.
+     */
+    if ((state->since != 0) && (state->cursor == NULL)) {
+        if (!root->rescan_again) {
+            root->rescanning = 0;
+            root->rescan_since = 0;
+            inotify_unlock();
+            g_ptr_array_free(batch, TRUE);
+            free(read_buf);
+            goto finished;
+        }
+
+        state->since = 0;
+    }
+
+    /* Starting a pass. Anything that overflows from here on has the
+     * next one go over it.
+     */
+    if (state->since == 0) {
+        state->since = root->rescan_since;
+        root->rescan_again = 0;
+    }
+
+    if (state->cursor == NULL) {
+        watch = top;
+    } else {
+        watch = watch_lookup(state->cursor);
+        g_free(state->cursor);
+        state->cursor = NULL;
+
+        /* Where we were going to pick up went away. Go on from the
+         * top again rather than miss the rest.
+         */
+        if (watch == NULL) {
+            log_debug("Rescan of '%s' lost it's place in the watch table",
+                      state->root_path);
+            watch = top;
+        }
+    }
+
+    for (; watch && batch->len < INOTIFY_RESCAN_BATCH;
+         watch = watch_next(watch, top)) {
+        if ((watch->wd == -1) || (watch->root != root))
+            continue;
+        if (watch_path(watch, buf, sizeof buf) == -1)
+            continue;
+
+        dir = malloc(sizeof(R_Dir) + strlen(buf) + 1);
+        if (dir == NULL)
+            break;
+
+        dir->mtime = watch->mtime;
+        dir->entries = watch->entries;
+        strcpy(dir->path, buf);
+        g_ptr_array_add(batch, dir);
+    }
+
+    while (watch && watch->wd == -1)
+        watch = watch_next(watch, top);
+
+    if (watch && (watch_path(watch, buf, sizeof buf) != -1))
+        state->cursor = g_strdup(buf);
+
+    inotify_unlock();
+
+    n = batch->len;
+    for (i = 0; i < n; i++, ++state->total) {
+        dir = g_ptr_array_index(batch, i);
+        rescan_dir(state->root_path, dir, state->since, read_buf);
+        free(dir);
+    }
+
+    g_ptr_array_free(batch, TRUE);
+    free(read_buf);
+
+    /* Queue the next run, even after the last batch, so the next
+     * pass (if there is one) keeps to the rate too.
+     *
+     * This is done holding inotify_mutex so the root can't be marked
+     * for destruction between checking and queueing, which would
+     * leave the next run queued after destroy_root() had already
+     * cancelled the rest.
+     */
+    inotify_lock();
+
+    root = g_hash_table_lookup(inotify_roots, state->root_path);
+    if ((root == NULL) || (root->destroy != 0)) {
+        inotify_unlock();
+        goto finished;
+    }
+
+    rv = pool_run_later(_inotify_rescan, state, root,
+                        (unsigned int) ((1000.0 * n) /
+                                        CONFIG->overflow_rescan_rate));
+    if (rv != 0) {
+        log_error("Failed to queue rescan of root '%s': %s",
+                  state->root_path, error_to_string(rv));
+        root->rescanning = 0;
+        root->rescan_since = 0;
+    }
+
+    inotify_unlock();
+
+    if (rv == 0)
+        return;
+
+  finished:
+    log_notice("Rescan of root '%s' looked at %d directories",
+               state->root_path, state->total);
+
+    rescan_free(state);
+}
+
+/* Free an overflow rescan's R_State, for _inotify_rescan() and for
+ * pool_cancel() when it's root is unwatched.
+ */
+static void rescan_free(void *data)
+{
+    R_State *state = (R_State *) data;
+
+    g_free(state->cursor);
+    free(state);
+}
+
+/* Look at a single directory during an overflow rescan.
+ *
+ * Without a copy of every directory listing there's no telling
+ * exactly what happened while events were being lost, so this
+ * makes a best guess from timestamps, anything changed at or after
+ * 'since' being suspect:
+ *
+ *  - If the directory itself has changed, entries have come or gone.
+ *    Files created since then are reported as IN_CREATE, and sub-
+ *    directories we don't have a watch on as IN_CREATE | IN_ISDIR
+ *    (and are watched). If there are fewer entries than before,
+ *    plus the ones we just called new, something was removed that
+ *    we can't name, which gets an IN_Q_OVERFLOW event for this
+ *    directory so the client knows to look for itself.
+ *  - Otherwise files with a new mtime get an IN_CLOSE_WRITE, and
+ *    ones with only a new ctime an IN_ATTRIB.
+ *  - A directory that no longer exists gets an IN_DELETE | IN_ISDIR
+ *    and is unwatched.
+ */
+static void rescan_dir(const char *root_path, const R_Dir * dir,
+                       time_t since, char *read_buf)
+{
+    int fd;
+    char *name, *parent;
+    struct stat dir_stat;
+    Watch *watch;
+    R_Read read;
+
+    fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        if ((errno != ENOENT) && (errno != ENOTDIR)) {
+            log_debug("Failed to open dir '%s' during rescan: %s",
+                      dir->path, strerror(errno));
+            return;
+        }
+
+        if (strcmp(dir->path, root_path) == 0) {
+            log_debug("Root '%s' went away during an overflow", root_path);
+            return;
+        }
+
+        parent = strdup(dir->path);
+        if (parent == NULL)
+            return;
+
+        name = strrchr(parent, '/');
+        *name++ = '\0';
+
+        rescan_event(root_path, IN_DELETE | IN_ISDIR,
+                     (*parent == '\0') ? "/" : parent, name);
+        free(parent);
+        return;
+    }
+
+    if (fstat(fd, &dir_stat) != 0) {
+        close(fd);
+        return;
+    }
+
+    read.root_path = root_path;
+    read.dir = dir;
+    read.since = since;
+    read.changed = (dir_stat.st_mtime >= since)
+        || ((uint32_t) dir_stat.st_mtime != dir->mtime);
+    read.entries = 0;
+    read.created = 0;
+
+    if (crawl_readdir(fd, read_buf, CRAWL_BUF_SIZE, 0, rescan_entry,
+                      &read) != 0) {
+        log_debug("Failed to read dir '%s' during rescan: %s", dir->path,
+                  strerror(errno));
+        close(fd);
+        return;
+    }
+
+    close(fd);
+
+    if (read.changed && (read.entries < dir->entries + read.created))
+        rescan_event(root_path, IN_Q_OVERFLOW, dir->path, "");
+
+    inotify_lock();
+
+    watch = watch_lookup(dir->path);
+    if (watch != NULL) {
+        watch->mtime = (uint32_t) dir_stat.st_mtime;
+        watch->entries = read.entries;
+    }
+
+    inotify_unlock();
+}
+
+/* One entry in the directory rescan_dir() is looking at. */
+static int rescan_entry(int fd, const char *name, unsigned char type,
+                        void *data)
+{
+    uint32_t mask;
+    mode_t mode;
+    time_t mtime, ctime, btime;
+    Watch *watch;
+    R_Read *read = data;
+    const char *dir_path = read->dir->path;
+
+    ++read->entries;
+
+    /* Subdirectories only matter if entries have come and gone, and
+     * where the file system tells us which they are there's no need
+     * to stat() them to find out.
+     */
+    if ((type == DT_DIR) && !read->changed)
+        return 0;
+
+    if (rescan_stat(fd, name, &mode, &mtime, &ctime, &btime) != 0)
+        return 0;
+
+    if (S_ISDIR(mode)) {
+        if (!read->changed)
+            return 0;
+
+        char path[PATH_MAX];
+        int rv = snprintf(path, sizeof path, "%s/%s",
+                          (strcmp(dir_path, "/") == 0) ? "" : dir_path,
+                          name);
+        if ((rv < 0) || (rv >= (int) sizeof path))
+            return 0;
+
+        inotify_lock();
+        watch = watch_lookup(path);
+        inotify_unlock();
+
+        if (watch == NULL) {
+            rescan_event(read->root_path, IN_CREATE | IN_ISDIR, dir_path,
+                         name);
+            ++read->created;
+        }
+        return 0;
+    }
+
+    if (read->changed && (btime >= read->since)) {
+        mask = IN_CREATE;
+        ++read->created;
+    } else if (mtime >= read->since) {
+        mask = IN_CLOSE_WRITE;
+    } else if (ctime >= read->since) {
+        mask = IN_ATTRIB;
+    } else {
+        return 0;
+    }
+
+    rescan_event(read->root_path, mask, dir_path, name);
+
+    return 0;
+}
+
+/* Queue a synthetic event found by rescan_dir(), and keep the
+ * watch table in step with it the same way inotify_handle_batch()
+ * would have for the real thing.
+ */
+static void rescan_event(const char *root_path, uint32_t mask,
+                         const char *path, const char *name)
+{
+    int rv;
+    char abs_path[PATH_MAX];
+    Root *root;
+    Watch *watch;
+
+    if (strcmp(path, "/") == 0)
+        rv = snprintf(abs_path, sizeof abs_path, "/%s", name);
+    else
+        rv = snprintf(abs_path, sizeof abs_path, "%s/%s", path, name);
+
+    if ((rv < 0) || (rv >= (int) sizeof abs_path))
+        return;
+
+    inotify_lock();
+
+    root = g_hash_table_lookup(inotify_roots, root_path);
+    if ((root == NULL) || (root->destroy != 0)) {
+        inotify_unlock();
+        return;
+    }
+
+    if (!(mask & IN_Q_OVERFLOW)
+        && (ignore_name(root->ignore, name, mask & IN_ISDIR)
+            || ignore_path(root->ignore, path, name, mask & IN_ISDIR))) {
+        inotify_unlock();
+        return;
+    }
+
+    log_trace("Rescan found mask:%u for '%s'", mask, abs_path);
+
+    if (mask == (IN_CREATE | IN_ISDIR)) {
+        rv = do_watch_tree(abs_path, root, CRAWL_NEW);
+        if (rv != 0)
+            log_error("Failed to watch dir '%s' found in rescan: %s",
+                      abs_path, error_to_string(rv));
+    } else if (mask == (IN_DELETE | IN_ISDIR)) {
+        watch = watch_lookup(abs_path);
+        if ((watch != NULL) && (watch->root == root))
+            unwatch_tree(watch);
+    }
+
+    if (!root->pause && ((mask & root->mask) || (mask & IN_Q_OVERFLOW))) {
+        Event e = {
+            -1, mask, 0, (*name == '\0') ? 0 : strlen(name) + 1,
+            (char *) path, (char *) name, NULL, NULL
+        };
+
+        rv = inotify_enqueue(root, &e);
+        if (rv != 0)
+            log_warn("Failed to queue rescan event for '%s': %s",
+                     abs_path, error_to_string(rv));
+    }
+
+    inotify_unlock();
+}
+
+/* lstat() 'name' in the directory open on 'fd' for rescan_dir().
+ *
+ * Where the kernel and file system can tell us when a file was
+ * created 'btime' is that, which is what lets a new file be told
+ * apart from one that was only written to. Otherwise it's the
+ * ctime, and anything touched in a changed directory looks new.
+ *
+ * Returns 0 (zero) on success, or -1 on error.
+ */
+static int rescan_stat(int fd, const char *name, mode_t * mode,
+                       time_t * mtime, time_t * ctime, time_t * btime)
+{
+#ifdef STATX_BTIME
+    struct statx stx;
+
+    if (statx(fd, name, AT_SYMLINK_NOFOLLOW,
+              STATX_BASIC_STATS | STATX_BTIME, &stx) != 0)
+        return -1;
+
+    *mode = stx.stx_mode;
+    *mtime = stx.stx_mtime.tv_sec;
+    *ctime = stx.stx_ctime.tv_sec;
+    *btime = (stx.stx_mask & STATX_BTIME) ? stx.stx_btime.tv_sec : *ctime;
+#else
+    struct stat stat_buf;
+
+    if (fstatat(fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+
+    *mode = stat_buf.st_mode;
+    *mtime = stat_buf.st_mtime;
+    *ctime = stat_buf.st_ctime;
+    *btime = stat_buf.st_ctime;
+#endif
+
+    return 0;
 }
@@ -30,8 +30,10 @@
 #define _INOTISPY_INOTIFY_H_
 
 #include <stdint.h>
+#include <time.h>
 #include <glib/ghash.h>
-#include <glib/gqueue.h>
+#include "ring.h"
+#include "ignore.h"
 #include <sys/inotify.h>
 
 #define INOTIFY_ROOT_DUMP_DIR  "/var/run/inotispy"
@@ -40,6 +42,17 @@
 #define INOTIFY_EVENT_BUF_LEN  ( 1024 * ( INOTIFY_EVENT_SIZE + 16 ) )
 #define INOTIFY_MAX_EVENTS     65536    /* This number is arbatrary */
 #define INOTIFY_MEMCLEAN_FREQ  600
+#define INOTIFY_MEMCLEAN_BATCH 1024
+#define INOTIFY_UNWATCH_BATCH  1024
+#define INOTIFY_QUEUE_MIN_SIZE ( 16 * 1024 )
+#define INOTIFY_MOVE_PAIR_WINDOW   100  /* milliseconds */
+#define INOTIFY_RESCAN_BATCH   256
+#define INOTIFY_RESCAN_RATE    2000     /* directories per second */
+#define INOTIFY_INGEST_RING_SIZE   ( 8 * 1024 * 1024 )
+#define INOTIFY_INGEST_STALL_USEC  1000
+#define INOTIFY_INGEST_MAX_READY   64
+#define INOTIFY_HELD_MAX           4096 /* per instance */
+#define INOTIFY_DEFAULT_INSTANCE   "default"
 #define INOTIFY_DEFAULT_MASK   ( \
         IN_ATTRIB              | \
         IN_MOVED_FROM          | \
@@ -51,28 +64,186 @@
         IN_DONT_FOLLOW           \
     )
 
+/* Per root options, SEE: inotify_watch_tree(). */
+#define INOTIFY_ROOT_COALESCE      0x1
+#define INOTIFY_ROOT_PAIR_MOVES    0x2
+
+/* How far the crawl that sets up a new root's watches has got, SEE:
+ * inotify_get_crawl_stats(). Until it's complete events in the parts
+ * of the tree it hasn't reached yet are missed.
+ */
+#define INOTIFY_CRAWL_QUEUED       0
+#define INOTIFY_CRAWL_CRAWLING     1
+#define INOTIFY_CRAWL_COMPLETE     2
+
+/* Queued, with the root's path, once a root's crawl is complete and
+ * everything under it is being watched. This isn't a real inotify
+ * event, so it's one of the bits the kernel doesn't use for one.
+ */
+#define IN_CRAWL_COMPLETE  0x00010000
+
 #ifndef _INOTISPY_INOTIFY_H_META_
 #define _INOTISPY_INOTIFY_H_META_
 
 typedef struct inotify_event IN_Event;
 
+/* Table of watch descriptor -> watch for one inotify instance
+ * (SEE: wd_table_get() in watch.h).
+ *
+ * Watch descriptors are small integers, so this is an array indexed
+ * by wd rather than a hash. The kernel hands out wds in increasing
+ * order and doesn't reuse them until it wraps, so on a busy box the
+ * live wds slowly spread out over a wide range. The array is split
+ * into pages that are only allocated while they hold a live watch,
+ * which keeps the memory used proportional to the number of watches
+ * and not to the highest wd ever seen.
+ *
+ * Every slot also records the generation of the instance at the
+ * time the watch was added. Events read from the kernel before that
+ * can't belong to this watch, even if they carry the same wd.
+ */
+#define WD_PAGE_SHIFT  10
+#define WD_PAGE_SIZE   ( 1 << WD_PAGE_SHIFT )
+
+typedef struct wd_slot {
+    struct inotify_watch *watch;
+    uint32_t gen;
+} WdSlot;
+
+typedef struct wd_page {
+    WdSlot slots[WD_PAGE_SIZE];
+    int used;
+} WdPage;
+
+typedef struct wd_table {
+    WdPage **pages;
+    int num_pages;
+    int count;
+} WdTable;
+
+/* An inotify instance, i.e. one inotify file descriptor and
+ * the kernel event queue that goes along with it.
+ *
+ * By default every root shares the same instance, which means
+ * they also share the kernel's queue of max_queued_events. A
+ * single root churning through a huge 'rm -rf' can then overflow
+ * that queue for everyone. Roots can instead be given their own
+ * instance (SEE: inotify_instance_per_root in inotispy.conf) or
+ * be grouped into named instances at watch time, so that overflow
+ * and drain rate are isolated per root or per group.
+ *
+ * Watch descriptors are only unique within an instance, which is
+ * why the wd -> watch table lives here rather than being global.
+ */
+typedef struct inotify_instance {
+    int id;
+    int fd;
+    char *name;
+    int refs;                   /* Number of roots using this instance */
+    uint32_t gen;               /* Bumped before every inotify_add_watch() */
+    WdTable wds;
+    unsigned long events;
+    unsigned long batches;
+    unsigned long overflows;
+    time_t drained;             /* When a batch was last handled */
+    int fanotify;               /* This is the fanotify group */
+    int adding;                 /* Crawl batches adding watches */
+    GPtrArray *held;            /* Events waiting on those watches */
+    int roots;                  /* Roots watched through it */
+    const Ignore *ignore;       /* Their ignore rules, if only one */
+} Instance;
+
 /* Meta data for the root of each watched tree. */
 typedef struct inotify_root {
     char *path;
     uint32_t mask;
     int max_events;
-    GQueue *queue;
+    Ring queue;                 /* Event_Record arena */
+    int queue_len;              /* Number of records in 'queue' */
+    GHashTable *queue_index;    /* Queued records by path, if coalescing */
+    int pair_moves;
+    Ignore *ignore;             /* SEE: ignore.h */
+    Instance *instance;
     int destroy;
     int pause;
+    int publish;                /* Events go out on the PUB socket */
     int rewatch;
     int persist;                /* Future feature */
+    time_t rescan_since;        /* Non-zero while possibly inconsistent */
+    int rescanning;
+    int rescan_again;
+    int crawls;                 /* Crawls not yet done with the root */
+    int crawl_state;            /* INOTIFY_CRAWL_* */
+    unsigned long crawl_found;  /* Directories the crawl has found, */
+    unsigned long crawl_dirs;   /* and how many of them it's watched */
+    long long crawl_start;      /* now_usec() */
+    double crawl_secs;          /* How long it took, once complete */
 } Root;
 
+/* A node in the watch table (SEE: watch.h). There is one of these
+ * for every watched directory, plus the unwatched directories
+ * between '/' and each root.
+ *
+ * Every watch points straight back at the root it belongs to,
+ * so an event can be matched to its root without searching. The
+ * one exception is a detached tree (SEE: watch_detach()), which
+ * may still be being unwatched after its root has been freed, so
+ * its root pointers must not be followed.
+ */
 typedef struct inotify_watch {
-    int wd;
-    char *path;
+    Root *root;
+    struct inotify_watch *parent;
+    struct inotify_watch *child;        /* First child */
+    struct inotify_watch *prev; /* Siblings */
+    struct inotify_watch *next;
+    struct inotify_watch *hnext;        /* Watch table hash chain */
+    uint32_t mtime;             /* Directory mtime and number of */
+    uint32_t entries;           /* entries when last looked at */
+    int wd;                     /* -1 if not watched */
+    char name[];                /* Last component of the path only */
 } Watch;
 
+/* Point in time copy of an instance's counters, SEE:
+ * inotify_get_instance_stats().
+ */
+typedef struct inotify_instance_stats {
+    char *name;
+    int roots;
+    int watches;
+    unsigned long events;
+    unsigned long overflows;
+} InstanceStats;
+
+/* Point in time copy of how a root's crawl is getting on, SEE:
+ * inotify_get_crawl_stats(). 'eta' is how many more seconds it should
+ * take to get to every directory found so far, or -1 if there's no
+ * telling yet. The crawl may of course find more on the way.
+ */
+typedef struct inotify_crawl_stats {
+    char *path;
+    int state;                  /* INOTIFY_CRAWL_* */
+    unsigned long dirs;
+    unsigned long found;
+    double secs;
+    double dirs_per_sec;
+    double eta;
+} CrawlStats;
+
+/* How long one of our locks has been held for, SEE:
+ * inotify_get_lock_stats(). Holds are counted in power of two
+ * buckets: hold_us[0] are those under 1us, hold_us[i] those under
+ * 2^i us, and the last bucket gets everything longer.
+ */
+#define INOTIFY_LOCK_BUCKETS 16
+
+typedef struct inotify_lock_stats {
+    const char *name;
+    unsigned long holds;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned long hold_us[INOTIFY_LOCK_BUCKETS];
+} LockStats;
+
 /* Event queue node. This is identical to the inotify_event
  * struct (SEE: man inotify) plus one more field for the
  * path of the event. The inotify_event struct is:
@@ -92,17 +263,33 @@ typedef struct inotify_queue_node {
     uint32_t len;
     char *path;
     char *name;
+    char *old_path;             /* Only set for a paired move */
+    char *old_name;
 } Event;
 
-/* Global inotify file descriptor. This daemon will
- * only ever need one of these.
+/* How an event sits in its root's queue, which is one contiguous
+ * ring buffer per root rather than a list of separately allocated
+ * Events. The path, name, old path and old name follow the record,
+ * each with its terminating NUL, and the whole thing is copied in
+ * with a single memcpy() per string (SEE: inotify_enqueue()). The
+ * old path is empty unless the record is a paired move.
  */
-int inotify_fd;
+typedef struct inotify_event_record {
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    uint32_t len;
+    uint32_t path_len;
+    uint32_t name_len;
+    uint32_t old_path_len;
+    uint32_t old_name_len;
+    char data[];                /* path '\0' name '\0' old_path '\0' old_name '\0' */
+} Event_Record;
 
 /* Running tally of watched roots. */
 int inotify_num_watched_roots;
 
-/* Global hashs for mapping the inotify related meta data.
+/* Global tables for mapping the inotify related meta data.
  * 
  * - inotify_roots
  * 
@@ -110,9 +297,9 @@ int inotify_num_watched_roots;
  *   information. Meta data that applies to the entire tree
  *   starting at a given root will stored in this hash.
  * 
- * - inotify_wd_to_watch
+ * - Instance::wds
  * 
- *   The data in this hash is used to construt absolute paths
+ *   The data in this table is used to construt absolute paths
  *   for the events that occur.
  * 
  *   Inotify unfortunatly leaves it up to you to do anything
@@ -133,40 +320,86 @@ int inotify_num_watched_roots;
  *        name = "foo.txt";
  *     }
  * 
- *   To get the full path we look up key '1' in inotify_wd_to_watch
- *   to get the value 'a/b/c', then we concatinate it with the
- *   name 'foo.txt' and bam we have the absolute path for the event.
- * 
- *   XXX: This does not scale well. If you watch a giant tree
- *        then lots of memory will be used up. This is a sad, but
- *        very real, reality.
+ *   To get the full path we look up slot '1' in the wd table
+ *   of the instance the event came from to get the watch for
+ *   '/a/b/c', then we concatinate it's path with the name 'foo.txt'
+ *   and bam we have the absolute path for the event.
  * 
- * - inotify_path_to_watch
+ * - The watch table (SEE: watch.h)
  * 
  *   On the flip side if we want to UN-watch a directory or
  *   directory tree we're going to have to know the integer watch
  *   descriptor value for that directory because that's what the
- *   funtion inotify_rm_watch() requires as an argument. This
- *   hash let's us take an absolute path and look up it's watch
- *   descriptor.
+ *   funtion inotify_rm_watch() requires as an argument. The watch
+ *   table let's us take an absolute path and look up it's watch.
+ * 
+ *   Watches used to be kept in a hash keyed by absolute path, with
+ *   a second copy of the path in each watch, which did not scale
+ *   to giant trees. The table instead stores each directory as a
+ *   tree node holding only its own name, and rebuilds full paths
+ *   when they're needed.
  */
 GHashTable *inotify_roots;
-GHashTable *inotify_wd_to_watch;
-GHashTable *inotify_path_to_watch;
 
 #endif /*_INOTIOFY_H_META_*/
 
-/* Initialize */
+/* Initialize. Returns the file descriptor the main loop
+ * should poll on for new events.
+ */
 int inotify_setup(void);
 
-/* Verify is a path is a currently watched root */
+/* Verify is a path is a currently watched root. The caller must
+ * hold inotify_mutex, and can only use the root while it does, so
+ * this is for inotify.c's own use.
+ */
 Root *inotify_is_root(const char *path);
 
-/* Event handler for new inotify alerts. */
+/* Same again, for everyone else: 1 if 'path' is a watched root
+ * that isn't being destroyed, 0 otherwise.
+ */
+int inotify_is_watched(const char *path);
+
+/* Event handler for new inotify alerts. This processes every
+ * batch of raw events the ingest thread has read off of the
+ * kernel's queue since the last call.
+ */
 void inotify_handle_event(void);
 
-/* Recursively watch a directory tree */
-int inotify_watch_tree(char *path, int mask, int max_events, int rewatch);
+/* Drain statistics for inotify_handle_event(). The log function
+ * is called periodically from the main loop and closes out the
+ * current measurement window; the get function returns the
+ * values from the last closed window.
+ */
+void inotify_log_drain_stats(void);
+void inotify_get_drain_stats(double *events_per_batch,
+                             double *batches_per_sec);
+
+/* Timer support for the main loop. inotify_timeout() returns how
+ * long (in microseconds, for zmq_poll()) until inotify_tick() has
+ * work to do, or -1 if there's nothing pending. inotify_tick()
+ * should be called every time around the loop.
+ */
+long inotify_timeout(void);
+void inotify_tick(void);
+
+/* Recursively watch a directory tree. If 'instance' is not NULL
+ * the root is attached to the named inotify instance, which is
+ * created if it doesn't exist yet.
+ *
+ * 'flags' is any of:
+ *
+ *   INOTIFY_ROOT_COALESCE   - An event for a path that already has
+ *                             one queued is merged into it instead
+ *                             of being queued separately.
+ *   INOTIFY_ROOT_PAIR_MOVES - The two halves of a rename are queued
+ *                             as a single move event.
+ *
+ * 'ignore' is a NULL terminated list of patterns for files and
+ * directories under the root that no events should be queued for
+ * (SEE: ignore.h). It may be NULL, and is copied.
+ */
+int inotify_watch_tree(char *path, int mask, int max_events, int rewatch,
+                       int flags, const char *instance, char **ignore);
 
 /* Recursively UN-watch a directory tree. */
 int inotify_unwatch_tree(char *path);
@@ -175,13 +408,34 @@ int inotify_unwatch_tree(char *path);
 int inotify_pause_tree(char *path);
 int inotify_unpause_tree(char *path);
 
+/* Turn publishing of a root's events on or off. While it's on,
+ * everything queued for the root is handed to the PUB socket
+ * instead of waiting for a client to ask for it with 'get_events'
+ * (SEE: zmq_publish() in zeromq.h).
+ */
+int inotify_publish_tree(char *path, int publish);
+
+/* Get a NULL terminated list of the paths of published roots that
+ * have had events queued since the last call, or NULL if none
+ * have. Free it with g_strfreev().
+ */
+char **inotify_get_publish_roots(void);
+
 /* Get (and free) a list of all the currently watched roots. */
 char **inotify_get_roots(void);
 void inotify_free_roots(char **roots);
 
-/* Free up an event buffer. */
+/* Free up an event buffer. The events and their strings all live
+ * in the one allocation, so this is a single free().
+ */
 void inotify_free_events(Event ** events);
 
+/* Number of events currently queued for the root at 'path', or -1
+ * if it isn't a watched root. A root that's being destroyed has
+ * none.
+ */
+int inotify_queue_size(const char *path);
+
 /* Functions for retrieving queued events */
 Event **inotify_get_event(const char *path);
 Event **inotify_get_events(const char *path, int count);
@@ -194,6 +448,22 @@ void inotify_dump_roots(void);
 /* Get the total number of current inotify watches. */
 int inotify_num_watched_dirs(void);
 
+/* Get (and free) a copy of the counters for every inotify instance. */
+InstanceStats *inotify_get_instance_stats(int *count);
+void inotify_free_instance_stats(InstanceStats * stats, int count);
+
+/* Get (and free) a copy of how the crawl of the root at 'path', or
+ * of every root if 'path' is NULL, is getting on. Returns NULL, with
+ * 'count' set to 0 (zero), if there is no such root.
+ */
+CrawlStats *inotify_get_crawl_stats(const char *path, int *count);
+void inotify_free_crawl_stats(CrawlStats * stats, int count);
+
+/* Copy the hold time counters for up to 'max' of our locks into
+ * 'stats'. Returns how many were copied.
+ */
+int inotify_get_lock_stats(LockStats * stats, int max);
+
 /* Clean up stuff... */
 void inotify_cleanup(void);
 void inotify_memclean(void);
@@ -88,14 +88,17 @@ char *level_str(int level)
     }
 }
 
-static char *time_str(void)
+/* Log messages come from the worker, crawler and pool threads as
+ * well as the main loop, so the time is formatted into the caller's
+ * buffer (of at least 26 bytes) instead of ctime()'s static one.
+ */
+static char *time_str(char *t_str)
 {
     int len;
     time_t t;
-    char *t_str;
 
     t = time(NULL);
-    t_str = ctime(&t);
+    ctime_r(&t, t_str);
     len = strlen(t_str) - 1;
 
     /* Remove potential newline */
@@ -108,7 +111,7 @@ static char *time_str(void)
 static void log_msg(int level, const char *fmt, va_list ap)
 {
     int rv;
-    char *msg;
+    char *msg, t_str[32];
 
     if (level > log_level)
         return;
@@ -120,8 +123,8 @@ static void log_msg(int level, const char *fmt, va_list ap)
     }
 
     if (CONFIG->logging_enabled) {
-        fprintf(logger, "[%s] [%s] %s\n", time_str(), level_str(level),
-                msg);
+        fprintf(logger, "[%s] [%s] %s\n", time_str(t_str),
+                level_str(level), msg);
         fflush(logger);
     }
 
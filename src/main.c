@@ -79,6 +79,7 @@ static int daemon_mode;
 /* Funcion decls. */
 static void print_help_and_exit(void);
 static void alarm_handler(void);
+static long loop_timeout(void);
 static void sig_handler(int sig);
 static void write_pid();
 static void check_pid();
@@ -88,8 +89,7 @@ static void print_version_and_exit(void);
 
 int main(int argc, char **argv)
 {
-    int pid, c, rv, inotify_fd;
-    void *zmq_receiver;
+    int pid, c, rv, ingest_fd;
     struct utsname u_name;
     int option_index;
     int silent, help;
@@ -97,7 +97,7 @@ int main(int argc, char **argv)
 
     start_time = time(NULL);    /* start_time is in config.h */
 
-    zmq_pollitem_t items[2];
+    zmq_pollitem_t items[1];
 
     /* Make sure we're on linux. */
     rv = uname(&u_name);
@@ -189,22 +189,22 @@ int main(int argc, char **argv)
 
     log_notice("Initializing daemon");
 
-    inotify_fd = inotify_setup();
-    assert(inotify_fd > 0);
+    ingest_fd = inotify_setup();
+    assert(ingest_fd > 0);
 
-    zmq_receiver = zmq_setup();
-    if (zmq_receiver == NULL) {
+    if (zmq_setup() == NULL) {
         fprintf(stderr,
                 "Failed to start Inotispy. Please see the log file for details\n");
         return EXIT_FAILURE;
     }
 
     items[0].socket = NULL;
-    items[0].fd = inotify_fd;
+    items[0].fd = ingest_fd;
     items[0].events = ZMQ_POLLIN;
 
-    items[1].socket = zmq_receiver;
-    items[1].events = ZMQ_POLLIN;
+    /* Client requests are handled on the ZeroMQ worker threads
+     * (SEE: zmq_setup()), so all the main loop waits on is inotify.
+     */
 
     log_debug("Entering event loop...");
 
@@ -214,7 +214,11 @@ int main(int argc, char **argv)
 
     while (1) {
 
-        rv = zmq_poll(items, 2, -1);
+        /* Wake up in time for anything inotify has pending (held
+         * move events) or the next periodic timer, or sleep until
+         * there's something to do.
+         */
+        rv = zmq_poll(items, 1, loop_timeout());
         if ((rv == -1) && (errno != EINTR)) {
             log_error("Failed to call zmq_poll(): %d: %s", errno,
                       strerror(errno));
@@ -239,12 +243,39 @@ int main(int argc, char **argv)
             inotify_handle_event();
         }
 
-        if (items[1].revents & ZMQ_POLLIN) {
-            zmq_handle_event();
-        }
+        inotify_tick();
+
+        /* Push out anything queued for published roots. */
+        zmq_publish();
     }
 }
 
+/* How long the main loop may sleep for (in microseconds, for
+ * zmq_poll()). Client requests don't go through the main loop any
+ * more, so on a quiet filesystem nothing else wakes it up in time
+ * for the periodic timers.
+ */
+static long loop_timeout(void)
+{
+    long timeout, pending;
+    time_t now, next;
+
+    /* The timers fire once they're strictly past due, hence the +1. */
+    next = alarm_timer + ALARM_TIMEOUT + 1;
+    if ((CONFIG->memclean_freq > 0)
+        && (memclean_timer + CONFIG->memclean_freq + 1 < next))
+        next = memclean_timer + CONFIG->memclean_freq + 1;
+
+    now = time(NULL);
+    timeout = (next > now) ? (long) (next - now) * 1000000L : 0;
+
+    pending = inotify_timeout();
+    if ((pending != -1) && (pending < timeout))
+        timeout = pending;
+
+    return timeout;
+}
+
 static void check_pid(void)
 {
     DIR *d;
@@ -388,6 +419,9 @@ static void alarm_handler(void)
     /* Dump rewatch roots. */
     inotify_dump_roots();
 
+    /* Close out the current inotify drain statistics window. */
+    inotify_log_drain_stats();
+
     /* Handle updates to config file. */
     if (config_has_an_update()) {
         if (reload_config() != 0) {
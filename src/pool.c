@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "log.h"
+#include "reply.h"
+#include "pool.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct pool_task {
+    Pool_Func func;
+    void *data;
+    const void *owner;
+    uint64_t due;               /* For delayed tasks, in usecs */
+    struct pool_task *next;
+} Task;
+
+typedef struct pool_list {
+    Task *head;
+    Task *tail;
+} List;
+
+/* There are three queues. Threads take from pool_first while there
+ * is anything in it, and from pool_ready otherwise. Delayed tasks sit
+ * in pool_later, soonest first, and are moved to the end of
+ * pool_ready once they are due.
+ *
+ * All of them, and everything else here, are guarded by pool_mutex.
+ * Idle threads wait on pool_cond, which uses CLOCK_MONOTONIC so a
+ * change to the wall clock doesn't hold up or hurry a delayed task.
+ */
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond;
+static List pool_first = { NULL, NULL };
+static List pool_ready = { NULL, NULL };
+static List pool_later = { NULL, NULL };
+static Pool_Stats pool_stats;
+
+static uint64_t pool_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static void list_push(List * list, Task * task)
+{
+    task->next = NULL;
+    if (list->tail != NULL)
+        list->tail->next = task;
+    else
+        list->head = task;
+    list->tail = task;
+}
+
+static Task *list_pop(List * list)
+{
+    Task *task = list->head;
+
+    list->head = task->next;
+    if (list->head == NULL)
+        list->tail = NULL;
+
+    return task;
+}
+
+/* Move every task in 'list' that 'owner' queued onto 'dropped', and
+ * return how many there were.
+ */
+static int list_cancel(List * list, const void *owner, Task ** dropped)
+{
+    int n = 0;
+    Task *task, *prev = NULL, *next;
+
+    for (task = list->head; task != NULL; task = next) {
+        next = task->next;
+
+        if (task->owner != owner) {
+            prev = task;
+            continue;
+        }
+
+        if (prev != NULL)
+            prev->next = next;
+        else
+            list->head = next;
+        if (list->tail == task)
+            list->tail = prev;
+
+        task->next = *dropped;
+        *dropped = task;
+        ++n;
+    }
+
+    return n;
+}
+
+static void *_pool_worker(void *thread_data)
+{
+    Task *task;
+    uint64_t now;
+    struct timespec ts;
+
+    thread_data = NULL;
+
+    for (;;) {
+        pthread_mutex_lock(&pool_mutex);
+
+        for (;;) {
+            now = pool_now();
+            while ((pool_later.head != NULL)
+                   && (pool_later.head->due <= now)) {
+                list_push(&pool_ready, list_pop(&pool_later));
+                --pool_stats.delayed;
+                ++pool_stats.queued;
+            }
+
+            if ((pool_first.head != NULL) || (pool_ready.head != NULL))
+                break;
+
+            if (pool_later.head == NULL) {
+                pthread_cond_wait(&pool_cond, &pool_mutex);
+            } else {
+                ts.tv_sec = pool_later.head->due / 1000000;
+                ts.tv_nsec = (pool_later.head->due % 1000000) * 1000;
+                pthread_cond_timedwait(&pool_cond, &pool_mutex, &ts);
+            }
+        }
+
+        if (pool_first.head != NULL)
+            task = list_pop(&pool_first);
+        else
+            task = list_pop(&pool_ready);
+
+        --pool_stats.queued;
+        ++pool_stats.busy;
+
+        pthread_mutex_unlock(&pool_mutex);
+
+        task->func(task->data);
+        free(task);
+
+        pthread_mutex_lock(&pool_mutex);
+        --pool_stats.busy;
+        ++pool_stats.run;
+        pthread_mutex_unlock(&pool_mutex);
+    }
+
+    return NULL;
+}
+
+int pool_init(int num_threads)
+{
+    int i, rv;
+    pthread_t t;
+    pthread_attr_t attr;
+    pthread_condattr_t cattr;
+
+    if (num_threads <= 0)
+        num_threads = POOL_THREADS;
+    if (num_threads > POOL_MAX_THREADS)
+        num_threads = POOL_MAX_THREADS;
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    /* Initialize thread attribute to automatically detach */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    for (i = 0; i < num_threads; i++) {
+        rv = pthread_create(&t, &attr, _pool_worker, NULL);
+        if (rv) {
+            log_error("Failed to create background thread: %d", rv);
+            break;
+        }
+
+        ++pool_stats.threads;
+    }
+
+    pthread_attr_destroy(&attr);
+
+    if (pool_stats.threads == 0)
+        return -1;
+
+    log_debug("Started %d background threads", pool_stats.threads);
+
+    return 0;
+}
+
+static Task *task_new(Pool_Func func, void *data, const void *owner,
+                      const char *caller)
+{
+    Task *task;
+
+    task = malloc(sizeof(Task));
+    if (task == NULL) {
+        log_error("Failed to allocate memory for background task: %s",
+                  caller);
+        return NULL;
+    }
+
+    task->func = func;
+    task->data = data;
+    task->owner = owner;
+    task->due = 0;
+    task->next = NULL;
+
+    return task;
+}
+
+static int pool_queue(List * list, Pool_Func func, void *data,
+                      const void *owner, const char *caller)
+{
+    Task *task;
+
+    if (pool_stats.threads == 0)
+        return ERROR_FAILED_TO_CREATE_NEW_THREAD;
+
+    task = task_new(func, data, owner, caller);
+    if (task == NULL)
+        return ERROR_MEMORY_ALLOCATION;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    list_push(list, task);
+
+    if (++pool_stats.queued > pool_stats.max_queued)
+        pool_stats.max_queued = pool_stats.queued;
+
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    return 0;
+}
+
+int pool_run(Pool_Func func, void *data, const void *owner)
+{
+    return pool_queue(&pool_ready, func, data, owner, "pool.c:pool_run()");
+}
+
+int pool_run_first(Pool_Func func, void *data, const void *owner)
+{
+    return pool_queue(&pool_first, func, data, owner,
+                      "pool.c:pool_run_first()");
+}
+
+int pool_run_later(Pool_Func func, void *data, const void *owner,
+                   unsigned int msecs)
+{
+    Task *task, *prev = NULL, *at;
+
+    if (pool_stats.threads == 0)
+        return ERROR_FAILED_TO_CREATE_NEW_THREAD;
+
+    task = task_new(func, data, owner, "pool.c:pool_run_later()");
+    if (task == NULL)
+        return ERROR_MEMORY_ALLOCATION;
+
+    task->due = pool_now() + ((uint64_t) msecs * 1000);
+
+    pthread_mutex_lock(&pool_mutex);
+
+    /* Keep pool_later soonest first. Tasks due at the same time stay
+     * in the order they were queued.
+     */
+    for (at = pool_later.head; at != NULL; at = at->next) {
+        if (at->due > task->due)
+            break;
+        prev = at;
+    }
+
+    task->next = at;
+    if (prev != NULL)
+        prev->next = task;
+    else
+        pool_later.head = task;
+    if (at == NULL)
+        pool_later.tail = task;
+
+    ++pool_stats.delayed;
+
+    /* An idle thread may be waiting for a later task than this one. */
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    return 0;
+}
+
+int pool_cancel(const void *owner, Pool_Func discard)
+{
+    int n, delayed;
+    Task *task, *next, *dropped = NULL;
+
+    if (owner == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pool_mutex);
+
+    n = list_cancel(&pool_first, owner, &dropped);
+    n += list_cancel(&pool_ready, owner, &dropped);
+    delayed = list_cancel(&pool_later, owner, &dropped);
+
+    pool_stats.queued -= n;
+    pool_stats.delayed -= delayed;
+    n += delayed;
+    pool_stats.cancelled += n;
+
+    pthread_mutex_unlock(&pool_mutex);
+
+    /* Free them without holding the lock. */
+    for (task = dropped; task != NULL; task = next) {
+        next = task->next;
+        if (discard != NULL)
+            discard(task->data);
+        free(task);
+    }
+
+    return n;
+}
+
+void pool_get_stats(Pool_Stats * stats)
+{
+    pthread_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_POOL_H_
+#define _INOTISPY_POOL_H_
+
+/* Default number of background threads (SEE: pool_threads in
+ * inotispy.conf).
+ */
+#define POOL_THREADS      4
+#define POOL_MAX_THREADS  64
+
+/* A fixed pool of threads for the background work that doesn't go
+ * through the crawler (SEE: crawl.h): destroying roots, unwatching
+ * big trees, memory cleanups and overflow rescans.
+ *
+ * Tasks are run in the order they were queued, at most one per
+ * thread at a time, so no matter how much is asked for at once there
+ * are never more than that many threads competing for inotify_mutex.
+ * Anything that has to wait for a thread just sits in the queue.
+ *
+ * Since a task has a thread to itself until it returns, nothing that
+ * takes a long time should run as one task. Work that goes at a
+ * limited rate (an overflow rescan, say) should do a bit at a time
+ * and queue the rest with pool_run_later(), rather than sleep on the
+ * thread. Tasks that something else is waiting on (tearing a root
+ * down) go ahead of the rest with pool_run_first().
+ *
+ * A task can be queued on behalf of an 'owner' (a root, say), so
+ * that if the owner goes away whatever it still has waiting can be
+ * dropped with pool_cancel() rather than run for nothing.
+ */
+typedef void (*Pool_Func) (void *data);
+
+/* Point in time copy of the pool's counters, SEE: pool_get_stats(). */
+typedef struct pool_stats {
+    int threads;
+    int busy;                   /* Threads running a task right now */
+    int queued;                 /* Tasks waiting for a thread */
+    int delayed;                /* and for their time to come */
+    int max_queued;             /* The most there have ever been */
+    unsigned long run;          /* Tasks run so far */
+    unsigned long cancelled;    /* and dropped with pool_cancel() */
+} Pool_Stats;
+
+/* Start the pool's threads. Returns 0 (zero) on success. */
+int pool_init(int num_threads);
+
+/* Queue 'func' to be called with 'data' on one of the pool's
+ * threads. 'owner' may be NULL.
+ *
+ * Returns 0 (zero) on success, or an ERROR_* code.
+ */
+int pool_run(Pool_Func func, void *data, const void *owner);
+
+/* The same, but ahead of everything queued with pool_run() and
+ * pool_run_later(). Tasks queued with this run in the order they
+ * were queued.
+ */
+int pool_run_first(Pool_Func func, void *data, const void *owner);
+
+/* The same as pool_run(), but the task isn't queued until 'msecs'
+ * milliseconds from now. No thread is tied up in the meantime.
+ */
+int pool_run_later(Pool_Func func, void *data, const void *owner,
+                   unsigned int msecs);
+
+/* Drop every task 'owner' still has waiting in the queue, delayed
+ * ones included. Tasks that are already running are left to finish.
+ * If 'discard' isn't NULL it's called with the data of each task
+ * dropped, to free it.
+ *
+ * Returns the number of tasks dropped.
+ */
+int pool_cancel(const void *owner, Pool_Func discard);
+
+void pool_get_stats(Pool_Stats * stats);
+
+#endif /*_INOTISPY_POOL_H_*/
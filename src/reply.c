@@ -38,17 +38,19 @@
 int reply_send_message(const char *message)
 {
     int rv;
+    size_t len;
     zmq_msg_t msg;
 
-    rv = zmq_msg_init_size(&msg, strlen(message));
+    len = strlen(message);
+    rv = zmq_msg_init_size(&msg, len);
     if (rv != 0) {
         log_error("Failed to initialize message '%s': %s (%d)",
                   message, zmq_strerror(errno), errno);
         return 1;
     }
 
-    strncpy(zmq_msg_data(&msg), message, strlen(message));
-    rv = zmq_send(zmq_listener, &msg, ZMQ_NOBLOCK);
+    memcpy(zmq_msg_data(&msg), message, len);
+    rv = zmq_send(zmq_reply_socket, &msg, ZMQ_NOBLOCK);
 
     if (rv != 0) {
         log_error("Failed to send message '%s': %s (%d)",
@@ -59,6 +61,38 @@ int reply_send_message(const char *message)
     return 0;
 }
 
+void reply_free_buffer(void *data, void *hint)
+{
+    (void) hint;
+
+    free(data);
+}
+
+int reply_send_buffer(char *data, size_t size)
+{
+    int rv;
+    zmq_msg_t msg;
+
+    rv = zmq_msg_init_data(&msg, data, size, reply_free_buffer, NULL);
+    if (rv != 0) {
+        log_error("Failed to initialize %lu byte message: %s (%d)",
+                  (unsigned long) size, zmq_strerror(errno), errno);
+        free(data);
+        return 1;
+    }
+
+    rv = zmq_send(zmq_reply_socket, &msg, ZMQ_NOBLOCK);
+
+    if (rv != 0) {
+        log_error("Failed to send %lu byte message: %s (%d)",
+                  (unsigned long) size, zmq_strerror(errno), errno);
+        zmq_msg_close(&msg);
+        return 1;
+    }
+
+    return 0;
+}
+
 int reply_send_error(unsigned int err_code)
 {
     int rv, do_free;
@@ -133,6 +167,14 @@ const char *error_to_string(unsigned int err_code)
         return "Path must be absolute";
     case ERROR_BAD_CALL:
         return "User tried to execute an unsupported call";
+    case ERROR_INVALID_INSTANCE_NAME:
+        return "Instance names must not contain commas or newlines";
+    case ERROR_INVALID_IGNORE_PATTERN:
+        return "Ignore patterns must not be empty or contain commas or newlines";
+    case ERROR_ZEROMQ_NOT_PUBLISHING:
+        return "Publishing is turned off (SEE: zmq_pub_uri)";
+    case ERROR_INVALID_FORMAT:
+        return "Format must be 'json' or 'binary'";
     default:
         return "Unknown error";
     }
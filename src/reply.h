@@ -29,6 +29,8 @@
 #ifndef _INOTISPY_REPLY_H_
 #define _INOTISPY_REPLY_H_
 
+#include <stddef.h>
+
 #ifndef _INOTISPY_REPLY_ERRORS_
 #define _INOTISPY_REPLY_ERRORS_
 
@@ -52,6 +54,10 @@ enum inotispy_error {
     ERROR_MEMORY_ALLOCATION,
     ERROR_INOTIFY_ROOT_BEING_DESTROYED,
     ERROR_BAD_CALL,
+    ERROR_INVALID_INSTANCE_NAME,
+    ERROR_INVALID_IGNORE_PATTERN,
+    ERROR_ZEROMQ_NOT_PUBLISHING,
+    ERROR_INVALID_FORMAT,
 
     ERROR_UNKNOWN
 };
@@ -67,6 +73,18 @@ enum inotispy_error {
  */
 int reply_send_message(const char *message);
 
+/* A zmq_free_fn for malloc()ed message data. 0MQ calls it once it's
+ * done with the data, which may be on one of its I/O threads.
+ */
+void reply_free_buffer(void *data, void *hint);
+
+/* Send 'size' bytes of malloc()ed data, which needn't be text, as
+ * the reply. The buffer is handed over to 0MQ as it is rather than
+ * copied, and free()d once it has been sent, so the caller must not
+ * touch it again, whether or not this succeeds.
+ */
+int reply_send_buffer(char *data, size_t size);
+
 /* Wrapper functions for error and success. */
 int reply_send_error(unsigned int error_code);
 int reply_send_success(void);
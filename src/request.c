@@ -180,6 +180,86 @@ char *request_get_path(const Request * req)
     return path;
 }
 
+int request_get_coalesce(const Request * req)
+{
+    int coalesce;
+
+    coalesce = request_get_key_int(req, "coalesce");
+
+    if (coalesce == -1)
+        return 0;
+
+    return coalesce ? 1 : 0;
+}
+
+int request_get_pair_moves(const Request * req)
+{
+    int pair_moves;
+
+    pair_moves = request_get_key_int(req, "pair_moves");
+
+    if (pair_moves == -1)
+        return 0;
+
+    return pair_moves ? 1 : 0;
+}
+
+char *request_get_instance(const Request * req)
+{
+    return request_get_key_str(req, "instance");
+}
+
+/* The 'ignore' field may be a single pattern or an array of them.
+ * Anything in the array that isn't a string is skipped.
+ */
+char **request_get_ignore(const Request * req)
+{
+    int i, n, len = 0;
+    char **patterns;
+    JOBJ val, item;
+
+    val = json_object_object_get(req->parser, "ignore");
+
+    if (val == NULL) {
+        log_trace("Did not find ignore patterns in JSON request");
+        return NULL;
+    }
+
+    if (json_object_is_type(val, json_type_string))
+        n = 1;
+    else if (json_object_is_type(val, json_type_array))
+        n = json_object_array_length(val);
+    else {
+        log_debug("Found key 'ignore', but it is not a string or array");
+        return NULL;
+    }
+
+    patterns = malloc((n + 1) * sizeof(char *));
+    if (patterns == NULL) {
+        log_error("Failed to allocate memory for ignore patterns: %s",
+                  "request.c:request_get_ignore()");
+        return NULL;
+    }
+
+    if (json_object_is_type(val, json_type_string)) {
+        patterns[len++] = (char *) json_object_get_string(val);
+    } else {
+        for (i = 0; i < n; i++) {
+            item = json_object_array_get_idx(val, i);
+            if ((item == NULL) || !json_object_is_type(item, json_type_string)) {
+                log_debug("Skipping ignore pattern %d, it is not a string",
+                          i);
+                continue;
+            }
+            patterns[len++] = (char *) json_object_get_string(item);
+        }
+    }
+
+    patterns[len] = NULL;
+
+    return patterns;
+}
+
 int request_get_max_events(const Request * req)
 {
     int max_events;
@@ -248,6 +328,23 @@ int request_get_count(const Request * req)
     return count;
 }
 
+int request_get_format(const Request * req)
+{
+    char *format;
+
+    format = request_get_key_str(req, "format");
+
+    if ((format == NULL) || (strcmp(format, "json") == 0))
+        return REQUEST_FORMAT_JSON;
+
+    if (strcmp(format, "binary") == 0)
+        return REQUEST_FORMAT_BINARY;
+
+    log_warn("Invalid format: '%s'. Value must be 'json' or 'binary'",
+             format);
+    return -1;
+}
+
 const char *request_to_string(const Request * req)
 {
     return req->json;
@@ -46,6 +46,10 @@ typedef struct request {
     char *json;
     JOBJ parser;
 } Request;
+
+/* Encodings a client can ask for events in ('format'). */
+#define REQUEST_FORMAT_JSON    0
+#define REQUEST_FORMAT_BINARY  1
 #endif /*_INOTISPY_REQUEST_H_META_*/
 
 /* Take a printable string and attempt to parse
@@ -64,10 +68,24 @@ int request_get_count(const Request * req);
 int request_get_max_events(const Request * req);
 int request_get_mask(const Request * req);
 int request_get_rewatch(const Request * req);
+int request_get_coalesce(const Request * req);
+int request_get_pair_moves(const Request * req);
 char *request_get_call(const Request * req);
 char *request_get_path(const Request * req);
+char *request_get_instance(const Request * req);
+
+/* A NULL terminated list of the 'ignore' patterns, or NULL if there
+ * aren't any. The list must be free()d by the caller but the strings
+ * in it belong to the request.
+ */
+char **request_get_ignore(const Request * req);
 int request_is_verbose(const Request * req);
 
+/* The REQUEST_FORMAT_* asked for with 'format' ("json" or "binary"),
+ * REQUEST_FORMAT_JSON if there isn't one, or -1 if it's neither.
+ */
+int request_get_format(const Request * req);
+
 /* Turn the JSON object into a printable string. */
 const char *request_to_string(const Request * req);
 
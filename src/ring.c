@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RING_ALIGN         8
+#define RING_HEADER_SIZE   RING_ALIGN
+#define RING_SKIP          0xFFFFFFFF
+#define RING_MIN_SIZE      4096
+
+#define ring_load(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static uint32_t record_size(uint32_t len)
+{
+    return (RING_HEADER_SIZE + len + (RING_ALIGN - 1)) & ~(RING_ALIGN - 1);
+}
+
+int ring_init(Ring * ring, uint32_t size)
+{
+    uint32_t real_size = RING_MIN_SIZE;
+
+    while (real_size < size && real_size < 0x80000000)
+        real_size <<= 1;
+
+    ring->buf = malloc(real_size);
+    if (ring->buf == NULL)
+        return 1;
+
+    ring->size = real_size;
+    ring->mask = real_size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->reserved = 0;
+
+    return 0;
+}
+
+void ring_free(Ring * ring)
+{
+    free(ring->buf);
+    ring->buf = NULL;
+    ring->size = 0;
+}
+
+uint32_t ring_max_record(const Ring * ring)
+{
+    return (ring->size / 2) - RING_HEADER_SIZE;
+}
+
+void *ring_reserve(Ring * ring, uint32_t len)
+{
+    uint64_t head, tail;
+    uint32_t offset, total, contiguous, used;
+
+    if (len > ring_max_record(ring))
+        return NULL;
+
+    head = ring_load(&ring->head);
+    tail = ring->tail;
+    used = (uint32_t) (tail - head);
+    total = record_size(len);
+    offset = (uint32_t) (tail & ring->mask);
+    contiguous = ring->size - offset;
+
+    /* If the record won't fit before the end of the buffer we
+     * burn what's left with a skip marker and start over at the
+     * beginning, so records are never split in two.
+     */
+    if (total > contiguous) {
+        if ((ring->size - used) < (contiguous + total))
+            return NULL;
+
+        *(uint32_t *) (ring->buf + offset) = RING_SKIP;
+        tail += contiguous;
+        ring_store(&ring->tail, tail);
+        offset = 0;
+    } else if ((ring->size - used) < total) {
+        return NULL;
+    }
+
+    ring->reserved = tail;
+
+    return ring->buf + offset + RING_HEADER_SIZE;
+}
+
+void ring_commit(Ring * ring, uint32_t len)
+{
+    uint64_t tail = ring->reserved;
+
+    *(uint32_t *) (ring->buf + (tail & ring->mask)) = len;
+    ring_store(&ring->tail, tail + record_size(len));
+}
+
+void *ring_peek(Ring * ring, uint32_t * len)
+{
+    uint64_t head, tail;
+    uint32_t offset, header;
+
+    head = ring->head;
+    tail = ring_load(&ring->tail);
+
+    while (head != tail) {
+        offset = (uint32_t) (head & ring->mask);
+        header = *(uint32_t *) (ring->buf + offset);
+
+        if (header != RING_SKIP) {
+            *len = header;
+            return ring->buf + offset + RING_HEADER_SIZE;
+        }
+
+        /* Skip marker: the producer wrapped around. */
+        head += ring->size - offset;
+        ring_store(&ring->head, head);
+    }
+
+    return NULL;
+}
+
+void ring_release(Ring * ring, uint32_t len)
+{
+    ring_store(&ring->head, ring->head + record_size(len));
+}
+
+void *ring_peek_next(Ring * ring, uint64_t * pos, uint32_t * len)
+{
+    uint64_t head, tail;
+    uint32_t offset, header;
+
+    head = ring_load(&ring->head);
+    tail = ring_load(&ring->tail);
+
+    if (*pos < head)
+        *pos = head;
+
+    while (*pos != tail) {
+        offset = (uint32_t) (*pos & ring->mask);
+        header = *(uint32_t *) (ring->buf + offset);
+
+        if (header != RING_SKIP) {
+            *len = header;
+            *pos += record_size(header);
+            return ring->buf + offset + RING_HEADER_SIZE;
+        }
+
+        *pos += ring->size - offset;
+    }
+
+    return NULL;
+}
+
+uint32_t ring_used(const Ring * ring)
+{
+    return (uint32_t) (ring_load(&ring->tail) - ring_load(&ring->head));
+}
+
+int ring_resize(Ring * ring, uint32_t size)
+{
+    Ring new;
+    void *src, *dst;
+    uint32_t len;
+    uint64_t pos = 0;
+
+    if (size < ring_used(ring))
+        return 1;
+
+    if (ring_init(&new, size) != 0)
+        return 1;
+
+    /* Copy without releasing anything, so the old ring is still
+     * intact if the new one turns out to be too small.
+     */
+    while ((src = ring_peek_next(ring, &pos, &len)) != NULL) {
+        dst = ring_reserve(&new, len);
+        if (dst == NULL) {
+            ring_free(&new);
+            return 1;
+        }
+
+        memcpy(dst, src, len);
+        ring_commit(&new, len);
+    }
+
+    ring_free(ring);
+    *ring = new;
+
+    return 0;
+}
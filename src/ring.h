@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_RING_H_
+#define _INOTISPY_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Lock-free, single-producer/single-consumer ring buffer of
+ * variable length records.
+ *
+ * Exactly one thread may write to the ring (ring_reserve() and
+ * ring_commit()) and exactly one thread may read from it
+ * (ring_peek() and ring_release()). No locks are taken by either
+ * side; the head and tail positions are published with atomic
+ * acquire/release operations.
+ *
+ * Records never wrap around the end of the buffer, so the consumer
+ * always gets a single contiguous block of memory and can work on
+ * it in place. Each record is prefixed with a 32 bit length and is
+ * padded out to 8 bytes, which keeps anything stored in the ring
+ * (like struct inotify_event) properly aligned.
+ */
+typedef struct spsc_ring {
+    char *buf;
+    uint32_t size;              /* Always a power of two */
+    uint32_t mask;
+    uint64_t head;              /* Only ever written by the consumer */
+    uint64_t tail;              /* Only ever written by the producer */
+    uint64_t reserved;          /* Producer's pending tail */
+} Ring;
+
+/* Allocate the ring's buffer. The size is rounded up to the next
+ * power of two.
+ *
+ * On success 0 (zero) is returned.
+ * On failure 1 is returned.
+ */
+int ring_init(Ring * ring, uint32_t size);
+void ring_free(Ring * ring);
+
+/* Producer side. Reserve 'len' contiguous bytes in the ring and
+ * return a pointer to them, or NULL if the ring does not currently
+ * have enough free space. Once the data has been written call
+ * ring_commit() with the number of bytes actually used (which may
+ * be less than what was reserved) to make it visible to the consumer.
+ */
+void *ring_reserve(Ring * ring, uint32_t len);
+void ring_commit(Ring * ring, uint32_t len);
+
+/* Consumer side. Return a pointer to the oldest record in the ring
+ * (storing its length in 'len'), or NULL if the ring is empty. The
+ * record stays valid until ring_release() is called.
+ */
+void *ring_peek(Ring * ring, uint32_t * len);
+void ring_release(Ring * ring, uint32_t len);
+
+/* Consumer side. Walk the records in the ring without releasing
+ * them. Start with '*pos' set to 0 (zero) for the oldest record;
+ * each call returns the record at '*pos' and moves '*pos' past it.
+ * Returns NULL once there are no more records.
+ */
+void *ring_peek_next(Ring * ring, uint64_t * pos, uint32_t * len);
+
+/* Number of bytes (records plus overhead) currently in the ring. */
+uint32_t ring_used(const Ring * ring);
+
+/* Move everything in the ring into a new buffer of (at least)
+ * 'size' bytes. This is only safe when nobody else can be using
+ * the ring at the same time, i.e. when both ends of it belong to
+ * the same thread or are behind the same lock.
+ *
+ * On success 0 (zero) is returned.
+ * On failure 1 is returned and the ring is left as it was.
+ */
+int ring_resize(Ring * ring, uint32_t size);
+
+/* The largest single record this ring will accept. */
+uint32_t ring_max_record(const Ring * ring);
+
+#endif /*_INOTISPY_RING_H_*/
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "slab.h"
+
+#include <stdlib.h>
+
+#define SLAB_ALIGN       sizeof(void *)
+#define SLAB_CHUNK_SIZE  ( 64 * 1024 )
+
+void slab_init(Slab * slab, size_t size)
+{
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+
+    slab->size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    slab->free = NULL;
+    slab->pos = NULL;
+    slab->left = 0;
+    slab->in_use = 0;
+    slab->chunks = 0;
+}
+
+void *slab_alloc(Slab * slab)
+{
+    void *obj;
+    size_t chunk_size;
+
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = *(void **) obj;
+        ++slab->in_use;
+        return obj;
+    }
+
+    if (slab->left < slab->size) {
+        chunk_size = SLAB_CHUNK_SIZE;
+        if (chunk_size < slab->size)
+            chunk_size = slab->size;
+
+        /* Whatever is left at the end of the old chunk is lost. */
+        slab->pos = malloc(chunk_size);
+        if (slab->pos == NULL) {
+            slab->left = 0;
+            return NULL;
+        }
+
+        slab->left = chunk_size;
+        ++slab->chunks;
+    }
+
+    obj = slab->pos;
+    slab->pos += slab->size;
+    slab->left -= slab->size;
+    ++slab->in_use;
+
+    return obj;
+}
+
+void slab_free(Slab * slab, void *obj)
+{
+    if (obj == NULL)
+        return;
+
+    *(void **) obj = slab->free;
+    slab->free = obj;
+    --slab->in_use;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_SLAB_H_
+#define _INOTISPY_SLAB_H_
+
+#include <stddef.h>
+
+/* A very small slab allocator for lots of same sized objects.
+ *
+ * Memory is carved out of large chunks, with no per-object header
+ * and no rounding beyond pointer alignment, and freed objects go on
+ * a free list to be handed out again. Chunks are never given back
+ * to the system.
+ *
+ * A Slab is not thread safe; the caller has to provide locking.
+ */
+typedef struct slab {
+    size_t size;                /* Object size, rounded up */
+    void *free;                 /* Free list */
+    char *pos;                  /* Unused space in the current chunk */
+    size_t left;
+    size_t in_use;
+    size_t chunks;
+} Slab;
+
+void slab_init(Slab * slab, size_t size);
+void *slab_alloc(Slab * slab);
+void slab_free(Slab * slab, void *obj);
+
+#endif /*_INOTISPY_SLAB_H_*/
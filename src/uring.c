@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+
+    /* Submission queue */
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_queued;     /* Our tail, ahead of *sq_tail */
+    unsigned int sq_pending;    /* Queued but not yet submitted */
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+Uring *uring_new(unsigned int entries)
+{
+    struct io_uring_params p;
+    Uring *ring;
+
+    ring = calloc(1, sizeof(Uring));
+    if (ring == NULL)
+        return NULL;
+
+    memset(&p, 0, sizeof p);
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* Newer kernels map both queues in one go. */
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask =
+        (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array =
+        (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_queued = *ring->sq_tail;
+
+    ring->cq_head = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask =
+        (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes =
+        (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+
+    return ring;
+
+  fail:
+    if (ring->sq_ptr == MAP_FAILED)
+        ring->sq_ptr = NULL;
+    uring_free(ring);
+    return NULL;
+}
+
+void uring_free(Uring * ring)
+{
+    if (ring == NULL)
+        return;
+
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if ((ring->cq_ptr != NULL) && (ring->cq_ptr != ring->sq_ptr))
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL)
+        munmap(ring->sq_ptr, ring->sq_len);
+
+    close(ring->fd);
+    free(ring);
+}
+
+static struct io_uring_sqe *uring_sqe(Uring * ring)
+{
+    unsigned int head, index;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_queued - head >= ring->sq_entries)
+        return NULL;
+
+    index = ring->sq_queued & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ++ring->sq_queued;
+    ++ring->sq_pending;
+
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+
+    return sqe;
+}
+
+int uring_openat(Uring * ring, int dirfd, const char *name, int flags,
+                 uint64_t data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t) (uintptr_t) name;
+    sqe->open_flags = flags;
+    sqe->user_data = data;
+
+    return 0;
+}
+
+int uring_statx(Uring * ring, int dirfd, const char *name, int flags,
+                unsigned int mask, struct statx *buf, uint64_t data)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe == NULL)
+        return -1;
+
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uint64_t) (uintptr_t) name;
+    sqe->len = mask;
+    sqe->off = (uint64_t) (uintptr_t) buf;
+    sqe->statx_flags = flags;
+    sqe->user_data = data;
+
+    return 0;
+}
+
+int uring_submit(Uring * ring, unsigned int wait)
+{
+    int rv;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_queued, __ATOMIC_RELEASE);
+
+    do {
+        rv = (int) syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending,
+                           wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL,
+                           0);
+        if (rv >= 0)
+            ring->sq_pending -= rv;
+    } while ((rv >= 0) ? (ring->sq_pending > 0)
+             : ((errno == EINTR) || (errno == EAGAIN)));
+
+    return (rv < 0) ? -1 : 0;
+}
+
+int uring_reap(Uring * ring, uint64_t * data, int *res)
+{
+    unsigned int head;
+    struct io_uring_cqe *cqe;
+
+    head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+#else
+
+Uring *uring_new(unsigned int entries)
+{
+    return NULL;
+}
+
+void uring_free(Uring * ring)
+{
+}
+
+int uring_openat(Uring * ring, int dirfd, const char *name, int flags,
+                 uint64_t data)
+{
+    return -1;
+}
+
+int uring_statx(Uring * ring, int dirfd, const char *name, int flags,
+                unsigned int mask, struct statx *buf, uint64_t data)
+{
+    return -1;
+}
+
+int uring_submit(Uring * ring, unsigned int wait)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_reap(Uring * ring, uint64_t * data, int *res)
+{
+    return 0;
+}
+
+#endif /*HAVE_IO_URING*/
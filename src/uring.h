@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_URING_H_
+#define _INOTISPY_URING_H_
+
+#include <stdint.h>
+#include <sys/stat.h>           /* struct statx */
+
+/* Just enough io_uring, on top of the raw system calls, for the
+ * crawler to batch up openat() and statx() calls (SEE: crawl.c).
+ *
+ * A Uring belongs to a single thread. Requests are queued with
+ * uring_openat() and uring_statx(), which fail once the submission
+ * queue is full, handed to the kernel with uring_submit(), and their
+ * results picked up with uring_reap(). The caller must not have more
+ * requests outstanding than the Uring was created with.
+ *
+ * Without HAVE_IO_URING, or on a kernel that doesn't have it (or
+ * doesn't allow it), uring_new() returns NULL and the caller does
+ * things the old way.
+ */
+typedef struct uring Uring;
+
+Uring *uring_new(unsigned int entries);
+void uring_free(Uring * ring);
+
+/* Queue a request, tagged with 'data'. Both return 0 (zero), or -1
+ * if the submission queue is full. 'name' and 'buf' must stay valid
+ * until the request has been reaped.
+ */
+int uring_openat(Uring * ring, int dirfd, const char *name, int flags,
+                 uint64_t data);
+int uring_statx(Uring * ring, int dirfd, const char *name, int flags,
+                unsigned int mask, struct statx *buf, uint64_t data);
+
+/* Submit everything queued and wait for at least 'wait' requests to
+ * finish. Returns 0 (zero) on success, or -1 with errno set.
+ */
+int uring_submit(Uring * ring, unsigned int wait);
+
+/* Pick up a finished request. Returns 1 and sets 'data' and 'res'
+ * (what the system call would have returned, or -errno) if there
+ * was one, otherwise 0 (zero).
+ */
+int uring_reap(Uring * ring, uint64_t * data, int *res);
+
+#endif /*_INOTISPY_URING_H_*/
@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "slab.h"
+#include "watch.h"
+
+#include <glib.h>
+#include <limits.h>             /* NAME_MAX */
+#include <stddef.h>             /* offsetof() */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WATCH_MIN_BUCKETS 1024
+
+/* Watches are allocated from one slab per size, in steps of 8
+ * bytes, so a watch costs exactly it's own size rounded up to
+ * the next 8 bytes.
+ */
+#define WATCH_SLAB_STEP   8
+#define WATCH_NUM_SLABS   \
+    ( ( offsetof(Watch, name) + NAME_MAX + 1 ) / WATCH_SLAB_STEP + 2 )
+
+static Slab watch_slabs[WATCH_NUM_SLABS];
+
+/* Every node except the top one ('/') is in this hash, keyed on
+ * it's parent and name. The hash is chained through Watch::hnext
+ * rather than being a GHashTable, which saves a good deal of memory
+ * when there are millions of directories.
+ */
+static Watch **watch_buckets;
+static guint watch_num_buckets;         /* Always a power of two */
+static guint watch_num_nodes = 0;
+static Watch *watch_top;
+static int watch_num = 0;
+
+static guint watch_hash(const Watch * parent, const char *name)
+{
+    return g_str_hash(name) ^
+        (guint) (((uintptr_t) parent >> 4) * 2654435761u);
+}
+
+static Slab *watch_slab(size_t len)
+{
+    return &watch_slabs[(offsetof(Watch, name) + len + 1 +
+                         WATCH_SLAB_STEP - 1) / WATCH_SLAB_STEP];
+}
+
+/* Double the number of buckets once there are more nodes than
+ * buckets. If we can't get the memory we just carry on with longer
+ * chains.
+ */
+static void watch_grow(void)
+{
+    guint i, n, slot;
+    Watch **buckets, *watch, *next;
+
+    n = watch_num_buckets * 2;
+    buckets = calloc(n, sizeof(Watch *));
+    if (buckets == NULL)
+        return;
+
+    for (i = 0; i < watch_num_buckets; i++) {
+        for (watch = watch_buckets[i]; watch != NULL; watch = next) {
+            next = watch->hnext;
+            slot = watch_hash(watch->parent, watch->name) & (n - 1);
+            watch->hnext = buckets[slot];
+            buckets[slot] = watch;
+        }
+    }
+
+    free(watch_buckets);
+    watch_buckets = buckets;
+    watch_num_buckets = n;
+}
+
+static void watch_link_hash(Watch * watch)
+{
+    guint slot;
+
+    if (++watch_num_nodes > watch_num_buckets)
+        watch_grow();
+
+    slot = watch_hash(watch->parent, watch->name) & (watch_num_buckets - 1);
+    watch->hnext = watch_buckets[slot];
+    watch_buckets[slot] = watch;
+}
+
+static void watch_unlink_hash(Watch * watch)
+{
+    guint slot;
+    Watch **link;
+
+    slot = watch_hash(watch->parent, watch->name) & (watch_num_buckets - 1);
+    for (link = &watch_buckets[slot]; *link != NULL;
+         link = &(*link)->hnext) {
+        if (*link == watch) {
+            *link = watch->hnext;
+            break;
+        }
+    }
+    --watch_num_nodes;
+    watch->hnext = NULL;
+}
+
+/* Put a node into the hash and at the head of its parent's list of
+ * children.
+ */
+static void watch_link(Watch * watch, Watch * parent)
+{
+    watch->parent = parent;
+    watch->prev = NULL;
+    watch->next = parent->child;
+    if (parent->child != NULL)
+        parent->child->prev = watch;
+    parent->child = watch;
+
+    watch_link_hash(watch);
+}
+
+/* Take a node out of the hash and its parent's list of children. */
+static void watch_unlink(Watch * watch)
+{
+    watch_unlink_hash(watch);
+
+    if (watch->prev != NULL)
+        watch->prev->next = watch->next;
+    else
+        watch->parent->child = watch->next;
+
+    if (watch->next != NULL)
+        watch->next->prev = watch->prev;
+
+    watch->parent = NULL;
+    watch->prev = NULL;
+    watch->next = NULL;
+}
+
+/* Allocate a new, unwatched node and link it in under 'parent'.
+ * The name is stored in the same allocation as the node itself.
+ */
+static Watch *watch_new(Watch * parent, const char *name, size_t len)
+{
+    Watch *watch;
+
+    /* The name starts right after wd, not at the end of the padded
+     * struct, so short names cost nothing extra.
+     */
+    watch = slab_alloc(watch_slab(len));
+    if (watch == NULL)
+        return NULL;
+
+    watch->wd = -1;
+    watch->root = NULL;
+    watch->parent = NULL;
+    watch->child = NULL;
+    watch->prev = NULL;
+    watch->next = NULL;
+    watch->hnext = NULL;
+    watch->mtime = 0;
+    watch->entries = 0;
+    memcpy(watch->name, name, len);
+    watch->name[len] = '\0';
+
+    if (parent != NULL)
+        watch_link(watch, parent);
+
+    return watch;
+}
+
+/* Free 'watch' if it's unwatched and has no children, then do the
+ * same for its parent, and so on up the tree. A detached node (SEE:
+ * watch_detach()) has no parent, so that's as far as it goes.
+ */
+static void watch_prune(Watch * watch)
+{
+    Watch *parent;
+
+    while ((watch != NULL) && (watch != watch_top) && (watch->wd == -1)
+           && (watch->child == NULL)) {
+        parent = watch->parent;
+        if (parent != NULL)
+            watch_unlink(watch);
+        slab_free(watch_slab(strlen(watch->name)), watch);
+        watch = parent;
+    }
+}
+
+static Watch *watch_child(Watch * parent, const char *name)
+{
+    Watch *watch;
+
+    watch = watch_buckets[watch_hash(parent, name)
+                          & (watch_num_buckets - 1)];
+
+    for (; watch != NULL; watch = watch->hnext) {
+        if ((watch->parent == parent) && (strcmp(watch->name, name) == 0))
+            return watch;
+    }
+
+    return NULL;
+}
+
+/* Walk down the tree following the components of 'path'. If 'create'
+ * is set any missing nodes are added along the way.
+ */
+static Watch *watch_walk(const char *path, int create)
+{
+    size_t len;
+    const char *end;
+    char name[NAME_MAX + 1];
+    Watch *node, *next;
+
+    if ((path == NULL) || (*path != '/'))
+        return NULL;
+
+    node = watch_top;
+
+    while (*path != '\0') {
+
+        while (*path == '/')
+            path++;
+
+        if (*path == '\0')
+            break;
+
+        for (end = path; (*end != '\0') && (*end != '/'); end++);
+
+        len = end - path;
+        if (len > NAME_MAX)
+            goto fail;
+
+        memcpy(name, path, len);
+        name[len] = '\0';
+
+        next = watch_child(node, name);
+        if (next == NULL) {
+            if (!create)
+                return NULL;
+
+            next = watch_new(node, name, len);
+            if (next == NULL)
+                goto fail;
+        }
+
+        node = next;
+        path = end;
+    }
+
+    return node;
+
+  fail:
+    if (create)
+        watch_prune(node);
+    return NULL;
+}
+
+int watch_table_init(void)
+{
+    size_t i;
+
+    for (i = 0; i < WATCH_NUM_SLABS; i++)
+        slab_init(&watch_slabs[i], i * WATCH_SLAB_STEP);
+
+    watch_num_buckets = WATCH_MIN_BUCKETS;
+    watch_buckets = calloc(watch_num_buckets, sizeof(Watch *));
+    if (watch_buckets == NULL)
+        return 1;
+
+    watch_top = watch_new(NULL, "", 0);
+    if (watch_top == NULL)
+        return 1;
+
+    return 0;
+}
+
+Watch *watch_lookup(const char *path)
+{
+    Watch *watch;
+
+    watch = watch_walk(path, 0);
+    if ((watch == NULL) || (watch->wd == -1))
+        return NULL;
+
+    return watch;
+}
+
+Watch *watch_add(const char *path, int wd, Root * root)
+{
+    Watch *watch;
+
+    watch = watch_walk(path, 1);
+    if (watch == NULL)
+        return NULL;
+
+    if (watch->wd == -1)
+        ++watch_num;
+
+    watch->wd = wd;
+    watch->root = root;
+    watch->mtime = 0;
+    watch->entries = 0;
+
+    return watch;
+}
+
+void watch_remove(Watch * watch)
+{
+    if (watch->wd != -1) {
+        --watch_num;
+        watch->wd = -1;
+        watch->root = NULL;
+    }
+
+    watch_prune(watch);
+}
+
+void watch_remove_tree(Watch * watch, void (*func) (Watch *, void *),
+                       void *data)
+{
+    watch_remove_tree_max(watch, func, data, 0);
+}
+
+int watch_remove_tree_max(Watch * watch, void (*func) (Watch *, void *),
+                          void *data, int max)
+{
+    int n = 0;
+    Watch *node, *parent;
+
+    /* Post-order: always go as far down as we can, deal with that
+     * node, free it and go back up to its parent. When we're back
+     * at 'watch' everything under it is gone. Stopping part way
+     * leaves a perfectly good (smaller) tree behind.
+     */
+    node = watch;
+
+    while (1) {
+        while (node->child != NULL)
+            node = node->child;
+
+        if (node->wd != -1) {
+            if ((max > 0) && (n == max))
+                return 1;
+            ++n;
+
+            if (func != NULL)
+                func(node, data);
+
+            --watch_num;
+            node->wd = -1;
+            node->root = NULL;
+        }
+
+        if (node == watch)
+            break;
+
+        parent = node->parent;
+        watch_unlink(node);
+        slab_free(watch_slab(strlen(node->name)), node);
+        node = parent;
+    }
+
+    watch_prune(watch);
+
+    return 0;
+}
+
+void watch_detach(Watch * watch)
+{
+    Watch *parent;
+
+    parent = watch->parent;
+    if ((parent == NULL) || (watch == watch_top))
+        return;
+
+    /* Only 'watch' itself is hashed on its parent. Everything below
+     * it is hashed on nodes that are coming along, so it stays put.
+     */
+    watch_unlink(watch);
+    watch_prune(parent);
+}
+
+Watch *watch_attach(Watch * watch, Watch * parent, const char *name)
+{
+    size_t len;
+    Watch *node, *child;
+
+    len = strlen(name);
+    if ((watch->parent != NULL) || (len > NAME_MAX)
+        || (watch_child(parent, name) != NULL))
+        return NULL;
+
+    /* If the new name doesn't fit in the same size class the node
+     * has to move, and its children are hashed on its address so
+     * they need to be rehashed on the new one.
+     */
+    if (watch_slab(len) != watch_slab(strlen(watch->name))) {
+        node = slab_alloc(watch_slab(len));
+        if (node == NULL)
+            return NULL;
+
+        memcpy(node, watch, offsetof(Watch, name));
+
+        for (child = node->child; child != NULL; child = child->next) {
+            watch_unlink_hash(child);
+            child->parent = node;
+            watch_link_hash(child);
+        }
+
+        slab_free(watch_slab(strlen(watch->name)), watch);
+        watch = node;
+    }
+
+    memcpy(watch->name, name, len + 1);
+    watch_link(watch, parent);
+
+    return watch;
+}
+
+void watch_set_root(Watch * watch, Root * root)
+{
+    Watch *node;
+
+    for (node = watch; node != NULL; node = watch_next(node, watch)) {
+        if (node->wd != -1)
+            node->root = root;
+    }
+}
+
+int watch_path(const Watch * watch, char *buf, size_t size)
+{
+    size_t len = 0, pos, n;
+    const Watch *w;
+
+    if (watch == watch_top) {
+        if (size < 2)
+            return -1;
+        buf[0] = '/';
+        buf[1] = '\0';
+        return 1;
+    }
+
+    /* A detached subtree never gets back to the top. */
+    for (w = watch; w != watch_top; w = w->parent) {
+        if (w == NULL)
+            return -1;
+        len += strlen(w->name) + 1;
+    }
+
+    if (len + 1 > size)
+        return -1;
+
+    /* Fill the buffer in from the end, since we're walking up. */
+    pos = len;
+    buf[pos] = '\0';
+
+    for (w = watch; w != watch_top; w = w->parent) {
+        n = strlen(w->name);
+        pos -= n;
+        memcpy(buf + pos, w->name, n);
+        buf[--pos] = '/';
+    }
+
+    return (int) len;
+}
+
+Watch *watch_first(void)
+{
+    return watch_top;
+}
+
+Watch *watch_next(const Watch * watch, const Watch * top)
+{
+    if (watch->child != NULL)
+        return watch->child;
+
+    while ((watch != NULL) && (watch != top)) {
+        if (watch->next != NULL)
+            return watch->next;
+        watch = watch->parent;
+    }
+
+    return NULL;
+}
+
+int watch_count(void)
+{
+    return watch_num;
+}
+
+int wd_table_set(WdTable * table, int wd, Watch * watch, uint32_t gen)
+{
+    int n, page;
+    WdPage **pages;
+    WdSlot *slot;
+
+    if (wd < 0)
+        return 1;
+
+    page = wd >> WD_PAGE_SHIFT;
+
+    if (page >= table->num_pages) {
+        n = table->num_pages ? table->num_pages : 16;
+        while (n <= page)
+            n *= 2;
+
+        pages = realloc(table->pages, n * sizeof(WdPage *));
+        if (pages == NULL)
+            return 1;
+
+        memset(pages + table->num_pages, 0,
+               (n - table->num_pages) * sizeof(WdPage *));
+        table->pages = pages;
+        table->num_pages = n;
+    }
+
+    if (table->pages[page] == NULL) {
+        table->pages[page] = calloc(1, sizeof(WdPage));
+        if (table->pages[page] == NULL)
+            return 1;
+    }
+
+    slot = &table->pages[page]->slots[wd & (WD_PAGE_SIZE - 1)];
+    if (slot->watch == NULL) {
+        ++table->pages[page]->used;
+        ++table->count;
+    }
+
+    slot->watch = watch;
+    slot->gen = gen;
+
+    return 0;
+}
+
+Watch *wd_table_get(const WdTable * table, int wd, uint32_t gen)
+{
+    int page;
+    const WdSlot *slot;
+
+    page = wd >> WD_PAGE_SHIFT;
+
+    if ((wd < 0) || (page >= table->num_pages)
+        || (table->pages[page] == NULL))
+        return NULL;
+
+    slot = &table->pages[page]->slots[wd & (WD_PAGE_SIZE - 1)];
+
+    /* The watch was added after the event was read, so the event
+     * is left over from whatever used this wd before.
+     */
+    if ((int32_t) (gen - slot->gen) < 0)
+        return NULL;
+
+    return slot->watch;
+}
+
+void wd_table_replace(WdTable * table, int wd, Watch * watch)
+{
+    int page;
+    WdSlot *slot;
+
+    page = wd >> WD_PAGE_SHIFT;
+
+    if ((wd < 0) || (page >= table->num_pages)
+        || (table->pages[page] == NULL))
+        return;
+
+    slot = &table->pages[page]->slots[wd & (WD_PAGE_SIZE - 1)];
+    if (slot->watch != NULL)
+        slot->watch = watch;
+}
+
+void wd_table_remove(WdTable * table, int wd)
+{
+    int page;
+    WdSlot *slot;
+
+    page = wd >> WD_PAGE_SHIFT;
+
+    if ((wd < 0) || (page >= table->num_pages)
+        || (table->pages[page] == NULL))
+        return;
+
+    slot = &table->pages[page]->slots[wd & (WD_PAGE_SIZE - 1)];
+    if (slot->watch == NULL)
+        return;
+
+    slot->watch = NULL;
+    --table->count;
+
+    if (--table->pages[page]->used == 0) {
+        free(table->pages[page]);
+        table->pages[page] = NULL;
+    }
+}
+
+void wd_table_free(WdTable * table)
+{
+    int i;
+
+    for (i = 0; i < table->num_pages; i++)
+        free(table->pages[i]);
+
+    free(table->pages);
+    table->pages = NULL;
+    table->num_pages = 0;
+    table->count = 0;
+}
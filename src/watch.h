@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_WATCH_H_
+#define _INOTISPY_WATCH_H_
+
+#include "inotify.h"
+
+#include <stddef.h>
+
+/* The watch table.
+ *
+ * Every watched directory gets a node in a single tree that mirrors
+ * the file system, starting at '/'. A node only stores the last
+ * component of its path (its name) and a link to its parent, so a
+ * directory's full path is never kept in memory. When one is needed
+ * it is rebuilt by walking up the parent links (SEE: watch_path()).
+ *
+ * Looking up a path walks it one component at a time through a
+ * single hash of (parent, name) -> node.
+ *
+ * Directories between '/' and a root are in the tree too, so that
+ * every node has a parent, but they aren't watched (their wd is -1)
+ * and they're removed again as soon as they have no children left.
+ *
+ * Watches are allocated from slabs (SEE: slab.h), not one at a time
+ * with malloc().
+ *
+ * None of these functions lock anything. The caller must hold
+ * inotify_mutex.
+ */
+
+int watch_table_init(void);
+
+/* Return the watch for the absolute 'path', or NULL if that
+ * directory isn't watched.
+ */
+Watch *watch_lookup(const char *path);
+
+/* Add a watch for the absolute 'path' with watch descriptor 'wd'
+ * that belongs to 'root'. If the path is already in the table its
+ * wd and root are replaced.
+ *
+ * Returns the new watch, or NULL on failure.
+ */
+Watch *watch_add(const char *path, int wd, Root * root);
+
+/* Remove a single watch. If it still has children it's left in the
+ * tree unwatched, otherwise it's freed (and so are any unwatched
+ * parents left with no children).
+ */
+void watch_remove(Watch * watch);
+
+/* Remove a watch and everything under it. 'func' is called once for
+ * every watched node, children first, before it is freed.
+ */
+void watch_remove_tree(Watch * watch, void (*func) (Watch *, void *),
+                       void *data);
+
+/* The same as watch_remove_tree(), but gives up after 'max' watched
+ * nodes (no limit if 'max' is 0) so that huge trees can be removed
+ * a piece at a time.
+ *
+ * Returns 0 (zero) once 'watch' itself is gone, or 1 if there is
+ * still more of the tree left to remove.
+ */
+int watch_remove_tree_max(Watch * watch, void (*func) (Watch *, void *),
+                          void *data, int max);
+
+/* Take 'watch', and everything under it, out of the tree without
+ * touching any of the watches. The detached subtree keeps its wds
+ * and still counts towards watch_count(); it can be put back under
+ * a new parent with watch_attach() or freed with watch_remove_tree().
+ */
+void watch_detach(Watch * watch);
+
+/* Put a detached 'watch' back into the tree as 'name' under 'parent'.
+ * The node may have to be reallocated for the new name, so use the
+ * returned pointer from here on (the wd table included).
+ *
+ * Returns the attached watch, or NULL if 'parent' already has a
+ * child called 'name' or memory runs out; 'watch' is still detached
+ * and unchanged in that case.
+ */
+Watch *watch_attach(Watch * watch, Watch * parent, const char *name);
+
+/* Set the root of every watched node in the tree under 'watch'. */
+void watch_set_root(Watch * watch, Root * root);
+
+/* Write the absolute path of 'watch' into 'buf', which is 'size'
+ * bytes long.
+ *
+ * Returns the length of the path, or -1 if it doesn't fit or the
+ * watch is in a detached subtree.
+ */
+int watch_path(const Watch * watch, char *buf, size_t size);
+
+/* Walk the table in pre-order. watch_next() returns the node after
+ * 'watch' that is inside the tree starting at 'top', or NULL when
+ * there are no more. A NULL 'top' walks the entire table, starting
+ * from watch_first(). Unwatched nodes (wd == -1) are included.
+ */
+Watch *watch_first(void);
+Watch *watch_next(const Watch * watch, const Watch * top);
+
+/* Number of watched directories. */
+int watch_count(void);
+
+/* Per instance wd -> watch tables (SEE: WdTable in inotify.h). A
+ * zeroed WdTable is empty and ready to use.
+ *
+ * wd_table_set() records 'watch' for 'wd', added at generation
+ * 'gen'. It returns 0 (zero) on success and 1 on failure.
+ *
+ * wd_table_get() returns the watch for 'wd', or NULL if there is
+ * none or it was added after generation 'gen', i.e. after the event
+ * being looked up was read.
+ *
+ * wd_table_replace() points an existing 'wd' at 'watch', keeping its
+ * generation. It's for when a watch is reallocated (SEE:
+ * watch_attach()), not for when the wd is reused.
+ */
+int wd_table_set(WdTable * table, int wd, Watch * watch, uint32_t gen);
+Watch *wd_table_get(const WdTable * table, int wd, uint32_t gen);
+void wd_table_replace(WdTable * table, int wd, Watch * watch);
+void wd_table_remove(WdTable * table, int wd);
+void wd_table_free(WdTable * table);
+
+#endif /*_INOTISPY_WATCH_H_*/
@@ -31,6 +31,8 @@
 #include "reply.h"
 #include "config.h"
 #include "inotify.h"
+#include "crawl.h"
+#include "pool.h"
 #include "utils.h"
 
 #include <zmq.h>
@@ -38,21 +40,31 @@
 #include <time.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <linux/limits.h>
 
-pthread_mutex_t zmq_mutex = PTHREAD_MUTEX_INITIALIZER;
+__thread void *zmq_reply_socket = NULL;
+
+static pthread_t zmq_queue_thread;
+static int zmq_num_workers = 0;
+static int zmq_busy_workers = 0;
+static unsigned long zmq_requests = 0;
 
 static void zmq_dispatch_event(Request * req);
+static void *_zmq_queue(void *thread_data);
+static void *_zmq_worker(void *thread_data);
 
 void *zmq_setup(void)
 {
-    int rv, bind_rv;
+    int i, rv, bind_rv, linger = 0;
+    pthread_t tid;
 
     zmq_context = zmq_init(ZMQ_THREADS);
-    zmq_listener = zmq_socket(zmq_context, ZMQ_REP);
+    zmq_listener = zmq_socket(zmq_context, ZMQ_XREP);
+    zmq_setsockopt(zmq_listener, ZMQ_LINGER, &linger, sizeof linger);
     bind_rv = zmq_bind(zmq_listener, CONFIG->zmq_uri);
 
     if (bind_rv != 0) {
@@ -60,45 +72,141 @@ void *zmq_setup(void)
         return NULL;
     }
 
+    /* The workers connect to this, so it has to be bound before
+     * any of them start.
+     */
+    zmq_workers = zmq_socket(zmq_context, ZMQ_XREQ);
+    bind_rv = zmq_bind(zmq_workers, ZMQ_WORKER_URI);
+
+    if (bind_rv != 0) {
+        log_error("Failed to bind ZeroMQ worker socket: '%s'",
+                  strerror(errno));
+        return NULL;
+    }
+
+    for (i = 0; i < CONFIG->zmq_workers; i++) {
+        rv = pthread_create(&tid, NULL, _zmq_worker, NULL);
+        if (rv != 0) {
+            log_error("Failed to create ZeroMQ worker thread: %s",
+                      strerror(rv));
+            return NULL;
+        }
+        pthread_detach(tid);
+        ++zmq_num_workers;
+    }
+
+    rv = pthread_create(&zmq_queue_thread, NULL, _zmq_queue, NULL);
+    if (rv != 0) {
+        log_error("Failed to create ZeroMQ queue thread: %s",
+                  strerror(rv));
+        return NULL;
+    }
+
+    /* The publisher is optional. The high water mark bounds how
+     * much a slow subscriber can make us hold on to; past it, its
+     * messages are dropped.
+     */
+    zmq_publisher = NULL;
+    if ((CONFIG->zmq_pub_uri != NULL) && (*CONFIG->zmq_pub_uri != '\0')) {
+        uint64_t hwm = ZMQ_PUB_HWM;
+
+        zmq_publisher = zmq_socket(zmq_context, ZMQ_PUB);
+        zmq_setsockopt(zmq_publisher, ZMQ_HWM, &hwm, sizeof hwm);
+        zmq_setsockopt(zmq_publisher, ZMQ_LINGER, &linger, sizeof linger);
+        bind_rv = zmq_bind(zmq_publisher, CONFIG->zmq_pub_uri);
+
+        if (bind_rv != 0) {
+            log_error("Failed to bind ZeroMQ publisher socket: '%s'",
+                      strerror(errno));
+            return NULL;
+        }
+    }
+
+    log_debug("Handing requests to %d ZeroMQ workers", zmq_num_workers);
+
     return zmq_listener;
 }
 
+/* Terminating the context makes the queue device and every worker
+ * return from whatever 0MQ call they're blocked in with ETERM, and
+ * each of them closes its own socket(s) on the way out. zmq_term()
+ * waits for that, so the only socket to close here is the one that
+ * belongs to the main loop.
+ */
 void zmq_cleanup(void)
 {
-    zmq_close(zmq_listener);
+    if (zmq_publisher != NULL)
+        zmq_close(zmq_publisher);
     zmq_term(zmq_context);
 }
 
-/* This is where we grab a 0MQ request off the socket, try to
- * identify it as JSON, and then send it to the json-c parsing
- * functions if it looks like valid JSON. If it parses correctly
- * and contains the manditory 'call' field then this request is
- * sent to the dispatcher.
+void zmq_get_worker_stats(Zmq_Worker_Stats * stats)
+{
+    stats->threads = zmq_num_workers;
+    stats->busy = __atomic_load_n(&zmq_busy_workers, __ATOMIC_RELAXED);
+    stats->requests = __atomic_load_n(&zmq_requests, __ATOMIC_RELAXED);
+}
+
+/* Shuffle requests from the clients to the workers, and replies
+ * from the workers back to the clients. The XREP socket tags each
+ * request with the client it came from, and the XREQ socket hands
+ * them out to whichever workers are free.
  */
-void zmq_handle_event(void)
+static void *_zmq_queue(void *thread_data)
+{
+    thread_data = NULL;
+
+    zmq_device(ZMQ_QUEUE, zmq_listener, zmq_workers);
+
+    zmq_close(zmq_listener);
+    zmq_close(zmq_workers);
+
+    return NULL;
+}
+
+/* When a 0MQ event comes in over the wire this is the function
+ * that will get invoked, on one of the worker threads. This
+ * function serves mainly as a sanity checker and forwarder. What
+ * it does is:
+ *
+ * 1. Grab the message off the wire
+ * 2. Dirty check to see if the message looks like JSON. (Bail if not)
+ * 3. Parse JSON and see if it has a "call" field. (Bail if not)
+ * 4. If JSON parsed successfully and there was a "call" field
+ *    create a Request struct/blob and send that off to the dispatcher.
+ *
+ * The worker's socket is a REP socket, so every request has to get
+ * exactly one reply, even the ones we bail on, or the socket won't
+ * take another request.
+ *
+ * Returns -1 once the context has been terminated, 0 otherwise.
+ */
+static int zmq_handle_request(void)
 {
     int i, rv, nil, msg_size;
     char *json;
     Request *req;
 
-    pthread_mutex_lock(&zmq_mutex);
-
     zmq_msg_t request;
     zmq_msg_init(&request);
-    rv = zmq_recv(zmq_listener, &request, 0);
+    rv = zmq_recv(zmq_reply_socket, &request, 0);
 
     /* If the call to recv() failed then we need to tell the
      * client to reconnect. This should only happen under
      * very heavy load, or from connections from many clients.
      */
     if (rv != 0) {
+        zmq_msg_close(&request);
+
+        if (errno == ETERM)
+            return -1;
+
         log_trace
             ("Failed to call recv(): %s. Sending reconnect error to client",
              zmq_strerror(errno));
 
         reply_send_error(ERROR_ZEROMQ_RECONNECT);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        return 0;
     }
 
     msg_size = zmq_msg_size(&request);
@@ -106,16 +214,17 @@ void zmq_handle_event(void)
         log_trace("Got 0 byte message. Skipping...");
 
         zmq_msg_close(&request);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        reply_send_error(ERROR_ZERO_BYTE_MESSAGE);
+        return 0;
     }
 
     json = malloc(msg_size + 1);
     if (json == NULL) {
         log_error("Failed to allocate memory for JSON message: %s",
-                  "zmq.c:zmq_handle_event()");
+                  "zmq.c:zmq_handle_request()");
+        zmq_msg_close(&request);
         reply_send_error(ERROR_MEMORY_ALLOCATION);
-        return;
+        return 0;
     }
 
     memcpy(json, zmq_msg_data(&request), msg_size);
@@ -126,8 +235,8 @@ void zmq_handle_event(void)
         log_trace("Message contained no data");
 
         free(json);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        reply_send_error(ERROR_ZERO_BYTE_MESSAGE);
+        return 0;
     }
 
     log_trace("Received raw message: '%s'", json);
@@ -153,8 +262,7 @@ void zmq_handle_event(void)
         || (json[0] != '{' && json[strlen(json) - 1] != '}')) {
         free(json);
         reply_send_error(ERROR_JSON_INVALID);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        return 0;
     }
 
     /* Handle JSON parsing and request here. */
@@ -162,22 +270,48 @@ void zmq_handle_event(void)
     if (req == (Request *) - 1) {
         log_error("Failed to allocate memory for new JSON message: %s",
                   json);
+        free(json);
         reply_send_error(ERROR_MEMORY_ALLOCATION);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        return 0;
     } else if (req == NULL) {
         log_error("Failed to parse JSON message: %s", json);
 
         free(json);
         reply_send_error(ERROR_JSON_PARSE);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
+        return 0;
     }
 
     free(json);
-    pthread_mutex_unlock(&zmq_mutex);
 
     zmq_dispatch_event(req);
+
+    return 0;
+}
+
+static void *_zmq_worker(void *thread_data)
+{
+    void *socket;
+
+    thread_data = NULL;
+
+    socket = zmq_socket(zmq_context, ZMQ_REP);
+    if (zmq_connect(socket, ZMQ_WORKER_URI) != 0) {
+        log_error("ZeroMQ worker failed to connect to '%s': %s",
+                  ZMQ_WORKER_URI, zmq_strerror(errno));
+        zmq_close(socket);
+        return NULL;
+    }
+
+    zmq_reply_socket = socket;
+
+    while (1) {
+        if (zmq_handle_request() == -1)
+            break;
+    }
+
+    zmq_close(socket);
+
+    return NULL;
 }
 
 /*
@@ -186,8 +320,8 @@ void zmq_handle_event(void)
 
 static void EVENT_watch(const Request * req)
 {
-    int rv, mask, max_events, rewatch;
-    char *path;
+    int i, rv, mask, max_events, rewatch, flags = 0;
+    char *path, *instance, **ignore;
 
     /* Grab the path from our request, or bail if the user
      * did not supply a valid one.
@@ -214,17 +348,9 @@ static void EVENT_watch(const Request * req)
         return;
     }
 
-    /* Check to see if we're already watching this path. */
-    pthread_mutex_lock(&zmq_mutex);
-    if (inotify_is_root(path)) {
-        log_warn("Path '%s' is already being watched.", path);
-        reply_send_error(ERROR_INOTIFY_ROOT_ALREADY_WATCHED);
-        free(path);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
-    }
-    pthread_mutex_unlock(&zmq_mutex);
-
+    /* Whether we're already watching this path is checked by
+     * inotify_watch_tree(), under the same lock it adds the root in.
+     */
     log_notice("Watching new root at path '%s'", path);
 
     /* Check for user defined configuration overrides. */
@@ -241,6 +367,16 @@ static void EVENT_watch(const Request * req)
         log_debug("New root '%s' is set to be re-watched on startup",
                   path);
 
+    if (request_get_coalesce(req)) {
+        flags |= INOTIFY_ROOT_COALESCE;
+        log_debug("New root '%s' will coalesce events per path", path);
+    }
+
+    if (request_get_pair_moves(req)) {
+        flags |= INOTIFY_ROOT_PAIR_MOVES;
+        log_debug("New root '%s' will pair up move events", path);
+    }
+
     max_events = request_get_max_events(req);
     if (max_events == 0) {
         max_events = CONFIG->max_inotify_events;
@@ -249,8 +385,37 @@ static void EVENT_watch(const Request * req)
         log_debug("Using user defined max events %d", max_events);
     }
 
+    /* Instance names end up in the root dump file, which is
+     * comma and newline delimited.
+     */
+    instance = request_get_instance(req);
+    if (instance != NULL) {
+        if (strpbrk(instance, ",\n") != NULL) {
+            log_warn("Invalid inotify instance name '%s'", instance);
+            reply_send_error(ERROR_INVALID_INSTANCE_NAME);
+            free(path);
+            return;
+        }
+        log_debug("Using user defined inotify instance '%s'", instance);
+    }
+
+    /* Same goes for ignore patterns. */
+    ignore = request_get_ignore(req);
+    for (i = 0; (ignore != NULL) && (ignore[i] != NULL); i++) {
+        if ((*ignore[i] == '\0') || (strpbrk(ignore[i], ",\n") != NULL)) {
+            log_warn("Invalid ignore pattern '%s'", ignore[i]);
+            reply_send_error(ERROR_INVALID_IGNORE_PATTERN);
+            free(ignore);
+            free(path);
+            return;
+        }
+        log_debug("New root '%s' will ignore '%s'", path, ignore[i]);
+    }
+
     /* Watch our new root. */
-    rv = inotify_watch_tree(path, mask, max_events, rewatch);
+    rv = inotify_watch_tree(path, mask, max_events, rewatch, flags,
+                            instance, ignore);
+    free(ignore);
     if (rv != 0) {
         reply_send_error(rv);
         free(path);
@@ -261,11 +426,27 @@ static void EVENT_watch(const Request * req)
     reply_send_success();
 }
 
+/* Start publishing a root's events. The reply tells the client
+ * where to connect its SUB socket and what to subscribe to:
+ *
+ *   {"data":{"uri":"tcp://localhost:5560","topic":"/foo/bar"}}
+ *
+ * The uri is zmq_pub_uri just as it's configured, so if that binds
+ * to a wildcard address the client fills in the host itself. The
+ * topic frame of each message has a NUL after the path, and the
+ * client has to subscribe with that NUL included, or it would also
+ * get the events of any other root whose path starts with this one
+ * (SEE: zmq_publish_batch()).
+ *
+ * From then on the root's events are pushed out as they're queued
+ * (SEE: zmq_publish()) and 'get_events' will only see whatever
+ * hasn't been published yet.
+ */
 static void EVENT_subscribe(const Request * req)
 {
-    int rv, sid;
-    char *path, *reply;
-    Root *root;
+    int rv;
+    char *path;
+    JOBJ jobj, jdata;
 
     path = request_get_path(req);
     if (path == NULL) {
@@ -274,28 +455,52 @@ static void EVENT_subscribe(const Request * req)
         return;
     }
 
-    /* Check to make sure that we're already watching this path. */
-    pthread_mutex_lock(&zmq_mutex);
-    root = inotify_is_root(path);
-    if (!root) {
-        log_warn("Path '%s' is not currently being watched.", path);
-        reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
-        pthread_mutex_unlock(&zmq_mutex);
+    if (zmq_publisher == NULL) {
+        log_warn("Cannot subscribe to '%s' since publishing is off", path);
+        reply_send_error(ERROR_ZEROMQ_NOT_PUBLISHING);
         return;
     }
-    pthread_mutex_unlock(&zmq_mutex);
 
-    sid = 1234;                 /* TODO call to actually subscribe to a root */
-    rv = mk_string(&reply, "{\"data\":%d}", sid);
-    if (rv == -1) {
-        log_error("Failed to allocate memory for SUCCESS reply: %s",
-                  "zmq.c:EVENT_subscribe");
-        reply_send_error(ERROR_MEMORY_ALLOCATION);
+    rv = inotify_publish_tree(path, 1);
+    if (rv != 0) {
+        reply_send_error(rv);
         return;
     }
 
-    reply_send_message(reply);
-    free(reply);
+    jobj = json_object_new_object();
+    jdata = json_object_new_object();
+
+    json_object_object_add(jdata, "uri",
+                           json_object_new_string(CONFIG->zmq_pub_uri));
+    json_object_object_add(jdata, "topic", json_object_new_string(path));
+    json_object_object_add(jobj, "data", jdata);
+
+    reply_send_message((char *) json_object_to_json_string(jobj));
+
+    json_object_put(jobj);
+}
+
+/* Stop publishing a root's events. Events queued from here on wait
+ * for 'get_events' again.
+ */
+static void EVENT_unsubscribe(const Request * req)
+{
+    int rv;
+    char *path = request_get_path(req);
+
+    if (path == NULL) {
+        log_warn("JSON parsed successfully but no 'path' field found");
+        reply_send_error(ERROR_JSON_KEY_NOT_FOUND);
+        return;
+    }
+
+    rv = inotify_publish_tree(path, 0);
+    if (rv != 0) {
+        reply_send_error(rv);
+        return;
+    }
+
+    reply_send_success();
 }
 
 static void EVENT_unwatch(const Request * req)
@@ -318,102 +523,379 @@ static void EVENT_unwatch(const Request * req)
     reply_send_success();
 }
 
-static JOBJ inotify_event_to_jobj(const Event * event)
+/* A buffer that event replies are written into as JSON, grown as
+ * needed. If growing it ever fails 'failed' is set and anything
+ * written after that is dropped, so the writer only has to check
+ * once at the end.
+ */
+typedef struct json_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;
+} JsonBuf;
+
+static void jbuf_reserve(JsonBuf * buf, size_t n)
 {
-    JOBJ jobj;
-    JOBJ jint_mask, jint_cookie;
-    JOBJ jstr_path, jstr_name;
-    /*JOBJ jint_wd, jint_len; UNNEEDED */
+    size_t size;
+    char *data;
 
-    jobj = json_object_new_object();
+    if (buf->failed || (buf->len + n <= buf->size))
+        return;
 
-    jint_mask = json_object_new_int(event->mask);
-    jint_cookie = json_object_new_int(event->cookie);
-    jstr_path = json_object_new_string(event->path);
-    jstr_name = json_object_new_string(event->name);
-    /*jint_len    = json_object_new_int(event->len); */
-    /*jint_wd     = json_object_new_int(event->wd); */
-
-    /* Add our data */
-    json_object_object_add(jobj, "name", jstr_name);
-    json_object_object_add(jobj, "path", jstr_path);
-    json_object_object_add(jobj, "mask", jint_mask);
-
-    /* The inotify cookie value is only set when a file is moved.
-     * for all other operations it's value is 0 (zero). So we only
-     * pass this value on to the user if it has a value other than
-     * zero.
-     */
-    if (event->cookie != 0)
-        json_object_object_add(jobj, "cookie", jint_cookie);
-    else
-        json_object_put(jint_cookie);
+    size = buf->size ? buf->size : 256;
+    while (size < buf->len + n)
+        size *= 2;
 
-    /* The following is data we don't need to pass to the client.
-     *
-     * json_object_object_add(jobj, "wd", jint_wd);
-     * json_object_object_add(jobj, "len", jint_len);
-     */
+    data = realloc(buf->data, size);
+    if (data == NULL) {
+        buf->failed = 1;
+        return;
+    }
 
-    return jobj;
+    buf->data = data;
+    buf->size = size;
+}
+
+static void jbuf_append(JsonBuf * buf, const char *s, size_t n)
+{
+    jbuf_reserve(buf, n);
+    if (buf->failed)
+        return;
+
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+}
+
+static void jbuf_append_uint(JsonBuf * buf, uint32_t v)
+{
+    char tmp[10], *p = tmp + sizeof tmp;
+
+    do {
+        *--p = '0' + (v % 10);
+        v /= 10;
+    } while (v != 0);
+
+    jbuf_append(buf, p, tmp + sizeof tmp - p);
+}
+
+/* Append 's' as a quoted JSON string. Most file names don't need
+ * any escaping at all, so runs of plain characters are copied in
+ * one go. Bytes over 0x7f are passed through as they are, just like
+ * json-c does.
+ */
+static void jbuf_append_string(JsonBuf * buf, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p, *run;
+    char esc[6];
+
+    jbuf_append(buf, "\"", 1);
+
+    for (p = run = (const unsigned char *) s; *p; p++) {
+        if ((*p >= 0x20) && (*p != '"') && (*p != '\\'))
+            continue;
+
+        jbuf_append(buf, (const char *) run, p - run);
+        run = p + 1;
+
+        esc[0] = '\\';
+        switch (*p) {
+        case '"':
+        case '\\':
+            esc[1] = *p;
+            break;
+        case '\b':
+            esc[1] = 'b';
+            break;
+        case '\f':
+            esc[1] = 'f';
+            break;
+        case '\n':
+            esc[1] = 'n';
+            break;
+        case '\r':
+            esc[1] = 'r';
+            break;
+        case '\t':
+            esc[1] = 't';
+            break;
+        default:
+            esc[1] = 'u';
+            esc[2] = '0';
+            esc[3] = '0';
+            esc[4] = hex[*p >> 4];
+            esc[5] = hex[*p & 0xf];
+            jbuf_append(buf, esc, 6);
+            continue;
+        }
+        jbuf_append(buf, esc, 2);
+    }
+
+    jbuf_append(buf, (const char *) run, p - run);
+    jbuf_append(buf, "\"", 1);
+}
+
+/* Write a list of events, which may be NULL, straight out as the
+ * JSON for a 'get_events' reply:
+ *
+ *   {"data":[{"name":"...","path":"...","mask":256}, ...]}
+ *
+ * rather than building a tree of json-c objects for every event and
+ * then turning that into a string, and copying it, again.
+ *
+ * The inotify cookie value is only set when a file is moved. For
+ * all other operations its value is 0 (zero), so we only pass it on
+ * to the user if it has a value other than zero. A rename paired up
+ * by the daemon is a single event, with both where the file was and
+ * where it is now. The wd and len are of no use to the client.
+ *
+ * Returns a malloc()ed buffer with the JSON in it, and its length in
+ * 'size', or NULL if it couldn't be allocated.
+ */
+char *zmq_events_to_json(Event ** events, size_t * size)
+{
+    int i;
+    JsonBuf buf = { NULL, 0, 0, 0 };
+
+    for (i = 0; events && events[i]; i++);
+    jbuf_reserve(&buf, 16 + i * 128);
+
+    jbuf_append(&buf, "{\"data\":[", 9);
+
+    for (i = 0; events && events[i]; i++) {
+        if (i > 0)
+            jbuf_append(&buf, ",", 1);
+
+        jbuf_append(&buf, "{\"name\":", 8);
+        jbuf_append_string(&buf, events[i]->name);
+        jbuf_append(&buf, ",\"path\":", 8);
+        jbuf_append_string(&buf, events[i]->path);
+        jbuf_append(&buf, ",\"mask\":", 8);
+        jbuf_append_uint(&buf, events[i]->mask);
+
+        if (events[i]->cookie != 0) {
+            jbuf_append(&buf, ",\"cookie\":", 10);
+            jbuf_append_uint(&buf, events[i]->cookie);
+        }
+
+        if (events[i]->old_path != NULL) {
+            jbuf_append(&buf, ",\"old_path\":", 12);
+            jbuf_append_string(&buf, events[i]->old_path);
+            jbuf_append(&buf, ",\"old_name\":", 12);
+            jbuf_append_string(&buf, events[i]->old_name);
+        }
+
+        jbuf_append(&buf, "}", 1);
+    }
+
+    jbuf_append(&buf, "]}", 2);
+
+    if (buf.failed) {
+        log_error("Failed to allocate memory for events JSON: %s",
+                  "zmq.c:zmq_events_to_json()");
+        free(buf.data);
+        return NULL;
+    }
+
+    *size = buf.len;
+
+    return buf.data;
+}
+
+static char *put_le16(char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static char *put_le32(char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+/* Encode a list of events in the binary format described in
+ * zeromq.h, into a single malloc()ed buffer. Paths can't be longer
+ * than PATH_MAX, so their lengths always fit in 16 bits. Returns
+ * NULL if the buffer couldn't be allocated.
+ */
+char *zmq_events_to_binary(Event ** events, size_t * size)
+{
+    int i, count;
+    size_t len;
+    uint16_t lens[4];
+    char *buf, *p;
+
+    len = ZMQ_BINARY_HEADER_LEN;
+    for (count = 0; events && events[count]; count++) {
+        len += ZMQ_BINARY_EVENT_LEN + strlen(events[count]->path) +
+            strlen(events[count]->name);
+        if (events[count]->old_path != NULL)
+            len += strlen(events[count]->old_path) +
+                strlen(events[count]->old_name);
+    }
+
+    buf = malloc(len);
+    if (buf == NULL) {
+        log_error("Failed to allocate memory for binary events: %s",
+                  "zmq.c:zmq_events_to_binary()");
+        return NULL;
+    }
+
+    memcpy(buf, ZMQ_BINARY_MAGIC, 4);
+    p = put_le32(buf + 4, count);
+
+    for (i = 0; i < count; i++) {
+        lens[0] = strlen(events[i]->path);
+        lens[1] = strlen(events[i]->name);
+        lens[2] = events[i]->old_path ? strlen(events[i]->old_path) : 0;
+        lens[3] = events[i]->old_name ? strlen(events[i]->old_name) : 0;
+
+        p = put_le32(p, events[i]->mask);
+        p = put_le32(p, events[i]->cookie);
+        p = put_le16(p, lens[0]);
+        p = put_le16(p, lens[1]);
+        p = put_le16(p, lens[2]);
+        p = put_le16(p, lens[3]);
+
+        memcpy(p, events[i]->path, lens[0]);
+        p += lens[0];
+        memcpy(p, events[i]->name, lens[1]);
+        p += lens[1];
+        if (lens[2] != 0)
+            memcpy(p, events[i]->old_path, lens[2]);
+        p += lens[2];
+        if (lens[3] != 0)
+            memcpy(p, events[i]->old_name, lens[3]);
+        p += lens[3];
+    }
+
+    *size = len;
+
+    return buf;
 }
 
 static void EVENT_get_queue_size(const Request * req)
 {
     int rv;
     char *reply;
-    Root *root;
-    guint size;
+    int size;
 
     const char *path = request_get_path(req);
 
     if (path == NULL) {
         log_warn("JSON parsed successfully but no 'path' field found");
         reply_send_error(ERROR_JSON_KEY_NOT_FOUND);
-        pthread_mutex_unlock(&zmq_mutex);
         return;
     }
 
-    pthread_mutex_lock(&zmq_mutex);
-    root = inotify_is_root(path);
+    size = inotify_queue_size(path);
 
-    if (root == NULL) {
+    if (size == -1) {
         log_warn("Path '%s' is not a currently watch root", path);
         reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
-        pthread_mutex_unlock(&zmq_mutex);
-        return;
-    } else if (root->destroy) {
-        log_warn
-            ("Cannot get queue size as tree at root '%s' is being destroyed",
-             path);
-        reply_send_message("{\"data\":0}");
-        pthread_mutex_unlock(&zmq_mutex);
         return;
     }
 
-    size = g_queue_get_length(root->queue);
-
     rv = mk_string(&reply, "{\"data\":%d}", size);
     if (rv == -1) {
         log_error("Failed to allocate memory for reply JSON: %s",
                   "zmq.c:EVENT_get_queue_size");
         reply_send_error(ERROR_MEMORY_ALLOCATION);
-        pthread_mutex_unlock(&zmq_mutex);
         return;
     }
 
     reply_send_message(reply);
     free(reply);
+}
+
+static const char *crawl_state_names[] = { "queued", "crawling",
+    "complete"
+};
+
+/* JSON for one root's CrawlStats, for 'status' and 'get_crawl_status'. */
+static JOBJ crawl_stats_to_json(const CrawlStats * stats)
+{
+    JOBJ jobj = json_object_new_object();
+
+    json_object_object_add(jobj, "path",
+                           json_object_new_string(stats->path));
+    json_object_object_add(jobj, "state",
+                           json_object_new_string(crawl_state_names
+                                                  [stats->state]));
+    json_object_object_add(jobj, "dirs",
+                           json_object_new_int((int) stats->dirs));
+    json_object_object_add(jobj, "found",
+                           json_object_new_int((int) stats->found));
+    json_object_object_add(jobj, "secs",
+                           json_object_new_double(stats->secs));
+    json_object_object_add(jobj, "dirs_per_sec",
+                           json_object_new_double(stats->dirs_per_sec));
+    json_object_object_add(jobj, "eta",
+                           json_object_new_double(stats->eta));
+
+    return jobj;
+}
+
+static void EVENT_get_crawl_status(const Request * req)
+{
+    int i, count;
+    CrawlStats *stats;
+    JOBJ jobj, jarr;
+
+    const char *path = request_get_path(req);
+
+    stats = inotify_get_crawl_stats(path, &count);
+
+    if (stats == NULL) {
+        if (path != NULL) {
+            log_warn("Path '%s' is not a currently watch root", path);
+            reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
+        } else {
+            reply_send_error(ERROR_MEMORY_ALLOCATION);
+        }
+        return;
+    }
 
-    pthread_mutex_unlock(&zmq_mutex);
+    jobj = json_object_new_object();
+
+    /* Just the one root if we were given a path, otherwise all of
+     * them.
+     */
+    if (path != NULL) {
+        json_object_object_add(jobj, "data", crawl_stats_to_json(stats));
+    } else {
+        jarr = json_object_new_array();
+        for (i = 0; i < count; i++)
+            json_object_array_add(jarr, crawl_stats_to_json(&stats[i]));
+        json_object_object_add(jobj, "data", jarr);
+    }
+
+    reply_send_message((char *) json_object_to_json_string(jobj));
+
+    json_object_put(jobj);
+    inotify_free_crawl_stats(stats, count);
 }
 
 static void EVENT_status(void)
 {
-    int rv, num_watches;
+    int i, j, rv, num_watches, num_instances, num_locks, num_crawls;
     int secs, mins, hours, days;
-    char *reply;
+    double events_per_batch, batches_per_sec;
+    char *uptime;
     pid_t pid;
+    InstanceStats *instances;
+    CrawlStats *crawls;
+    Crawl_Stats crawler;
+    Pool_Stats pool;
+    Zmq_Worker_Stats workers;
+    LockStats locks[4];
+    JOBJ jobj, jarr, jinst, jhist;
 
     pid = getpid();
     secs = time(NULL) - start_time;
@@ -422,10 +904,9 @@ static void EVENT_status(void)
     days = hours / 24;
 
     num_watches = inotify_num_watched_dirs();
+    inotify_get_drain_stats(&events_per_batch, &batches_per_sec);
 
-    rv = mk_string(&reply,
-                   "{\"pid\":%d,\"watches\":%d,\"uptime\":\"%dd %dh %dm %ds\"}",
-                   pid, num_watches, days, (hours - (days * 24)),
+    rv = mk_string(&uptime, "%dd %dh %dm %ds", days, (hours - (days * 24)),
                    (mins - (hours * 60)), (secs - (mins * 60)));
     if (rv == -1) {
         log_error("Failed to allocate memory for reply JSON: %s",
@@ -434,8 +915,121 @@ static void EVENT_status(void)
         return;
     }
 
-    reply_send_message(reply);
-    free(reply);
+    instances = inotify_get_instance_stats(&num_instances);
+    num_locks = inotify_get_lock_stats(locks, 4);
+    crawls = inotify_get_crawl_stats(NULL, &num_crawls);
+    crawl_get_stats(&crawler);
+    pool_get_stats(&pool);
+    zmq_get_worker_stats(&workers);
+
+    jobj = json_object_new_object();
+    json_object_object_add(jobj, "pid", json_object_new_int(pid));
+    json_object_object_add(jobj, "watches",
+                           json_object_new_int(num_watches));
+    json_object_object_add(jobj, "uptime", json_object_new_string(uptime));
+    json_object_object_add(jobj, "events_per_batch",
+                           json_object_new_double(events_per_batch));
+    json_object_object_add(jobj, "batches_per_sec",
+                           json_object_new_double(batches_per_sec));
+
+    /* One entry for each inotify instance (kernel event queue). */
+    jarr = json_object_new_array();
+    for (i = 0; i < num_instances; i++) {
+        jinst = json_object_new_object();
+        json_object_object_add(jinst, "name",
+                               json_object_new_string(instances[i].name));
+        json_object_object_add(jinst, "roots",
+                               json_object_new_int(instances[i].roots));
+        json_object_object_add(jinst, "watches",
+                               json_object_new_int(instances[i].watches));
+        json_object_object_add(jinst, "events",
+                               json_object_new_int((int)
+                                                   instances[i].events));
+        json_object_object_add(jinst, "overflows",
+                               json_object_new_int((int)
+                                                   instances[i].
+                                                   overflows));
+        json_object_array_add(jarr, jinst);
+    }
+    json_object_object_add(jobj, "instances", jarr);
+
+    /* How each root's crawl is getting on. */
+    jarr = json_object_new_array();
+    for (i = 0; i < num_crawls; i++)
+        json_object_array_add(jarr, crawl_stats_to_json(&crawls[i]));
+    json_object_object_add(jobj, "crawls", jarr);
+
+    /* How busy the crawler and background threads are. */
+    jinst = json_object_new_object();
+    json_object_object_add(jinst, "threads",
+                           json_object_new_int(crawler.threads));
+    json_object_object_add(jinst, "idle", json_object_new_int(crawler.idle));
+    json_object_object_add(jinst, "queued",
+                           json_object_new_int(crawler.queued));
+    json_object_object_add(jinst, "crawls",
+                           json_object_new_int(crawler.crawls));
+    json_object_object_add(jobj, "crawler", jinst);
+
+    jinst = json_object_new_object();
+    json_object_object_add(jinst, "threads",
+                           json_object_new_int(pool.threads));
+    json_object_object_add(jinst, "busy", json_object_new_int(pool.busy));
+    json_object_object_add(jinst, "queued", json_object_new_int(pool.queued));
+    json_object_object_add(jinst, "delayed",
+                           json_object_new_int(pool.delayed));
+    json_object_object_add(jinst, "max_queued",
+                           json_object_new_int(pool.max_queued));
+    json_object_object_add(jinst, "run", json_object_new_int((int) pool.run));
+    json_object_object_add(jinst, "cancelled",
+                           json_object_new_int((int) pool.cancelled));
+    json_object_object_add(jobj, "pool", jinst);
+
+    jinst = json_object_new_object();
+    json_object_object_add(jinst, "threads",
+                           json_object_new_int(workers.threads));
+    json_object_object_add(jinst, "busy", json_object_new_int(workers.busy));
+    json_object_object_add(jinst, "requests",
+                           json_object_new_int((int) workers.requests));
+    json_object_object_add(jobj, "workers", jinst);
+
+    /* How long each of our locks has been held for. 'hold_us' is a
+     * histogram: entry i counts the holds that took less than 2^i
+     * microseconds, and the last entry everything longer.
+     */
+    jarr = json_object_new_array();
+    for (i = 0; i < num_locks; i++) {
+        jinst = json_object_new_object();
+        json_object_object_add(jinst, "name",
+                               json_object_new_string(locks[i].name));
+        json_object_object_add(jinst, "holds",
+                               json_object_new_int((int) locks[i].holds));
+        json_object_object_add(jinst, "avg_us",
+                               json_object_new_double(locks[i].holds
+                                                      ? locks[i].total_ns
+                                                      / 1000.0 /
+                                                      locks[i].holds :
+                                                      0));
+        json_object_object_add(jinst, "max_us",
+                               json_object_new_double(locks[i].max_ns /
+                                                      1000.0));
+
+        jhist = json_object_new_array();
+        for (j = 0; j < INOTIFY_LOCK_BUCKETS; j++)
+            json_object_array_add(jhist,
+                                  json_object_new_int((int)
+                                                      locks[i].hold_us[j]));
+        json_object_object_add(jinst, "hold_us", jhist);
+
+        json_object_array_add(jarr, jinst);
+    }
+    json_object_object_add(jobj, "locks", jarr);
+
+    reply_send_message((char *) json_object_to_json_string(jobj));
+
+    json_object_put(jobj);
+    inotify_free_instance_stats(instances, num_instances);
+    inotify_free_crawl_stats(crawls, num_crawls);
+    free(uptime);
 }
 
 static void EVENT_pause(const Request * req)
@@ -452,12 +1046,6 @@ static void EVENT_pause(const Request * req)
         return;
     }
 
-    if (inotify_is_root(path) == NULL) {
-        log_warn("Path '%s' is not a currently watch root", path);
-        reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
-        return;
-    }
-
     /* First pause the queue... */
     rv = inotify_pause_tree(path);
     if (rv != 0) {
@@ -468,7 +1056,8 @@ static void EVENT_pause(const Request * req)
 
     /* ... then flush all it's events. */
     events = inotify_get_events(path, 0);
-    inotify_free_events(events);
+    if ((events != NULL) && (events != (Event **) - 1))
+        inotify_free_events(events);
 
     reply_send_success();
 }
@@ -486,12 +1075,6 @@ static void EVENT_unpause(const Request * req)
         return;
     }
 
-    if (inotify_is_root(path) == NULL) {
-        log_warn("Path '%s' is not a currently watch root", path);
-        reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
-        return;
-    }
-
     /* Unpause the queue. */
     rv = inotify_unpause_tree(path);
     if (rv != 0) {
@@ -503,12 +1086,30 @@ static void EVENT_unpause(const Request * req)
     reply_send_success();
 }
 
+/* Send a list of events, which may be NULL, in the given format. */
+static void reply_send_events(Event ** events, int format)
+{
+    size_t size;
+    char *buf;
+
+    if (format == REQUEST_FORMAT_BINARY)
+        buf = zmq_events_to_binary(events, &size);
+    else
+        buf = zmq_events_to_json(events, &size);
+
+    if (buf == NULL) {
+        reply_send_error(ERROR_MEMORY_ALLOCATION);
+        return;
+    }
+
+    reply_send_buffer(buf, size);
+}
+
 static void EVENT_get_events(const Request * req)
 {
-    int i, count;
+    int count, format;
     char *path;
     Event **events;
-    JOBJ jobj, jarr;
 
     path = request_get_path(req);
 
@@ -518,7 +1119,7 @@ static void EVENT_get_events(const Request * req)
         return;
     }
 
-    if (inotify_is_root(path) == NULL) {
+    if (!inotify_is_watched(path)) {
         log_warn("Path '%s' is not a currently watch root", path);
         reply_send_error(ERROR_INOTIFY_ROOT_NOT_WATCHED);
         return;
@@ -531,6 +1132,12 @@ static void EVENT_get_events(const Request * req)
         return;
     }
 
+    format = request_get_format(req);
+    if (format == -1) {
+        reply_send_error(ERROR_INVALID_FORMAT);
+        return;
+    }
+
     log_trace("Trying to get %d events for root '%s'", count, path);
     events = inotify_get_events(path, count);
     if (events == (Event **) - 1) {
@@ -538,30 +1145,85 @@ static void EVENT_get_events(const Request * req)
         return;
     }
 
-    if (events == NULL) {
+    if (events == NULL)
         log_trace("No events found for root at path '%s'", path);
-        reply_send_message("{\"data\":[]}");
-        return;
-    }
 
-    jobj = json_object_new_object();
-    jarr = json_object_new_array();
+    reply_send_events(events, format);
 
-    for (i = 0; events[i]; i++) {
-        json_object_array_add(jarr, inotify_event_to_jobj(events[i]));
-    }
-    json_object_object_add(jobj, "data", jarr);
+    if (events != NULL)
+        inotify_free_events(events);
+}
 
-    reply_send_message((char *) json_object_to_json_string(jobj));
+/* Send one batch of events for 'path' out on the PUB socket as a
+ * two part message: the root's path as the topic, then the JSON.
+ * Returns 0 on success or -1 if the send failed.
+ *
+ * 0MQ subscriptions match on prefix, so the topic is the path with
+ * its terminating NUL. A subscription to "/foo/bar\0" then can't
+ * also match "/foo/bar2", which a bare "/foo/bar" would.
+ */
+static int zmq_publish_batch(const char *path, Event ** events)
+{
+    int rv;
+    size_t len;
+    char *json;
+    zmq_msg_t topic, body;
+
+    json = zmq_events_to_json(events, &len);
+    if (json == NULL)
+        return -1;
+
+    /* The JSON goes out as it is, and 0MQ frees it when it's done. */
+    zmq_msg_init_data(&body, json, len, reply_free_buffer, NULL);
+
+    len = strlen(path) + 1;
+    zmq_msg_init_size(&topic, len);
+    memcpy(zmq_msg_data(&topic), path, len);
 
-    inotify_free_events(events);
+    rv = zmq_send(zmq_publisher, &topic, ZMQ_SNDMORE | ZMQ_NOBLOCK);
+    if (rv == 0)
+        rv = zmq_send(zmq_publisher, &body, ZMQ_NOBLOCK);
 
-    /* Using json-c, when you create new json_objects you need
-     * to "put" them in order to get the correct memory freeing
-     * when they fall out of scope. This is essentially json-c's
-     * way of preemptively freeing dynamically allocated data.
+    if (rv != 0)
+        log_warn("Failed to publish events for root '%s': %s", path,
+                 zmq_strerror(errno));
+
+    zmq_msg_close(&topic);
+    zmq_msg_close(&body);
+
+    return (rv == 0) ? 0 : -1;
+}
+
+void zmq_publish(void)
+{
+    int i;
+    char **paths;
+    Event **events;
+
+    if (zmq_publisher == NULL)
+        return;
+
+    paths = inotify_get_publish_roots();
+    if (paths == NULL)
+        return;
+
+    /* A PUB socket never blocks, it drops messages for subscribers
+     * that have hit their high water mark. So there's nothing to be
+     * gained by leaving events queued when a send fails; they're
+     * gone either way.
      */
-    json_object_put(jobj);
+    for (i = 0; paths[i]; i++) {
+        while ((events = inotify_get_events(paths[i], ZMQ_PUB_BATCH))
+               != NULL) {
+            if (events == (Event **) - 1)
+                break;
+
+            zmq_publish_batch(paths[i], events);
+            inotify_free_events(events);
+        }
+    }
+
+    g_strfreev(paths);
 }
 
 /* This is just a way for client code to see all of the
@@ -607,6 +1269,9 @@ static void zmq_dispatch_event(Request * req)
 {
     char *call = req->call;
 
+    __atomic_add_fetch(&zmq_busy_workers, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&zmq_requests, 1, __ATOMIC_RELAXED);
+
     log_debug("Dispatching call '%s' with data '%s'",
               call, request_to_string(req));
 
@@ -622,6 +1287,8 @@ static void zmq_dispatch_event(Request * req)
         EVENT_unpause(req);
     } else if (strcmp(call, "subscribe") == 0) {
         EVENT_subscribe(req);
+    } else if (strcmp(call, "unsubscribe") == 0) {
+        EVENT_unsubscribe(req);
     } else if (strcmp(call, "unwatch") == 0) {
         EVENT_unwatch(req);
     } else if (strcmp(call, "get_events") == 0) {
@@ -630,10 +1297,14 @@ static void zmq_dispatch_event(Request * req)
         EVENT_get_queue_size(req);
     } else if (strcmp(call, "get_roots") == 0) {
         EVENT_get_roots();
+    } else if (strcmp(call, "get_crawl_status") == 0) {
+        EVENT_get_crawl_status(req);
     } else {
         log_warn("Unknown call: '%s'", call);
         reply_send_error(ERROR_BAD_CALL);
     }
 
     request_free(req);
+
+    __atomic_sub_fetch(&zmq_busy_workers, 1, __ATOMIC_RELAXED);
 }
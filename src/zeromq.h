@@ -30,45 +30,119 @@
 #define _INOTISPY_ZMQ_H_
 
 #include "request.h"
+#include "inotify.h"
 
 #include <zmq.h>
+#include <stddef.h>
 
 #ifndef _INOTISPY_ZMQ_H_META_
 #define _INOTISPY_ZMQ_H_META_
 
 #define ZMQ_URI         "tcp://*:5559"
+#define ZMQ_PUB_URI     "tcp://*:5560"
 #define ZMQ_THREADS     16
 #define ZMQ_MAX_MSG_LEN 1024
 
-/* 0MQ context and socket for client connections. */
+/* Requests are handed out to this many worker threads by default
+ * (SEE: zmq_workers in inotispy.conf), over this in-process socket.
+ */
+#define ZMQ_WORKERS     4
+#define ZMQ_MAX_WORKERS 64
+#define ZMQ_WORKER_URI  "inproc://inotispy-workers"
+
+/* The most events put in a single published message, and the most
+ * messages the PUB socket will hold on to for a slow subscriber
+ * before it starts dropping them.
+ */
+#define ZMQ_PUB_BATCH   1024
+#define ZMQ_PUB_HWM     1000
+
+/* The binary encoding of events, for 'get_events' requests with
+ * "format":"binary". Everything is little endian. The message starts
+ * with
+ *
+ *   char     magic[4]     "ISPB" (never '{', unlike any JSON reply)
+ *   uint32_t count        number of events that follow
+ *
+ * and then each event is a 16 byte header
+ *
+ *   uint32_t mask
+ *   uint32_t cookie
+ *   uint16_t path_len
+ *   uint16_t name_len
+ *   uint16_t old_path_len  0 unless it's a paired move
+ *   uint16_t old_name_len
+ *
+ * followed by that many bytes of path, name, old_path and old_name,
+ * in that order and without terminating NULs. The next event's
+ * header comes straight after, with no padding.
+ */
+#define ZMQ_BINARY_MAGIC         "ISPB"
+#define ZMQ_BINARY_HEADER_LEN    8
+#define ZMQ_BINARY_EVENT_LEN     16
+
+/* 0MQ context and socket for client connections, the socket the
+ * requests are passed on to the workers over, and the socket
+ * events are published on (NULL if publishing is turned off).
+ */
 void *zmq_context;
 void *zmq_listener;
+void *zmq_workers;
+void *zmq_publisher;
+
+/* The socket the calling thread should send its reply on. Each
+ * worker has its own (SEE: reply.c).
+ */
+extern __thread void *zmq_reply_socket;
+
+typedef struct zmq_worker_stats {
+    int threads;
+    int busy;                   /* Workers handling a request right now */
+    unsigned long requests;     /* Requests handled since start up */
+} Zmq_Worker_Stats;
 
 #endif /*_INOTISPY_ZMQ_H_META_*/
 
 /* Initialization. Set up our 0MQ file descriptor and our ZMQ_*
  * socket listeners.
  *
- * XXX: At the time of this writing this daemon only supports
- *      the REQ/REP request/reply 0MQ pattern. In the future
- *      it also might (should) support the PUB/SUB publisher/
- *      subscriber pattern so that clients don't have to
- *      implement their own polling mechanism for retreiving
- *      inotify events.
+ * Clients send their requests to the ROUTER (XREP) socket at zmq_uri,
+ * so as far as they're concerned it behaves just like a REP socket.
+ * A queue device on its own thread passes the requests on through a
+ * DEALER (XREQ) socket to a pool of zmq_workers worker threads, each
+ * with its own REP socket, and the replies back again. A client
+ * pulling tens of thousands of events, or a slow one, then only ties
+ * up one worker, and never the main loop that's draining inotify.
+ *
+ * On top of that, roots a client has subscribed to have their events
+ * pushed out on a PUB socket at zmq_pub_uri (SEE: zmq_publish()),
+ * so clients don't have to keep polling with 'get_events'.
+ *
+ * Returns NULL if any of it couldn't be set up.
  */
 void *zmq_setup(void);
 
-/* When a 0MQ event comes in over the wire this is the function
- * that will get invoked. This function serves mainly as a
- * sanity checker and forwarder. What it does is:
+/* Publish everything that's been queued for subscribed roots since
+ * the last call. Each root's events go out in messages of two parts:
+ * the root's path and its terminating NUL, which is what subscribers
+ * filter on (they must include the NUL), followed by the same JSON a
+ * 'get_events' call would have returned, with at most ZMQ_PUB_BATCH
+ * events in it. Published events are taken off the root's queue.
  *
- * 1. Grab the message off the wire
- * 2. Dirty check to see if the message looks like JSON. (Bail if not)
- * 3. Parse JSON and see if it has a "call" field. (Bail if not)
- * 4. If JSON parsed successfully and there was a "call" field
- *    create a Request struct/blob and send that off to the dispatcher.
+ * Called every time around the main loop.
+ */
+void zmq_publish(void);
+
+/* Encode a NULL terminated list of events, which may itself be NULL,
+ * as the JSON of a 'get_events' reply, or in the binary format above.
+ * Returns a malloc()ed buffer, with its length in 'size', or NULL if
+ * it couldn't be allocated.
  */
-void zmq_handle_event(void);
+char *zmq_events_to_json(Event ** events, size_t * size);
+char *zmq_events_to_binary(Event ** events, size_t * size);
+
+/* Get the worker pool's numbers, for 'status'. */
+void zmq_get_worker_stats(Zmq_Worker_Stats * stats);
 
 /* Clean up stuff */
 void zmq_cleanup(void);
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Bytes and nanoseconds per event to encode a 'get_events' reply as
+ * JSON and in the binary format (SEE: zeromq.h), for replies of 1,
+ * 100 and 10,000 events. One event in ten is a paired move.
+ *
+ * Usage: bench_encode [events] (default 1000000 in total per size)
+ */
+
+#include "zeromq.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH  "/var/www/example.com/htdocs/images/2011/06"
+
+static void bench(int num, int batch)
+{
+    int i, n;
+    size_t size, json_bytes = 0, binary_bytes = 0;
+    double start, json_secs, binary_secs;
+    char *names;
+    Event *e, **events;
+
+    events = malloc((batch + 1) * sizeof *events);
+    e = malloc(batch * sizeof(Event));
+    names = malloc(batch * 32);
+
+    for (i = 0; i < batch; i++) {
+        snprintf(names + i * 32, 32, "thumbnail_%06d.jpg", i);
+
+        e[i].wd = 1;
+        e[i].mask = IN_CLOSE_WRITE;
+        e[i].cookie = 0;
+        e[i].len = 0;
+        e[i].path = PATH;
+        e[i].name = names + i * 32;
+        e[i].old_path = NULL;
+        e[i].old_name = NULL;
+
+        if (i % 10 == 9) {
+            e[i].mask = IN_MOVED_FROM | IN_MOVED_TO;
+            e[i].cookie = 1000 + i;
+            e[i].old_path = PATH;
+            e[i].old_name = "upload.tmp";
+        }
+
+        events[i] = &e[i];
+    }
+    events[i] = NULL;
+
+    start = test_now();
+    for (n = 0; n < num; n += batch) {
+        free(zmq_events_to_json(events, &size));
+        json_bytes += size;
+    }
+    json_secs = test_now() - start;
+
+    start = test_now();
+    for (n = 0; n < num; n += batch) {
+        free(zmq_events_to_binary(events, &size));
+        binary_bytes += size;
+    }
+    binary_secs = test_now() - start;
+
+    printf("%5d events/reply: JSON %5.1f bytes %6.1f ns/event, "
+           "binary %5.1f bytes %6.1f ns/event\n", batch,
+           (double) json_bytes / n, json_secs * 1e9 / n,
+           (double) binary_bytes / n, binary_secs * 1e9 / n);
+
+    free(names);
+    free(e);
+    free(events);
+}
+
+int main(int argc, char **argv)
+{
+    int num = 1000000;
+
+    if (argc > 1)
+        num = atoi(argv[1]);
+
+    if (num <= 0) {
+        fprintf(stderr, "Usage: %s [events]\n", argv[0]);
+        return 1;
+    }
+
+    test_init();
+
+    bench(num, 1);
+    bench(num, 100);
+    bench(num, 10000);
+
+    return 0;
+}
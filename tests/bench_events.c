@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Events per second through inotify_handle_event() with 10, 1,000
+ * and 10,000 roots watched.
+ *
+ * Each root is a single empty directory. Files are closed after
+ * writing in the last root a burst at a time, and the events are
+ * handled and drained from the root's queue before the next burst,
+ * so the rate includes the kernel's side of things as well as ours.
+ * Finding the root an event belongs to used to cost a walk over every
+ * root, which is what this is meant to show.
+ *
+ * Usage: bench_events [events per root count] (default 100000)
+ */
+
+#include "config.h"
+#include "inotify.h"
+#include "test.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BURST 1000
+
+static int ingest_fd;
+
+/* Handle whatever's come in within the next 'msecs' milliseconds. */
+static void pump(int msecs)
+{
+    struct pollfd pfd = {.fd = ingest_fd,.events = POLLIN };
+
+    if (poll(&pfd, 1, msecs) > 0)
+        inotify_handle_event();
+}
+
+/* Take everything queued for 'root', returning how many there were. */
+static int drain(const char *root)
+{
+    int n = 0;
+    Event **events;
+
+    events = inotify_get_events(root, 0);
+    if (events == NULL)
+        return 0;
+
+    while (events[n] != NULL)
+        ++n;
+
+    inotify_free_events(events);
+    return n;
+}
+
+static void bench(int num_roots, int num_events)
+{
+    int i, n, left, fd, got, sent, rv;
+    char *dir, path[PATH_MAX], file[PATH_MAX];
+    double start, secs, wait;
+
+    dir = test_mkdtemp();
+
+    for (i = 0; i < num_roots; i++) {
+        snprintf(path, sizeof path, "%s/r%05d", dir, i);
+        mkdir(path, 0755);
+
+        rv = inotify_watch_tree(path, IN_CLOSE_WRITE, 2 * BURST, 0, 0,
+                                NULL, NULL);
+        if (rv != 0) {
+            fprintf(stderr, "Failed to watch '%s': %d\n", path, rv);
+            exit(1);
+        }
+    }
+
+    /* Wait for the crawls to add every root's watch. */
+    start = test_now();
+    while ((inotify_num_watched_dirs() < num_roots)
+           && (test_now() - start < 60))
+        pump(10);
+
+    got = 0;
+    sent = 0;
+    snprintf(path, sizeof path, "%s/r%05d", dir, num_roots - 1);
+
+    /* Out of the way with the crawl's completion marker. */
+    drain(path);
+
+    start = test_now();
+
+    while (sent < num_events) {
+        for (n = 0; (n < BURST) && (sent < num_events); n++, sent++) {
+            snprintf(file, sizeof file, "%s/f%d", path, sent % 64);
+            fd = open(file, O_WRONLY | O_CREAT, 0644);
+            if (fd != -1)
+                close(fd);
+        }
+
+        left = n;
+        for (wait = test_now(); (left > 0) && (test_now() - wait < 5);) {
+            pump(10);
+            left -= drain(path);
+        }
+
+        got += n - left;
+    }
+
+    secs = test_now() - start;
+
+    printf("%6d roots: %8d events in %7.3fs = %10.0f events/sec\n",
+           num_roots, got, secs, got / secs);
+
+    for (i = 0; i < num_roots; i++) {
+        snprintf(path, sizeof path, "%s/r%05d", dir, i);
+        inotify_unwatch_tree(path);
+    }
+
+    /* Let the unwatches finish before the next round. */
+    start = test_now();
+    while ((inotify_num_watched_dirs() > 0) && (test_now() - start < 60))
+        pump(10);
+
+    test_rmtree(dir);
+    free(dir);
+}
+
+int main(int argc, char **argv)
+{
+    int num_events = 100000;
+
+    if (argc > 1)
+        num_events = atoi(argv[1]);
+
+    test_init();
+
+    ingest_fd = inotify_setup();
+    if (ingest_fd == 0) {
+        fprintf(stderr, "Failed to set up inotify\n");
+        return 1;
+    }
+
+    bench(10, num_events);
+    bench(1000, num_events);
+    bench(10000, num_events);
+
+    return 0;
+}
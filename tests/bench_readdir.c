@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Nanoseconds per directory entry to walk a tree with readdir(), the
+ * way the crawl used to, and with crawl_readdir()'s getdents64() into
+ * a CRAWL_BUF_SIZE buffer.
+ *
+ * Each walk is timed twice: once trusting d_type where the file
+ * system fills it in, and once looking up every entry's type, which
+ * is what happens on a file system that leaves d_type as DT_UNKNOWN
+ * (XFS and ZFS for instance). The readdir() walk builds each entry's
+ * path and lstat()s that, as before, the getdents64() one uses
+ * fstatat() against the open directory.
+ *
+ * The caches are warm; the best of several runs is reported.
+ *
+ * Usage: bench_readdir [dir]
+ *
+ * Without a 'dir' a directory of 100,000 files and 1,000
+ * subdirectories is made under $TMPDIR (or /tmp) and timed instead.
+ */
+
+#include "crawl.h"
+#include "utils.h"
+#include "test.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FILES  100000
+#define DIRS   1000
+#define RUNS   5
+#define DEPTH  64
+
+typedef struct walk {
+    int force_stat;
+    long entries;
+    int depth;
+    char *bufs[DEPTH];          /* A CRAWL_BUF_SIZE buffer per level */
+} Walk;
+
+static int is_dir(unsigned char type, const struct stat *stat_buf)
+{
+    if (type == DT_UNKNOWN)
+        return S_ISDIR(stat_buf->st_mode);
+
+    return type == DT_DIR;
+}
+
+static void walk_readdir(Walk * walk, const char *path)
+{
+    char *tmp;
+    DIR *d;
+    struct dirent *dir;
+    struct stat stat_buf;
+    unsigned char type;
+
+    d = opendir(path);
+    if (d == NULL)
+        return;
+
+    while ((dir = readdir(d))) {
+        if (strcmp(dir->d_name, ".") == 0
+            || strcmp(dir->d_name, "..") == 0)
+            continue;
+
+        ++walk->entries;
+
+        if (mk_string(&tmp, "%s/%s", path, dir->d_name) == -1)
+            break;
+
+        type = walk->force_stat ? DT_UNKNOWN : dir->d_type;
+        if ((type == DT_UNKNOWN) && (lstat(tmp, &stat_buf) != 0)) {
+            free(tmp);
+            continue;
+        }
+
+        if (is_dir(type, &stat_buf))
+            walk_readdir(walk, tmp);
+
+        free(tmp);
+    }
+
+    closedir(d);
+}
+
+static void walk_getdents(Walk * walk, int fd);
+
+static int getdents_entry(int fd, const char *name, unsigned char type,
+                          void *data)
+{
+    int sub;
+    Walk *walk = data;
+    struct stat stat_buf;
+
+    ++walk->entries;
+
+    if (walk->force_stat) {
+        if (fstatat(fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0)
+            return 0;
+        type = IFTODT(stat_buf.st_mode);
+    }
+
+    if (type == DT_DIR) {
+        sub = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub != -1)
+            walk_getdents(walk, sub);
+    }
+
+    return 0;
+}
+
+/* Closes 'fd' when it's done. */
+static void walk_getdents(Walk * walk, int fd)
+{
+    char **buf;
+
+    /* The buffers are kept from one directory to the next, like a
+     * crawl thread's is.
+     */
+    if (walk->depth < DEPTH) {
+        buf = &walk->bufs[walk->depth];
+        if (*buf == NULL)
+            *buf = malloc(CRAWL_BUF_SIZE);
+
+        if (*buf != NULL) {
+            ++walk->depth;
+            crawl_readdir(fd, *buf, CRAWL_BUF_SIZE, !walk->force_stat,
+                          getdents_entry, walk);
+            --walk->depth;
+        }
+    }
+
+    close(fd);
+}
+
+static void bench(const char *path, int force_stat)
+{
+    int i, fd;
+    long entries = 0;
+    double start, t, best_old = 0, best_new = 0;
+    Walk walk;
+
+    memset(&walk, 0, sizeof walk);
+
+    for (i = 0; i < RUNS; i++) {
+        walk.force_stat = force_stat;
+        walk.entries = 0;
+
+        start = test_now();
+        walk_readdir(&walk, path);
+        t = test_now() - start;
+        if ((best_old == 0) || (t < best_old))
+            best_old = t;
+
+        entries = walk.entries;
+        walk.entries = 0;
+
+        start = test_now();
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1)
+            walk_getdents(&walk, fd);
+        t = test_now() - start;
+        if ((best_new == 0) || (t < best_new))
+            best_new = t;
+
+        if (walk.entries != entries)
+            fprintf(stderr, "Walks disagree: %ld vs %ld entries\n",
+                    entries, walk.entries);
+    }
+
+    for (i = 0; i < DEPTH; i++)
+        free(walk.bufs[i]);
+
+    if (entries == 0)
+        entries = 1;
+
+    printf("%-14s %ld entries: readdir %7.1f ns/entry, "
+           "getdents64 %7.1f ns/entry (%.2fx)\n",
+           force_stat ? "stat all:" : "using d_type:", entries,
+           best_old * 1e9 / entries, best_new * 1e9 / entries,
+           best_old / best_new);
+}
+
+int main(int argc, char **argv)
+{
+    int i, fd;
+    char *dir = NULL, path[PATH_MAX];
+    const char *root;
+
+    if (argc > 1) {
+        root = argv[1];
+    } else {
+        dir = test_mkdtemp();
+        root = dir;
+
+        for (i = 0; i < DIRS; i++) {
+            snprintf(path, sizeof path, "%s/dir%06d", dir, i);
+            mkdir(path, 0755);
+        }
+
+        for (i = 0; i < FILES; i++) {
+            snprintf(path, sizeof path, "%s/file%06d", dir, i);
+            fd = open(path, O_WRONLY | O_CREAT, 0644);
+            if (fd != -1)
+                close(fd);
+        }
+    }
+
+    bench(root, 0);
+    bench(root, 1);
+
+    if (dir != NULL) {
+        test_rmtree(dir);
+        free(dir);
+    }
+
+    return 0;
+}
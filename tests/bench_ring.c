@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Nanoseconds per event to queue and dequeue events, with each root's
+ * queue as a ring of records (SEE: ring.h) against the GQueue of
+ * separately allocated Events it replaced.
+ *
+ * Both sides are copies of the queueing code from inotify.c, before
+ * and after, without the locking and logging around it. The old one
+ * made three allocations per event (the Event and, through
+ * mk_string(), its path and name) plus a list node; the new one
+ * copies the event into the ring and hands a batch of them back in a
+ * single allocation.
+ *
+ * Usage: bench_ring [events] (default 1000000)
+ */
+
+#include "inotify.h"
+#include "ring.h"
+#include "utils.h"
+#include "test.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH  "/var/www/example.com/htdocs/images/2011/06"
+#define NAME  "thumbnail_000123.jpg"
+
+/* An Event from before, which had no old_path or old_name. */
+typedef struct old_event {
+    int wd;
+    uint32_t mask;
+    uint32_t cookie;
+    uint32_t len;
+    char *path;
+    char *name;
+} Old_Event;
+
+static void old_enqueue(GQueue * queue, const Event * event)
+{
+    Old_Event *node;
+
+    node = malloc(sizeof(Old_Event));
+    node->wd = event->wd;
+    node->mask = event->mask;
+    node->cookie = event->cookie;
+    node->len = event->len;
+    mk_string(&node->name, "%s", event->name);
+    mk_string(&node->path, "%s", event->path);
+
+    g_queue_push_tail(queue, node);
+}
+
+static Old_Event **old_dequeue(GQueue * queue, int count)
+{
+    int i;
+    Old_Event **events;
+
+    events = malloc((count + 1) * sizeof *events);
+    for (i = 0; i < count; i++)
+        events[i] = g_queue_pop_head(queue);
+    events[i] = NULL;
+
+    return events;
+}
+
+static void old_free(Old_Event ** events)
+{
+    int i;
+
+    for (i = 0; events[i]; i++) {
+        free(events[i]->name);
+        free(events[i]->path);
+        free(events[i]);
+    }
+
+    free(events);
+}
+
+static void new_enqueue(Ring * ring, const Event * event)
+{
+    uint32_t size, path_len, name_len;
+    char *data;
+    Event_Record *record;
+
+    path_len = strlen(event->path);
+    name_len = strlen(event->name);
+    size = sizeof(Event_Record) + path_len + name_len + 4;
+
+    record = ring_reserve(ring, size);
+    while (record == NULL) {
+        ring_resize(ring, ring->size * 2);
+        record = ring_reserve(ring, size);
+    }
+
+    record->wd = event->wd;
+    record->mask = event->mask;
+    record->cookie = event->cookie;
+    record->len = event->len;
+    record->path_len = path_len;
+    record->name_len = name_len;
+    record->old_path_len = 0;
+    record->old_name_len = 0;
+
+    data = record->data;
+    memcpy(data, event->path, path_len + 1);
+    data += path_len + 1;
+    memcpy(data, event->name, name_len + 1);
+    data += name_len + 1;
+    data[0] = '\0';
+    data[1] = '\0';
+
+    ring_commit(ring, size);
+}
+
+static Event **new_dequeue(Ring * ring, int count)
+{
+    int i;
+    size_t strings = 0;
+    uint32_t len, n;
+    uint64_t pos = 0;
+    char *str;
+    Event *e, **events;
+    Event_Record *record;
+
+    for (i = 0; i < count; i++) {
+        record = ring_peek_next(ring, &pos, &len);
+        strings += record->path_len + record->name_len +
+            record->old_path_len + record->old_name_len + 4;
+    }
+
+    events = malloc((count + 1) * sizeof *events + count * sizeof(Event) +
+                    strings);
+    e = (Event *) (events + count + 1);
+    str = (char *) (e + count);
+
+    for (i = 0; i < count; i++, e++) {
+        record = ring_peek(ring, &len);
+
+        e->wd = record->wd;
+        e->mask = record->mask;
+        e->cookie = record->cookie;
+        e->len = record->len;
+
+        n = record->path_len + record->name_len + record->old_path_len +
+            record->old_name_len + 4;
+        memcpy(str, record->data, n);
+        e->path = str;
+        e->name = e->path + record->path_len + 1;
+        e->old_path = NULL;
+        e->old_name = NULL;
+        str += n;
+
+        events[i] = e;
+        ring_release(ring, len);
+    }
+    events[i] = NULL;
+
+    return events;
+}
+
+/* Queue 'num' events and take them back out 'batch' at a time,
+ * 'batch' being what a client asks for with 'get_events'.
+ */
+static void bench(int num, int batch)
+{
+    int i, j;
+    double start, old_in, old_out, new_in, new_out;
+    Event event = { 1, IN_CLOSE_WRITE, 0, 0, PATH, NAME, NULL, NULL };
+    GQueue *queue;
+    Ring ring;
+
+    queue = g_queue_new();
+    ring_init(&ring, 64 * 1024);
+
+    old_in = old_out = new_in = new_out = 0;
+
+    for (i = 0; i < num; i += batch) {
+        start = test_now();
+        for (j = 0; j < batch; j++)
+            old_enqueue(queue, &event);
+        old_in += test_now() - start;
+
+        start = test_now();
+        old_free(old_dequeue(queue, batch));
+        old_out += test_now() - start;
+
+        start = test_now();
+        for (j = 0; j < batch; j++)
+            new_enqueue(&ring, &event);
+        new_in += test_now() - start;
+
+        start = test_now();
+        free(new_dequeue(&ring, batch));
+        new_out += test_now() - start;
+    }
+
+    printf("batches of %4d: GQueue %6.1f + %6.1f ns/event, "
+           "ring %6.1f + %6.1f ns/event (enqueue + dequeue)\n", batch,
+           old_in * 1e9 / num, old_out * 1e9 / num, new_in * 1e9 / num,
+           new_out * 1e9 / num);
+
+    g_queue_free(queue);
+    ring_free(&ring);
+}
+
+int main(int argc, char **argv)
+{
+    int num = 1000000;
+
+    if (argc > 1)
+        num = atoi(argv[1]);
+
+    if (num <= 0) {
+        fprintf(stderr, "Usage: %s [events]\n", argv[0]);
+        return 1;
+    }
+
+    /* Warm up malloc() and the ring first. */
+    bench(num / 10 + 1, 1);
+
+    bench(num, 1);
+    bench(num, 64);
+    bench(num, 1024);
+
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Resident memory used by the watch table at 1,000,000 directories,
+ * against the pair of GHashTables it replaced, where every watch was
+ * a malloc()ed struct holding its full path, with another copy of
+ * the path as the key of the path -> watch table.
+ *
+ * The directories make up a tree with 20 subdirectories to each
+ * directory, about 70 bytes to a path. None of it has to exist, as
+ * only the table is being measured. Each table is built in a child
+ * process of its own so neither sees what the other freed.
+ *
+ * Usage: bench_rss [directories] (default 1000000)
+ */
+
+#include "watch.h"
+#include "test.h"
+
+#include <glib.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FANOUT 20
+#define TOP    "/srv/inotispy-bench/www"
+
+/* Write the path of directory 'i' into 'buf', returning its length. */
+static int dir_path(int i, char *buf)
+{
+    int len;
+
+    if (i == 0)
+        return sprintf(buf, "%s", TOP);
+
+    len = dir_path((i - 1) / FANOUT, buf);
+    return len + sprintf(buf + len, "/dir%07d", i);
+}
+
+/* What a watch used to be. */
+typedef struct old_watch {
+    int wd;
+    char *path;
+} Old_Watch;
+
+static int build_old(int num)
+{
+    int i, len;
+    char path[PATH_MAX];
+    GHashTable *wd_to_watch, *path_to_watch;
+    Old_Watch *watch;
+
+    wd_to_watch =
+        g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    path_to_watch =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < num; i++) {
+        len = dir_path(i, path);
+
+        watch = malloc(sizeof(Old_Watch));
+        if (watch == NULL)
+            return 1;
+        watch->wd = i + 1;
+        watch->path = malloc(len + 1);
+        if (watch->path == NULL)
+            return 1;
+        memcpy(watch->path, path, len + 1);
+
+        g_hash_table_replace(wd_to_watch, GINT_TO_POINTER(i + 1), watch);
+        g_hash_table_replace(path_to_watch, g_strdup(path), watch);
+    }
+
+    dir_path(num - 1, path);
+    return (g_hash_table_lookup(path_to_watch, path) == NULL);
+}
+
+static int build_new(int num)
+{
+    int i;
+    char path[PATH_MAX];
+
+    if (watch_table_init() != 0)
+        return 1;
+
+    for (i = 0; i < num; i++) {
+        dir_path(i, path);
+        if (watch_add(path, i + 1, NULL) == NULL)
+            return 1;
+    }
+
+    dir_path(num - 1, path);
+    return (watch_lookup(path) == NULL) || (watch_count() != num);
+}
+
+/* Build a table in a child and report how much it grew the RSS by,
+ * in kilobytes, or -1 if it failed.
+ */
+static long measure(int (*build) (int), int num, double *secs)
+{
+    int fds[2], status;
+    long kb = -1;
+    double start;
+    pid_t pid;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        long before = test_rss_kb();
+
+        start = test_now();
+        if (build(num) == 0) {
+            kb = test_rss_kb() - before;
+            *secs = test_now() - start;
+        }
+
+        if ((write(fds[1], &kb, sizeof kb) != sizeof kb)
+            || (write(fds[1], secs, sizeof *secs) != sizeof *secs))
+            _exit(1);
+        _exit(0);
+    }
+
+    if ((read(fds[0], &kb, sizeof kb) != sizeof kb)
+        || (read(fds[0], secs, sizeof *secs) != sizeof *secs))
+        kb = -1;
+
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    return kb;
+}
+
+int main(int argc, char **argv)
+{
+    int num = 1000000;
+    long old_kb, new_kb;
+    double old_secs = 0, new_secs = 0;
+
+    if (argc > 1)
+        num = atoi(argv[1]);
+
+    if (num <= 0) {
+        fprintf(stderr, "Usage: %s [directories]\n", argv[0]);
+        return 1;
+    }
+
+    old_kb = measure(build_old, num, &old_secs);
+    new_kb = measure(build_new, num, &new_secs);
+
+    if ((old_kb < 0) || (new_kb < 0)) {
+        fprintf(stderr, "Failed to build the tables\n");
+        return 1;
+    }
+
+    printf("%d directories:\n", num);
+    printf("  hash tables: %8ld KB (%5.1f bytes/dir) in %.2fs\n",
+           old_kb, old_kb * 1024.0 / num, old_secs);
+    printf("  watch tree:  %8ld KB (%5.1f bytes/dir) in %.2fs\n",
+           new_kb, new_kb * 1024.0 / num, new_secs);
+    printf("  %.2fx less memory\n", (double) old_kb / new_kb);
+
+    return 0;
+}
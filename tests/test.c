@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "log.h"
+#include "test.h"
+
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int test_failures = 0;
+
+void test_init(void)
+{
+    if (init_config(1, TEST_CONF) != 0) {
+        fprintf(stderr, "Failed to load test config '%s'\n", TEST_CONF);
+        exit(1);
+    }
+
+    if (init_logger() != 0)
+        exit(1);
+}
+
+int test_done(const char *name)
+{
+    if (test_failures > 0) {
+        fprintf(stderr, "%s: %d check(s) failed\n", name, test_failures);
+        return 1;
+    }
+
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+double test_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+char *test_mkdtemp(void)
+{
+    const char *tmp;
+    char *path;
+
+    tmp = getenv("TMPDIR");
+    if ((tmp == NULL) || (*tmp == '\0'))
+        tmp = "/tmp";
+
+    path = malloc(strlen(tmp) + sizeof "/inotispy-test.XXXXXX");
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    sprintf(path, "%s/inotispy-test.XXXXXX", tmp);
+    if (mkdtemp(path) == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    return path;
+}
+
+static int _rmtree(const char *path, const struct stat *st, int flag,
+                   struct FTW *ftw)
+{
+    (void) st;
+    (void) flag;
+    (void) ftw;
+
+    remove(path);
+    return 0;
+}
+
+void test_rmtree(const char *path)
+{
+    nftw(path, _rmtree, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+long test_rss_kb(void)
+{
+    long rss = -1;
+    char line[256];
+    FILE *fp;
+
+    fp = fopen("/proc/self/status", "r");
+    if (fp == NULL)
+        return -1;
+
+    while (fgets(line, sizeof line, fp) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+
+    fclose(fp);
+    return rss;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _INOTISPY_TEST_H_
+#define _INOTISPY_TEST_H_
+
+#include <stdio.h>
+
+/* Helpers shared by the unit tests and benchmarks in this directory.
+ *
+ * A test is a program that exits with 0 (zero) if every CHECK() in
+ * it held. A failed CHECK() says where it was and carries on, so a
+ * single run shows everything that's broken.
+ */
+extern int test_failures;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,    \
+                    __LINE__, #cond);                                 \
+            ++test_failures;                                          \
+        }                                                             \
+    } while (0)
+
+/* Load test.conf into CONFIG and start the logger. Exits if either
+ * fails.
+ */
+void test_init(void);
+
+/* Print a summary and return the exit status for main(). */
+int test_done(const char *name);
+
+/* Seconds since some fixed point, for timing things. */
+double test_now(void);
+
+/* Make a scratch directory under $TMPDIR (or /tmp) and return its
+ * path, or remove one and everything in it. test_mkdtemp() exits if
+ * the directory can't be made.
+ */
+char *test_mkdtemp(void);
+void test_rmtree(const char *path);
+
+/* The resident set size of this process, in kilobytes. */
+long test_rss_kb(void);
+
+#endif /*_INOTISPY_TEST_H_*/
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Round trip tests for the two encodings of a 'get_events' reply
+ * (SEE: zeromq.h): the binary one is decoded byte by byte, the way a
+ * client on any architecture would have to, and the JSON one is
+ * parsed back with json-c. Both must give back exactly the events
+ * that went in.
+ */
+
+#include "zeromq.h"
+#include "test.h"
+
+#include <json/json.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const unsigned char *p, *end;
+
+/* Little endian, whatever the host is. */
+static uint32_t get_le(int bytes)
+{
+    int i;
+    uint32_t v = 0;
+
+    CHECK(p + bytes <= end);
+    if (p + bytes > end)
+        return 0;
+
+    for (i = 0; i < bytes; i++)
+        v |= (uint32_t) p[i] << (8 * i);
+    p += bytes;
+
+    return v;
+}
+
+/* Compare the next 'len' bytes with 'str', which has no NUL in the
+ * message. A NULL 'str' has to have been sent as nothing at all.
+ */
+static int get_string(uint32_t len, const char *str)
+{
+    int same;
+
+    if (str == NULL)
+        str = "";
+
+    CHECK(p + len <= end);
+    if (p + len > end)
+        return 0;
+
+    same = (len == strlen(str)) && (memcmp(p, str, len) == 0);
+    p += len;
+
+    return same;
+}
+
+static void check_binary(Event ** events, int count)
+{
+    int i;
+    size_t size;
+    uint32_t lens[4];
+    char *buf;
+
+    buf = zmq_events_to_binary(events, &size);
+    CHECK(buf != NULL);
+    if (buf == NULL)
+        return;
+
+    p = (const unsigned char *) buf;
+    end = p + size;
+
+    CHECK(size >= ZMQ_BINARY_HEADER_LEN);
+    CHECK(memcmp(p, "ISPB", 4) == 0);
+    CHECK(buf[0] != '{');
+    p += 4;
+    CHECK(get_le(4) == (uint32_t) count);
+
+    for (i = 0; i < count; i++) {
+        const unsigned char *start = p;
+
+        CHECK(get_le(4) == events[i]->mask);
+        CHECK(get_le(4) == events[i]->cookie);
+        lens[0] = get_le(2);
+        lens[1] = get_le(2);
+        lens[2] = get_le(2);
+        lens[3] = get_le(2);
+        CHECK(p - start == ZMQ_BINARY_EVENT_LEN);
+
+        CHECK(get_string(lens[0], events[i]->path));
+        CHECK(get_string(lens[1], events[i]->name));
+        CHECK(get_string(lens[2], events[i]->old_path));
+        CHECK(get_string(lens[3], events[i]->old_name));
+    }
+
+    /* Nothing left over. */
+    CHECK(p == end);
+
+    free(buf);
+}
+
+static int same_string(json_object * obj, const char *key, const char *str)
+{
+    json_object *val = json_object_object_get(obj, key);
+
+    if (str == NULL)
+        return val == NULL;
+
+    return (val != NULL) && (strcmp(json_object_get_string(val), str) == 0);
+}
+
+static void check_json(Event ** events, int count)
+{
+    int i;
+    size_t size;
+    char *buf;
+    json_object *reply, *data, *event, *val;
+    struct json_tokener *tok;
+
+    buf = zmq_events_to_json(events, &size);
+    CHECK(buf != NULL);
+    if (buf == NULL)
+        return;
+
+    CHECK(buf[0] == '{');
+
+    tok = json_tokener_new();
+    reply = json_tokener_parse_ex(tok, buf, size);
+    CHECK(reply != NULL);
+    json_tokener_free(tok);
+
+    if (reply == NULL) {
+        free(buf);
+        return;
+    }
+
+    data = json_object_object_get(reply, "data");
+    CHECK((data != NULL) && json_object_is_type(data, json_type_array));
+    if ((data == NULL) || !json_object_is_type(data, json_type_array))
+        goto done;
+
+    CHECK(json_object_array_length(data) == count);
+
+    for (i = 0; (i < count) && (i < json_object_array_length(data)); i++) {
+        event = json_object_array_get_idx(data, i);
+
+        CHECK(same_string(event, "path", events[i]->path));
+        CHECK(same_string(event, "name", events[i]->name));
+        CHECK(same_string(event, "old_path", events[i]->old_path));
+        CHECK(same_string(event, "old_name", events[i]->old_name));
+
+        val = json_object_object_get(event, "mask");
+        CHECK((val != NULL)
+              && ((uint32_t) json_object_get_int(val) == events[i]->mask));
+
+        /* The cookie is left out when there isn't one. */
+        val = json_object_object_get(event, "cookie");
+        if (events[i]->cookie == 0)
+            CHECK(val == NULL);
+        else
+            CHECK((val != NULL) && ((uint32_t) json_object_get_int(val) ==
+                                    events[i]->cookie));
+    }
+
+  done:
+    json_object_put(reply);
+    free(buf);
+}
+
+static void check(Event ** events, int count)
+{
+    check_binary(events, count);
+    check_json(events, count);
+}
+
+static void test_empty(void)
+{
+    size_t size;
+    char *buf;
+    Event *none[] = { NULL };
+
+    buf = zmq_events_to_binary(NULL, &size);
+    CHECK(buf != NULL);
+    CHECK(size == ZMQ_BINARY_HEADER_LEN);
+    if (buf != NULL)
+        CHECK(memcmp(buf, "ISPB\0\0\0\0", 8) == 0);
+    free(buf);
+
+    buf = zmq_events_to_json(NULL, &size);
+    CHECK(buf != NULL);
+    if (buf != NULL)
+        CHECK((size == 11) && (memcmp(buf, "{\"data\":[]}", 11) == 0));
+    free(buf);
+
+    check(none, 0);
+}
+
+/* The exact bytes of one event, to pin the layout down. */
+static void test_layout(void)
+{
+    size_t size;
+    char *buf;
+    Event event = { 7, IN_ISDIR | IN_CREATE, 0x01020304, 0, "/r", "ab",
+        NULL, NULL
+    };
+    Event *events[] = { &event, NULL };
+    const unsigned char want[] = {
+        'I', 'S', 'P', 'B', 1, 0, 0, 0,
+        0x00, 0x01, 0x00, 0x40,         /* mask */
+        0x04, 0x03, 0x02, 0x01,         /* cookie */
+        2, 0, 2, 0, 0, 0, 0, 0,         /* lengths */
+        '/', 'r', 'a', 'b'
+    };
+
+    buf = zmq_events_to_binary(events, &size);
+    CHECK(buf != NULL);
+    CHECK(size == sizeof want);
+    if ((buf != NULL) && (size == sizeof want))
+        CHECK(memcmp(buf, want, size) == 0);
+    free(buf);
+}
+
+static void test_events(void)
+{
+    int i;
+    char long_path[PATH_MAX];
+    Event plain = { 1, IN_CLOSE_WRITE, 0, 0, "/srv/www", "index.html",
+        NULL, NULL
+    };
+    Event move = { 1, IN_MOVED_FROM | IN_MOVED_TO, 4242, 0, "/srv/www/b",
+        "new.txt", "/srv/www/a", "old.txt"
+    };
+    Event dir = { 2, IN_DELETE | IN_ISDIR, 0, 0, "/srv/www", "cache",
+        NULL, NULL
+    };
+    Event odd = { 3, IN_CREATE, 0, 0, "/srv/\"quoted\"\\dir",
+        "tab\there\nnewline \xc3\xa9t\xc3\xa9", NULL, NULL
+    };
+    Event big = { 4, IN_MODIFY, 0, 0, long_path, "x", NULL, NULL };
+    Event *events[] = { &plain, &move, &dir, &odd, &big, NULL };
+
+    /* Over 256 bytes, so both bytes of its length matter. */
+    long_path[0] = '/';
+    for (i = 1; i < 4000; i++)
+        long_path[i] = (i % 10 == 0) ? '/' : 'a' + (i % 26);
+    long_path[i] = '\0';
+
+    check(events, 5);
+
+    /* One at a time too. */
+    for (i = 0; i < 5; i++) {
+        Event *one[] = { events[i], NULL };
+        check(one, 1);
+    }
+}
+
+int main(void)
+{
+    test_init();
+
+    test_empty();
+    test_layout();
+    test_events();
+
+    return test_done("test_binary");
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests for the ignore rules (SEE: ignore.h): each kind of
+ * pattern, directory only patterns, paths, and the built in rule for
+ * rsync's temp files.
+ */
+
+#include "ignore.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ROOT "/srv/www"
+
+static Ignore *compile(char **patterns)
+{
+    Ignore *ignore = ignore_compile(ROOT, patterns);
+
+    CHECK(ignore != NULL);
+    if (ignore == NULL)
+        exit(test_done("test_ignore"));
+
+    return ignore;
+}
+
+/* rsync writes a file to '.name.XXXXXX' and renames it over 'name'
+ * when it's done, and the 'name.~tmp~' directories of --delay-updates
+ * work the same way. Anything ending in '.~tmp~' has always been
+ * skipped, whatever patterns the root has.
+ */
+static void test_builtin(void)
+{
+    char *none[] = { NULL };
+    char *some[] = { "*.swp", NULL };
+    Ignore *ignore;
+
+    ignore = compile(NULL);
+    CHECK(ignore_name(ignore, ".foo.abc123.~tmp~", 0));
+    CHECK(ignore_name(ignore, "x.~tmp~", 0));
+    CHECK(ignore_name(ignore, "x.~tmp~", 1));
+    CHECK(ignore_name(ignore, ".~tmp~", 1));
+    CHECK(!ignore_name(ignore, "x.~tmp~y", 0));
+    CHECK(!ignore_name(ignore, "x~tmp~", 0));
+    CHECK(!ignore_name(ignore, "x.~tmp", 0));
+    CHECK(!ignore_name(ignore, "index.html", 0));
+
+    /* It's not one of the root's own patterns. */
+    CHECK(ignore_patterns(ignore)[0] == NULL);
+    ignore_free(ignore);
+
+    ignore = compile(none);
+    CHECK(ignore_name(ignore, "x.~tmp~", 0));
+    ignore_free(ignore);
+
+    ignore = compile(some);
+    CHECK(ignore_name(ignore, "x.~tmp~", 0));
+    CHECK(ignore_name(ignore, "x.swp", 0));
+    ignore_free(ignore);
+}
+
+static void test_names(void)
+{
+    char *patterns[] = { "*.swp", ".#*", ".git", "*.t?p", "[0-9]*.log",
+        NULL
+    };
+    char **copy;
+    Ignore *ignore;
+
+    ignore = compile(patterns);
+
+    /* Suffix */
+    CHECK(ignore_name(ignore, "a.swp", 0));
+    CHECK(ignore_name(ignore, ".swp", 0));
+    CHECK(ignore_name(ignore, "a.swp", 1));
+    CHECK(!ignore_name(ignore, "a.swpx", 0));
+    CHECK(!ignore_name(ignore, "a.sw", 0));
+
+    /* Prefix */
+    CHECK(ignore_name(ignore, ".#index.html", 0));
+    CHECK(ignore_name(ignore, ".#", 0));
+    CHECK(!ignore_name(ignore, "x.#index.html", 0));
+    CHECK(!ignore_name(ignore, ".index.html", 0));
+
+    /* Exact */
+    CHECK(ignore_name(ignore, ".git", 1));
+    CHECK(ignore_name(ignore, ".git", 0));
+    CHECK(!ignore_name(ignore, ".gitignore", 0));
+    CHECK(!ignore_name(ignore, "x.git", 0));
+    CHECK(!ignore_name(ignore, ".gi", 0));
+
+    /* Globs */
+    CHECK(ignore_name(ignore, "a.tmp", 0));
+    CHECK(ignore_name(ignore, "a.tap", 0));
+    CHECK(!ignore_name(ignore, "a.tp", 0));
+    CHECK(ignore_name(ignore, "2011.log", 0));
+    CHECK(!ignore_name(ignore, "error.log", 0));
+
+    CHECK(!ignore_name(ignore, "index.html", 0));
+    CHECK(!ignore_name(ignore, "", 0));
+
+    /* Name patterns never match on the directory. */
+    CHECK(!ignore_path(ignore, ROOT "/.git", "config", 0));
+
+    /* The root's patterns come back as they were given. */
+    copy = ignore_patterns(ignore);
+    CHECK(copy != patterns);
+    CHECK((copy[0] != NULL) && (strcmp(copy[0], "*.swp") == 0));
+    CHECK((copy[4] != NULL) && (strcmp(copy[4], "[0-9]*.log") == 0));
+    CHECK(copy[5] == NULL);
+
+    ignore_free(ignore);
+}
+
+static void test_dirs(void)
+{
+    char *patterns[] = { "cache/", "*.d/", "tmp*/", "[ab]x/", NULL };
+    Ignore *ignore;
+
+    ignore = compile(patterns);
+
+    CHECK(ignore_name(ignore, "cache", 1));
+    CHECK(!ignore_name(ignore, "cache", 0));
+    CHECK(ignore_name(ignore, "conf.d", 1));
+    CHECK(!ignore_name(ignore, "conf.d", 0));
+    CHECK(ignore_name(ignore, "tmp1", 1));
+    CHECK(!ignore_name(ignore, "tmp1", 0));
+    CHECK(ignore_name(ignore, "ax", 1));
+    CHECK(!ignore_name(ignore, "ax", 0));
+    CHECK(!ignore_name(ignore, "cx", 1));
+
+    ignore_free(ignore);
+}
+
+static void test_paths(void)
+{
+    char *patterns[] = { "a/b", "/logs/old", "x/y/", NULL };
+    Ignore *ignore;
+
+    ignore = compile(patterns);
+
+    /* The path itself, whether it's a file or a directory. */
+    CHECK(ignore_path(ignore, ROOT "/a", "b", 0));
+    CHECK(ignore_path(ignore, ROOT "/a", "b", 1));
+    CHECK(ignore_path(ignore, ROOT "/logs", "old", 1));
+
+    /* Everything under it. */
+    CHECK(ignore_path(ignore, ROOT "/a/b", "c", 0));
+    CHECK(ignore_path(ignore, ROOT "/a/b/c/d", "e", 1));
+    CHECK(ignore_path(ignore, ROOT "/logs/old", "2011.log", 0));
+
+    /* But nothing beside it or above it. */
+    CHECK(!ignore_path(ignore, ROOT "/a", "bc", 0));
+    CHECK(!ignore_path(ignore, ROOT "/a", "c", 0));
+    CHECK(!ignore_path(ignore, ROOT, "a", 1));
+    CHECK(!ignore_path(ignore, ROOT "/ab", "b", 0));
+    CHECK(!ignore_path(ignore, ROOT "/c/a", "b", 0));
+
+    /* Only relative to the root. */
+    CHECK(!ignore_path(ignore, "/srv/other/a", "b", 0));
+
+    /* A directory only path. */
+    CHECK(ignore_path(ignore, ROOT "/x", "y", 1));
+    CHECK(!ignore_path(ignore, ROOT "/x", "y", 0));
+
+    /* Paths aren't names. */
+    CHECK(!ignore_name(ignore, "b", 0));
+    CHECK(!ignore_name(ignore, "old", 1));
+
+    ignore_free(ignore);
+}
+
+static void test_tree(void)
+{
+    char *patterns[] = { ".git", "cache/", "a/b", NULL };
+    Ignore *ignore;
+
+    ignore = compile(patterns);
+
+    /* Any directory between the root and the event counts. */
+    CHECK(ignore_tree(ignore, ROOT "/src/.git/objects", "ab", 0));
+    CHECK(ignore_tree(ignore, ROOT "/cache", "page.html", 0));
+    CHECK(ignore_tree(ignore, ROOT "/x/cache/y", "page.html", 0));
+    CHECK(ignore_tree(ignore, ROOT "/a/b/c", "d", 0));
+    CHECK(ignore_tree(ignore, ROOT "/x.~tmp~", "index.html", 0));
+
+    /* And the name itself. */
+    CHECK(ignore_tree(ignore, ROOT "/src", ".git", 1));
+    CHECK(ignore_tree(ignore, ROOT "/src", "x.~tmp~", 0));
+
+    CHECK(!ignore_tree(ignore, ROOT "/src", "main.c", 0));
+    CHECK(!ignore_tree(ignore, ROOT "/src", "cache", 0));
+    CHECK(!ignore_tree(ignore, ROOT "/src/.gitx", "main.c", 0));
+
+    /* The root's own name doesn't. */
+    ignore_free(ignore);
+    ignore = ignore_compile("/srv/cache", patterns);
+    CHECK(ignore != NULL);
+    CHECK(!ignore_tree(ignore, "/srv/cache/src", "main.c", 0));
+    ignore_free(ignore);
+}
+
+int main(void)
+{
+    test_init();
+
+    test_builtin();
+    test_names();
+    test_dirs();
+    test_paths();
+    test_tree();
+
+    return test_done("test_ignore");
+}
@@ -0,0 +1,303 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Tests for move pairing (SEE: INOTIFY_ROOT_PAIR_MOVES), run against
+ * the kernel's inotify: a rename inside a root comes out as a single
+ * event, a move out of the roots as an IN_DELETE once the pairing
+ * window (move_pair_window in test.conf) is up, a move in from
+ * outside as an IN_CREATE, and a renamed directory keeps its watches
+ * under the new name.
+ */
+
+#include "inotify.h"
+#include "watch.h"
+#include "test.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MASK (IN_CREATE | IN_DELETE | IN_MOVE)
+
+static int ingest_fd;
+static char root[PATH_MAX], outside[PATH_MAX];
+
+/* Run the main loop for up to 'msecs' milliseconds, or until 'want'
+ * events are queued for the root, and return what's queued.
+ */
+static Event **wait_events(int want, int msecs)
+{
+    int timeout;
+    long pending;
+    double start = test_now();
+    struct pollfd pfd = {.fd = ingest_fd,.events = POLLIN };
+
+    while ((inotify_queue_size(root) < want)
+           && ((test_now() - start) * 1000 < msecs)) {
+        timeout = 10;
+        pending = inotify_timeout();
+        if ((pending != -1) && (pending / 1000 < timeout))
+            timeout = pending / 1000;
+
+        if (poll(&pfd, 1, timeout) > 0)
+            inotify_handle_event();
+
+        inotify_tick();
+    }
+
+    return inotify_get_events(root, 0);
+}
+
+static int count(Event ** events)
+{
+    int n = 0;
+
+    while ((events != NULL) && (events[n] != NULL))
+        ++n;
+
+    return n;
+}
+
+/* Is 'event' for 'name' in the directory 'path'? */
+static int is(const Event * event, const char *path, const char *name)
+{
+    return (strcmp(event->path, path) == 0)
+        && (strcmp(event->name, name) == 0);
+}
+
+static void touch(const char *dir, const char *name)
+{
+    int fd;
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    fd = open(path, O_WRONLY | O_CREAT, 0644);
+    CHECK(fd != -1);
+    if (fd != -1)
+        close(fd);
+}
+
+static void move(const char *from_dir, const char *from,
+                 const char *to_dir, const char *to)
+{
+    char a[PATH_MAX], b[PATH_MAX];
+
+    snprintf(a, sizeof a, "%s/%s", from_dir, from);
+    snprintf(b, sizeof b, "%s/%s", to_dir, to);
+    CHECK(rename(a, b) == 0);
+}
+
+/* Create 'name' in the root and take its IN_CREATE out of the way. */
+static void create(const char *name)
+{
+    Event **events;
+
+    touch(root, name);
+    events = wait_events(1, 1000);
+    CHECK(count(events) == 1);
+    inotify_free_events(events);
+}
+
+static void test_rename(void)
+{
+    Event **events;
+
+    create("a");
+    move(root, "a", root, "b");
+
+    events = wait_events(1, 1000);
+    CHECK(count(events) == 1);
+    if (count(events) == 1) {
+        CHECK(events[0]->mask == (IN_MOVED_FROM | IN_MOVED_TO));
+        CHECK(is(events[0], root, "b"));
+        CHECK(events[0]->cookie != 0);
+        CHECK(events[0]->old_path != NULL);
+        CHECK(events[0]->old_name != NULL);
+        if (events[0]->old_path != NULL)
+            CHECK(strcmp(events[0]->old_path, root) == 0);
+        if (events[0]->old_name != NULL)
+            CHECK(strcmp(events[0]->old_name, "a") == 0);
+    }
+    inotify_free_events(events);
+
+    /* Nothing else turns up once the window is up. */
+    events = wait_events(1, 300);
+    CHECK(count(events) == 0);
+    inotify_free_events(events);
+}
+
+static void test_move_out(void)
+{
+    double start;
+    Event **events;
+
+    create("c");
+
+    start = test_now();
+    move(root, "c", outside, "c");
+
+    /* Held on to until the window is up, then queued as a delete. */
+    events = wait_events(1, 50);
+    CHECK(count(events) == 0);
+    inotify_free_events(events);
+
+    events = wait_events(1, 1000);
+    CHECK(test_now() - start >= 0.1);
+    CHECK(count(events) == 1);
+    if (count(events) == 1) {
+        CHECK(events[0]->mask == IN_DELETE);
+        CHECK(is(events[0], root, "c"));
+        CHECK(events[0]->cookie == 0);
+        CHECK(events[0]->old_path == NULL);
+    }
+    inotify_free_events(events);
+
+    CHECK(inotify_timeout() == -1);
+}
+
+static void test_move_in(void)
+{
+    Event **events;
+
+    touch(outside, "d");
+    move(outside, "d", root, "e");
+
+    events = wait_events(1, 1000);
+    CHECK(count(events) == 1);
+    if (count(events) == 1) {
+        CHECK(events[0]->mask == IN_CREATE);
+        CHECK(is(events[0], root, "e"));
+        CHECK(events[0]->cookie == 0);
+        CHECK(events[0]->old_path == NULL);
+    }
+    inotify_free_events(events);
+}
+
+static void test_rename_dir(void)
+{
+    int n, i;
+    double start;
+    char dir[PATH_MAX], sub[PATH_MAX], moved[PATH_MAX];
+    Event **events;
+
+    snprintf(dir, sizeof dir, "%s/d1", root);
+    snprintf(sub, sizeof sub, "%s/d1/s", root);
+    snprintf(moved, sizeof moved, "%s/d2/s", root);
+
+    CHECK(mkdir(dir, 0755) == 0);
+    CHECK(mkdir(sub, 0755) == 0);
+
+    /* Wait for the new directories to be watched, along with the
+     * root itself.
+     */
+    start = test_now();
+    while ((inotify_num_watched_dirs() < 3) && (test_now() - start < 5))
+        inotify_free_events(wait_events(INT_MAX, 10));
+    CHECK(inotify_num_watched_dirs() == 3);
+    inotify_free_events(wait_events(INT_MAX, 100));
+
+    /* Nothing else is touching the watch table by now, so it's safe
+     * to look in it without inotify_mutex.
+     */
+    CHECK(watch_lookup(sub) != NULL);
+
+    move(root, "d1", root, "d2");
+
+    events = wait_events(1, 1000);
+    CHECK(count(events) == 1);
+    if (count(events) == 1) {
+        CHECK(events[0]->mask == (IN_MOVED_FROM | IN_MOVED_TO | IN_ISDIR));
+        CHECK(is(events[0], root, "d2"));
+        if (events[0]->old_name != NULL)
+            CHECK(strcmp(events[0]->old_name, "d1") == 0);
+    }
+    inotify_free_events(events);
+
+    /* The watches moved along with the directories. */
+    CHECK(inotify_num_watched_dirs() == 3);
+    CHECK(watch_lookup(dir) == NULL);
+    CHECK(watch_lookup(sub) == NULL);
+    CHECK(watch_lookup(moved) != NULL);
+
+    /* And events under them are for the new path. */
+    touch(moved, "f");
+    events = wait_events(1, 1000);
+    n = count(events);
+    CHECK(n == 1);
+    for (i = 0; i < n; i++) {
+        CHECK(events[i]->mask == IN_CREATE);
+        CHECK(is(events[i], moved, "f"));
+    }
+    inotify_free_events(events);
+}
+
+int main(void)
+{
+    int rv;
+    char *dir;
+    Event **events;
+
+    test_init();
+
+    ingest_fd = inotify_setup();
+    if (ingest_fd == 0) {
+        fprintf(stderr, "Failed to set up inotify\n");
+        return 1;
+    }
+
+    dir = test_mkdtemp();
+    snprintf(root, sizeof root, "%s/root", dir);
+    snprintf(outside, sizeof outside, "%s/outside", dir);
+    mkdir(root, 0755);
+    mkdir(outside, 0755);
+
+    rv = inotify_watch_tree(root, MASK, 1000, 0, INOTIFY_ROOT_PAIR_MOVES,
+                            NULL, NULL);
+    CHECK(rv == 0);
+
+    /* Out of the way with the crawl's completion marker. */
+    events = wait_events(1, 5000);
+    CHECK((count(events) == 1) && (events[0]->mask & IN_CRAWL_COMPLETE));
+    inotify_free_events(events);
+
+    test_rename();
+    test_move_out();
+    test_move_in();
+    test_rename_dir();
+
+    inotify_unwatch_tree(root);
+    test_rmtree(dir);
+    free(dir);
+
+    return test_done("test_moves");
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests for the single-producer/single-consumer ring (SEE:
+ * ring.h): records going in and out in order, wrapping around the
+ * end of the buffer with a skip marker, walking the ring without
+ * releasing anything, resizing it, and one thread on each end.
+ */
+
+#include "ring.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes a record of 'len' takes up in the ring, header included. */
+#define RECORD(len) ((8 + (len) + 7) & ~7u)
+
+/* Write a record of 'len' bytes, all of them 'seq', and commit it. */
+static int put(Ring * ring, uint32_t len, unsigned char seq)
+{
+    char *data = ring_reserve(ring, len);
+
+    if (data == NULL)
+        return 1;
+
+    memset(data, seq, len);
+    ring_commit(ring, len);
+    return 0;
+}
+
+/* Is 'data' a whole record of 'len' bytes of 'seq', that doesn't run
+ * off the end of the buffer?
+ */
+static int is_record(const Ring * ring, const char *data, uint32_t len,
+                     uint32_t want_len, unsigned char seq)
+{
+    uint32_t i;
+
+    if ((data == NULL) || (len != want_len)
+        || (data + len > ring->buf + ring->size))
+        return 0;
+
+    for (i = 0; i < len; i++) {
+        if ((unsigned char) data[i] != seq)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void test_sizes(void)
+{
+    Ring ring;
+
+    CHECK(ring_init(&ring, 100) == 0);
+    CHECK(ring.size == 4096);
+    CHECK(ring.mask == 4095);
+    CHECK(ring_used(&ring) == 0);
+    CHECK(ring_max_record(&ring) == 2048 - 8);
+    ring_free(&ring);
+
+    CHECK(ring_init(&ring, 5000) == 0);
+    CHECK(ring.size == 8192);
+    ring_free(&ring);
+}
+
+static void test_fifo(void)
+{
+    char *data;
+    uint32_t len;
+    Ring ring;
+
+    ring_init(&ring, 4096);
+
+    CHECK(ring_peek(&ring, &len) == NULL);
+
+    CHECK(put(&ring, 1, 'a') == 0);
+    CHECK(put(&ring, 8, 'b') == 0);
+    CHECK(put(&ring, 9, 'c') == 0);
+    CHECK(ring_used(&ring) == RECORD(1) + RECORD(8) + RECORD(9));
+
+    /* Committing less than was reserved only uses what was written. */
+    data = ring_reserve(&ring, 100);
+    CHECK(data != NULL);
+    memset(data, 'd', 10);
+    ring_commit(&ring, 10);
+    CHECK(ring_used(&ring) == RECORD(1) + RECORD(8) + RECORD(9) +
+          RECORD(10));
+
+    /* A reserved record that's never committed isn't seen. */
+    CHECK(ring_reserve(&ring, 50) != NULL);
+
+    data = ring_peek(&ring, &len);
+    CHECK(is_record(&ring, data, len, 1, 'a'));
+    /* Peeking again gives the same record until it's released. */
+    CHECK(ring_peek(&ring, &len) == data);
+    ring_release(&ring, len);
+
+    data = ring_peek(&ring, &len);
+    CHECK(is_record(&ring, data, len, 8, 'b'));
+    CHECK(((uintptr_t) data & 7) == 0);
+    ring_release(&ring, len);
+
+    data = ring_peek(&ring, &len);
+    CHECK(is_record(&ring, data, len, 9, 'c'));
+    ring_release(&ring, len);
+
+    data = ring_peek(&ring, &len);
+    CHECK(is_record(&ring, data, len, 10, 'd'));
+    ring_release(&ring, len);
+
+    CHECK(ring_peek(&ring, &len) == NULL);
+    CHECK(ring_used(&ring) == 0);
+
+    ring_free(&ring);
+}
+
+static void test_full(void)
+{
+    int n = 0;
+    uint32_t len;
+    Ring ring;
+
+    ring_init(&ring, 4096);
+
+    CHECK(ring_reserve(&ring, ring_max_record(&ring) + 1) == NULL);
+
+    while (put(&ring, 100, (unsigned char) n) == 0)
+        ++n;
+
+    CHECK(n == 4096 / RECORD(100));
+    CHECK(ring_used(&ring) <= 4096);
+    CHECK(ring_used(&ring) + RECORD(100) > 4096);
+
+    /* Room for one more once the oldest is gone. */
+    ring_peek(&ring, &len);
+    ring_release(&ring, len);
+    CHECK(put(&ring, 100, (unsigned char) n) == 0);
+    CHECK(put(&ring, 100, (unsigned char) n) != 0);
+
+    ring_free(&ring);
+}
+
+/* Leave the ring with records 2, 3 and 4 in it, 4 having wrapped
+ * around to the start of the buffer behind a skip marker.
+ */
+static void fill_wrapped(Ring * ring)
+{
+    uint32_t len;
+    int i;
+
+    ring_init(ring, 4096);
+
+    for (i = 0; i < 4; i++)
+        CHECK(put(ring, 1000, (unsigned char) i) == 0);
+
+    for (i = 0; i < 2; i++) {
+        ring_peek(ring, &len);
+        ring_release(ring, len);
+    }
+
+    /* 64 bytes left before the end of the buffer isn't enough. */
+    CHECK((ring->tail & ring->mask) == 4 * RECORD(1000));
+    CHECK(put(ring, 1000, 4) == 0);
+    CHECK((ring->tail & ring->mask) == RECORD(1000));
+
+    /* The skip marker counts as used until the consumer gets past
+     * it.
+     */
+    CHECK(ring_used(ring) == 3 * RECORD(1000) + (4096 - 4 * RECORD(1000)));
+}
+
+static void test_wrap(void)
+{
+    int i;
+    char *data;
+    uint32_t len;
+    Ring ring;
+
+    fill_wrapped(&ring);
+
+    for (i = 2; i < 5; i++) {
+        data = ring_peek(&ring, &len);
+        CHECK(is_record(&ring, data, len, 1000, (unsigned char) i));
+        if (i == 4)
+            CHECK(data == ring.buf + 8);
+        ring_release(&ring, len);
+    }
+
+    CHECK(ring_peek(&ring, &len) == NULL);
+    CHECK(ring_used(&ring) == 0);
+
+    /* A record that doesn't fit at the end and doesn't fit at the
+     * start either is turned away without burning the end of the
+     * buffer.
+     */
+    ring_free(&ring);
+    ring_init(&ring, 4096);
+    for (i = 0; i < 4; i++)
+        put(&ring, 1000, (unsigned char) i);
+    ring_peek(&ring, &len);
+    ring_release(&ring, len);
+    CHECK(ring_reserve(&ring, 1001) == NULL);
+    CHECK((ring.tail & ring.mask) == 4 * RECORD(1000));
+    CHECK(ring_reserve(&ring, 1000) != NULL);
+
+    ring_free(&ring);
+}
+
+static void test_peek_next(void)
+{
+    int i = 2;
+    char *data;
+    uint32_t len, used;
+    uint64_t pos = 0;
+    Ring ring;
+
+    fill_wrapped(&ring);
+    used = ring_used(&ring);
+
+    while ((data = ring_peek_next(&ring, &pos, &len)) != NULL) {
+        CHECK(is_record(&ring, data, len, 1000, (unsigned char) i));
+        ++i;
+    }
+
+    CHECK(i == 5);
+    CHECK(ring_used(&ring) == used);
+
+    ring_free(&ring);
+}
+
+static void test_resize(void)
+{
+    int i;
+    char *data;
+    uint32_t len;
+    Ring ring;
+
+    fill_wrapped(&ring);
+
+    /* Too small for what's in it. */
+    CHECK(ring_resize(&ring, 2048) != 0);
+    CHECK(ring.size == 4096);
+
+    CHECK(ring_resize(&ring, 16384) == 0);
+    CHECK(ring.size == 16384);
+    CHECK(ring_used(&ring) == 3 * RECORD(1000));
+    CHECK(ring_max_record(&ring) == 8192 - 8);
+
+    for (i = 2; i < 5; i++) {
+        data = ring_peek(&ring, &len);
+        CHECK(is_record(&ring, data, len, 1000, (unsigned char) i));
+        ring_release(&ring, len);
+    }
+    CHECK(ring_peek(&ring, &len) == NULL);
+
+    /* And it carries on as normal after. */
+    CHECK(put(&ring, 5000, 9) == 0);
+    data = ring_peek(&ring, &len);
+    CHECK(is_record(&ring, data, len, 5000, 9));
+
+    ring_free(&ring);
+}
+
+#define THREADED_RECORDS 1000000
+
+static void *_producer(void *data)
+{
+    Ring *ring = data;
+    uint32_t i, len, *record;
+
+    for (i = 0; i < THREADED_RECORDS; i++) {
+        len = 4 + (i % 61) * 4;
+        while ((record = ring_reserve(ring, len)) == NULL)
+            sched_yield();
+        record[0] = i;
+        record[len / 4 - 1] = i;
+        ring_commit(ring, len);
+    }
+
+    return NULL;
+}
+
+static void test_threads(void)
+{
+    int ok = 1;
+    uint32_t i, len, *record;
+    pthread_t t;
+    Ring ring;
+
+    ring_init(&ring, 4096);
+    pthread_create(&t, NULL, _producer, &ring);
+
+    for (i = 0; i < THREADED_RECORDS; i++) {
+        while ((record = ring_peek(&ring, &len)) == NULL)
+            sched_yield();
+        if ((len != 4 + (i % 61) * 4) || (record[0] != i)
+            || (record[len / 4 - 1] != i))
+            ok = 0;
+        ring_release(&ring, len);
+    }
+
+    pthread_join(t, NULL);
+
+    CHECK(ok);
+    CHECK(ring_used(&ring) == 0);
+
+    ring_free(&ring);
+}
+
+int main(void)
+{
+    test_sizes();
+    test_fifo();
+    test_full();
+    test_wrap();
+    test_peek_next();
+    test_resize();
+    test_threads();
+
+    return test_done("test_ring");
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests for the watch table (SEE: watch.h): adding, looking up
+ * and removing watches, walking the tree, and moving a subtree with
+ * watch_detach() and watch_attach().
+ */
+
+#include "watch.h"
+#include "test.h"
+
+#include <limits.h>
+#include <string.h>
+
+static Root root_a, root_b;
+
+static Watch *add(const char *path, int wd)
+{
+    Watch *watch = watch_add(path, wd, &root_a);
+
+    CHECK(watch != NULL);
+    return watch;
+}
+
+/* Is the path of 'watch' 'path'? */
+static int has_path(const Watch * watch, const char *path)
+{
+    char buf[PATH_MAX];
+
+    return (watch_path(watch, buf, sizeof buf) == (int) strlen(path))
+        && (strcmp(buf, path) == 0);
+}
+
+static void test_add_lookup(void)
+{
+    char buf[8];
+    Watch *b, *c;
+
+    CHECK(watch_count() == 0);
+    CHECK(watch_lookup("/a") == NULL);
+
+    b = add("/a/b", 1);
+    c = add("/a/b/c", 2);
+    add("/a/b/d", 3);
+    add("/a/b/c/e", 4);
+    add("/x", 5);
+
+    CHECK(watch_count() == 5);
+    CHECK(watch_lookup("/a/b") == b);
+    CHECK(watch_lookup("/a/b/c") == c);
+    CHECK(watch_lookup("//a/b//c/") == c);
+    CHECK(watch_lookup("a/b/c") == NULL);
+    CHECK(watch_lookup("/a/b/nope") == NULL);
+
+    /* '/a' is only there to hold '/a/b', it isn't watched. */
+    CHECK(watch_lookup("/a") == NULL);
+    CHECK(b->parent->wd == -1);
+
+    CHECK(c->wd == 2);
+    CHECK(c->root == &root_a);
+    CHECK(strcmp(c->name, "c") == 0);
+    CHECK(has_path(c, "/a/b/c"));
+    CHECK(has_path(watch_first(), "/"));
+    CHECK(watch_path(c, buf, 6) == -1);
+    CHECK(watch_path(c, buf, 7) == 6);
+
+    /* Adding it again only changes the wd and root. */
+    CHECK(watch_add("/a/b/c", 22, &root_b) == c);
+    CHECK(c->wd == 22);
+    CHECK(c->root == &root_b);
+    CHECK(watch_count() == 5);
+}
+
+static void test_walk(void)
+{
+    int n = 0, watched = 0, in_order = 1;
+    Watch *watch, *top, *prev = NULL;
+
+    /* Pre-order: every node comes after its parent. */
+    for (watch = watch_first(); watch != NULL;
+         watch = watch_next(watch, NULL)) {
+        if ((watch != watch_first()) && (prev != watch->parent)
+            && (prev->parent != watch->parent)
+            && (watch->parent->child != watch))
+            in_order = 0;
+        if (watch->wd != -1)
+            ++watched;
+        prev = watch;
+        ++n;
+    }
+
+    CHECK(in_order);
+    CHECK(watched == 5);
+    CHECK(n == 7);              /* Plus '/' and '/a' */
+
+    /* Only what's under '/a/b'. */
+    n = 0;
+    top = watch_lookup("/a/b");
+    for (watch = top; watch != NULL; watch = watch_next(watch, top)) {
+        CHECK(strcmp(watch->name, "x") != 0);
+        ++n;
+    }
+    CHECK(n == 4);
+
+    watch = watch_lookup("/a/b/c/e");
+    CHECK(watch_next(watch, watch) == NULL);
+}
+
+static void test_remove(void)
+{
+    Watch *b, *x;
+
+    /* A watch with children stays in the tree, unwatched. */
+    b = watch_lookup("/a/b");
+    watch_remove(b);
+    CHECK(watch_lookup("/a/b") == NULL);
+    CHECK(watch_lookup("/a/b/c") != NULL);
+    CHECK(watch_count() == 4);
+    CHECK(add("/a/b", 1) == b);
+
+    /* One without is freed, and so is its parent if it was only
+     * there to hold it.
+     */
+    x = watch_lookup("/x");
+    watch_remove(x);
+    CHECK(watch_lookup("/x") == NULL);
+    CHECK(watch_count() == 4);
+
+    for (x = watch_first(); x != NULL; x = watch_next(x, NULL))
+        CHECK(strcmp(x->name, "x") != 0);
+
+    add("/deep/er/still", 6);
+    watch_remove(watch_lookup("/deep/er/still"));
+    CHECK(watch_first()->child != NULL);
+    for (x = watch_first()->child; x != NULL; x = x->next)
+        CHECK(strcmp(x->name, "deep") != 0);
+}
+
+static void _removed(Watch * watch, void *data)
+{
+    int *n = data;
+
+    /* Children go first. */
+    CHECK(watch->child == NULL);
+    ++*n;
+}
+
+static void test_remove_tree(void)
+{
+    int i, j, n = 0, calls = 0, count;
+    char path[64];
+    Watch *top;
+
+    count = watch_count();
+
+    add("/t", 100);
+    for (i = 0; i < 10; i++) {
+        for (j = 0; j < 5; j++) {
+            snprintf(path, sizeof path, "/t/n%d/m%d", i, j);
+            add(path, 101 + (i * 10) + j);
+        }
+        snprintf(path, sizeof path, "/t/n%d", i);
+        add(path, 200 + i);
+    }
+    CHECK(watch_count() == count + 61);
+
+    top = watch_lookup("/t");
+    while (watch_remove_tree_max(top, _removed, &n, 20) != 0)
+        ++calls;
+
+    CHECK(calls == 3);
+    CHECK(n == 61);
+    CHECK(watch_lookup("/t") == NULL);
+    CHECK(watch_lookup("/t/n3/m2") == NULL);
+    CHECK(watch_count() == count);
+}
+
+static void test_move(void)
+{
+    int count;
+    Watch *src, *sub, *leaf, *dst, *moved, *again;
+    const char *long_name = "a_much_longer_name_than_it_had_before";
+
+    src = add("/m/src", 300);
+    sub = add("/m/src/sub", 301);
+    leaf = add("/m/src/sub/leaf", 302);
+    dst = add("/m/dst", 303);
+    add("/m/dst/taken", 304);
+    count = watch_count();
+
+    /* Detached, the subtree can't be found or named, but is kept. */
+    watch_detach(src);
+    CHECK(watch_lookup("/m/src") == NULL);
+    CHECK(watch_lookup("/m/src/sub/leaf") == NULL);
+    CHECK(!has_path(leaf, "/m/src/sub/leaf"));
+    CHECK(watch_count() == count);
+
+    /* Not on top of something that's already there. */
+    CHECK(watch_attach(src, dst, "taken") == NULL);
+    CHECK(src->parent == NULL);
+
+    moved = watch_attach(src, dst, "renamed");
+    CHECK(moved != NULL);
+    CHECK(watch_lookup("/m/dst/renamed") == moved);
+    CHECK(watch_lookup("/m/dst/renamed/sub/leaf") == leaf);
+    CHECK(has_path(leaf, "/m/dst/renamed/sub/leaf"));
+    CHECK(moved->wd == 300);
+
+    /* A name that needs a bigger node moves the node, and its
+     * children have to be found under the new one.
+     */
+    watch_detach(moved);
+    again = watch_attach(moved, dst->parent, long_name);
+    CHECK(again != NULL);
+    CHECK(sub->parent == again);
+    CHECK(watch_lookup("/m/dst/renamed") == NULL);
+    CHECK(watch_lookup("/m/a_much_longer_name_than_it_had_before/sub")
+          == sub);
+    CHECK(has_path(leaf, "/m/a_much_longer_name_than_it_had_before/sub/leaf"));
+    CHECK(watch_count() == count);
+
+    /* And the subtree can be handed to another root. */
+    watch_set_root(again, &root_b);
+    CHECK(again->root == &root_b);
+    CHECK(leaf->root == &root_b);
+    CHECK(dst->root == &root_a);
+
+    watch_remove_tree(watch_lookup("/m/dst"), NULL, NULL);
+    watch_remove_tree(again, NULL, NULL);
+    CHECK(watch_lookup("/m/dst/taken") == NULL);
+    CHECK(watch_count() == count - 5);
+}
+
+int main(void)
+{
+    if (watch_table_init() != 0) {
+        fprintf(stderr, "Failed to set up the watch table\n");
+        return 1;
+    }
+
+    test_add_lookup();
+    test_walk();
+    test_remove();
+    test_remove_tree();
+    test_move();
+
+    return test_done("test_watch");
+}
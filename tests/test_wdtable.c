@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2011-*, (mt) MediaTemple <mediatemple.net>
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *  - Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *  - Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CON-
+ * SEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+ * GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* Unit tests for the per instance wd -> watch tables (SEE: WdTable
+ * in inotify.h), and the generations that keep an event read before
+ * a wd was reused from being handed to the new watch.
+ */
+
+#include "watch.h"
+#include "test.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static Watch *new_watch(void)
+{
+    Watch *watch = calloc(1, sizeof(Watch));
+
+    if (watch == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    return watch;
+}
+
+static void test_empty(void)
+{
+    WdTable table = { NULL, 0, 0 };
+    Watch *a = new_watch();
+
+    CHECK(wd_table_get(&table, 0, 0) == NULL);
+    CHECK(wd_table_get(&table, 1, 100) == NULL);
+    CHECK(wd_table_get(&table, -1, 0) == NULL);
+    CHECK(wd_table_get(&table, 1 << 20, 0) == NULL);
+
+    /* Neither of these should trip over a table with no pages. */
+    wd_table_remove(&table, 1);
+    wd_table_replace(&table, 1, NULL);
+    CHECK(table.count == 0);
+
+    CHECK(wd_table_set(&table, -1, a, 0) != 0);
+    CHECK(table.count == 0);
+
+    wd_table_free(&table);
+    free(a);
+}
+
+static void test_generations(void)
+{
+    WdTable table = { NULL, 0, 0 };
+    Watch *a = new_watch(), *b = new_watch(), *c = new_watch();
+
+    CHECK(wd_table_set(&table, 1, a, 10) == 0);
+    CHECK(table.count == 1);
+
+    /* Events read at or after the generation the watch was added at
+     * are its. Anything read before belongs to whatever had the wd
+     * before.
+     */
+    CHECK(wd_table_get(&table, 1, 10) == a);
+    CHECK(wd_table_get(&table, 1, 11) == a);
+    CHECK(wd_table_get(&table, 1, 9) == NULL);
+
+    /* The wd is reused for another watch. */
+    wd_table_remove(&table, 1);
+    CHECK(table.count == 0);
+    CHECK(wd_table_get(&table, 1, 11) == NULL);
+
+    CHECK(wd_table_set(&table, 1, b, 20) == 0);
+    CHECK(wd_table_get(&table, 1, 15) == NULL);
+    CHECK(wd_table_get(&table, 1, 20) == b);
+
+    /* Setting it again doesn't count it twice. */
+    CHECK(wd_table_set(&table, 1, b, 21) == 0);
+    CHECK(table.count == 1);
+    CHECK(wd_table_get(&table, 1, 20) == NULL);
+
+    /* Replacing the watch, as when it's reallocated, keeps the
+     * generation.
+     */
+    wd_table_replace(&table, 1, c);
+    CHECK(wd_table_get(&table, 1, 21) == c);
+    CHECK(wd_table_get(&table, 1, 20) == NULL);
+
+    /* Only wds that are in use can be replaced. */
+    wd_table_replace(&table, 2, c);
+    CHECK(wd_table_get(&table, 2, 100) == NULL);
+    CHECK(table.count == 1);
+
+    wd_table_free(&table);
+    free(a);
+    free(b);
+    free(c);
+}
+
+static void test_wraparound(void)
+{
+    WdTable table = { NULL, 0, 0 };
+    Watch *a = new_watch();
+
+    /* Generations are compared as a distance, so they keep working
+     * when the counter wraps.
+     */
+    CHECK(wd_table_set(&table, 3, a, UINT32_MAX - 5) == 0);
+    CHECK(wd_table_get(&table, 3, UINT32_MAX - 5) == a);
+    CHECK(wd_table_get(&table, 3, UINT32_MAX) == a);
+    CHECK(wd_table_get(&table, 3, 5) == a);
+    CHECK(wd_table_get(&table, 3, UINT32_MAX - 6) == NULL);
+
+    wd_table_free(&table);
+    free(a);
+}
+
+static void test_pages(void)
+{
+    int i;
+    WdTable table = { NULL, 0, 0 };
+    Watch *a = new_watch();
+
+    /* Far apart wds end up on pages of their own. */
+    CHECK(wd_table_set(&table, 5, a, 1) == 0);
+    CHECK(wd_table_set(&table, WD_PAGE_SIZE * 3 + 7, a, 1) == 0);
+    CHECK(wd_table_set(&table, 100000, a, 1) == 0);
+    CHECK(table.count == 3);
+    CHECK(table.num_pages > (100000 >> WD_PAGE_SHIFT));
+
+    CHECK(wd_table_get(&table, 5, 1) == a);
+    CHECK(wd_table_get(&table, WD_PAGE_SIZE * 3 + 7, 1) == a);
+    CHECK(wd_table_get(&table, WD_PAGE_SIZE * 3 + 8, 1) == NULL);
+    CHECK(wd_table_get(&table, 100000, 1) == a);
+
+    /* A page goes once nothing on it is in use. */
+    wd_table_remove(&table, WD_PAGE_SIZE * 3 + 7);
+    CHECK(table.pages[3] == NULL);
+    CHECK(table.count == 2);
+
+    /* Fill a whole page and empty it again. */
+    for (i = 0; i < WD_PAGE_SIZE; i++)
+        CHECK(wd_table_set(&table, WD_PAGE_SIZE + i, a, 2) == 0);
+    CHECK(table.count == 2 + WD_PAGE_SIZE);
+    CHECK(table.pages[1]->used == WD_PAGE_SIZE);
+
+    for (i = 0; i < WD_PAGE_SIZE; i++)
+        wd_table_remove(&table, WD_PAGE_SIZE + i);
+    CHECK(table.pages[1] == NULL);
+    CHECK(table.count == 2);
+
+    wd_table_free(&table);
+    CHECK(table.pages == NULL);
+    CHECK(table.num_pages == 0);
+    CHECK(table.count == 0);
+    free(a);
+}
+
+int main(void)
+{
+    test_empty();
+    test_generations();
+    test_wraparound();
+    test_pages();
+
+    return test_done("test_wdtable");
+}